@@ -23,12 +23,21 @@ extern "C" {
 #define APP_EXEC_DEFAULT_ARGV NULL
 #define APP_CMD_ENTRY "main"
 
+/**
+ * Allocator of the Lua state.
+ */
+typedef enum {
+    APP_ALLOC_SYSTEM,   /**< Allocate all blocks by pal_mem_realloc(). */
+    APP_ALLOC_SLAB,     /**< Allocate small blocks from size-class slabs. */
+} app_allocator;
+
 /**
  * Initialize App.
  *
  * @param workdir The path of the working directory.
+ * @param allocator The allocator of the Lua state.
  */
-void app_init(const char *dir);
+void app_init(const char *dir, app_allocator allocator);
 
 /**
  * De-initialize App.
@@ -9,6 +9,12 @@ local timer = {}
 ---@class MessageQueue:userdata Message queue.
 local mq = {}
 
+---@class Task:userdata Task started by ``core.spawn()``.
+local task = {}
+
+---@class Context:userdata Cancellation context.
+local context = {}
+
 ---Get current time in milliseconds.
 ---@return integer time
 function core.time() end
@@ -41,9 +47,20 @@ function timer:start(ms) end
 function timer:stop() end
 
 ---Send message.
+---
+---If coroutines are waiting in ``mq:recv()``, all of them receive the message.
+---When the message queue is full, the current coroutine
+---waits here until a message is received.
 ---@param ... any
 function mq:send(...) end
 
+---Try to send message without waiting.
+---
+---Returns ``false`` if the message queue is full.
+---@param ... any
+---@return boolean success
+function mq:trySend(...) end
+
 ---Receive message.
 ---
 ---When the message queue is empty, the current coroutine
@@ -63,6 +80,231 @@ function mq:recv() end
 ---@nodiscard
 function mq:recvUntil(deadline) end
 
+---@class TimerStats Timing wheel statistics.
+---
+---@field armed integer Number of the timers waiting to expire.
+---@field fired integer Number of the expired timers.
+---@field cancelled integer Number of the stopped timers.
+---@field dispatches integer Number of the platform timer callbacks.
+---@field maxBatch integer Maximum number of timers expired in a dispatch.
+---@field platformTimers integer Number of the registered platform timers.
+
+---Get statistics of the timing wheel.
+---
+---Sleeps, timers and message queue deadlines share a single platform timer.
+---@return TimerStats stats
+---@nodiscard
+function core.getTimerStats() end
+
+---@class SchedulerStats Ready queue statistics.
+---
+---@field depth integer Number of the coroutines waiting to be resumed.
+---@field maxDepth integer Maximum number of the coroutines waiting to be resumed.
+---@field drains integer Number of the ready queue drains.
+---@field resumes integer Number of the coroutines resumed by the drains.
+---@field lastResumes integer Number of the coroutines resumed by the last drain.
+---@field maxResumes integer Maximum number of the coroutines resumed by a drain.
+---@field gcSteps integer Number of the GC steps done by the drains.
+
+---Get statistics of the ready queue.
+---
+---Coroutines woken by sleeps, timers and message queues are resumed
+---in priority order at the end of the run loop iteration,
+---HomeKit read and write handlers first, timeouts last.
+---A single GC step is done for all of them.
+---@return SchedulerStats stats
+---@nodiscard
+function core.getSchedulerStats() end
+
+---@class GCConfig GC pacer configuration.
+---
+---@field mode? '"incremental"'|'"generational"' GC mode.
+---@field budget? integer Target heap size in bytes.
+---@field maxPause? integer Maximum pause of a GC step in milliseconds.
+
+---Configure the GC pacer, the fields not given keep the current values.
+---
+---GC steps do work in proportion to the memory allocated since the last step,
+---plus the memory over the heap budget, and are shrunk when they pause
+---longer than ``maxPause``. The GC also steps when the run loop is idle,
+---until no memory is allocated.
+---
+---The bridge reads the configuration from the config keys
+---``gc.mode``, ``gc.budget`` and ``gc.maxpause`` at startup.
+---@param conf GCConfig
+function core.configureGC(conf) end
+
+---@class GCStats GC pacer statistics.
+---
+---@field mode '"incremental"'|'"generational"' GC mode.
+---@field budget integer Target heap size in bytes.
+---@field maxPauseBudget integer Maximum pause of a GC step in milliseconds.
+---@field heap integer Current heap size in bytes.
+---@field heapHigh integer Heap high-water mark in bytes.
+---@field stepLimit integer Current maximum step size in bytes.
+---@field steps integer Number of the paced steps.
+---@field stepsPerSec integer Number of the paced steps in the last full second.
+---@field idleSteps integer Number of the steps run when the run loop is idle.
+---@field idleStops integer Number of times the idle steps stopped without allocation.
+---@field fullCycles integer Number of the full cycles.
+---@field lastPause integer Pause of the last step in milliseconds.
+---@field maxPause integer Maximum pause of a step in milliseconds.
+
+---Get GC pacer statistics.
+---@return GCStats stats
+---@nodiscard
+function core.getGCStats() end
+
+---@class MemSizeClassStats Statistics of a size class of the slab allocator.
+---
+---@field size integer Block size.
+---@field blocks integer Number of the live blocks.
+---@field bytes integer Live bytes requested in the blocks.
+---@field free integer Number of the free blocks.
+---@field slabs integer Number of the slabs.
+
+---@class MemTagStats Statistics of a memory tag.
+---
+---@field tag integer Memory tag.
+---@field name string Tag name.
+---@field live integer Live bytes owned by the tag.
+---@field peak integer Peak of the live bytes.
+---@field limit integer Soft limit of the live bytes, 0 means no limit.
+---@field limitHits integer Number of the allocations failed for the soft limit.
+
+---@class MemStats Lua allocator statistics.
+---
+---@field allocator '"slab"'|'"system"' Allocator type.
+---@field live integer Live bytes.
+---@field peak integer Peak of the live bytes.
+---@field large integer Live bytes not in the slabs.
+---@field slabBytes integer Bytes of the slabs.
+---@field allocs integer Number of the allocations, including the growing reallocations.
+---@field allocBytes integer Total bytes allocated.
+---@field processBytes integer Memory used by the process, the RSS on Linux or the used heap on ESP, 0 if it is unknown.
+---@field fragmentation number Ratio of the slab bytes not used by the live blocks.
+---@field classes MemSizeClassStats[] Statistics of the size classes.
+---@field tags MemTagStats[] Statistics of the memory tags.
+
+---Get Lua allocator statistics.
+---@return MemStats stats
+---@nodiscard
+function core.memstats() end
+
+---Create a memory tag.
+---
+---The memory allocated when the tag is set is accounted to the tag.
+---An allocation exceeding the soft limit runs a full GC,
+---if it still exceeds the limit, a memory error is raised.
+---@param name string Tag name.
+---@param softLimit? integer Soft limit in bytes, 0 or nil means no limit.
+---@return integer tag
+---@nodiscard
+function core.createMemTag(name, softLimit) end
+
+---Set the memory tag of the current coroutine.
+---
+---The coroutines created by it and the callbacks registered by it inherit the tag.
+---@param tag integer Memory tag, 0 is the bridge.
+function core.setMemTag(tag) end
+
+---Get the memory tag of the current coroutine.
+---@return integer tag
+---@nodiscard
+function core.getMemTag() end
+
+---Wait on multiple message queues.
+---
+---Returns the index of the message queue in ``mqs`` and the received message.
+---If several message queues have messages, the first one is used.
+---When all message queues are empty, the current coroutine waits here until
+---a message is sent to one of them or the deadline expires.
+---A message is taken by only one of the coroutines waiting in ``core.select()``.
+---Returns ``false, "timeout"`` on timeout.
+---@param mqs MessageQueue[] Message queues.
+---@param deadline? integer Absolute deadline in milliseconds.
+---@return integer|false index
+---@return any ...
+---@nodiscard
+function core.select(mqs, deadline) end
+
+---Run a function in a new coroutine.
+---
+---The function starts running after the current coroutine waits or returns.
+---@param fn async fun(...) Function to run.
+---@param ... any Arguments passed to the function.
+---@return Task task
+function core.spawn(fn, ...) end
+
+---Check whether the task is done.
+---@return boolean done
+---@nodiscard
+function task:done() end
+
+---Wait for all tasks to be done.
+---
+---Returns a table of results in the order of ``tasks``,
+---each result is ``{true, ...}`` with the return values of the function,
+---or ``{false, err}`` if the function raised an error.
+---Returns ``false, "timeout"`` if the deadline expires first,
+---the tasks keep running.
+---@param tasks Task[] Tasks.
+---@param deadline? integer Absolute deadline in milliseconds.
+---@return table[]|false results
+---@return string? err
+---@nodiscard
+function core.gather(tasks, deadline) end
+
+---Create a context.
+---
+---A context bound to a coroutine with ``core.setContext()`` cancels
+---all waits of the coroutine when it is cancelled or the deadline expires,
+---including ``core.sleep()``, ``mq:recv()``, ``core.select()``, socket receives,
+---stream reads/writes and DNS resolves.
+---Waits returning an error return ``"cancelled"`` or ``"timeout"``,
+---the other waits raise it.
+---@param deadline? integer Absolute deadline in milliseconds.
+---@return Context ctx
+---@nodiscard
+function core.createContext(deadline) end
+
+---Get the context of the current coroutine.
+---@return Context|nil ctx
+---@nodiscard
+function core.getContext() end
+
+---Bind a context to the current coroutine, ``nil`` to unbind.
+---
+---Coroutines started by ``core.spawn()`` inherit the context.
+---@param ctx Context|nil
+function core.setContext(ctx) end
+
+---Cancel the context.
+---If the context is done, nothing will happen.
+function context:cancel() end
+
+---Get the reason the context is done.
+---@return "cancelled"|"timeout"|nil err ``nil`` if the context is not done.
+---@nodiscard
+function context:err() end
+
+---Run a CPU-heavy operation off the run loop.
+---
+---The current coroutine waits here until the operation is done,
+---then the result is returned, an error is raised on failure.
+---
+---Operations:
+---- ``core.offload("hash", type, data, key?)``: digest of ``data``, HMAC if ``key`` is given,
+---  ``type`` is the same as ``hash.create()``.
+---- ``core.offload("cipher", type, op, key, iv?, input)``: the same as ``ctx:process()`` of ``cipher.create(type)``.
+---- ``core.offload("base64encode", input)``: the same as ``base64.encode()``.
+---- ``core.offload("base64decode", input)``: the same as ``base64.decode()``.
+---@param op '"hash"'|'"cipher"'|'"base64encode"'|'"base64decode"' Operation.
+---@param ... any Arguments of the operation.
+---@return string result
+---@nodiscard
+function core.offload(op, ...) end
+
 ---Create a message queue.
 ---@param size integer Queue size.
 ---@return MessageQueue
@@ -51,14 +51,74 @@ function characteristic:setValidVals(...) end
 ---@return HAPCharacteristic self
 function characteristic:setValidValsRanges(...) end
 
----@class HAPAccessoryIdentifyRequest:table Accessory identify request.
+---Set the TTL of the value cache of the characteristic, it overrides ``hap.setCacheTTL()``.
+---
+---A fresh cached value is returned without calling the read callback,
+---a stale one is returned while the value is refreshed in the background.
+---@param ttl integer Time to live in milliseconds, 0 disables the cache.
+---@return HAPCharacteristic self
+function characteristic:setCacheTTL(ttl) end
+
+---Set the write debounce window of the characteristic.
+---
+---The writes in the window are answered at once, and only the latest value
+---is passed to the write callback when the window closes. The values written
+---while the callback is running are collapsed into one more call.
+---The debounced writes have no ``session``.
+---@param window integer Window in milliseconds, 0 disables the debounce.
+---@return HAPCharacteristic self
+function characteristic:setWriteDebounce(window) end
+
+---@class HAPCharacteristicPrototype:userdata HomeKit characteristic prototype.
+---
+---It holds the type, format, properties and metadata shared by the characteristics instantiated from it,
+---the metadata is set before the characteristics are instantiated, the setters raise an error once the
+---prototype is instantiated. The instances may override the metadata.
+local prototype = {}
+
+---Set the manufacturer description for the prototype.
+---@param mfgDesc? string Description of the characteristic provided by the manufacturer of the accessory.
+---@return HAPCharacteristicPrototype self
+function prototype:setMfgDesc(mfgDesc) end
+
+---Set units for prototype.
+---@param units HAPCharacteristicUnits The units of the values for the characteristic. Format: UInt8|UInt16|UInt32|UInt64|Int|Float
+---@return HAPCharacteristicPrototype self
+function prototype:setUnits(units) end
+
+---Set contraints for prototype.
+---@overload fun(prototype: HAPCharacteristicPrototype, maxLen: integer): HAPCharacteristicPrototype
+---@param minVal number Minimum value.
+---@param maxVal number Maximum value.
+---@param stepVal number Step value.
+---@return HAPCharacteristicPrototype self
+function prototype:setContraints(minVal, maxVal, stepVal) end
+
+---Set valid values for ``UInt8`` prototype. Only supported for Apple defined characteristics.
+---@param ... integer Valid values in ascending order.
+---@return HAPCharacteristicPrototype self
+function prototype:setValidVals(...) end
+
+---Set valid values ranges for ``UInt8`` prototype. Only supported for Apple defined characteristics.
+---@param ... HAPValidValsRanges Valid values ranges in ascending order.
+---@return HAPCharacteristicPrototype self
+function prototype:setValidValsRanges(...) end
+
+---New a characteristic from the prototype.
+---@param iid integer Instance ID.
+---@param read? async fun(request: HAPCharacteristicReadRequest): any The callback used to handle read requests, it returns value.
+---@param write? async fun(request: HAPCharacteristicWriteRequest, value: any) The callback used to handle write requests.
+---@return HAPCharacteristic
+function prototype:new(iid, read, write) end
+
+---@class HAPAccessoryIdentifyRequest:userdata Accessory identify request.
 ---
 ---@field transportType HAPTransportType Transport type over which the request has been received.
 ---@field remote boolean Whether the request appears to have originated from a remote controller, e.g. via Apple TV.
 ---@field session HAPSession The session over which the request has been received.
 ---@field aid integer Accessory instance ID.
 
----@class HAPCharacteristicReadRequest:table Characteristic read request.
+---@class HAPCharacteristicReadRequest:userdata Characteristic read request.
 ---
 ---@field transportType HAPTransportType Transport type over which the request has been received.
 ---@field session HAPSession The session over which the request has been received.
@@ -66,16 +126,16 @@ function characteristic:setValidValsRanges(...) end
 ---@field sid integer Service instance ID.
 ---@field cid integer Characteristic intstance ID.
 
----@class HAPCharacteristicWriteRequest:table Characteristic write request.
+---@class HAPCharacteristicWriteRequest:userdata Characteristic write request.
 ---
 ---@field transportType HAPTransportType Transport type over which the request has been received.
----@field session HAPSession The session over which the request has been received.
+---@field session? HAPSession The session over which the request has been received, nil if the write is debounced.
 ---@field aid integer Accessory instance ID.
 ---@field sid integer Service instance ID.
 ---@field cid integer Characteristic intstance ID.
 ---@field remote boolean Whether the request appears to have originated from a remote controller, e.g. via Apple TV.
 
----@class HAPCharacteristicSubscriptionRequest:table Characteristic subscription request.
+---@class HAPCharacteristicSubscriptionRequest:userdata Characteristic subscription request.
 ---
 ---@field transportType HAPTransportType Transport type over which the request has been received.
 ---@field session HAPSession The session over which the request has been received.
@@ -340,8 +400,9 @@ M.PairingService = {}
 ---@param hardwareVersion string The hardware version of the accessory.
 ---@param services HAPService[] The services of the accessory.
 ---@param identify? async fun(request: HAPAccessoryIdentifyRequest) The callback used to invoke the identify routine.
+---@param readMany? async fun(requests: HAPCharacteristicReadRequest[]): any[] The callback used to handle the reads of the accessory in the same server turn at once, it returns the values in the order of the requests, the read callbacks of the characteristics are not called.
 ---@return HAPAccessory
-function M.newAccessory(aid, category, name, manufacturer, model, serialNumber, firmwareVersion, hardwareVersion, services, identify) end
+function M.newAccessory(aid, category, name, manufacturer, model, serialNumber, firmwareVersion, hardwareVersion, services, identify, readMany) end
 
 ---New a service.
 ---@param iid integer Instance ID.
@@ -364,6 +425,13 @@ function M.newService(iid, type, primary, hidden, characteristics) end
 ---@return HAPCharacteristic
 function M.newCharacteristic(iid, format, type, props, read, write, sub, unsub) end
 
+---New a characteristic prototype.
+---@param format HAPCharacteristicFormat Characteristic format.
+---@param type HAPCharacteristicType The type of the characteristic.
+---@param props HAPCharacteristicProperties Characteristic properties.
+---@return HAPCharacteristicPrototype
+function M.newCharacteristicPrototype(format, type, props) end
+
 ---Whether the accessory is valid.
 ---@param accessory HAPAccessory HAP accessory.
 ---@param bridged? boolean Whether the accessory is bridged accessory.
@@ -371,7 +439,7 @@ function M.accessoryIsValid(accessory, bridged) end
 
 ---Start accessory server.
 ---@param primaryAccessory HAPAccessory Primary accessory to serve.
----@param bridgedAccessories? HAPAccessory[] Bridged accessories.
+---@param bridgedAccessories? HAPAccessory[] Bridged accessories, at most 149.
 ---@param confChanged boolean Whether or not the bridge configuration changed since the last start.
 ---@param sessionAccept? async fun(session: HAPSession) The callback used when a HomeKit Session is accepted.
 ---@param sessionInvalidate? async fun(session: HAPSession) The callback used when a HomeKit Session is invalidated.
@@ -380,6 +448,19 @@ function M.start(primaryAccessory, bridgedAccessories, confChanged, sessionAccep
 ---Stop accessory server.
 function M.stop() end
 
+---Replace the bridged accessories of the running accessory server.
+---
+---The accessories in both sets are kept as they are, including their value caches and the reads in flight.
+---If the set changes, the configuration number is increased and the controllers fetch the accessories again,
+---the server keeps running and the sessions are kept. The queued reads of the removed accessories fail,
+---the reads and writes running their callbacks are answered when the callbacks return.
+---The primary accessory must be a bridge, and the IP session buffers keep the sizes of the start.
+---An error is raised if the new set needs more event notification slots or characteristic contexts
+---than the sessions have, the server must be restarted to serve it.
+---@param bridgedAccessories? HAPAccessory[] Bridged accessories, at most 149.
+---@return boolean changed Whether the set of the bridged accessories is changed.
+function M.reconfigure(bridgedAccessories) end
+
 ---Raises an event notification for a given characteristic in a given service provided by a given accessory.
 ---If has session, it raises event on a given session.
 ---@overload fun(aid: integer, sid: integer, cid: integer)
@@ -389,12 +470,173 @@ function M.stop() end
 ---@param session? HAPSession The session on which to raise the event.
 function M.raiseEvent(aid, sid, cid, session) end
 
+---Raises event notifications for the given characteristics at once.
+---
+---The events raised in the event window are merged, one event is
+---delivered for a characteristic in a window.
+---@param events integer[][] Array of ``{aid, sid, cid}``.
+---@param session? HAPSession The session on which to raise the events.
+function M.raiseEvents(events, session) end
+
+---Set the window to coalesce the events.
+---@param window integer Window in milliseconds, 0 raises the events at once.
+function M.setEventWindow(window) end
+
+---@class HAPEventStats:table Statistics of the event notifications.
+---
+---@field window integer Window in milliseconds to coalesce the events.
+---@field raised integer Events raised.
+---@field delivered integer Events passed to the accessory server after merged.
+
+---@class HAPIPSessionLimits:table Limits of the IP sessions, the missing fields are not changed.
+---
+---@field max? integer Maximum IP sessions, 5 by default.
+---@field reserve? integer Idle IP sessions kept allocated to accept the connections, at most ``max``, 2 by default.
+---@field maxContexts? integer Maximum characteristics in a request of a session, 0 means the number of the readable or writable characteristics, 0 by default.
+---@field maxEventNotifications? integer Maximum characteristics a session subscribes, 0 means the number of the characteristics supporting event notification, 0 by default.
+
+---Set the limits of the IP sessions.
+---
+---The buffers of the IP sessions are sized by the characteristics of the accessories.
+---The characteristic contexts are capped by the free memory at start, the event notification
+---slots are not, and hap.start() fails if the memory can't cover them.
+---They are allocated when a connection takes the last idle session, and released to a pool
+---when the session is closed, so the reserve of idle sessions is kept ready.
+---This function must be called before calling start().
+---@param limits HAPIPSessionLimits
+function M.setIPSessionLimits(limits) end
+
+---@class HAPIPSessionStats:table Statistics of the IP sessions.
+---
+---@field max integer Maximum IP sessions.
+---@field reserve integer Idle IP sessions kept allocated.
+---@field active integer IP sessions in use.
+---@field allocated integer IP sessions with buffers allocated.
+---@field pooled integer Buffers of the released sessions kept in the pool.
+---@field peak integer Most IP sessions allocated at once.
+---@field contexts integer Characteristic contexts of a session.
+---@field eventNotifications integer Event notification slots of a session.
+---@field sessionBytes integer Bytes of the buffers of an IP session, it grows with the characteristics.
+---@field allocatedBytes integer Bytes of the buffers of the allocated and pooled sessions.
+---@field defaultBytes integer Bytes of the buffers of the default maximum sessions.
+---@field port integer Port of the IP accessory server, 0 if it is not listening.
+
+---Get statistics of the IP sessions.
+---@return HAPIPSessionStats stats
+---@nodiscard
+function M.getIPSessionStats() end
+
+---Get statistics of the event notifications.
+---@return HAPEventStats stats
+---@nodiscard
+function M.getEventStats() end
+
+---Update the value of a characteristic and raise an event notification if it is changed.
+---
+---The value answers the following reads without calling the read callback,
+---for the TTL of the cache or at least 1 second.
+---@overload fun(aid: integer, sid: integer, cid: integer, value: any): boolean
+---@param aid integer Accessory instance ID.
+---@param sid integer Service instance ID.
+---@param cid integer Characteristic intstance ID.
+---@param value any The new value.
+---@param session? HAPSession The session on which to raise the event.
+---@return boolean changed Whether the value is changed and the event is raised.
+function M.updateValue(aid, sid, cid, value, session) end
+
 ---Get a new Instance ID for bridged accessory or service or characteristic.
+---
+---The Instance IDs are reserved in NVS in ranges, the unused ones in a range are skipped after a reboot.
 ---@param bridgedAccessory? boolean Whether or not to get new IID for bridged accessory.
 ---@return integer iid Instance ID.
 ---@nodiscard
 function M.getNewInstanceID(bridgedAccessory) end
 
+---Set the default TTL of the characteristic value caches.
+---
+---The cached value is dropped when the characteristic is written or an event is raised for it.
+---@param ttl integer Time to live in milliseconds, 0 disables the caches.
+function M.setCacheTTL(ttl) end
+
+---@class HAPCacheStats:table Statistics of the characteristic value caches.
+---
+---@field ttl integer Default TTL in milliseconds.
+---@field hits integer Reads served by fresh values.
+---@field staleHits integer Reads served by stale values.
+---@field misses integer Reads passed to the read callbacks.
+---@field refreshes integer Background refreshes.
+
+---@class HAPReadStats:table Statistics of the characteristic reads.
+---
+---@field inFlight integer Reads running the read callbacks.
+---@field collapsed integer Reads answered by the result of a read in flight of the same characteristic.
+---@field batched integer Reads passed to the readMany callbacks.
+---@field readManyCalls integer Calls of the readMany callbacks.
+---@field handled integer Reads dispatched to the Lua callbacks.
+---@field allocs integer Lua allocations while dispatching the reads, until they are answered or the callbacks yield.
+---@field allocBytes integer Lua bytes allocated while dispatching the reads.
+---@field pooled integer Free read requests kept for the queued, batched and collapsed reads.
+---@field requestAllocs integer Read requests allocated when there is no pooled one.
+
+---@class HAPReadLimits:table Limits of the characteristic reads, the missing fields are not changed.
+---
+---@field maxInFlight? integer Maximum reads running the read callbacks, 32 by default.
+---@field maxPerAccessory? integer Maximum reads of an accessory running the read callbacks, 4 by default.
+---@field maxQueued? integer Maximum reads waiting for the limits, more reads fail with busy, 128 by default.
+---@field deadline? integer Milliseconds a read may wait for the limits before it fails with busy, 0 means no deadline, 5000 by default.
+
+---Set the limits of the characteristic reads.
+---
+---The reads over the limits are queued per accessory,
+---and the accessories with queued reads are served in round-robin.
+---A readMany call counts as one read in flight, and the reads waiting for readMany
+---count against ``maxQueued`` and ``deadline``.
+---@param limits HAPReadLimits
+function M.setReadLimits(limits) end
+
+---@class HAPHistogramBucket:table Histogram bucket.
+---
+---@field le? integer Upper bound of the bucket, the last bucket has no bound.
+---@field count integer Number of the samples in the bucket.
+
+---@class HAPReadSchedStats:table Statistics of the read scheduler.
+---
+---@field maxInFlight integer Maximum reads running the read callbacks.
+---@field maxPerAccessory integer Maximum reads of an accessory running the read callbacks.
+---@field maxQueued integer Maximum queued reads.
+---@field deadline integer Deadline of the queued reads in milliseconds.
+---@field queued integer Reads waiting for the limits.
+---@field dispatched integer Queued reads passed to the read callbacks.
+---@field rejected integer Reads failed with busy when they are queued.
+---@field expired integer Queued reads failed with busy for the deadline.
+---@field depth HAPHistogramBucket[] Queue depth when the reads are queued.
+---@field wait HAPHistogramBucket[] Milliseconds the reads wait in the queue.
+
+---Get statistics of the read scheduler.
+---@return HAPReadSchedStats stats
+---@nodiscard
+function M.getReadSchedStats() end
+
+---@class HAPWriteStats:table Statistics of the characteristic writes.
+---
+---@field debounced integer Writes answered without calling the write callbacks.
+---@field dispatched integer Debounced writes passed to the write callbacks.
+
+---Get statistics of the characteristic writes.
+---@return HAPWriteStats stats
+---@nodiscard
+function M.getWriteStats() end
+
+---Get statistics of the characteristic reads.
+---@return HAPReadStats stats
+---@nodiscard
+function M.getReadStats() end
+
+---Get statistics of the characteristic value caches.
+---@return HAPCacheStats stats
+---@nodiscard
+function M.getCacheStats() end
+
 ---Get setup code.
 ---@return string setupCode
 ---@nodiscard
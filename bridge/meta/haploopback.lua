@@ -0,0 +1,47 @@
+---@meta
+
+---@class haploopbacklib Loopback server of the HAP tests, built with -DCONFIG_HAP_LOOPBACK=ON.
+local M = {}
+
+---@class HAPLoopbackResponse:table Response or event recorded by the loopback server.
+---
+---@field kind '"read"'|'"write"'|'"event"' Kind of the response.
+---@field session? integer Loopback session, nil for the events of all sessions.
+---@field aid integer Accessory instance ID.
+---@field iid integer Characteristic instance ID.
+---@field err integer HAP error code, 0 on success.
+---@field value? any The value read.
+
+---Start the loopback server instead of the accessory server.
+---
+---The loopback server handles the requests in the run loop like the accessory server does,
+---and records the responses and the events instead of sending them.
+---Call hap.stop() to stop it.
+---@param primaryAccessory HAPAccessory Primary accessory to serve.
+---@param bridgedAccessories? HAPAccessory[] Bridged accessories, at most 149.
+---@param sessionInvalidate? async fun(session: HAPSession) The callback used when a session is invalidated.
+function M.start(primaryAccessory, bridgedAccessories, sessionInvalidate) end
+
+---Read a characteristic on a loopback session.
+---@param session integer Loopback session, 1 to 4.
+---@param aid integer Accessory instance ID.
+---@param iid integer Characteristic instance ID.
+function M.read(session, aid, iid) end
+
+---Write a characteristic on a loopback session.
+---@param session integer Loopback session, 1 to 4.
+---@param aid integer Accessory instance ID.
+---@param iid integer Characteristic instance ID.
+---@param value any The value to write.
+function M.write(session, aid, iid, value) end
+
+---Invalidate a loopback session, like the controller is disconnected.
+---@param session integer Loopback session, 1 to 4.
+function M.invalidate(session) end
+
+---Take the responses and the events recorded by the loopback server.
+---@return HAPLoopbackResponse[] responses
+---@nodiscard
+function M.responses() end
+
+return M
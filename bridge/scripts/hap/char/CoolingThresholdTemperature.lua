@@ -1,5 +1,11 @@
 local hap = require "hap"
 
+local prototype = hap.newCharacteristicPrototype("Float", "CoolingThresholdTemperature", {
+    readable = true,
+    writable = true,
+    supportsEventNotification = true
+}):setUnits("Celsius"):setContraints(10, 35, 0.1)
+
 return {
     ---New a ``CoolingThresholdTemperature`` characteristic.
     ---@param iid integer Instance ID.
@@ -7,10 +13,6 @@ return {
     ---@param write fun(request: HAPCharacteristicWriteRequest, value: number)
     ---@return HAPCharacteristic characteristic
     new = function (iid, read, write)
-        return hap.newCharacteristic(iid, "Float", "CoolingThresholdTemperature", {
-            readable = true,
-            writable = true,
-            supportsEventNotification = true
-        }, read, write):setUnits("Celsius"):setContraints(10, 35, 0.1)
+        return prototype:new(iid, read, write)
     end
 }
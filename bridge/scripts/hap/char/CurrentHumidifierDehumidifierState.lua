@@ -1,5 +1,11 @@
 local hap = require "hap"
 
+local prototype = hap.newCharacteristicPrototype("UInt8", "CurrentHumidifierDehumidifierState", {
+    readable = true,
+    writable = false,
+    supportsEventNotification = true
+}):setContraints(0, 3, 1)
+
 return {
     value = {
         Inactive = 0,
@@ -12,10 +18,6 @@ return {
     ---@param read fun(request: HAPCharacteristicReadRequest): integer
     ---@return HAPCharacteristic characteristic
     new = function (iid, read)
-        return hap.newCharacteristic(iid, "UInt8", "CurrentHumidifierDehumidifierState", {
-            readable = true,
-            writable = false,
-            supportsEventNotification = true
-        }, read):setContraints(0, 3, 1)
+        return prototype:new(iid, read)
     end
 }
@@ -1,5 +1,11 @@
 local hap = require "hap"
 
+local prototype = hap.newCharacteristicPrototype("Float", "HeatingThresholdTemperature", {
+    readable = true,
+    writable = true,
+    supportsEventNotification = true
+}):setUnits("Celsius"):setContraints(0, 25, 0.1)
+
 return {
     ---New a ``HeatingThresholdTemperature`` characteristic.
     ---@param iid integer Instance ID.
@@ -7,10 +13,6 @@ return {
     ---@param write fun(request: HAPCharacteristicWriteRequest, value: number)
     ---@return HAPCharacteristic characteristic
     new = function (iid, read, write)
-        return hap.newCharacteristic(iid, "Float", "HeatingThresholdTemperature", {
-            readable = true,
-            writable = true,
-            supportsEventNotification = true
-        }, read, write):setUnits("Celsius"):setContraints(0, 25, 0.1)
+        return prototype:new(iid, read, write)
     end
 }
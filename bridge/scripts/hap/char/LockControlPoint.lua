@@ -1,16 +1,18 @@
 local hap = require "hap"
 
+local prototype = hap.newCharacteristicPrototype("TLV8", "LockControlPoint", {
+    readable = false,
+    writable = true,
+    supportsEventNotification = false,
+    requiresTimedWrite = true,
+})
+
 return {
     ---New a ``LockControlPoint`` characteristic.
     ---@param iid integer Instance ID.
     ---@param write fun(request: HAPCharacteristicWriteRequest, value: string)
     ---@return HAPCharacteristic characteristic
     new = function (iid, write)
-        return hap.newCharacteristic(iid, "TLV8", "LockControlPoint", {
-            readable = false,
-            writable = true,
-            supportsEventNotification = false,
-            requiresTimedWrite = true,
-        }, nil, write)
+        return prototype:new(iid, nil, write)
     end
 }
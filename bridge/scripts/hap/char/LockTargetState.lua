@@ -1,5 +1,12 @@
 local hap = require "hap"
 
+local prototype = hap.newCharacteristicPrototype("UInt8", "LockTargetState", {
+    readable = true,
+    writable = true,
+    supportsEventNotification = true,
+    requiresTimedWrite = true
+}):setContraints(0, 1, 1)
+
 return {
     value = {
         Unsecured = 0,
@@ -11,11 +18,6 @@ return {
     ---@param write fun(request: HAPCharacteristicWriteRequest, value: integer)
     ---@return HAPCharacteristic characteristic
     new = function (iid, read, write)
-        return hap.newCharacteristic(iid, "UInt8", "LockTargetState", {
-            readable = true,
-            writable = true,
-            supportsEventNotification = true,
-            requiresTimedWrite = true
-        }, read, write):setContraints(0, 1, 1)
+        return prototype:new(iid, read, write)
     end
 }
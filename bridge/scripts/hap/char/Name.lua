@@ -1,17 +1,19 @@
 local hap = require "hap"
 
+local prototype = hap.newCharacteristicPrototype("String", "Name", {
+    readable = true,
+    writable = false,
+    supportsEventNotification = false
+}):setContraints(64)
+
 return {
     ---New a ``Name`` characteristic.
     ---@param iid integer Instance ID.
     ---@param name string Service name.
     ---@return HAPCharacteristic characteristic
     new = function (iid, name)
-        return hap.newCharacteristic(iid, "String", "Name", {
-            readable = true,
-            writable = false,
-            supportsEventNotification = false
-        }, function (request)
+        return prototype:new(iid, function (request)
             return name
-        end):setContraints(64)
+        end)
     end
 }
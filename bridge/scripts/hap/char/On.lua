@@ -1,5 +1,11 @@
 local hap = require "hap"
 
+local prototype = hap.newCharacteristicPrototype("Bool", "On", {
+    readable = true,
+    writable = true,
+    supportsEventNotification = true
+})
+
 return {
     ---New a ``On`` characteristic.
     ---@param iid integer Instance ID.
@@ -7,10 +13,6 @@ return {
     ---@param write fun(request: HAPCharacteristicWriteRequest, value: boolean)
     ---@return HAPCharacteristic characteristic
     new = function (iid, read, write)
-        return hap.newCharacteristic(iid, "Bool", "On", {
-            readable = true,
-            writable = true,
-            supportsEventNotification = true
-        }, read, write)
+        return prototype:new(iid, read, write)
     end
 }
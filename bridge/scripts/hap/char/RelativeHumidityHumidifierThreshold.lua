@@ -1,5 +1,11 @@
 local hap = require "hap"
 
+local prototype = hap.newCharacteristicPrototype("Float", "RelativeHumidityHumidifierThreshold", {
+    readable = true,
+    writable = true,
+    supportsEventNotification = true
+}):setUnits("Percentage"):setContraints(0, 100, 1)
+
 return {
     ---New a ``RelativeHumidityHumidifierThreshold`` characteristic.
     ---@param iid integer Instance ID.
@@ -7,10 +13,6 @@ return {
     ---@param write fun(request: HAPCharacteristicWriteRequest, value: number)
     ---@return HAPCharacteristic characteristic
     new = function (iid, read, write)
-        return hap.newCharacteristic(iid, "Float", "RelativeHumidityHumidifierThreshold", {
-            readable = true,
-            writable = true,
-            supportsEventNotification = true
-        }, read, write):setUnits("Percentage"):setContraints(0, 100, 1)
+        return prototype:new(iid, read, write)
     end
 }
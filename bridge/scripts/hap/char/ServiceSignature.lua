@@ -1,17 +1,19 @@
 local hap = require("hap")
 
+local prototype = hap.newCharacteristicPrototype("Data", "ServiceSignature", {
+    readable = true,
+    writable = false,
+    supportsEventNotification = false,
+    ip = { controlPoint = true }
+}):setContraints(2097152)
+
 return {
     ---New a ``ServiceSignature`` characteristic.
     ---@param iid integer Instance ID.
     ---@return HAPCharacteristic characteristic
     new = function (iid)
-        return hap.newCharacteristic(iid, "Data", "ServiceSignature", {
-            readable = true,
-            writable = false,
-            supportsEventNotification = false,
-            ip = { controlPoint = true }
-        }, function (request)
+        return prototype:new(iid, function (request)
             return ""
-        end):setContraints(2097152)
+        end)
     end
 }
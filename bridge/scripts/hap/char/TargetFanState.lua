@@ -1,5 +1,11 @@
 local hap = require "hap"
 
+local prototype = hap.newCharacteristicPrototype("UInt8", "TargetFanState", {
+    readable = true,
+    writable = true,
+    supportsEventNotification = true
+}):setContraints(0, 1, 1)
+
 return {
     value = {
         Manual= 0,
@@ -11,10 +17,6 @@ return {
     ---@param write fun(request: HAPCharacteristicWriteRequest, value: integer)
     ---@return HAPCharacteristic characteristic
     new = function (iid, read, write)
-        return hap.newCharacteristic(iid, "UInt8", "TargetFanState", {
-            readable = true,
-            writable = true,
-            supportsEventNotification = true
-        }, read, write):setContraints(0, 1, 1)
+        return prototype:new(iid, read, write)
     end
 }
@@ -1,5 +1,19 @@
 local hap = require "hap"
 
+---@param writable boolean
+local function newPrototype(writable)
+    return hap.newCharacteristicPrototype("UInt8", "TargetHeaterCoolerState", {
+        readable = true,
+        writable = writable,
+        supportsEventNotification = true
+    }):setContraints(0, 2, 1)
+end
+
+local prototypes = {
+    [true] = newPrototype(true),
+    [false] = newPrototype(false)
+}
+
 return {
     value = {
         HeatOrCool= 0,
@@ -12,10 +26,6 @@ return {
     ---@param write? fun(request: HAPCharacteristicWriteRequest, value: integer)
     ---@return HAPCharacteristic characteristic
     new = function (iid, read, write)
-        return hap.newCharacteristic(iid, "UInt8", "TargetHeaterCoolerState", {
-            readable = true,
-            writable = write and true or false,
-            supportsEventNotification = true
-        }, read, write):setContraints(0, 2, 1)
+        return prototypes[write and true or false]:new(iid, read, write)
     end
 }
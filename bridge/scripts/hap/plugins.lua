@@ -1,5 +1,8 @@
 local util = require "util"
 local config = require "config"
+local core = require "core"
+local hapUtil = require "hap.util"
+local hap = require "hap"
 local traceback = debug.traceback
 
 local M = {}
@@ -8,12 +11,37 @@ local logger = log.getLogger("hap.plugins")
 
 ---@class Plugin:table Plugin.
 ---
----@field init fun() Initialize plugin and generate accessories in initialization.
+---@field init fun(update: fun(accessories: HAPAccessory[]): boolean): HAPAccessory[] Initialize plugin and generate accessories, ``update`` replaces them later.
 
 local priv = {
     plugins = {},   ---@type table<string, Plugin>
+    names = {},     ---@type string[]
+    accessories = {},   ---@type table<string, HAPAccessory[]>
 }
 
+---Replace the accessories of a plugin, and reconfigure the bridged accessories of the running server.
+---@param name string Plugin name.
+---@param accessories HAPAccessory[] Accessories of the plugin.
+---@return boolean ok
+local function update(name, accessories)
+    local all = {}
+    for _, n in ipairs(priv.names) do
+        for _, accessory in ipairs(n == name and accessories or priv.accessories[n] or {}) do
+            table.insert(all, accessory)
+        end
+    end
+    local success, result = pcall(hap.reconfigure, all)
+    if success == false then
+        logger:error(("Plugin '%s' failed to update the accessories: %s"):format(name, result))
+        return false
+    end
+    priv.accessories[name] = accessories
+    if result then
+        logger:info(("Plugin '%s' updated the accessories, %d bridged accessories."):format(name, #all))
+    end
+    return true
+end
+
 ---Load plugin.
 ---@param name string Plugin name.
 local function loadPlugin(name)
@@ -38,9 +66,12 @@ local function loadPlugin(name)
         end
     end
     logger:info(("Plugin '%s' initializing ..."):format(name))
-    local accessories = plugin.init()
+    local accessories = plugin.init(function (accessories)
+        return update(name, accessories)
+    end)
     logger:info(("Plugin '%s' initialized."):format(name))
     priv.plugins[name] = true
+    priv.accessories[name] = accessories
     return accessories
 end
 
@@ -55,8 +86,19 @@ function M.init()
         for name in pairs(loaded) do
             loadedBefore[name] = true
         end
+        -- Memory allocated by a plugin, its coroutines and callbacks is accounted to its tag.
+        local memLimit = math.tointeger(tonumber(config.get("bridge.plugin.memlimit"))) or 0
+        local prevTag = core.getMemTag()
         for _, name in ipairs(names) do
+            local ok, tag = pcall(core.createMemTag, name, memLimit)
+            if ok then
+                core.setMemTag(tag)
+            else
+                logger:error(("Plugin '%s' shares the memory tag: %s"):format(name, tag))
+            end
+            table.insert(priv.names, name)
             local success, result = xpcall(loadPlugin, traceback, name)
+            core.setMemTag(prevTag)
             if success == false then
                 logger:error(result)
             else
@@ -65,6 +107,11 @@ function M.init()
                 end
             end
         end
+        -- Persist the Instance IDs allocated by the plugins at once.
+        local success, err = pcall(hapUtil.flush)
+        if success == false then
+            logger:error(("Failed to persist Instance IDs: %s"):format(err))
+        end
         for name in pairs(loaded) do
             if not loadedBefore[name] then
                 loaded[name] = nil
@@ -2,7 +2,13 @@ local hap = require "hap"
 
 local M = {}
 
+local priv = {
+    dirty = {},     ---@type table<NVSHandle, table<string, integer>|false>
+}
+
 ---Get bridged accessory Instance ID.
+---
+---A new Instance ID is persisted by ``flush()``.
 ---@param handle NVSHandle
 ---@return integer
 function M.getBridgedAccessoryIID(handle)
@@ -10,12 +16,14 @@ function M.getBridgedAccessoryIID(handle)
     if aid == nil then
         aid = hap.getNewInstanceID(true)
         handle:set("aid", aid)
-        handle:commit()
+        priv.dirty[handle] = priv.dirty[handle] or false
     end
     return aid
 end
 
 ---Get Instance IDs for services or characteristics, excluding bridged accessories.
+---
+---New Instance IDs are persisted by ``flush()``.
 ---@param handle NVSHandle
 ---@return table<string, integer>
 function M.getInstanceIDs(handle)
@@ -29,8 +37,7 @@ function M.getInstanceIDs(handle)
         if v == nil then
             v = hap.getNewInstanceID()
             iids[k] = v
-            handle:set("iids", iids)
-            handle:commit()
+            priv.dirty[handle] = iids
         end
         return v
     end
@@ -40,4 +47,16 @@ function M.getInstanceIDs(handle)
     return setmetatable({}, mt)
 end
 
+---Persist the Instance IDs allocated since the last flush, with a single commit per handle.
+function M.flush()
+    local dirty = priv.dirty
+    priv.dirty = {}
+    for handle, iids in pairs(dirty) do
+        if iids then
+            handle:set("iids", iids)
+        end
+        handle:commit()
+    end
+end
+
 return M
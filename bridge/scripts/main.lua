@@ -6,6 +6,41 @@ local netlink = require "netlink"
 
 local logger = log.getLogger()
 
+local function getInteger(key)
+    local value = config.get(key)
+    return value and math.tointeger(tonumber(value))
+end
+
+-- Tune the GC pacer for the deployment.
+core.configureGC({
+    mode = config.get("gc.mode"),
+    budget = getInteger("gc.budget"),
+    maxPause = getInteger("gc.maxpause"),
+})
+
+-- Serve characteristic reads from the value caches.
+hap.setCacheTTL(getInteger("hap.cache.ttl") or 0)
+
+-- Limit the reads running the read callbacks.
+hap.setReadLimits({
+    maxInFlight = getInteger("hap.read.maxinflight"),
+    maxPerAccessory = getInteger("hap.read.maxperaccessory"),
+    maxQueued = getInteger("hap.read.maxqueued"),
+    deadline = getInteger("hap.read.deadline"),
+})
+
+-- Limit the IP sessions and the idle sessions kept allocated.
+hap.setIPSessionLimits({
+    max = getInteger("hap.ip.maxsessions"),
+    reserve = getInteger("hap.ip.reservesessions"),
+})
+
+-- Coalesce the events raised in the window.
+local eventWindow = getInteger("hap.event.window")
+if eventWindow then
+    hap.setEventWindow(eventWindow)
+end
+
 -- Wait for the network link is ready.
 if not netlink.isUp() then netlink.waitUp() end
 
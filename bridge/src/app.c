@@ -8,11 +8,8 @@
 #include <lauxlib.h>
 #include <lualib.h>
 #include <embedfs.h>
-#include <pal/mem.h>
 #include <pal/err.h>
 #include <app.h>
-#include <HAPPlatformClock.h>
-#include <HAPPlatformTimer.h>
 
 #include "app_int.h"
 #include "lc.h"
@@ -28,11 +25,6 @@ extern int luaopen_cjson(lua_State *L);
 // Bridge embedfs root.
 extern const embedfs_dir BRIDGE_EMBEDFS_ROOT;
 
-#define APP_GC_PAUSE 120
-#define APP_GC_STEPMUL 400
-#define APP_GC_STEPSIZE 1024
-#define APP_GC_PUMP_INTERVAL_MS 100
-
 struct app_exec_ctx {
     bool in_progress;
     int argc;
@@ -43,7 +35,6 @@ struct app_exec_ctx {
 };
 
 static lua_State *L;
-static HAPPlatformTimerRef gc_timer;
 
 static const luaL_Reg globallibs[] = {
     {LUA_GNAME, luaopen_base},
@@ -62,6 +53,9 @@ static const luaL_Reg globallibs[] = {
 
 static const luaL_Reg dynamiclibs[] = {
     {LUA_HAP_NAME, luaopen_hap},
+#ifdef CONFIG_HAP_LOOPBACK
+    {LUA_HAP_LOOPBACK_NAME, luaopen_haploopback},
+#endif
     {LUA_CHIP_NAME, luaopen_chip},
     {LUA_HASH_NAME, luaopen_hash},
     {LUA_CIPHER_NAME, luaopen_cipher},
@@ -169,44 +163,6 @@ static int searcher_json(lua_State *L) {
     return 1;
 }
 
-static void *app_lua_alloc(void *ud, void *ptr, size_t osize, size_t nsize) {
-    (void)ud; (void)osize; /* not used */
-    if (nsize == 0) {
-        pal_mem_free(ptr);
-        return NULL;
-    } else {
-        return pal_mem_realloc(ptr, nsize);
-    }
-}
-
-static void app_schedule_gc_pump(void);
-
-static void app_gc_pump_cb(HAPPlatformTimerRef timer, void *context) {
-    (void)timer;
-    (void)context;
-    gc_timer = 0;
-    if (!L) {
-        return;
-    }
-    HAPAssert(lua_gettop(L) == 0);
-    lc_collectgarbage_idle(L);
-    lua_settop(L, 0);
-    app_schedule_gc_pump();
-}
-
-static void app_schedule_gc_pump(void) {
-    if (!L || gc_timer) {
-        return;
-    }
-    HAPError err = HAPPlatformTimerRegister(&gc_timer,
-        HAPPlatformClockGetCurrent() + APP_GC_PUMP_INTERVAL_MS,
-        app_gc_pump_cb, NULL);
-    if (err != kHAPError_None) {
-        gc_timer = 0;
-        HAPLogError(&kHAPLog_Default, "%s: failed to schedule GC pump", __func__);
-    }
-}
-
 // app_pinit(dir: lightuserdata)
 static int app_pinit(lua_State *L) {
     const char *dir = lua_touserdata(L, 1);
@@ -219,12 +175,6 @@ static int app_pinit(lua_State *L) {
         lua_pop(L, 1);  /* remove lib */
     }
 
-    // GC in incremental mode tuned for lower memory peaks.
-    lua_gc(L, LUA_GCINC);
-    lua_gc(L, LUA_GCPARAM, LUA_GCPPAUSE, APP_GC_PAUSE);
-    lua_gc(L, LUA_GCPARAM, LUA_GCPSTEPMUL, APP_GC_STEPMUL);
-    lua_gc(L, LUA_GCPARAM, LUA_GCPSTEPSIZE, APP_GC_STEPSIZE);
-
     // package.path = "${dir}/?.lua;${dir}/?.luac"
     lua_getglobal(L, "package");
     lua_pushfstring(L, "%s/?.lua;%s/?.luac", dir, dir);
@@ -277,10 +227,10 @@ static int panic(lua_State *L) {
     return 0;  /* return to Lua to abort */
 }
 
-void app_init(const char *dir) {
+void app_init(const char *dir, app_allocator allocator) {
     HAPPrecondition(dir);
 
-    L = lua_newstate(app_lua_alloc, NULL, luaL_makeseed(NULL));
+    L = lua_newstate(app_alloc_init(allocator), NULL, luaL_makeseed(NULL));
     if (luai_unlikely(!L)) {
         HAPLogError(&kHAPLog_Default,
             "%s: Cannot create state: not enough memory", __func__);
@@ -289,6 +239,13 @@ void app_init(const char *dir) {
 
     lua_atpanic(L, &panic);
 
+    // New threads inherit the extra space of the main thread.
+    HAPRawBufferZero(lua_getextraspace(L), LUA_EXTRASPACE);
+    lc_setpriority(L, LC_PRIO_NORMAL);
+
+    // GC paced by the heap budget and the pause budget.
+    lc_gc_init(L);
+
     // call 'app_pinit' in protected mode
     lua_pushcfunction(L, app_pinit);
     lua_pushlightuserdata(L, (void *)dir);
@@ -303,18 +260,17 @@ void app_init(const char *dir) {
 
     lua_settop(L, 0);
     lc_collectgarbage_full(L);
-    app_schedule_gc_pump();
 }
 
 void app_deinit() {
-    if (gc_timer) {
-        HAPPlatformTimerDeregister(gc_timer);
-        gc_timer = 0;
-    }
+    lc_gc_deinit();
     if (L) {
         lua_close(L);
         L = NULL;
     }
+    app_alloc_deinit();
+    lc_sched_deinit();
+    app_timer_deinit();
 }
 
 static int finishentry(lua_State *L, int status, lua_KContext extra) {
@@ -0,0 +1,319 @@
+// Copyright (c) 2021-2022 Zebin Wu and homekit-bridge contributors
+//
+// Licensed under the Apache License, Version 2.0 (the “License”);
+// you may not use this file except in compliance with the License.
+// See [CONTRIBUTORS.md] for the list of homekit-bridge project authors.
+
+#include <string.h>
+#include <pal/mem.h>
+#include <HAPLog.h>
+
+#include "app_int.h"
+
+// Size of a slab, including the header.
+#define APP_ALLOC_SLAB_SIZE ((size_t) 4096)
+
+// Blocks are aligned to the granule, size classes are multiples of it.
+#define APP_ALLOC_GRANULE 16
+
+// Blocks larger than this are allocated by pal_mem_realloc().
+#define APP_ALLOC_SMALL_MAX 256
+
+// Size of the block header keeping the owner tag, it keeps the alignment of Lua objects.
+#define APP_ALLOC_HDR_SIZE 8
+
+static const HAPLogObject app_alloc_log = {
+    .subsystem = APP_BRIDGE_LOG_SUBSYSTEM,
+    .category = "alloc",
+};
+
+static const uint16_t app_alloc_class_sizes[APP_ALLOC_CLASS_NUM] = {
+    16, 32, 48, 64, 96, 128, 192, 256
+};
+
+// Index of the size class for each number of granules.
+static const uint8_t app_alloc_class_index[APP_ALLOC_SMALL_MAX / APP_ALLOC_GRANULE + 1] = {
+    0, 0, 1, 2, 3, 4, 4, 5, 5, 6, 6, 6, 6, 7, 7, 7, 7
+};
+
+/**
+ * Block header.
+ */
+typedef union {
+    uint8_t tag;                /* owner of the block */
+    char pad[APP_ALLOC_HDR_SIZE];
+} app_alloc_hdr;
+HAP_STATIC_ASSERT(sizeof(app_alloc_hdr) == APP_ALLOC_HDR_SIZE, app_alloc_hdr);
+
+/**
+ * Free block, linked in the free list of its size class.
+ */
+typedef struct app_alloc_block {
+    struct app_alloc_block *next;
+} app_alloc_block;
+
+/**
+ * Slab, its blocks follow the header.
+ */
+typedef struct app_alloc_slab {
+    struct app_alloc_slab *next;
+    union {
+        max_align_t align;
+        char blocks[1];
+    } data;
+} app_alloc_slab;
+
+static struct {
+    app_allocator allocator;
+    uint8_t tag;                /* tag of the running code */
+    size_t ntags;               /* number of the created tags */
+    app_alloc_block *free[APP_ALLOC_CLASS_NUM];
+    app_alloc_slab *slabs;
+    app_alloc_stats stats;
+    app_alloc_tag_stats tags[APP_ALLOC_TAG_MAX];
+} pool;
+
+static inline size_t app_alloc_class(size_t size) {
+    return app_alloc_class_index[(size + APP_ALLOC_GRANULE - 1) / APP_ALLOC_GRANULE];
+}
+
+static void app_alloc_account(uint8_t tag, size_t osize, size_t nsize) {
+    pool.stats.live = pool.stats.live - osize + nsize;
+    if (pool.stats.live > pool.stats.peak) {
+        pool.stats.peak = pool.stats.live;
+    }
+    app_alloc_tag_stats *t = &pool.tags[tag];
+    t->live = t->live - osize + nsize;
+    if (t->live > t->peak) {
+        t->peak = t->live;
+    }
+}
+
+/**
+ * Check whether the tag exceeds its soft limit if the memory grows.
+ *
+ * The failed allocation makes Lua run an emergency full GC and try again,
+ * then raise a memory error in the running coroutine.
+ */
+static bool app_alloc_over_limit(uint8_t tag, size_t grow) {
+    app_alloc_tag_stats *t = &pool.tags[tag];
+    if (t->limit == 0 || t->live + grow <= t->limit) {
+        return false;
+    }
+    t->limit_hits++;
+    HAPLogError(&app_alloc_log, "'%s' exceeds the soft limit: %zu + %zu > %zu bytes.",
+        t->name, t->live, grow, t->limit);
+    return true;
+}
+
+static bool app_alloc_grow(size_t idx) {
+    app_alloc_slab *slab = pal_mem_alloc(APP_ALLOC_SLAB_SIZE);
+    if (!slab) {
+        return false;
+    }
+    size_t size = app_alloc_class_sizes[idx];
+    size_t n = (APP_ALLOC_SLAB_SIZE - offsetof(app_alloc_slab, data)) / size;
+    for (size_t i = n; i > 0; i--) {
+        app_alloc_block *b = (app_alloc_block *)(slab->data.blocks + (i - 1) * size);
+        b->next = pool.free[idx];
+        pool.free[idx] = b;
+    }
+    slab->next = pool.slabs;
+    pool.slabs = slab;
+
+    app_alloc_class_stats *cls = &pool.stats.classes[idx];
+    cls->slabs++;
+    cls->free += n;
+    pool.stats.slab_bytes += APP_ALLOC_SLAB_SIZE;
+    return true;
+}
+
+static void *app_alloc_small(size_t size) {
+    size_t idx = app_alloc_class(size);
+    if (!pool.free[idx] && !app_alloc_grow(idx)) {
+        return NULL;
+    }
+    app_alloc_block *b = pool.free[idx];
+    pool.free[idx] = b->next;
+
+    app_alloc_class_stats *cls = &pool.stats.classes[idx];
+    cls->free--;
+    cls->blocks++;
+    cls->bytes += size;
+    return b;
+}
+
+static void app_alloc_free_small(void *ptr, size_t size) {
+    size_t idx = app_alloc_class(size);
+    app_alloc_block *b = ptr;
+    b->next = pool.free[idx];
+    pool.free[idx] = b;
+
+    app_alloc_class_stats *cls = &pool.stats.classes[idx];
+    cls->free++;
+    cls->blocks--;
+    cls->bytes -= size;
+}
+
+static void *app_alloc_system_realloc(void *ptr, size_t osize, size_t nsize) {
+    if (nsize == 0) {
+        pal_mem_free(ptr);
+        return NULL;
+    }
+    return pal_mem_realloc(ptr, nsize);
+}
+
+static void *app_alloc_slab_realloc(void *ptr, size_t osize, size_t nsize) {
+    bool osmall = ptr && osize <= APP_ALLOC_SMALL_MAX;
+    bool nsmall = nsize <= APP_ALLOC_SMALL_MAX;
+
+    if (nsize == 0) {
+        if (osmall) {
+            app_alloc_free_small(ptr, osize);
+        } else if (ptr) {
+            pal_mem_free(ptr);
+            pool.stats.large -= osize;
+        }
+        return NULL;
+    }
+
+    void *nptr;
+    if (osmall && nsmall && app_alloc_class(osize) == app_alloc_class(nsize)) {
+        // the block is big enough
+        size_t idx = app_alloc_class(osize);
+        pool.stats.classes[idx].bytes = pool.stats.classes[idx].bytes - osize + nsize;
+        nptr = ptr;
+    } else if (ptr && !osmall && !nsmall) {
+        nptr = pal_mem_realloc(ptr, nsize);
+        if (!nptr) {
+            return NULL;
+        }
+        pool.stats.large = pool.stats.large - osize + nsize;
+    } else {
+        nptr = nsmall ? app_alloc_small(nsize) : pal_mem_alloc(nsize);
+        if (!nptr) {
+            return NULL;
+        }
+        if (!nsmall) {
+            pool.stats.large += nsize;
+        }
+        if (ptr) {
+            memcpy(nptr, ptr, osize < nsize ? osize : nsize);
+            if (osmall) {
+                app_alloc_free_small(ptr, osize);
+            } else {
+                pal_mem_free(ptr);
+                pool.stats.large -= osize;
+            }
+        }
+    }
+    return nptr;
+}
+
+/**
+ * Allocator of the Lua state, each block is prefixed by a header keeping its owner.
+ */
+static void *app_alloc_realloc(void *ud, void *ptr, size_t osize, size_t nsize) {
+    (void)ud;  /* not used */
+    app_alloc_hdr *hdr = NULL;
+    uint8_t tag = pool.tag;
+    if (ptr) {
+        hdr = (app_alloc_hdr *)((char *)ptr - APP_ALLOC_HDR_SIZE);
+        tag = hdr->tag;
+    } else {
+        osize = 0;  /* 'osize' is the type of the object */
+    }
+
+    void *(*realloc_fn)(void *, size_t, size_t) =
+        pool.allocator == APP_ALLOC_SLAB ? app_alloc_slab_realloc : app_alloc_system_realloc;
+    size_t ohsize = hdr ? osize + APP_ALLOC_HDR_SIZE : 0;
+
+    if (nsize == 0) {
+        realloc_fn(hdr, ohsize, 0);
+        app_alloc_account(tag, osize, 0);
+        return NULL;
+    }
+    // Lua assumes that shrinking never fails.
+    if (nsize > osize && app_alloc_over_limit(tag, nsize - osize)) {
+        return NULL;
+    }
+    app_alloc_hdr *nhdr = realloc_fn(hdr, ohsize, nsize + APP_ALLOC_HDR_SIZE);
+    if (!nhdr) {
+        return NULL;
+    }
+    nhdr->tag = tag;
+    if (nsize > osize) {
+        pool.stats.allocs++;
+        pool.stats.alloc_bytes += nsize - osize;
+    }
+    app_alloc_account(tag, osize, nsize);
+    return (char *)nhdr + APP_ALLOC_HDR_SIZE;
+}
+
+lua_Alloc app_alloc_init(app_allocator allocator) {
+    HAPPrecondition(allocator == APP_ALLOC_SYSTEM || allocator == APP_ALLOC_SLAB);
+
+    HAPRawBufferZero(&pool, sizeof(pool));
+    pool.allocator = allocator;
+    for (size_t i = 0; i < APP_ALLOC_CLASS_NUM; i++) {
+        pool.stats.classes[i].size = app_alloc_class_sizes[i];
+    }
+    HAPRawBufferCopyBytes(pool.tags[0].name, "bridge", sizeof("bridge"));
+    pool.ntags = 1;
+    if (allocator == APP_ALLOC_SLAB) {
+        HAPLogInfo(&app_alloc_log, "Using slab allocator for blocks up to %u bytes.", APP_ALLOC_SMALL_MAX);
+    }
+    return app_alloc_realloc;
+}
+
+int app_alloc_new_tag(const char *name, size_t limit) {
+    HAPPrecondition(name);
+
+    if (pool.ntags == APP_ALLOC_TAG_MAX) {
+        return -1;
+    }
+    app_alloc_tag_stats *t = &pool.tags[pool.ntags];
+    size_t len = HAPStringGetNumBytes(name);
+    if (len > APP_ALLOC_TAG_NAME_MAX_LEN) {
+        len = APP_ALLOC_TAG_NAME_MAX_LEN;
+    }
+    HAPRawBufferCopyBytes(t->name, name, len);
+    t->name[len] = '\0';
+    t->limit = limit;
+    return (int)pool.ntags++;
+}
+
+uint8_t app_alloc_settag(uint8_t tag) {
+    HAPPrecondition(tag < pool.ntags);
+
+    uint8_t prev = pool.tag;
+    pool.tag = tag;
+    return prev;
+}
+
+size_t app_alloc_get_ntags(void) {
+    return pool.ntags;
+}
+
+void app_alloc_get_tag_stats(uint8_t tag, app_alloc_tag_stats *stats) {
+    HAPPrecondition(tag < pool.ntags);
+    HAPPrecondition(stats);
+
+    *stats = pool.tags[tag];
+}
+
+void app_alloc_get_stats(app_alloc_stats *stats) {
+    HAPPrecondition(stats);
+
+    *stats = pool.stats;
+    stats->allocator = pool.allocator;
+}
+
+void app_alloc_deinit(void) {
+    for (app_alloc_slab *slab = pool.slabs; slab;) {
+        app_alloc_slab *next = slab->next;
+        pal_mem_free(slab);
+        slab = next;
+    }
+    HAPRawBufferZero(&pool, sizeof(pool));
+}
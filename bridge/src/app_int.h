@@ -13,24 +13,200 @@ extern "C" {
 
 #include <lua.h>
 #include <HAP.h>
+#include <app.h>
 
 /**
  * Log subsystem used by the HAP Bridge implementation.
  */
 #define APP_BRIDGE_LOG_SUBSYSTEM "com.apple.mfi.HomeKit.Bridge"
 
+/**
+ * Timer reference, NULL means the timer is not registered.
+ *
+ * All timers are kept in a hierarchical timing wheel which is
+ * driven by a single platform timer.
+ */
+typedef struct app_timer *app_timer_ref;
+
+/**
+ * Callback invoked when a timer expires.
+ *
+ * @param timer The expired timer, it is invalid since the callback is called.
+ * @param context The context passed to app_timer_register().
+ */
+typedef void (*app_timer_cb)(app_timer_ref timer, void *context);
+
+/**
+ * Statistics of the timing wheel.
+ */
+typedef struct {
+    size_t armed;               /* number of the timers waiting to expire */
+    size_t fired;               /* number of the expired timers */
+    size_t cancelled;           /* number of the deregistered timers */
+    size_t dispatches;          /* number of the platform timer callbacks */
+    size_t max_batch;           /* maximum number of timers expired in a dispatch */
+    size_t platform_timers;     /* number of the registered platform timers */
+} app_timer_stats;
+
+/**
+ * Register a timer, it has the same semantics as HAPPlatformTimerRegister().
+ *
+ * Timers expired at the same time are called in a batch,
+ * timers registered in the callbacks are called in the next batch.
+ *
+ * @param[out] timer Timer reference.
+ * @param deadline Deadline after which the timer expires.
+ * @param cb Function to call when the timer expires.
+ * @param context The context passed to the callback.
+ */
+HAPError app_timer_register(app_timer_ref *timer, HAPTime deadline, app_timer_cb cb, void *context);
+
+/**
+ * Deregister a timer that has not yet fired.
+ */
+void app_timer_deregister(app_timer_ref timer);
+
+/**
+ * Get statistics of the timing wheel.
+ */
+void app_timer_get_stats(app_timer_stats *stats);
+
+/**
+ * Deregister the platform timer and release all timers.
+ */
+void app_timer_deinit(void);
+
+/**
+ * Number of the size classes of the slab allocator.
+ */
+#define APP_ALLOC_CLASS_NUM 8
+
+/**
+ * Statistics of a size class.
+ */
+typedef struct {
+    size_t size;                /* block size */
+    size_t blocks;              /* number of the live blocks */
+    size_t bytes;               /* live bytes requested in the blocks */
+    size_t free;                /* number of the free blocks */
+    size_t slabs;               /* number of the slabs */
+} app_alloc_class_stats;
+
+/**
+ * Statistics of the Lua allocator.
+ */
+typedef struct {
+    app_allocator allocator;
+    size_t live;                /* live bytes */
+    size_t peak;                /* peak of the live bytes */
+    size_t large;               /* live bytes not in the slabs */
+    size_t slab_bytes;          /* bytes of the slabs */
+    size_t allocs;              /* number of the allocations, including growing reallocations */
+    size_t alloc_bytes;         /* total bytes allocated */
+    app_alloc_class_stats classes[APP_ALLOC_CLASS_NUM];
+} app_alloc_stats;
+
+/**
+ * Maximum number of the allocation tags, the tag 0 is the bridge itself.
+ */
+#define APP_ALLOC_TAG_MAX 16
+
+/**
+ * Maximum length of the name of an allocation tag.
+ */
+#define APP_ALLOC_TAG_NAME_MAX_LEN 15
+
+/**
+ * Statistics of an allocation tag.
+ */
+typedef struct {
+    char name[APP_ALLOC_TAG_NAME_MAX_LEN + 1];
+    size_t live;                /* live bytes owned by the tag */
+    size_t peak;                /* peak of the live bytes */
+    size_t limit;               /* soft limit of the live bytes, 0 means no limit */
+    size_t limit_hits;          /* number of the allocations failed for the soft limit */
+} app_alloc_tag_stats;
+
+/**
+ * Initialize the Lua allocator.
+ *
+ * Each block is owned by the tag running when it is allocated.
+ * Slabs are kept until app_alloc_deinit() is called.
+ *
+ * @param allocator Allocator type.
+ * @return the allocator function passed to lua_newstate().
+ */
+lua_Alloc app_alloc_init(app_allocator allocator);
+
+/**
+ * Get statistics of the Lua allocator.
+ */
+void app_alloc_get_stats(app_alloc_stats *stats);
+
+/**
+ * Create an allocation tag.
+ *
+ * An allocation which makes the live bytes of the tag exceed the soft limit fails,
+ * Lua runs a full GC and tries again before raising a memory error.
+ *
+ * @param name Tag name.
+ * @param limit Soft limit of the live bytes, 0 means no limit.
+ * @return the tag on success.
+ * @return -1 if there are too many tags.
+ */
+int app_alloc_new_tag(const char *name, size_t limit);
+
+/**
+ * Set the tag of the running code.
+ *
+ * @return the previous tag.
+ */
+uint8_t app_alloc_settag(uint8_t tag);
+
+/**
+ * Get the number of the created tags.
+ */
+size_t app_alloc_get_ntags(void);
+
+/**
+ * Get statistics of an allocation tag.
+ */
+void app_alloc_get_tag_stats(uint8_t tag, app_alloc_tag_stats *stats);
+
+/**
+ * Release all slabs, it must be called after closing the state.
+ */
+void app_alloc_deinit(void);
+
 #define LUA_CHIP_NAME "chip"
 LUAMOD_API int luaopen_chip(lua_State *L);
 
 #define LUA_CIPHER_NAME "cipher"
 LUAMOD_API int luaopen_cipher(lua_State *L);
 
+/**
+ * Names of the cipher types and operations,
+ * indexed by pal_cipher_type and pal_cipher_operation.
+ */
+extern const char *lcipher_type_strs[];
+extern const char *lcipher_op_strs[];
+
 #define LUA_HAP_NAME "hap"
 LUAMOD_API int luaopen_hap(lua_State *L);
 
+#ifdef CONFIG_HAP_LOOPBACK
+#define LUA_HAP_LOOPBACK_NAME "haploopback"
+LUAMOD_API int luaopen_haploopback(lua_State *L);
+#endif
+
 #define LUA_HASH_NAME "hash"
 LUAMOD_API int luaopen_hash(lua_State *L);
 
+/**
+ * Names of the hash types, indexed by pal_md_type.
+ */
+extern const char *lhash_type_strs[];
+
 #define LUA_LOG_NAME "log"
 LUAMOD_API int luaopen_log(lua_State *L);
 
@@ -0,0 +1,359 @@
+// Copyright (c) 2021-2022 Zebin Wu and homekit-bridge contributors
+//
+// Licensed under the Apache License, Version 2.0 (the “License”);
+// you may not use this file except in compliance with the License.
+// See [CONTRIBUTORS.md] for the list of homekit-bridge project authors.
+
+#include <pal/mem.h>
+#include <HAPLog.h>
+#include <HAPPlatformClock.h>
+#include <HAPPlatformTimer.h>
+
+#include "app_int.h"
+
+// Each level of the wheel has 64 slots, so the occupancy fits in a uint64_t.
+#define APP_TIMER_LVL_BITS 6
+#define APP_TIMER_LVL_SIZE (1 << APP_TIMER_LVL_BITS)
+#define APP_TIMER_LVL_MASK (APP_TIMER_LVL_SIZE - 1)
+
+// 6 levels cover 2^36 ms (about 795 days), later deadlines wait in the overflow list.
+#define APP_TIMER_LVL_NUM 6
+
+#define APP_TIMER_LVL_SHIFT(lvl) ((lvl) * APP_TIMER_LVL_BITS)
+
+// Number of timer nodes allocated at once when the free list is empty.
+#define APP_TIMER_CHUNK_SIZE 32
+
+static const HAPLogObject app_timer_log = {
+    .subsystem = APP_BRIDGE_LOG_SUBSYSTEM,
+    .category = "timer",
+};
+
+/**
+ * Doubly linked list head. The list is circular, the head is a sentinel.
+ */
+typedef struct app_timer_list {
+    struct app_timer_list *prev;
+    struct app_timer_list *next;
+} app_timer_list;
+
+struct app_timer {
+    app_timer_list node;        /* must be the first member */
+    app_timer_list *list;       /* the list which the timer is linked in */
+    HAPTime deadline;
+    app_timer_cb cb;
+    void *context;
+};
+
+typedef struct app_timer_chunk {
+    struct app_timer_chunk *next;
+    struct app_timer timers[APP_TIMER_CHUNK_SIZE];
+} app_timer_chunk;
+
+static struct {
+    bool inited;
+    bool dispatching;
+    HAPTime now;                /* current time of the wheel */
+    uint64_t bitmap[APP_TIMER_LVL_NUM];
+    app_timer_list slots[APP_TIMER_LVL_NUM][APP_TIMER_LVL_SIZE];
+    app_timer_list overflow;    /* timers beyond the last level */
+    app_timer_list expired;     /* timers to be called in the next dispatch */
+    struct app_timer *free;
+    app_timer_chunk *chunks;
+    HAPPlatformTimerRef platform_timer;
+    HAPTime platform_deadline;
+    app_timer_stats stats;
+} wheel;
+
+static inline void app_timer_list_init(app_timer_list *list) {
+    list->prev = list;
+    list->next = list;
+}
+
+static inline bool app_timer_list_empty(const app_timer_list *list) {
+    return list->next == list;
+}
+
+static inline void app_timer_list_append(app_timer_list *list, struct app_timer *t) {
+    t->node.prev = list->prev;
+    t->node.next = list;
+    list->prev->next = &t->node;
+    list->prev = &t->node;
+    t->list = list;
+}
+
+static inline void app_timer_list_unlink(struct app_timer *t) {
+    t->node.prev->next = t->node.next;
+    t->node.next->prev = t->node.prev;
+    t->list = NULL;
+}
+
+// Move all nodes of the list 'from' to the tail of the list 'to'.
+static void app_timer_list_splice(app_timer_list *from, app_timer_list *to) {
+    for (app_timer_list *n = from->next; n != from; n = n->next) {
+        ((struct app_timer *)n)->list = to;
+    }
+    if (app_timer_list_empty(from)) {
+        return;
+    }
+    from->next->prev = to->prev;
+    from->prev->next = to;
+    to->prev->next = from->next;
+    to->prev = from->prev;
+    app_timer_list_init(from);
+}
+
+static void app_timer_init(void) {
+    for (size_t i = 0; i < APP_TIMER_LVL_NUM; i++) {
+        for (size_t j = 0; j < APP_TIMER_LVL_SIZE; j++) {
+            app_timer_list_init(&wheel.slots[i][j]);
+        }
+    }
+    app_timer_list_init(&wheel.overflow);
+    app_timer_list_init(&wheel.expired);
+    wheel.now = HAPPlatformClockGetCurrent();
+    wheel.inited = true;
+}
+
+static struct app_timer *app_timer_alloc(void) {
+    if (!wheel.free) {
+        app_timer_chunk *chunk = pal_mem_alloc(sizeof(*chunk));
+        if (!chunk) {
+            return NULL;
+        }
+        for (size_t i = 0; i < APP_TIMER_CHUNK_SIZE; i++) {
+            chunk->timers[i].node.next = (app_timer_list *)wheel.free;
+            wheel.free = &chunk->timers[i];
+        }
+        chunk->next = wheel.chunks;
+        wheel.chunks = chunk;
+    }
+    struct app_timer *t = wheel.free;
+    wheel.free = (struct app_timer *)t->node.next;
+    return t;
+}
+
+static void app_timer_release(struct app_timer *t) {
+    t->cb = NULL;
+    t->context = NULL;
+    t->node.next = (app_timer_list *)wheel.free;
+    wheel.free = t;
+}
+
+// Remove the timer from the list it is linked in, and keep the slot bitmap in sync.
+static void app_timer_detach(struct app_timer *t) {
+    app_timer_list *list = t->list;
+    app_timer_list_unlink(t);
+    if (list >= &wheel.slots[0][0] && list < &wheel.slots[0][0] + APP_TIMER_LVL_NUM * APP_TIMER_LVL_SIZE &&
+        app_timer_list_empty(list)) {
+        size_t idx = list - &wheel.slots[0][0];
+        wheel.bitmap[idx / APP_TIMER_LVL_SIZE] &= ~(1ULL << (idx % APP_TIMER_LVL_SIZE));
+    }
+}
+
+/**
+ * Put the timer into the lowest level whose current block contains the deadline.
+ *
+ * All slots in use on level N start after the block of level N - 1 that
+ * contains the wheel time, so the first non-empty level always holds
+ * the next event.
+ */
+static void app_timer_enqueue(struct app_timer *t) {
+    if (t->deadline <= wheel.now) {
+        app_timer_list_append(&wheel.expired, t);
+        return;
+    }
+    for (size_t lvl = 0; lvl < APP_TIMER_LVL_NUM; lvl++) {
+        size_t shift = APP_TIMER_LVL_SHIFT(lvl + 1);
+        if ((t->deadline >> shift) == (wheel.now >> shift)) {
+            size_t slot = (t->deadline >> APP_TIMER_LVL_SHIFT(lvl)) & APP_TIMER_LVL_MASK;
+            app_timer_list_append(&wheel.slots[lvl][slot], t);
+            wheel.bitmap[lvl] |= 1ULL << slot;
+            return;
+        }
+    }
+    app_timer_list_append(&wheel.overflow, t);
+}
+
+/**
+ * Get the time at which the wheel must process a slot,
+ * HAPTime_Max if no timers are waiting in the wheel.
+ */
+static HAPTime app_timer_next_event(size_t *plvl) {
+    for (size_t lvl = 0; lvl < APP_TIMER_LVL_NUM; lvl++) {
+        if (wheel.bitmap[lvl]) {
+            size_t shift = APP_TIMER_LVL_SHIFT(lvl + 1);
+            HAPTime slot = __builtin_ctzll(wheel.bitmap[lvl]);
+            *plvl = lvl;
+            return ((wheel.now >> shift) << shift) | (slot << APP_TIMER_LVL_SHIFT(lvl));
+        }
+    }
+    *plvl = APP_TIMER_LVL_NUM;
+    if (!app_timer_list_empty(&wheel.overflow)) {
+        size_t shift = APP_TIMER_LVL_SHIFT(APP_TIMER_LVL_NUM);
+        return ((wheel.now >> shift) + 1) << shift;
+    }
+    return HAPTime_Max;
+}
+
+/**
+ * Advance the wheel to the time, move the expired timers to the expired list.
+ *
+ * A timer is cascaded to a lower level when its slot is reached,
+ * so it moves at most APP_TIMER_LVL_NUM times before expiring.
+ */
+static void app_timer_advance(HAPTime now) {
+    for (;;) {
+        size_t lvl;
+        HAPTime next = app_timer_next_event(&lvl);
+        if (next > now) {
+            break;
+        }
+        wheel.now = next;
+
+        app_timer_list pending;
+        app_timer_list_init(&pending);
+        if (lvl == APP_TIMER_LVL_NUM) {
+            app_timer_list_splice(&wheel.overflow, &pending);
+        } else {
+            size_t slot = (next >> APP_TIMER_LVL_SHIFT(lvl)) & APP_TIMER_LVL_MASK;
+            app_timer_list_splice(&wheel.slots[lvl][slot], &pending);
+            wheel.bitmap[lvl] &= ~(1ULL << slot);
+        }
+        while (!app_timer_list_empty(&pending)) {
+            struct app_timer *t = (struct app_timer *)pending.next;
+            app_timer_list_unlink(t);
+            app_timer_enqueue(t);
+        }
+    }
+    if (now > wheel.now) {
+        wheel.now = now;
+    }
+}
+
+static void app_timer_platform_cb(HAPPlatformTimerRef timer, void *context);
+
+/**
+ * Make sure the platform timer fires no later than the next event.
+ *
+ * The platform timer is kept if it fires earlier than needed,
+ * a spurious dispatch is cheaper than re-registering it on every cancel.
+ */
+static HAPError app_timer_schedule(void) {
+    if (wheel.dispatching) {
+        return kHAPError_None;
+    }
+    size_t lvl;
+    HAPTime next = app_timer_list_empty(&wheel.expired) ? app_timer_next_event(&lvl) : 0;
+    if (next == HAPTime_Max || (wheel.platform_timer && wheel.platform_deadline <= next)) {
+        return kHAPError_None;
+    }
+    if (wheel.platform_timer) {
+        HAPPlatformTimerDeregister(wheel.platform_timer);
+        wheel.platform_timer = 0;
+    }
+    HAPError err = HAPPlatformTimerRegister(&wheel.platform_timer, next, app_timer_platform_cb, NULL);
+    if (err != kHAPError_None) {
+        wheel.platform_timer = 0;
+        HAPLogError(&app_timer_log, "%s: Failed to register the platform timer.", __func__);
+        return err;
+    }
+    wheel.platform_deadline = next;
+    wheel.stats.platform_timers++;
+    return kHAPError_None;
+}
+
+static void app_timer_platform_cb(HAPPlatformTimerRef timer, void *context) {
+    wheel.platform_timer = 0;
+
+    app_timer_advance(HAPPlatformClockGetCurrent());
+
+    // Only the timers expired so far are called in this dispatch,
+    // timers expired during the callbacks wait for the next one.
+    app_timer_list batch;
+    app_timer_list_init(&batch);
+    app_timer_list_splice(&wheel.expired, &batch);
+
+    size_t n = 0;
+    wheel.dispatching = true;
+    while (!app_timer_list_empty(&batch)) {
+        struct app_timer *t = (struct app_timer *)batch.next;
+        app_timer_cb cb = t->cb;
+        void *ctx = t->context;
+        app_timer_list_unlink(t);
+        app_timer_release(t);
+        wheel.stats.armed--;
+        wheel.stats.fired++;
+        n++;
+        cb(t, ctx);
+    }
+    wheel.dispatching = false;
+
+    wheel.stats.dispatches++;
+    if (n > wheel.stats.max_batch) {
+        wheel.stats.max_batch = n;
+    }
+    (void)app_timer_schedule();
+}
+
+HAPError app_timer_register(app_timer_ref *timer, HAPTime deadline, app_timer_cb cb, void *context) {
+    HAPPrecondition(timer);
+    HAPPrecondition(cb);
+
+    if (!wheel.inited) {
+        app_timer_init();
+    }
+
+    struct app_timer *t = app_timer_alloc();
+    if (!t) {
+        HAPLogError(&app_timer_log, "%s: Failed to alloc memory.", __func__);
+        return kHAPError_OutOfResources;
+    }
+    t->deadline = deadline;
+    t->cb = cb;
+    t->context = context;
+
+    // Keep the wheel close to the clock so that new timers land on low levels.
+    if (!wheel.dispatching) {
+        app_timer_advance(HAPPlatformClockGetCurrent());
+    }
+    app_timer_enqueue(t);
+    HAPError err = app_timer_schedule();
+    if (err != kHAPError_None) {
+        app_timer_detach(t);
+        app_timer_release(t);
+        return err;
+    }
+    wheel.stats.armed++;
+
+    *timer = t;
+    return kHAPError_None;
+}
+
+void app_timer_deregister(app_timer_ref timer) {
+    HAPPrecondition(timer);
+    HAPPrecondition(timer->list);
+
+    app_timer_detach(timer);
+    app_timer_release(timer);
+    wheel.stats.armed--;
+    wheel.stats.cancelled++;
+}
+
+void app_timer_get_stats(app_timer_stats *stats) {
+    HAPPrecondition(stats);
+
+    *stats = wheel.stats;
+}
+
+void app_timer_deinit(void) {
+    if (wheel.platform_timer) {
+        HAPPlatformTimerDeregister(wheel.platform_timer);
+    }
+    for (app_timer_chunk *chunk = wheel.chunks; chunk;) {
+        app_timer_chunk *next = chunk->next;
+        pal_mem_free(chunk);
+        chunk = next;
+    }
+    HAPRawBufferZero(&wheel, sizeof(wheel));
+}
@@ -6,29 +6,48 @@
 
 #include <string.h>
 #include <lauxlib.h>
+#include <pal/mem.h>
+#include <HAPPlatformClock.h>
+#include <HAPPlatformRunLoop.h>
 
 #include "app_int.h"
 #include "lc.h"
 
 #define THREAD_POOL_SIZE 8
-#define LC_GC_STEP_SMALL ((size_t) 4 * 1024)
-#define LC_GC_STEP_MEDIUM ((size_t) 8 * 1024)
-#define LC_GC_STEP_LARGE ((size_t) 16 * 1024)
-#define LC_GC_STEP_HUGE ((size_t) 32 * 1024)
 
-static size_t lc_gc_step_size(lua_State *L) {
-    int kb = lua_gc(L, LUA_GCCOUNT);
-    if (kb >= 1024) {
-        return LC_GC_STEP_HUGE;
-    }
-    if (kb >= 512) {
-        return LC_GC_STEP_LARGE;
-    }
-    if (kb >= 256) {
-        return LC_GC_STEP_MEDIUM;
-    }
-    return LC_GC_STEP_SMALL;
-}
+// Bounds of the size of a paced GC step in bytes.
+#define LC_GC_STEP_MIN ((size_t) 4 * 1024)
+#define LC_GC_STEP_MAX ((size_t) 64 * 1024)
+
+// Bytes of GC work per byte allocated since the last step.
+#define LC_GC_STEP_MUL 2
+
+// Parameters of the incremental mode, tuned for lower memory peaks.
+#define LC_GC_PAUSE 120
+#define LC_GC_STEPMUL 400
+#define LC_GC_STEPSIZE 1024
+
+// Default budgets of the GC pacer.
+#define LC_GC_BUDGET_DFT ((size_t) 256 * 1024)
+#define LC_GC_MAX_PAUSE_DFT 5
+
+// Interval of the idle GC pump.
+#define LC_GC_IDLE_INTERVAL_MS 100
+
+// Maximum number of coroutines resumed by a drain, the rest wait for the next run loop iteration.
+#define LC_READY_DRAIN_MAX 64
+
+// Registry key of the table mapping callbacks to their allocation tags.
+#define LC_FUNCTION_TAGS "_FUNCTION_TAGS"
+
+// Initial capacity of a ready queue.
+#define LC_READY_QUEUE_INIT_CAP 16
+
+// Registry key of the table mapping coroutines to their contexts.
+#define LC_CONTEXTS "_CONTEXTS"
+
+// Registry key of the table mapping key-value tables to their key indexes.
+#define LC_TABLE_KV_INDEXES "_TABLE_KV_INDEXES"
 
 static const HAPLogObject lc_log = {
     .subsystem = APP_BRIDGE_LOG_SUBSYSTEM,
@@ -64,14 +83,69 @@ static void thread_pool_enque(lua_State *L) {
     thread_pool.tail = (thread_pool.tail + 1) % HAPArrayCount(thread_pool.pool);
 }
 
-static const lc_table_kv *
-lc_lookup_kv_by_name(const lc_table_kv *kv_tab, const char *key) {
-    for (; kv_tab->key != NULL; kv_tab++) {
-        if (!strcmp(kv_tab->key, key)) {
-            return kv_tab;
+/**
+ * Per-coroutine data kept in the extra space of the thread.
+ */
+typedef struct {
+    uint8_t prio;       /* priority of the wakeups */
+    bool has_context;   /* a context is bound to the coroutine */
+    uint8_t tag;        /* allocation tag of the coroutine */
+} lc_thread_extra;
+HAP_STATIC_ASSERT(sizeof(lc_thread_extra) <= LUA_EXTRASPACE, lc_thread_extra);
+
+static inline lc_thread_extra *lc_getextra(lua_State *co) {
+    return lua_getextraspace(co);
+}
+
+/**
+ * Wakeup in the ready queue.
+ */
+typedef struct {
+    lua_State *co;
+    int narg;
+} lc_ready_entry;
+
+/**
+ * Ring of wakeups with the same priority.
+ */
+typedef struct {
+    lc_ready_entry *entries;
+    size_t cap;
+    size_t head;
+    size_t len;
+} lc_ready_queue;
+
+static struct {
+    bool scheduled;     /* the drain has been scheduled */
+    bool gc_pending;    /* a GC step has been requested */
+    lua_State *L;       /* main thread */
+    lc_ready_queue queues[LC_PRIO_NUM];
+    lc_sched_stats stats;
+} lc_sched;
+
+/**
+ * Push the index of the key-value table, it maps the keys to the positions in the table.
+ *
+ * The index is built at the first traversal and kept in the registry,
+ * the keys are looked up by the interned strings instead of comparing each entry.
+ */
+static void lc_push_kv_index(lua_State *L, const lc_table_kv *kvs) {
+    luaL_getsubtable(L, LUA_REGISTRYINDEX, LC_TABLE_KV_INDEXES);
+    if (lua_rawgetp(L, -1, kvs) == LUA_TNIL) {
+        lua_pop(L, 1);
+        size_t n = 0;
+        while (kvs[n].key) {
+            n++;
+        }
+        lua_createtable(L, 0, n);
+        for (size_t i = 0; i < n; i++) {
+            lua_pushinteger(L, i);
+            lua_setfield(L, -2, kvs[i].key);
         }
+        lua_pushvalue(L, -1);
+        lua_rawsetp(L, -3, kvs);
     }
-    return NULL;
+    lua_remove(L, -2);
 }
 
 static char *lc_typename(lua_State *L, uint32_t lc_type, char *buf, size_t len) {
@@ -98,6 +172,10 @@ static char *lc_typename(lua_State *L, uint32_t lc_type, char *buf, size_t len)
 }
 
 bool lc_traverse_table(lua_State *L, int idx, const lc_table_kv *kvs, void *arg) {
+    int top = lua_gettop(L);
+    idx = lua_absindex(L, idx);
+    lc_push_kv_index(L, kvs);
+    int index = lua_gettop(L);
     // Push another reference to the table on top of the stack (so we know
     // where it is, and this function can work for negative, positive and
     // pseudo indices
@@ -107,16 +185,18 @@ bool lc_traverse_table(lua_State *L, int idx, const lc_table_kv *kvs, void *arg)
     // stack now contains: -1 => nil; -2 => table
     while (lua_next(L, -2)) {
         // stack now contains: -1 => value; -2 => key; -3 => table
-        // copy the key so that lua_tostring does not modify the original
+        // look up the key in the index, only strings are hit
         lua_pushvalue(L, -2);
-        // stack now contains: -1 => key; -2 => value; -3 => key; -4 => table
-        const char *key = lua_tostring(L, -1);
-        const lc_table_kv *kv = lc_lookup_kv_by_name(kvs, key);
-        // pop copy of key
+        lua_rawget(L, index);
+        // stack now contains: -1 => position; -2 => value; -3 => key; -4 => table
+        const lc_table_kv *kv = lua_isinteger(L, -1) ? kvs + lua_tointeger(L, -1) : NULL;
         lua_pop(L, 1);
         // stack now contains: -1 => value; -2 => key; -3 => table
         if (!kv) {
-            HAPLogError(&lc_log, "%s: Unknown field '%s'.", __func__, key);
+            // copy the key so that lua_tostring does not modify the original
+            lua_pushvalue(L, -2);
+            const char *key = lua_tostring(L, -1);
+            HAPLogError(&lc_log, "%s: Unknown field '%s'.", __func__, key ? key : luaL_typename(L, -3));
             goto err;
         }
         if (!((1 << lua_type(L, -1)) & kv->type)) {
@@ -135,13 +215,13 @@ bool lc_traverse_table(lua_State *L, int idx, const lc_table_kv *kvs, void *arg)
     }
     // stack now contains: -1 => table (when lua_next returns 0 it pops the key
     // but does not push anything.)
-    // Pop table
-    lua_pop(L, 1);
+    // Pop table and index
+    lua_pop(L, 2);
     // Stack is now the same as it was on entry to this function
     return true;
 
 err:
-    lua_pop(L, 2);
+    lua_settop(L, top);
     return false;
 }
 
@@ -183,27 +263,208 @@ lua_State *lc_getmainthread(lua_State *L) {
     return mL;
 }
 
-void lc_collectgarbage(lua_State *L) {
-    lua_gc(L, LUA_GCSTEP, lc_gc_step_size(L));
+static void lc_sched_drain_cb(void *context, size_t contextSize);
+
+static void lc_sched_schedule(lua_State *L) {
+    lc_sched.L = L;
+    if (lc_sched.scheduled) {
+        return;
+    }
+    if (HAPPlatformRunLoopScheduleCallback(lc_sched_drain_cb, NULL, 0) != kHAPError_None) {
+        HAPLogError(&lc_log, "%s: Failed to schedule the ready queue drain.", __func__);
+        HAPFatalError();
+    }
+    lc_sched.scheduled = true;
+}
+
+/**
+ * GC pacer.
+ *
+ * A step does work in proportion to the bytes allocated since the last step,
+ * plus the bytes over the heap budget. The maximum step size is halved when
+ * a step pauses longer than the pause budget, and doubled when a full-sized
+ * step takes less than half of it.
+ */
+static struct {
+    lua_State *L;
+    lc_gc_config conf;
+    size_t step_limit;      /* maximum step size in bytes */
+    size_t last_heap;       /* heap size after the last step */
+    app_timer_ref idle_timer;
+    HAPTime window_start;   /* start of the window counting steps per second */
+    size_t window_steps;    /* number of the steps in the window */
+    lc_gc_stats stats;
+} lc_gc;
+
+static size_t lc_gc_heap(lua_State *L) {
+    return (size_t)lua_gc(L, LUA_GCCOUNT) * 1024 + (size_t)lua_gc(L, LUA_GCCOUNTB);
 }
 
-void lc_collectgarbage_idle(lua_State *L) {
-    int kb = lua_gc(L, LUA_GCCOUNT);
-    int rounds = 1;
-    if (kb >= 1024) {
-        rounds = 4;
-    } else if (kb >= 512) {
-        rounds = 3;
-    } else if (kb >= 256) {
-        rounds = 2;
+static void lc_gc_update_heap_high(size_t heap) {
+    if (heap > lc_gc.stats.heap_high) {
+        lc_gc.stats.heap_high = heap;
     }
-    for (int i = 0; i < rounds; i++) {
-        lua_gc(L, LUA_GCSTEP, lc_gc_step_size(L));
+}
+
+static void lc_gc_update_pause(HAPTime start, HAPTime end) {
+    uint32_t pause = (uint32_t)(end - start);
+    lc_gc.stats.last_pause = pause;
+    if (pause > lc_gc.stats.max_pause) {
+        lc_gc.stats.max_pause = pause;
     }
 }
 
+/**
+ * Run a paced step.
+ *
+ * @param idle Whether the step is run by the idle pump.
+ * @return false if the step is skipped for no allocation since the last step.
+ */
+static bool lc_gc_step(lua_State *L, bool idle) {
+    size_t heap = lc_gc_heap(L);
+    lc_gc_update_heap_high(heap);
+
+    size_t allocated = heap > lc_gc.last_heap ? heap - lc_gc.last_heap : 0;
+    if (idle && allocated == 0 && heap <= lc_gc.conf.budget) {
+        return false;
+    }
+
+    size_t step = allocated * LC_GC_STEP_MUL;
+    if (heap > lc_gc.conf.budget) {
+        step += heap - lc_gc.conf.budget;
+    }
+    if (step < LC_GC_STEP_MIN) {
+        step = LC_GC_STEP_MIN;
+    } else if (step > lc_gc.step_limit) {
+        step = lc_gc.step_limit;
+    }
+
+    HAPTime start = HAPPlatformClockGetCurrent();
+    lua_gc(L, LUA_GCSTEP, step);
+    HAPTime end = HAPPlatformClockGetCurrent();
+    lc_gc_update_pause(start, end);
+
+    if (lc_gc.stats.last_pause > lc_gc.conf.max_pause) {
+        if (lc_gc.step_limit / 2 >= LC_GC_STEP_MIN) {
+            lc_gc.step_limit /= 2;
+        }
+    } else if (step == lc_gc.step_limit && lc_gc.stats.last_pause * 2 <= lc_gc.conf.max_pause &&
+        lc_gc.step_limit * 2 <= LC_GC_STEP_MAX) {
+        lc_gc.step_limit *= 2;
+    }
+
+    lc_gc.stats.steps++;
+    if (idle) {
+        lc_gc.stats.idle_steps++;
+    }
+    if (end - lc_gc.window_start >= 1000) {
+        lc_gc.stats.steps_per_sec = lc_gc.window_steps;
+        lc_gc.window_start = end;
+        lc_gc.window_steps = 0;
+    }
+    lc_gc.window_steps++;
+    lc_gc.last_heap = lc_gc_heap(L);
+    return true;
+}
+
+static void lc_gc_schedule_idle(void);
+
+static void lc_gc_idle_cb(app_timer_ref timer, void *context) {
+    lua_State *L = context;
+    lc_gc.idle_timer = NULL;
+
+    HAPAssert(lua_gettop(L) == 0);
+    if (lc_gc_step(L, true)) {
+        lc_gc_schedule_idle();
+    } else {
+        lc_gc.stats.idle_stops++;
+    }
+}
+
+static void lc_gc_schedule_idle(void) {
+    if (!lc_gc.L || lc_gc.idle_timer) {
+        return;
+    }
+    if (app_timer_register(&lc_gc.idle_timer,
+        HAPPlatformClockGetCurrent() + LC_GC_IDLE_INTERVAL_MS,
+        lc_gc_idle_cb, lc_gc.L) != kHAPError_None) {
+        lc_gc.idle_timer = NULL;
+        HAPLogError(&lc_log, "%s: Failed to schedule the idle GC pump.", __func__);
+    }
+}
+
+void lc_gc_init(lua_State *L) {
+    lc_gc.L = lc_getmainthread(L);
+    lc_gc.step_limit = LC_GC_STEP_MAX;
+    lc_gc.window_start = HAPPlatformClockGetCurrent();
+    lc_gc.window_steps = 0;
+    HAPRawBufferZero(&lc_gc.stats, sizeof(lc_gc.stats));
+
+    lc_gc_config conf = {
+        .mode = LC_GC_INCREMENTAL,
+        .budget = LC_GC_BUDGET_DFT,
+        .max_pause = LC_GC_MAX_PAUSE_DFT,
+    };
+    lc_gc_configure(L, &conf);
+    lc_gc.last_heap = lc_gc_heap(L);
+    lc_gc_schedule_idle();
+}
+
+void lc_gc_configure(lua_State *L, const lc_gc_config *conf) {
+    HAPPrecondition(conf);
+    HAPPrecondition(conf->mode == LC_GC_INCREMENTAL || conf->mode == LC_GC_GENERATIONAL);
+
+    if (conf->mode == LC_GC_GENERATIONAL) {
+        lua_gc(L, LUA_GCGEN);
+    } else {
+        lua_gc(L, LUA_GCINC);
+        lua_gc(L, LUA_GCPARAM, LUA_GCPPAUSE, LC_GC_PAUSE);
+        lua_gc(L, LUA_GCPARAM, LUA_GCPSTEPMUL, LC_GC_STEPMUL);
+        lua_gc(L, LUA_GCPARAM, LUA_GCPSTEPSIZE, LC_GC_STEPSIZE);
+    }
+    lc_gc.conf = *conf;
+    lc_gc.step_limit = LC_GC_STEP_MAX;
+}
+
+void lc_gc_get_config(lc_gc_config *conf) {
+    HAPPrecondition(conf);
+
+    *conf = lc_gc.conf;
+}
+
+void lc_gc_get_stats(lc_gc_stats *stats) {
+    HAPPrecondition(stats);
+
+    *stats = lc_gc.stats;
+    stats->step_limit = lc_gc.step_limit;
+    if (lc_gc.L) {
+        stats->heap = lc_gc_heap(lc_gc.L);
+    }
+}
+
+void lc_gc_deinit(void) {
+    if (lc_gc.idle_timer) {
+        app_timer_deregister(lc_gc.idle_timer);
+        lc_gc.idle_timer = NULL;
+    }
+    lc_gc.L = NULL;
+}
+
+void lc_collectgarbage(lua_State *L) {
+    lc_sched.gc_pending = true;
+    lc_sched_schedule(L);
+    lc_gc_schedule_idle();
+}
+
 void lc_collectgarbage_full(lua_State *L) {
+    size_t heap = lc_gc_heap(L);
+    lc_gc_update_heap_high(heap);
+
+    HAPTime start = HAPPlatformClockGetCurrent();
     lua_gc(L, LUA_GCCOLLECT);
+    lc_gc_update_pause(start, HAPPlatformClockGetCurrent());
+    lc_gc.stats.full_cycles++;
+    lc_gc.last_heap = lc_gc_heap(L);
 }
 
 static int traceback(lua_State *L) {
@@ -224,12 +485,17 @@ lua_State *lc_newthread(lua_State *L) {
     if (!thread_pool_empty()) {
         lua_State *co = thread_pool_deque();
         HAPAssert(lua_gettop(co) == 0);
+        lc_setpriority(co, LC_PRIO_NORMAL);
+        lc_settag(co, lc_gettag(L));
         return co;
     }
     lua_State *co = lua_newthread(L);
     lua_pushthread(co);
     lua_rawsetp(co, LUA_REGISTRYINDEX, co);
     HAPAssert(lua_gettop(co) == 0);
+    lc_getextra(co)->has_context = false;
+    lc_setpriority(co, LC_PRIO_NORMAL);
+    lc_settag(co, lc_gettag(L));
     return co;
 }
 
@@ -240,6 +506,10 @@ static void lc_freethread(lua_State *L, lua_State *from) {
         lua_settop(L, 0);
     }
     HAPAssert(lua_gettop(L) == 0);
+    if (lc_getextra(L)->has_context) {
+        lua_pushnil(from);
+        lc_setcontext(from, L);
+    }
     if (thread_pool_full()) {
         lua_pushnil(L);
         lua_rawsetp(L, LUA_REGISTRYINDEX, L);
@@ -254,7 +524,9 @@ int lc_resume(lua_State *L, lua_State *from, int narg, int *nres) {
         luaL_error(L, "invalid coroutine status");
     }
 
+    uint8_t prev_tag = app_alloc_settag(lc_gettag(L));
     int status = lua_resume(L, from, narg, nres);
+    app_alloc_settag(prev_tag);
     switch (status) {
     case LUA_OK:
         if (luai_unlikely(!lua_checkstack(L, *nres))) {
@@ -272,3 +544,337 @@ int lc_resume(lua_State *L, lua_State *from, int narg, int *nres) {
     }
     return status;
 }
+
+void lc_setpriority(lua_State *co, lc_prio prio) {
+    HAPPrecondition(prio < LC_PRIO_NUM);
+    lc_getextra(co)->prio = prio;
+}
+
+static lc_prio lc_getpriority(lua_State *co) {
+    return lc_getextra(co)->prio;
+}
+
+void lc_settag(lua_State *co, uint8_t tag) {
+    lc_getextra(co)->tag = tag;
+}
+
+uint8_t lc_gettag(lua_State *co) {
+    return lc_getextra(co)->tag;
+}
+
+void lc_bindtag(lua_State *L, int idx) {
+    idx = lua_absindex(L, idx);
+    uint8_t tag = lc_gettag(L);
+    if (lua_getfield(L, LUA_REGISTRYINDEX, LC_FUNCTION_TAGS) == LUA_TNIL) {
+        lua_pop(L, 1);
+        if (tag == 0) {
+            return;
+        }
+        lua_createtable(L, 0, 1);
+        lua_createtable(L, 0, 1);
+        lua_pushliteral(L, "k");
+        lua_setfield(L, -2, "__mode");
+        lua_setmetatable(L, -2);
+        lua_pushvalue(L, -1);
+        lua_setfield(L, LUA_REGISTRYINDEX, LC_FUNCTION_TAGS);
+    }
+    lua_pushvalue(L, idx);
+    if (tag == 0) {
+        lua_pushnil(L);
+    } else {
+        lua_pushinteger(L, tag);
+    }
+    lua_rawset(L, -3);
+    lua_pop(L, 1);
+}
+
+void lc_applytag(lua_State *co, int idx) {
+    idx = lua_absindex(co, idx);
+    uint8_t tag = 0;
+    if (lua_getfield(co, LUA_REGISTRYINDEX, LC_FUNCTION_TAGS) == LUA_TTABLE) {
+        lua_pushvalue(co, idx);
+        if (lua_rawget(co, -2) == LUA_TNUMBER) {
+            tag = lua_tointeger(co, -1);
+        }
+        lua_pop(co, 1);
+    }
+    lua_pop(co, 1);
+    lc_settag(co, tag);
+}
+
+void lc_wakeup(lua_State *co, int narg, lc_prio prio) {
+    HAPPrecondition(prio < LC_PRIO_NUM);
+    lc_prio co_prio = lc_getpriority(co);
+    if (co_prio < prio) {
+        prio = co_prio;
+    }
+
+    lc_ready_queue *q = &lc_sched.queues[prio];
+    if (q->len == q->cap) {
+        size_t cap = q->cap ? q->cap * 2 : LC_READY_QUEUE_INIT_CAP;
+        lc_ready_entry *entries = pal_mem_alloc(sizeof(*entries) * cap);
+        if (!entries) {
+            HAPLogError(&lc_log, "%s: Failed to alloc memory.", __func__);
+            HAPFatalError();
+        }
+        for (size_t i = 0; i < q->len; i++) {
+            entries[i] = q->entries[(q->head + i) % q->cap];
+        }
+        pal_mem_free(q->entries);
+        q->entries = entries;
+        q->cap = cap;
+        q->head = 0;
+    }
+    lc_ready_entry *entry = &q->entries[(q->head + q->len) % q->cap];
+    entry->co = co;
+    entry->narg = narg;
+    q->len++;
+
+    lc_sched.stats.depth++;
+    if (lc_sched.stats.depth > lc_sched.stats.max_depth) {
+        lc_sched.stats.max_depth = lc_sched.stats.depth;
+    }
+    lc_sched_schedule(lc_getmainthread(co));
+}
+
+static bool lc_sched_pop(lc_ready_entry *entry) {
+    for (size_t i = 0; i < LC_PRIO_NUM; i++) {
+        lc_ready_queue *q = &lc_sched.queues[i];
+        if (q->len) {
+            *entry = q->entries[q->head];
+            q->head = (q->head + 1) % q->cap;
+            q->len--;
+            lc_sched.stats.depth--;
+            return true;
+        }
+    }
+    return false;
+}
+
+static int lc_sched_drain(lua_State *L) {
+    size_t *nresumes = lua_touserdata(L, 1);
+    lua_pop(L, 1);
+
+    lc_ready_entry entry;
+    while (*nresumes < LC_READY_DRAIN_MAX && lc_sched_pop(&entry)) {
+        (*nresumes)++;
+        int status, nres;
+        status = lc_resume(entry.co, L, entry.narg, &nres);
+        if (luai_unlikely(status != LUA_OK && status != LUA_YIELD)) {
+            HAPLogError(&lc_log, "%s: %s", __func__, lua_tostring(L, -1));
+        } else if (status == LUA_YIELD) {
+            lua_pop(entry.co, nres);
+        }
+        lua_settop(L, 0);
+    }
+    return 0;
+}
+
+static void lc_sched_drain_cb(void *context, size_t contextSize) {
+    lua_State *L = lc_sched.L;
+    lc_sched.scheduled = false;
+    if (!L) {
+        return;
+    }
+
+    HAPAssert(lua_gettop(L) == 0);
+
+    size_t nresumes = 0;
+    while (lc_sched.stats.depth && nresumes < LC_READY_DRAIN_MAX) {
+        lua_pushcfunction(L, lc_sched_drain);
+        lua_pushlightuserdata(L, &nresumes);
+        int status = lua_pcall(L, 1, 0, 0);
+        if (luai_unlikely(status != LUA_OK)) {
+            HAPLogError(&lc_log, "%s: %s", __func__, lua_tostring(L, -1));
+        }
+        lua_settop(L, 0);
+    }
+
+    lc_sched.stats.drains++;
+    lc_sched.stats.resumes += nresumes;
+    lc_sched.stats.last_resumes = nresumes;
+    if (nresumes > lc_sched.stats.max_resumes) {
+        lc_sched.stats.max_resumes = nresumes;
+    }
+
+    // One GC step for all the work done in this run loop iteration.
+    if (lc_sched.gc_pending || nresumes) {
+        lc_sched.gc_pending = false;
+        lc_gc_step(L, false);
+        lc_sched.stats.gc_steps++;
+    }
+
+    if (lc_sched.stats.depth) {
+        lc_sched_schedule(L);
+    }
+}
+
+void lc_get_sched_stats(lc_sched_stats *stats) {
+    HAPPrecondition(stats);
+
+    *stats = lc_sched.stats;
+}
+
+void lc_sched_deinit(void) {
+    for (size_t i = 0; i < LC_PRIO_NUM; i++) {
+        pal_mem_free(lc_sched.queues[i].entries);
+    }
+    HAPRawBufferZero(&lc_sched.queues, sizeof(lc_sched.queues));
+    lc_sched.L = NULL;
+    lc_sched.gc_pending = false;
+    lc_sched.stats.depth = 0;
+}
+
+static int lc_context_timeout(lua_State *L) {
+    lc_context *ctx = lua_touserdata(L, 1);
+    lua_pop(L, 1);
+
+    lc_cancelcontext(L, ctx, LC_CONTEXT_TIMEOUT);
+    return 0;
+}
+
+static void lc_context_timeout_cb(app_timer_ref timer, void *context) {
+    lc_context *ctx = context;
+    lua_State *L = ctx->mL;
+
+    ctx->timer = NULL;
+
+    HAPAssert(lua_gettop(L) == 0);
+
+    lua_pushcfunction(L, lc_context_timeout);
+    lua_pushlightuserdata(L, ctx);
+    int status = lua_pcall(L, 1, 0, 0);
+    if (luai_unlikely(status != LUA_OK)) {
+        HAPLogError(&lc_log, "%s: %s", __func__, lua_tostring(L, -1));
+    }
+
+    lua_settop(L, 0);
+    lc_collectgarbage(L);
+}
+
+lc_context *lc_newcontext(lua_State *L, lua_Integer deadline) {
+    lc_context *ctx = lua_newuserdatauv(L, sizeof(*ctx), 0);
+    ctx->state = LC_CONTEXT_ACTIVE;
+    ctx->mL = lc_getmainthread(L);
+    ctx->timer = NULL;
+    ctx->waits.prev = &ctx->waits;
+    ctx->waits.next = &ctx->waits;
+    ctx->waits.cb = NULL;
+    luaL_setmetatable(L, LC_CONTEXT_NAME);
+
+    if (deadline) {
+        // keep the context alive until the deadline
+        lua_pushvalue(L, -1);
+        lua_rawsetp(L, LUA_REGISTRYINDEX, ctx);
+        if (luai_unlikely(app_timer_register(&ctx->timer, (HAPTime)deadline,
+            lc_context_timeout_cb, ctx) != kHAPError_None)) {
+            lua_pushnil(L);
+            lua_rawsetp(L, LUA_REGISTRYINDEX, ctx);
+            luaL_error(L, "failed to create a timer");
+        }
+    }
+    return ctx;
+}
+
+void lc_cancelcontext(lua_State *L, lc_context *ctx, lc_context_state state) {
+    HAPPrecondition(state != LC_CONTEXT_ACTIVE);
+
+    if (ctx->state != LC_CONTEXT_ACTIVE) {
+        return;
+    }
+    ctx->state = state;
+    if (ctx->timer) {
+        app_timer_deregister(ctx->timer);
+        ctx->timer = NULL;
+    }
+    lua_pushnil(L);
+    lua_rawsetp(L, LUA_REGISTRYINDEX, ctx);
+
+    while (ctx->waits.next != &ctx->waits) {
+        lc_wait *wait = ctx->waits.next;
+        lc_wait_remove(wait);
+        wait->cb(L, wait, state);
+    }
+}
+
+const char *lc_context_strerror(lc_context_state state) {
+    switch (state) {
+    case LC_CONTEXT_CANCELLED:
+        return "cancelled";
+    case LC_CONTEXT_TIMEOUT:
+        return "timeout";
+    default:
+        return NULL;
+    }
+}
+
+void lc_pushcontext(lua_State *L, lua_State *co) {
+    if (!lc_getextra(co)->has_context) {
+        lua_pushnil(L);
+        return;
+    }
+    if (lua_getfield(L, LUA_REGISTRYINDEX, LC_CONTEXTS) != LUA_TTABLE) {
+        lua_pop(L, 1);
+        lua_pushnil(L);
+        return;
+    }
+    lua_pushthread(co);
+    lua_xmove(co, L, 1);
+    lua_rawget(L, -2);
+    lua_remove(L, -2);
+}
+
+void lc_setcontext(lua_State *L, lua_State *co) {
+    bool has_context = !lua_isnil(L, -1);
+    if (!has_context && !lc_getextra(co)->has_context) {
+        lua_pop(L, 1);
+        return;
+    }
+    if (!luaL_getsubtable(L, LUA_REGISTRYINDEX, LC_CONTEXTS)) {
+        // contexts do not keep the coroutines alive
+        lua_createtable(L, 0, 1);
+        lua_pushliteral(L, "k");
+        lua_setfield(L, -2, "__mode");
+        lua_setmetatable(L, -2);
+    }
+    lua_pushthread(co);
+    lua_xmove(co, L, 1);
+    lua_pushvalue(L, -3);
+    lua_rawset(L, -3);
+    lua_pop(L, 2);
+    lc_getextra(co)->has_context = has_context;
+}
+
+lc_context_state lc_wait_add(lua_State *co, lc_wait *wait, lc_wait_cancel_cb cb) {
+    wait->prev = NULL;
+    wait->next = NULL;
+    wait->cb = cb;
+
+    if (!lc_getextra(co)->has_context) {
+        return LC_CONTEXT_ACTIVE;
+    }
+    lc_pushcontext(co, co);
+    lc_context *ctx = lua_touserdata(co, -1);
+    lua_pop(co, 1);
+    if (!ctx) {
+        return LC_CONTEXT_ACTIVE;
+    }
+    if (ctx->state != LC_CONTEXT_ACTIVE) {
+        return ctx->state;
+    }
+    wait->prev = ctx->waits.prev;
+    wait->next = &ctx->waits;
+    ctx->waits.prev->next = wait;
+    ctx->waits.prev = wait;
+    return LC_CONTEXT_ACTIVE;
+}
+
+void lc_wait_remove(lc_wait *wait) {
+    if (!wait->next) {
+        return;
+    }
+    wait->prev->next = wait->next;
+    wait->next->prev = wait->prev;
+    wait->prev = NULL;
+    wait->next = NULL;
+}
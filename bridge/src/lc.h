@@ -28,6 +28,109 @@ extern "C" {
 #define LC_TANY             (LC_TNIL | LC_TBOOLEAN | LC_TLIGHTUSERDATA | LC_TNUMBER | \
     LC_TSTRING | LC_TTABLE | LC_TFUNCTION | LC_TUSERDATA | LC_TTHREAD)
 
+/**
+ * Priority of coroutine wakeups.
+ */
+typedef enum {
+    LC_PRIO_HIGH,       // HAP requests
+    LC_PRIO_NORMAL,     // I/O completions and messages
+    LC_PRIO_LOW,        // background timers
+    LC_PRIO_NUM,
+} lc_prio;
+
+/**
+ * State of a cancellation context.
+ */
+typedef enum {
+    LC_CONTEXT_ACTIVE,      // not yet done
+    LC_CONTEXT_CANCELLED,   // cancelled by lc_cancelcontext()
+    LC_CONTEXT_TIMEOUT,     // the deadline expired
+} lc_context_state;
+
+typedef struct lc_wait lc_wait;
+
+/**
+ * Callback called when the context of the waiting coroutine is done.
+ *
+ * The wait has been removed from the context, the callback must abort
+ * the pending operation and put the coroutine into the ready queue.
+ *
+ * @param L the running thread.
+ * @param wait the wait passed to lc_wait_add().
+ * @param state LC_CONTEXT_CANCELLED or LC_CONTEXT_TIMEOUT.
+ */
+typedef void (*lc_wait_cancel_cb)(lua_State *L, lc_wait *wait, lc_context_state state);
+
+/**
+ * Pending wait of a coroutine, embedded in the wait context of a library.
+ */
+struct lc_wait {
+    lc_wait *prev;
+    lc_wait *next;
+    lc_wait_cancel_cb cb;
+};
+
+/**
+ * Cancellation context.
+ *
+ * A context is bound to coroutines, all pending waits of the coroutines
+ * are cancelled at once when the context is cancelled or its deadline expires.
+ */
+typedef struct lc_context {
+    lc_context_state state;
+    lua_State *mL;              /* main thread */
+    struct app_timer *timer;    /* deadline timer */
+    lc_wait waits;              /* sentinel of the pending waits */
+} lc_context;
+
+#define LC_CONTEXT_NAME "Context*"
+
+/**
+ * Statistics of the ready queue.
+ */
+typedef struct {
+    size_t depth;           /* number of the coroutines in the ready queue */
+    size_t max_depth;       /* maximum depth of the ready queue */
+    size_t drains;          /* number of the ready queue drains */
+    size_t resumes;         /* number of the coroutines resumed by drains */
+    size_t last_resumes;    /* number of the coroutines resumed by the last drain */
+    size_t max_resumes;     /* maximum number of the coroutines resumed by a drain */
+    size_t gc_steps;        /* number of the GC steps run by drains */
+} lc_sched_stats;
+
+/**
+ * GC mode.
+ */
+typedef enum {
+    LC_GC_INCREMENTAL,
+    LC_GC_GENERATIONAL,
+} lc_gc_mode;
+
+/**
+ * Configuration of the GC pacer.
+ */
+typedef struct {
+    lc_gc_mode mode;        /* GC mode */
+    size_t budget;          /* target heap size in bytes */
+    uint32_t max_pause;     /* maximum pause of a GC step in milliseconds */
+} lc_gc_config;
+
+/**
+ * Statistics of the GC pacer.
+ */
+typedef struct {
+    size_t heap;            /* current heap size in bytes */
+    size_t heap_high;       /* heap high-water mark in bytes */
+    size_t step_limit;      /* current maximum step size in bytes */
+    size_t steps;           /* number of the paced steps */
+    size_t steps_per_sec;   /* number of the paced steps in the last full second */
+    size_t idle_steps;      /* number of the steps run by the idle pump */
+    size_t idle_stops;      /* number of times the idle pump stopped without allocation */
+    size_t full_cycles;     /* number of the full cycles */
+    uint32_t last_pause;    /* pause of the last step in milliseconds */
+    uint32_t max_pause;     /* maximum pause of a step in milliseconds */
+} lc_gc_stats;
+
 /**
  * Lua table key-value.
  */
@@ -67,19 +170,47 @@ bool lc_traverse_array(lua_State *L, int idx,
 lua_State *lc_getmainthread(lua_State *L);
 
 /**
- * Run a bounded garbage-collection step on hot paths.
+ * Request a bounded garbage-collection step on hot paths.
+ *
+ * The step runs once at the end of the current run loop iteration,
+ * no matter how many times it is requested.
+ * The size of the step is paced by the allocation since the last step,
+ * the heap budget and the pause budget.
  */
 void lc_collectgarbage(lua_State *L);
 
 /**
- * Run a stronger garbage-collection step when the run loop is otherwise idle.
+ * Run a full garbage-collection cycle at batch boundaries.
  */
-void lc_collectgarbage_idle(lua_State *L);
+void lc_collectgarbage_full(lua_State *L);
 
 /**
- * Run a full garbage-collection cycle at batch boundaries.
+ * Start the GC pacer with the default configuration.
+ *
+ * The pacer also steps the GC when the run loop is idle,
+ * until no allocation is done since the last step.
  */
-void lc_collectgarbage_full(lua_State *L);
+void lc_gc_init(lua_State *L);
+
+/**
+ * Configure the GC pacer.
+ */
+void lc_gc_configure(lua_State *L, const lc_gc_config *conf);
+
+/**
+ * Get the configuration of the GC pacer.
+ */
+void lc_gc_get_config(lc_gc_config *conf);
+
+/**
+ * Get statistics of the GC pacer.
+ */
+void lc_gc_get_stats(lc_gc_stats *stats);
+
+/**
+ * Stop the GC pacer, it must be called before closing the state.
+ */
+void lc_gc_deinit(void);
 
 /**
  * Push traceback function to lua stack.
@@ -96,6 +227,106 @@ lua_State *lc_newthread(lua_State *L);
  */
 int lc_resume(lua_State *L, lua_State *from, int narg, int *nres);
 
+/**
+ * Set the priority of a coroutine.
+ *
+ * The wakeups of the coroutine have at least this priority.
+ * A coroutine got from lc_newthread() has the priority LC_PRIO_NORMAL.
+ */
+void lc_setpriority(lua_State *co, lc_prio prio);
+
+/**
+ * Set the allocation tag of a coroutine.
+ *
+ * The memory allocated when the coroutine runs is accounted to the tag.
+ * A coroutine got from lc_newthread() inherits the tag of the creator.
+ */
+void lc_settag(lua_State *co, uint8_t tag);
+
+/**
+ * Get the allocation tag of a coroutine.
+ */
+uint8_t lc_gettag(lua_State *co);
+
+/**
+ * Bind the allocation tag of L to the function at the given index.
+ *
+ * Call it when a callback is registered, so that the callback
+ * runs with the tag of the code registering it.
+ */
+void lc_bindtag(lua_State *L, int idx);
+
+/**
+ * Set the tag of the coroutine to the tag bound to the function at the given index.
+ */
+void lc_applytag(lua_State *co, int idx);
+
+/**
+ * Put a coroutine in the ready queue.
+ *
+ * The coroutine is resumed with the 'narg' values at the top of its stack
+ * when the ready queue is drained at the next run loop iteration.
+ * Coroutines are resumed in the order of priority, then in the order of wakeup.
+ */
+void lc_wakeup(lua_State *co, int narg, lc_prio prio);
+
+/**
+ * Get statistics of the ready queue.
+ */
+void lc_get_sched_stats(lc_sched_stats *stats);
+
+/**
+ * Drop all coroutines in the ready queue, it must be called after closing the state.
+ */
+void lc_sched_deinit(void);
+
+/**
+ * Create a context and push it to the stack.
+ *
+ * @param deadline Absolute deadline in milliseconds, 0 means no deadline.
+ */
+lc_context *lc_newcontext(lua_State *L, lua_Integer deadline);
+
+/**
+ * Cancel a context and all pending waits of it.
+ *
+ * Nothing happens if the context is already done.
+ */
+void lc_cancelcontext(lua_State *L, lc_context *ctx, lc_context_state state);
+
+/**
+ * Get the error message of a context state, NULL if the state is LC_CONTEXT_ACTIVE.
+ */
+const char *lc_context_strerror(lc_context_state state);
+
+/**
+ * Push the context of the coroutine 'co' to the stack of 'L', or nil if it has no context.
+ */
+void lc_pushcontext(lua_State *L, lua_State *co);
+
+/**
+ * Bind the context at the top of the stack of 'L' to the coroutine 'co' and pop it.
+ *
+ * A nil value unbinds the context. The context is unbound when the coroutine
+ * got from lc_newthread() returns.
+ */
+void lc_setcontext(lua_State *L, lua_State *co);
+
+/**
+ * Add a wait of the running coroutine 'co' to its context.
+ *
+ * Nothing is added if the coroutine has no context or the context is done.
+ *
+ * @return the state of the context, the caller must fail the wait
+ * without waiting if it is not LC_CONTEXT_ACTIVE.
+ */
+lc_context_state lc_wait_add(lua_State *co, lc_wait *wait, lc_wait_cancel_cb cb);
+
+/**
+ * Remove a wait from its context, nothing happens if it is not added.
+ */
+void lc_wait_remove(lc_wait *wait);
+
 #ifdef __cplusplus
 }
 #endif
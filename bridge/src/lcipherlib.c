@@ -7,12 +7,14 @@
 #include <lauxlib.h>
 #include <pal/cipher.h>
 
+#include "app_int.h"
+
 #define LCIPHER_CTX_NAME "CipherContext*"
 
 #define LCIPHER_GET_CTX(L, idx) \
     luaL_checkudata(L, idx, LCIPHER_CTX_NAME)
 
-static const char *lcipher_type_strs[] = {
+const char *lcipher_type_strs[] = {
     "AES-128-ECB",
     "AES-192-ECB",
     "AES-256-ECB",
@@ -92,7 +94,7 @@ static const char *lcipher_padding_strs[] = {
     NULL
 };
 
-static const char *lcipher_op_strs[] = {
+const char *lcipher_op_strs[] = {
     "encrypt",
     "decrypt",
     NULL,
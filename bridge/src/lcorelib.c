@@ -4,17 +4,28 @@
 // you may not use this file except in compliance with the License.
 // See [CONTRIBUTORS.md] for the list of homekit-bridge project authors.
 
+#include <limits.h>
 #include <lauxlib.h>
 #include <HAPLog.h>
-#include <HAPPlatformTimer.h>
+#include <HAPPlatformClock.h>
+#include <util_base64.h>
+#include <pal/md.h>
+#include <pal/cipher.h>
+#include <pal/mem.h>
+#include <pal/worker.h>
 
 #include "app_int.h"
 #include "lc.h"
 
 #define LUA_TIMER_NAME "Timer*"
 #define LUA_MQ_OBJ_NAME "MQ*"
+#define LUA_TASK_NAME "Task*"
+#define LUA_OFFLOAD_JOB_NAME "OffloadJob*"
 #define LCORE_ATEXITS "_ATEXITS"
 
+// Number of value slots reserved for each message when creating a message queue.
+#define LCORE_MQ_VALUES_PER_MSG 2
+
 static const HAPLogObject lcore_log = {
     .subsystem = APP_BRIDGE_LOG_SUBSYSTEM,
     .category = "core",
@@ -26,21 +37,82 @@ static const HAPLogObject lcore_log = {
 typedef struct {
     int nargs;
     lua_State *mL;
-    HAPPlatformTimerRef timer;  /* Timer ID. Start from 1. */
+    app_timer_ref timer;
 } lcore_timer_ctx;
 
+/**
+ * Message queue.
+ *
+ * Messages are kept in a fixed-capacity ring, the values of the messages
+ * are kept in a ring of value slots in the array part of the uservalue table.
+ */
 typedef struct {
-    size_t first;
-    size_t last;
-    size_t size;
+    size_t size;        /* capacity of the queue */
+    size_t first;       /* ring index of the first message */
+    size_t count;       /* number of the queued messages */
+    size_t vcap;        /* capacity of the value ring */
+    size_t vfirst;      /* ring index of the first value */
+    size_t vcount;      /* number of the queued values */
+    int nvals[];        /* number of values of each message */
 } lcore_mq;
 
+/**
+ * Context of a coroutine blocked in mq:send(), the message is kept in the uservalues.
+ */
+typedef struct {
+    lua_State *co;
+    int nargs;
+} lcore_mq_send_ctx;
+
 typedef struct {
+    lc_wait wait;
     lua_State *co;
-    HAPPlatformTimerRef timer;
+    app_timer_ref timer;
     bool with_status;
 } lcore_mq_wait_ctx;
 
+/**
+ * Context of a coroutine waiting in core.select(), the message queues are kept in the uservalues.
+ */
+typedef struct {
+    lc_wait wait;
+    lua_State *co;
+    app_timer_ref timer;
+    int n;
+} lcore_select_ctx;
+
+/**
+ * Context of a coroutine waiting in core.sleep().
+ */
+typedef struct {
+    lc_wait wait;
+    lua_State *co;
+    app_timer_ref timer;
+} lcore_sleep_ctx;
+
+// Address of the value passed to a coroutine whose wait is cancelled.
+static const char lcore_cancelled_key;
+
+/**
+ * Task object.
+ *
+ * The result table is kept in the uservalue 1 when the task is done,
+ * the contexts of the coroutines waiting in core.gather() are kept in the uservalue 2.
+ */
+typedef struct {
+    bool done;
+} lcore_task;
+
+/**
+ * Context of a coroutine waiting in core.gather().
+ */
+typedef struct {
+    lua_State *co;
+    app_timer_ref timer;
+    int remaining;      /* number of the tasks not yet done */
+    bool timeout;
+} lcore_gather_ctx;
+
 static int lcore_time(lua_State *L) {
     lua_pushnumber(L, HAPPlatformClockGetCurrent());
     return 1;
@@ -88,50 +160,265 @@ static int lcore_atexit(lua_State *L) {
     return 0;
 }
 
-static int lcore_sleep_resume(lua_State *L) {
-    lua_State *co = lua_touserdata(L, 1);
-    lua_pop(L, 1);
+/**
+ * Put a coroutine whose wait is cancelled into the ready queue,
+ * the continuation raises the error by lcore_checkcancelled().
+ */
+static void lcore_wakeup_cancelled(lua_State *co, lc_context_state state) {
+    lua_pushlightuserdata(co, (void *)&lcore_cancelled_key);
+    lua_pushstring(co, lc_context_strerror(state));
+    lc_wakeup(co, 2, LC_PRIO_NORMAL);
+}
 
-    int status, nres;
-    status = lc_resume(co, L, 0, &nres);
-    if (luai_unlikely(status != LUA_OK && status != LUA_YIELD)) {
-        HAPLogError(&lcore_log, "%s: %s", __func__, lua_tostring(L, -1));
+static void lcore_checkcancelled(lua_State *L) {
+    if (lua_gettop(L) >= 2 && lua_touserdata(L, -2) == &lcore_cancelled_key) {
+        lua_error(L);
     }
-    return 0;
 }
 
-static void lcore_sleep_cb(HAPPlatformTimerRef timer, void *context) {
-    lua_State *co = context;
-    lua_State *L = lc_getmainthread(co);
-
-    HAPAssert(lua_gettop(L) == 0);
+static void lcore_sleep_cb(app_timer_ref timer, void *context) {
+    lcore_sleep_ctx *ctx = context;
+    ctx->timer = NULL;
+    lc_wait_remove(&ctx->wait);
+    lc_wakeup(ctx->co, 0, LC_PRIO_LOW);
+}
 
-    lua_pushcfunction(L, lcore_sleep_resume);
-    lua_pushlightuserdata(L, co);
-    int status = lua_pcall(L, 1, 0, 0);
-    if (luai_unlikely(status != LUA_OK)) {
-        HAPLogError(&lcore_log, "%s: %s", __func__, lua_tostring(L, -1));
-    }
+static void lcore_sleep_cancel(lua_State *L, lc_wait *wait, lc_context_state state) {
+    lcore_sleep_ctx *ctx = (lcore_sleep_ctx *)wait;
+    app_timer_deregister(ctx->timer);
+    ctx->timer = NULL;
+    lcore_wakeup_cancelled(ctx->co, state);
+}
 
-    lua_settop(L, 0);
-    lc_collectgarbage(L);
+static int finishsleep(lua_State *L, int status, lua_KContext extra) {
+    lcore_checkcancelled(L);
+    return 0;
 }
 
 static int lcore_sleep(lua_State *L) {
     lua_Integer ms = luaL_checkinteger(L, 1);
     luaL_argcheck(L, ms >= 0, 1, "ms out of range");
 
-    HAPPlatformTimerRef timer;
-    if (HAPPlatformTimerRegister(&timer,
+    // the context is kept in the stack until the coroutine is resumed
+    lcore_sleep_ctx *ctx = lua_newuserdatauv(L, sizeof(*ctx), 0);
+    ctx->co = L;
+    lc_context_state state = lc_wait_add(L, &ctx->wait, lcore_sleep_cancel);
+    if (luai_unlikely(state != LC_CONTEXT_ACTIVE)) {
+        luaL_error(L, "%s", lc_context_strerror(state));
+    }
+    if (app_timer_register(&ctx->timer,
         ms ? (HAPTime)ms + HAPPlatformClockGetCurrent() : 0,
-        lcore_sleep_cb, L) != kHAPError_None) {
+        lcore_sleep_cb, ctx) != kHAPError_None) {
+        lc_wait_remove(&ctx->wait);
         luaL_error(L, "failed to create a timer");
     }
-    return lua_yield(L, 0);
+    return lua_yieldk(L, 0, 0, finishsleep);
+}
+
+static int lcore_get_timer_stats(lua_State *L) {
+    app_timer_stats stats;
+    app_timer_get_stats(&stats);
+
+    lua_createtable(L, 0, 6);
+    lua_pushinteger(L, stats.armed);
+    lua_setfield(L, -2, "armed");
+    lua_pushinteger(L, stats.fired);
+    lua_setfield(L, -2, "fired");
+    lua_pushinteger(L, stats.cancelled);
+    lua_setfield(L, -2, "cancelled");
+    lua_pushinteger(L, stats.dispatches);
+    lua_setfield(L, -2, "dispatches");
+    lua_pushinteger(L, stats.max_batch);
+    lua_setfield(L, -2, "maxBatch");
+    lua_pushinteger(L, stats.platform_timers);
+    lua_setfield(L, -2, "platformTimers");
+    return 1;
+}
+
+static int lcore_get_scheduler_stats(lua_State *L) {
+    lc_sched_stats stats;
+    lc_get_sched_stats(&stats);
+
+    lua_createtable(L, 0, 7);
+    lua_pushinteger(L, stats.depth);
+    lua_setfield(L, -2, "depth");
+    lua_pushinteger(L, stats.max_depth);
+    lua_setfield(L, -2, "maxDepth");
+    lua_pushinteger(L, stats.drains);
+    lua_setfield(L, -2, "drains");
+    lua_pushinteger(L, stats.resumes);
+    lua_setfield(L, -2, "resumes");
+    lua_pushinteger(L, stats.last_resumes);
+    lua_setfield(L, -2, "lastResumes");
+    lua_pushinteger(L, stats.max_resumes);
+    lua_setfield(L, -2, "maxResumes");
+    lua_pushinteger(L, stats.gc_steps);
+    lua_setfield(L, -2, "gcSteps");
+    return 1;
+}
+
+static const char *lcore_gc_mode_strs[] = {
+    "incremental",
+    "generational",
+    NULL,
+};
+
+static int lcore_configure_gc(lua_State *L) {
+    luaL_checktype(L, 1, LUA_TTABLE);
+
+    // the fields not given keep the current values
+    lc_gc_config conf;
+    lc_gc_get_config(&conf);
+    if (lua_getfield(L, 1, "mode") != LUA_TNIL) {
+        conf.mode = luaL_checkoption(L, -1, NULL, lcore_gc_mode_strs);
+    }
+    if (lua_getfield(L, 1, "budget") != LUA_TNIL) {
+        lua_Integer budget = luaL_checkinteger(L, -1);
+        luaL_argcheck(L, budget > 0, 1, "budget out of range");
+        conf.budget = (size_t)budget;
+    }
+    if (lua_getfield(L, 1, "maxPause") != LUA_TNIL) {
+        lua_Integer max_pause = luaL_checkinteger(L, -1);
+        luaL_argcheck(L, max_pause > 0 && max_pause <= UINT32_MAX, 1, "maxPause out of range");
+        conf.max_pause = (uint32_t)max_pause;
+    }
+    lc_gc_configure(L, &conf);
+    return 0;
+}
+
+static int lcore_get_gc_stats(lua_State *L) {
+    lc_gc_config conf;
+    lc_gc_get_config(&conf);
+    lc_gc_stats stats;
+    lc_gc_get_stats(&stats);
+
+    lua_createtable(L, 0, 13);
+    lua_pushstring(L, lcore_gc_mode_strs[conf.mode]);
+    lua_setfield(L, -2, "mode");
+    lua_pushinteger(L, conf.budget);
+    lua_setfield(L, -2, "budget");
+    lua_pushinteger(L, conf.max_pause);
+    lua_setfield(L, -2, "maxPauseBudget");
+    lua_pushinteger(L, stats.heap);
+    lua_setfield(L, -2, "heap");
+    lua_pushinteger(L, stats.heap_high);
+    lua_setfield(L, -2, "heapHigh");
+    lua_pushinteger(L, stats.step_limit);
+    lua_setfield(L, -2, "stepLimit");
+    lua_pushinteger(L, stats.steps);
+    lua_setfield(L, -2, "steps");
+    lua_pushinteger(L, stats.steps_per_sec);
+    lua_setfield(L, -2, "stepsPerSec");
+    lua_pushinteger(L, stats.idle_steps);
+    lua_setfield(L, -2, "idleSteps");
+    lua_pushinteger(L, stats.idle_stops);
+    lua_setfield(L, -2, "idleStops");
+    lua_pushinteger(L, stats.full_cycles);
+    lua_setfield(L, -2, "fullCycles");
+    lua_pushinteger(L, stats.last_pause);
+    lua_setfield(L, -2, "lastPause");
+    lua_pushinteger(L, stats.max_pause);
+    lua_setfield(L, -2, "maxPause");
+    return 1;
+}
+
+static int lcore_memstats(lua_State *L) {
+    app_alloc_stats stats;
+    app_alloc_get_stats(&stats);
+
+    lua_createtable(L, 0, 10);
+    lua_pushstring(L, stats.allocator == APP_ALLOC_SLAB ? "slab" : "system");
+    lua_setfield(L, -2, "allocator");
+    lua_pushinteger(L, stats.live);
+    lua_setfield(L, -2, "live");
+    lua_pushinteger(L, stats.peak);
+    lua_setfield(L, -2, "peak");
+    lua_pushinteger(L, stats.large);
+    lua_setfield(L, -2, "large");
+    lua_pushinteger(L, stats.slab_bytes);
+    lua_setfield(L, -2, "slabBytes");
+    lua_pushinteger(L, stats.allocs);
+    lua_setfield(L, -2, "allocs");
+    lua_pushinteger(L, stats.alloc_bytes);
+    lua_setfield(L, -2, "allocBytes");
+    lua_pushinteger(L, pal_mem_get_used_size());
+    lua_setfield(L, -2, "processBytes");
+
+    // fragmentation of the slabs: the ratio of the bytes not used by the live blocks
+    size_t used = 0;
+    lua_createtable(L, APP_ALLOC_CLASS_NUM, 0);
+    for (size_t i = 0; i < APP_ALLOC_CLASS_NUM; i++) {
+        app_alloc_class_stats *cls = &stats.classes[i];
+        used += cls->bytes;
+        lua_createtable(L, 0, 5);
+        lua_pushinteger(L, cls->size);
+        lua_setfield(L, -2, "size");
+        lua_pushinteger(L, cls->blocks);
+        lua_setfield(L, -2, "blocks");
+        lua_pushinteger(L, cls->bytes);
+        lua_setfield(L, -2, "bytes");
+        lua_pushinteger(L, cls->free);
+        lua_setfield(L, -2, "free");
+        lua_pushinteger(L, cls->slabs);
+        lua_setfield(L, -2, "slabs");
+        lua_rawseti(L, -2, i + 1);
+    }
+    lua_setfield(L, -2, "classes");
+    lua_pushnumber(L, stats.slab_bytes ? 1 - (lua_Number)used / stats.slab_bytes : 0);
+    lua_setfield(L, -2, "fragmentation");
+
+    size_t ntags = app_alloc_get_ntags();
+    lua_createtable(L, ntags, 0);
+    for (size_t i = 0; i < ntags; i++) {
+        app_alloc_tag_stats tag;
+        app_alloc_get_tag_stats(i, &tag);
+        lua_createtable(L, 0, 6);
+        lua_pushinteger(L, i);
+        lua_setfield(L, -2, "tag");
+        lua_pushstring(L, tag.name);
+        lua_setfield(L, -2, "name");
+        lua_pushinteger(L, tag.live);
+        lua_setfield(L, -2, "live");
+        lua_pushinteger(L, tag.peak);
+        lua_setfield(L, -2, "peak");
+        lua_pushinteger(L, tag.limit);
+        lua_setfield(L, -2, "limit");
+        lua_pushinteger(L, tag.limit_hits);
+        lua_setfield(L, -2, "limitHits");
+        lua_rawseti(L, -2, i + 1);
+    }
+    lua_setfield(L, -2, "tags");
+    return 1;
+}
+
+static int lcore_create_mem_tag(lua_State *L) {
+    const char *name = luaL_checkstring(L, 1);
+    lua_Integer limit = luaL_optinteger(L, 2, 0);
+    luaL_argcheck(L, limit >= 0, 2, "soft limit out of range");
+    int tag = app_alloc_new_tag(name, limit);
+    if (tag < 0) {
+        luaL_error(L, "too many memory tags");
+    }
+    lua_pushinteger(L, tag);
+    return 1;
+}
+
+static int lcore_set_mem_tag(lua_State *L) {
+    lua_Integer tag = luaL_checkinteger(L, 1);
+    luaL_argcheck(L, tag >= 0 && (size_t)tag < app_alloc_get_ntags(), 1, "invalid tag");
+    lc_settag(L, tag);
+    app_alloc_settag(tag);
+    return 0;
+}
+
+static int lcore_get_mem_tag(lua_State *L) {
+    lua_pushinteger(L, lc_gettag(L));
+    return 1;
 }
 
 static int lcore_create_timer(lua_State *L) {
     luaL_checktype(L, 1, LUA_TFUNCTION);
+    lc_bindtag(L, 1);
 
     int n = lua_gettop(L);
     lcore_timer_ctx *ctx = lua_newuserdatauv(L, sizeof(lcore_timer_ctx), n);
@@ -141,20 +428,23 @@ static int lcore_create_timer(lua_State *L) {
         lua_setiuservalue(L, 1, i);
     }
     ctx->nargs = n - 1;
-    ctx->timer = 0;
+    ctx->timer = NULL;
     ctx->mL = lc_getmainthread(L);
     return 1;
 }
 
 static int lcore_create_mq(lua_State *L) {
-    size_t size = luaL_checkinteger(L, 1);
-    luaL_argcheck(L, size > 0, 1, "size out of range");
-    lcore_mq *obj = lua_newuserdatauv(L, sizeof(*obj), 1);
+    lua_Integer size = luaL_checkinteger(L, 1);
+    luaL_argcheck(L, size > 0 && size <= INT_MAX / LCORE_MQ_VALUES_PER_MSG, 1, "size out of range");
+    lcore_mq *obj = lua_newuserdatauv(L, sizeof(*obj) + sizeof(int) * size, 1);
     luaL_setmetatable(L, LUA_MQ_OBJ_NAME);
-    obj->first = 1;
-    obj->last = 1;
     obj->size = size;
-    lua_createtable(L, 0, 1);
+    obj->first = 0;
+    obj->count = 0;
+    obj->vcap = size * LCORE_MQ_VALUES_PER_MSG;
+    obj->vfirst = 0;
+    obj->vcount = 0;
+    lua_createtable(L, obj->vcap, 3);
     lua_setuservalue(L, -2);
     return 1;
 }
@@ -163,7 +453,6 @@ static int lcore_timer_resume(lua_State *L) {
     lcore_timer_ctx *ctx = lua_touserdata(L, -1);
     lua_pop(L, 1);
 
-    int nres, status;
     lua_State *co = lc_newthread(L);
     if (luai_unlikely(lua_rawgetp(co, LUA_REGISTRYINDEX, ctx) != LUA_TUSERDATA)) {
         HAPFatalError();
@@ -175,20 +464,18 @@ static int lcore_timer_resume(lua_State *L) {
         lua_getiuservalue(co, 1, i);
     }
     lua_remove(co, 1);
+    lc_applytag(co, 1);
     lua_pushnil(co);
     lua_rawsetp(co, LUA_REGISTRYINDEX, ctx);
-    status = lc_resume(co, L, ctx->nargs, &nres);
-    if (luai_unlikely(status != LUA_OK && status != LUA_YIELD)) {
-        HAPLogError(&lcore_log, "%s: %s", __func__, lua_tostring(L, -1));
-    }
+    lc_wakeup(co, ctx->nargs, LC_PRIO_LOW);
     return 0;
 }
 
-static void lcore_timer_cb(HAPPlatformTimerRef timer, void *context) {
+static void lcore_timer_cb(app_timer_ref timer, void *context) {
     lcore_timer_ctx *ctx = context;
     lua_State *L = ctx->mL;
 
-    ctx->timer = 0;
+    ctx->timer = NULL;
 
     HAPAssert(lua_gettop(L) == 0);
 
@@ -210,10 +497,10 @@ static int lcore_timer_start(lua_State *L) {
     luaL_argcheck(L, ms >= 0, 2, "ms out of range");
 
     if (ctx->timer) {
-        HAPPlatformTimerDeregister(ctx->timer);
+        app_timer_deregister(ctx->timer);
     }
 
-    if (HAPPlatformTimerRegister(&ctx->timer,
+    if (app_timer_register(&ctx->timer,
         ms ? (HAPTime)ms + HAPPlatformClockGetCurrent() : 0,
         lcore_timer_cb, ctx) != kHAPError_None) {
         luaL_error(L, "failed to start the timer");
@@ -227,8 +514,8 @@ static int lcore_timer_stop(lua_State *L) {
     lcore_timer_ctx *ctx = luaL_checkudata(L, 1, LUA_TIMER_NAME);
 
     if (ctx->timer) {
-        HAPPlatformTimerDeregister(ctx->timer);
-        ctx->timer = 0;
+        app_timer_deregister(ctx->timer);
+        ctx->timer = NULL;
         lua_pushnil(L);
         lua_rawsetp(L, LUA_REGISTRYINDEX, ctx);
     }
@@ -239,7 +526,7 @@ static int lcore_timer_tostring(lua_State *L) {
     lcore_timer_ctx *ctx = luaL_checkudata(L, 1, LUA_TIMER_NAME);
 
     if (ctx->timer) {
-        lua_pushfstring(L, "timer (%u)", ctx->timer);
+        lua_pushfstring(L, "timer (%p)", ctx->timer);
     } else {
         lua_pushliteral(L, "timer (expired)");
     }
@@ -274,38 +561,127 @@ static void lcore_timer_createmeta(lua_State *L) {
     lua_pop(L, 1);  /* pop metatable */
 }
 
-static size_t lcore_mq_size(lcore_mq *obj) {
-    return obj->first > obj->last ? obj->size - obj->first + obj->last : obj->last - obj->first;
+/**
+ * Move the top 'nargs' values to the waiting coroutine and put it into the ready queue.
+ */
+static void lcore_mq_resume(lua_State *L, lua_State *co, int nargs, lc_prio prio) {
+    lua_xmove(L, co, nargs);
+    lc_wakeup(co, nargs, prio);
 }
 
-static void lcore_mq_resume(lua_State *L, lua_State *co, int nargs) {
-    int status, nres;
-    lua_xmove(L, co, nargs);
-    status = lc_resume(co, L, nargs, &nres);
-    if (luai_unlikely(status != LUA_OK && status != LUA_YIELD)) {
-        HAPLogError(&lcore_log, "%s: %s", __func__, lua_tostring(L, -1));
+/**
+ * Grow the value ring of the message queue to hold at least 'need' values.
+ * The store table is at 'store_idx', it is replaced by the new one.
+ */
+static void lcore_mq_grow(lua_State *L, int mq_idx, int store_idx, lcore_mq *obj, size_t need) {
+    size_t vcap = obj->vcap * 2;
+    if (vcap < need) {
+        vcap = need;
+    }
+    luaL_argcheck(L, vcap <= INT_MAX, 2, "too many values");
+    lua_createtable(L, vcap, 3);
+    for (size_t i = 0; i < obj->vcount; i++) {
+        lua_rawgeti(L, store_idx, (obj->vfirst + i) % obj->vcap + 1);
+        lua_rawseti(L, -2, i + 1);
     }
-    lua_pop(L, nres);
+    lua_getfield(L, store_idx, "wait");
+    lua_setfield(L, -2, "wait");
+    lua_getfield(L, store_idx, "sendwait");
+    lua_setfield(L, -2, "sendwait");
+    lua_getfield(L, store_idx, "select");
+    lua_setfield(L, -2, "select");
+    lua_pushvalue(L, -1);
+    lua_setuservalue(L, mq_idx);
+    lua_replace(L, store_idx);
+    obj->vcap = vcap;
+    obj->vfirst = 0;
 }
 
-static int lcore_mq_recv_ready(lua_State *L, int mq_idx, lcore_mq *obj, bool with_status) {
+/**
+ * Append a message which consists of 'nargs' values starting at 'arg_idx'.
+ */
+static void lcore_mq_push(lua_State *L, int mq_idx, lcore_mq *obj, int arg_idx, int nargs) {
+    HAPAssert(obj->count < obj->size);
     mq_idx = lua_absindex(L, mq_idx);
+    arg_idx = lua_absindex(L, arg_idx);
     HAPAssert(lua_getuservalue(L, mq_idx) == LUA_TTABLE);
     int store_idx = lua_gettop(L);
-    lua_geti(L, store_idx, obj->first);
+    if (obj->vcount + nargs > obj->vcap) {
+        lcore_mq_grow(L, mq_idx, store_idx, obj, obj->vcount + nargs);
+    }
+    size_t pos = obj->vfirst + obj->vcount;
+    for (int i = 0; i < nargs; i++, pos++) {
+        lua_pushvalue(L, arg_idx + i);
+        lua_rawseti(L, store_idx, pos % obj->vcap + 1);
+    }
+    obj->nvals[(obj->first + obj->count) % obj->size] = nargs;
+    obj->count++;
+    obj->vcount += nargs;
+    lua_pop(L, 1);
+}
+
+/**
+ * Move the message of the first blocked sender to the queue, and wake the sender up.
+ */
+static void lcore_mq_wake_sender(lua_State *L, int mq_idx, lcore_mq *obj) {
+    mq_idx = lua_absindex(L, mq_idx);
+    HAPAssert(lua_getuservalue(L, mq_idx) == LUA_TTABLE);
+    if (lua_getfield(L, -1, "sendwait") != LUA_TTABLE) {
+        lua_pop(L, 2);
+        return;
+    }
+    int wait_idx = lua_gettop(L);
+    int wait_count = luaL_len(L, wait_idx);
+    HAPAssert(lua_rawgeti(L, wait_idx, 1) == LUA_TUSERDATA);
+    lcore_mq_send_ctx *ctx = lua_touserdata(L, -1);
+    int ctx_idx = lua_gettop(L);
+    for (int i = 1; i < wait_count; i++) {
+        lua_rawgeti(L, wait_idx, i + 1);
+        lua_rawseti(L, wait_idx, i);
+    }
     lua_pushnil(L);
-    lua_seti(L, store_idx, obj->first);
-    obj->first++;
-    if (obj->first > obj->size + 1) {
-        obj->first = 1;
+    lua_rawseti(L, wait_idx, wait_count);
+    if (wait_count == 1) {
+        lua_pushnil(L);
+        lua_setfield(L, wait_idx - 1, "sendwait");
+    }
+    if (luai_unlikely(!lua_checkstack(L, ctx->nargs))) {
+        luaL_error(L, "stack overflow");
+    }
+    for (int i = 1; i <= ctx->nargs; i++) {
+        lua_getiuservalue(L, ctx_idx, i);
+    }
+    lcore_mq_push(L, mq_idx, obj, -ctx->nargs, ctx->nargs);
+    lua_State *co = ctx->co;
+    lua_settop(L, wait_idx - 2);
+    lcore_mq_resume(L, co, 0, LC_PRIO_NORMAL);
+    lua_settop(L, wait_idx - 2);
+}
+
+static int lcore_mq_recv_ready(lua_State *L, int mq_idx, lcore_mq *obj, bool with_status) {
+    mq_idx = lua_absindex(L, mq_idx);
+    HAPAssert(obj->count > 0);
+    int nargs = obj->nvals[obj->first];
+    if (luai_unlikely(!lua_checkstack(L, nargs + 2))) {
+        luaL_error(L, "stack overflow");
     }
-    int nargs = luaL_len(L, store_idx + 1);
+    HAPAssert(lua_getuservalue(L, mq_idx) == LUA_TTABLE);
+    int store_idx = lua_gettop(L);
     if (with_status) {
         lua_pushboolean(L, true);
     }
-    for (int i = 1; i <= nargs; i++) {
-        lua_geti(L, store_idx + 1, i);
+    for (int i = 0; i < nargs; i++) {
+        int pos = (obj->vfirst + i) % obj->vcap + 1;
+        lua_rawgeti(L, store_idx, pos);
+        lua_pushnil(L);
+        lua_rawseti(L, store_idx, pos);
     }
+    lua_remove(L, store_idx);
+    obj->first = (obj->first + 1) % obj->size;
+    obj->count--;
+    obj->vfirst = (obj->vfirst + nargs) % obj->vcap;
+    obj->vcount -= nargs;
+    lcore_mq_wake_sender(L, mq_idx, obj);
     return with_status ? nargs + 1 : nargs;
 }
 
@@ -358,9 +734,10 @@ static void lcore_mq_waitctx_release(lua_State *L, int idx, bool cancel_timer) {
     lcore_mq_wait_ctx *ctx = lua_touserdata(L, idx);
 
     if (cancel_timer && ctx->timer) {
-        HAPPlatformTimerDeregister(ctx->timer);
+        app_timer_deregister(ctx->timer);
     }
-    ctx->timer = 0;
+    ctx->timer = NULL;
+    lc_wait_remove(&ctx->wait);
 
     lua_pushnil(L);
     lua_rawsetp(L, LUA_REGISTRYINDEX, ctx);
@@ -369,6 +746,25 @@ static void lcore_mq_waitctx_release(lua_State *L, int idx, bool cancel_timer) {
     ctx->co = NULL;
 }
 
+static void lcore_mq_wait_cancel(lua_State *L, lc_wait *wait, lc_context_state state) {
+    lcore_mq_wait_ctx *ctx = (lcore_mq_wait_ctx *)wait;
+    lua_State *co = ctx->co;
+    bool with_status = ctx->with_status;
+
+    lcore_mq_wait_remove(L, ctx);
+    HAPAssert(lua_rawgetp(L, LUA_REGISTRYINDEX, ctx) == LUA_TUSERDATA);
+    lcore_mq_waitctx_release(L, -1, true);
+    lua_pop(L, 1);
+
+    if (with_status) {
+        lua_pushboolean(co, false);
+        lua_pushstring(co, lc_context_strerror(state));
+        lc_wakeup(co, 2, LC_PRIO_NORMAL);
+    } else {
+        lcore_wakeup_cancelled(co, state);
+    }
+}
+
 static int lcore_mq_wait_timeout_resume(lua_State *L) {
     lcore_mq_wait_ctx *ctx = lua_touserdata(L, 1);
     lua_pop(L, 1);
@@ -389,19 +785,20 @@ static int lcore_mq_wait_timeout_resume(lua_State *L) {
 
     lua_pushboolean(L, false);
     lua_pushliteral(L, "timeout");
-    lcore_mq_resume(L, co, 2);
+    lcore_mq_resume(L, co, 2, LC_PRIO_LOW);
     return 0;
 }
 
-static void lcore_mq_wait_timeout_cb(HAPPlatformTimerRef timer, void *context) {
+static void lcore_mq_wait_timeout_cb(app_timer_ref timer, void *context) {
     lcore_mq_wait_ctx *ctx = context;
+
+    // The timer is released after it fires.
+    ctx->timer = NULL;
     if (!ctx->co) {
         return;
     }
     lua_State *L = lc_getmainthread(ctx->co);
 
-    ctx->timer = 0;
-
     HAPAssert(lua_gettop(L) == 0);
 
     lc_pushtraceback(L);
@@ -416,8 +813,22 @@ static void lcore_mq_wait_timeout_cb(HAPPlatformTimerRef timer, void *context) {
     lc_collectgarbage(L);
 }
 
+static int finishmqrecv(lua_State *L, int status, lua_KContext extra) {
+    lcore_checkcancelled(L);
+    return lua_gettop(L) - 1;
+}
+
 static int lcore_mq_wait(lua_State *L, int mq_idx, bool with_status, HAPTime deadline) {
     mq_idx = lua_absindex(L, mq_idx);
+    lcore_mq_wait_ctx *ctx = lua_newuserdatauv(L, sizeof(*ctx), 1);
+    int ctx_idx = lua_gettop(L);
+    ctx->wait.next = NULL;
+    ctx->co = L;
+    ctx->timer = NULL;
+    ctx->with_status = with_status;
+    lua_pushvalue(L, mq_idx);
+    lua_setiuservalue(L, ctx_idx, 1);
+
     HAPAssert(lua_getuservalue(L, mq_idx) == LUA_TTABLE);
     int store_idx = lua_gettop(L);
     int type = lua_getfield(L, store_idx, "wait");
@@ -431,122 +842,412 @@ static int lcore_mq_wait(lua_State *L, int mq_idx, bool with_status, HAPTime dea
     }
 
     int wait_idx = lua_gettop(L);
-    lcore_mq_wait_ctx *ctx = lua_newuserdatauv(L, sizeof(*ctx), 1);
-    ctx->co = L;
-    ctx->timer = 0;
-    ctx->with_status = with_status;
-    lua_pushvalue(L, mq_idx);
-    lua_setiuservalue(L, -2, 1);
-
     int wait_pos = luaL_len(L, wait_idx) + 1;
-    lua_pushvalue(L, -1);
+    lua_pushvalue(L, ctx_idx);
     lua_seti(L, wait_idx, wait_pos);
-    if (deadline) {
-        lua_pushvalue(L, -1);
+    lc_context_state state = lc_wait_add(L, &ctx->wait, lcore_mq_wait_cancel);
+    if (luai_unlikely(state != LC_CONTEXT_ACTIVE)) {
+        if (lcore_mq_wait_remove_at(L, wait_idx, wait_pos)) {
+            lua_pushnil(L);
+            lua_setfield(L, store_idx, "wait");
+        }
+        lcore_mq_waitctx_release(L, ctx_idx, false);
+        if (!with_status) {
+            luaL_error(L, "%s", lc_context_strerror(state));
+        }
+        lua_pushboolean(L, false);
+        lua_pushstring(L, lc_context_strerror(state));
+        return 2;
+    }
+    if (deadline || ctx->wait.next) {
+        // keep the context reachable for the timeout and the cancellation
+        lua_pushvalue(L, ctx_idx);
         lua_rawsetp(L, LUA_REGISTRYINDEX, ctx);
-        if (luai_unlikely(HAPPlatformTimerRegister(&ctx->timer,
+    }
+    if (deadline) {
+        if (luai_unlikely(app_timer_register(&ctx->timer,
             deadline, lcore_mq_wait_timeout_cb, ctx) != kHAPError_None)) {
             if (lcore_mq_wait_remove_at(L, wait_idx, wait_pos)) {
                 lua_pushnil(L);
                 lua_setfield(L, store_idx, "wait");
             }
-            lcore_mq_waitctx_release(L, -1, false);
+            lcore_mq_waitctx_release(L, ctx_idx, false);
             luaL_error(L, "failed to create a timer");
         }
     }
-    lua_pop(L, 3);
-    return lua_yield(L, 0);
+    lua_settop(L, mq_idx);
+    return lua_yieldk(L, 0, 0, finishmqrecv);
 }
 
-static int lcore_mq_send(lua_State *L) {
-    lcore_mq *obj = luaL_checkudata(L, 1, LUA_MQ_OBJ_NAME);
-    int narg = lua_gettop(L) - 1;
-
-    lua_getuservalue(L, 1);
-
-    if (lua_getfield(L, -1, "wait") == LUA_TTABLE) {
-        lua_pushnil(L);
-        lua_setfield(L, -3, "wait");  // que.wait = nil
-        int waiting = luaL_len(L, -1);
-        for (int i = 1; i <= waiting; i++) {
-            HAPAssert(lua_geti(L, -1, i) == LUA_TUSERDATA);
-            lcore_mq_wait_ctx *ctx = lua_touserdata(L, -1);
-            lua_State *co = ctx->co;
-            bool with_status = ctx->with_status;
-            lcore_mq_waitctx_release(L, -1, true);
-            lua_pop(L, 1);
-            int nargs = narg + with_status;
-            if (luai_unlikely(!lua_checkstack(L, nargs))) {
-                luaL_error(L, "stack overflow");
-            }
-            if (with_status) {
-                lua_pushboolean(L, true);
-            }
-            for (int j = 2; j <= 1 + narg; j++) {
-                lua_pushvalue(L, j);
-            }
-            if (co) {
-                lcore_mq_resume(L, co, nargs);
-            }
-        }
-    } else {
-        if (lcore_mq_size(obj) == obj->size) {
-            luaL_error(L, "the message queue is full");
-        }
+/**
+ * Remove the select context from the select waiters of the message queue.
+ * The order of other waiters is kept.
+ */
+static void lcore_mq_select_remove(lua_State *L, int store_idx, lcore_select_ctx *ctx) {
+    if (lua_getfield(L, store_idx, "select") != LUA_TTABLE) {
         lua_pop(L, 1);
-        lua_insert(L, 2);
-        lua_createtable(L, narg, 0);
-        lua_insert(L, 3);
-        for (int i = narg; i >= 1; i--) {
-            lua_seti(L, 3, i);
+        return;
+    }
+    int sel_idx = lua_gettop(L);
+    int count = luaL_len(L, sel_idx);
+    int pos = 1;
+    for (; pos <= count; pos++) {
+        bool found = lua_rawgeti(L, sel_idx, pos) == LUA_TUSERDATA && lua_touserdata(L, -1) == ctx;
+        lua_pop(L, 1);
+        if (found) {
+            break;
         }
-        lua_seti(L, 2, obj->last);
-        obj->last++;
-        if (obj->last > obj->size + 1) {
-            obj->last = 1;
+    }
+    if (pos <= count) {
+        for (; pos < count; pos++) {
+            lua_rawgeti(L, sel_idx, pos + 1);
+            lua_rawseti(L, sel_idx, pos);
+        }
+        lua_pushnil(L);
+        lua_rawseti(L, sel_idx, count);
+        if (count == 1) {
+            lua_pushnil(L);
+            lua_setfield(L, store_idx, "select");
         }
     }
-    return 0;
+    lua_pop(L, 1);
 }
 
-static int lcore_mq_recv(lua_State *L) {
-    lcore_mq *obj = luaL_checkudata(L, 1, LUA_MQ_OBJ_NAME);
-    if (lua_gettop(L) != 1) {
-        luaL_error(L, "invalid arguements");
+/**
+ * Stop waiting on all message queues of the select context at 'idx'.
+ *
+ * @return the coroutine waiting in core.select(), NULL if it has been released.
+ */
+static lua_State *lcore_select_release(lua_State *L, int idx, bool cancel_timer) {
+    idx = lua_absindex(L, idx);
+    lcore_select_ctx *ctx = lua_touserdata(L, idx);
+    lua_State *co = ctx->co;
+    if (!co) {
+        return NULL;
     }
-    if (obj->last == obj->first) {
-        return lcore_mq_wait(L, 1, false, 0);
-    } else {
-        return lcore_mq_recv_ready(L, 1, obj, false);
+
+    for (int i = 1; i <= ctx->n; i++) {
+        HAPAssert(lua_getiuservalue(L, idx, i) == LUA_TUSERDATA);
+        HAPAssert(lua_getuservalue(L, -1) == LUA_TTABLE);
+        lcore_mq_select_remove(L, lua_gettop(L), ctx);
+        lua_pop(L, 2);
+    }
+    if (cancel_timer && ctx->timer) {
+        app_timer_deregister(ctx->timer);
     }
+    ctx->timer = NULL;
+    ctx->co = NULL;
+    lc_wait_remove(&ctx->wait);
+    lua_pushnil(L);
+    lua_rawsetp(L, LUA_REGISTRYINDEX, ctx);
+    return co;
 }
 
-static int lcore_mq_recv_until(lua_State *L) {
-    lcore_mq *obj = luaL_checkudata(L, 1, LUA_MQ_OBJ_NAME);
-    lua_Integer deadline = luaL_checkinteger(L, 2);
-    luaL_argcheck(L, deadline >= 0, 2, "deadline out of range");
-    if (lua_gettop(L) != 2) {
-        luaL_error(L, "invalid arguements");
+static void lcore_select_cancel(lua_State *L, lc_wait *wait, lc_context_state state) {
+    lcore_select_ctx *ctx = (lcore_select_ctx *)wait;
+    HAPAssert(lua_rawgetp(L, LUA_REGISTRYINDEX, ctx) == LUA_TUSERDATA);
+    lua_State *co = lcore_select_release(L, -1, true);
+    lua_pop(L, 1);
+    HAPAssert(co);
+
+    lua_pushboolean(co, false);
+    lua_pushstring(co, lc_context_strerror(state));
+    lc_wakeup(co, 2, LC_PRIO_NORMAL);
+}
+
+/**
+ * Wake the first coroutine waiting in core.select() on the message queue
+ * with the message which consists of 'narg' values starting at 'arg_idx'.
+ *
+ * @return false if no coroutines are waiting.
+ */
+static bool lcore_mq_deliver_select(lua_State *L, int mq_idx, int store_idx, int arg_idx, int narg) {
+    if (lua_getfield(L, store_idx, "select") != LUA_TTABLE) {
+        lua_pop(L, 1);
+        return false;
     }
-    if (obj->last != obj->first) {
-        return lcore_mq_recv_ready(L, 1, obj, true);
+    HAPAssert(lua_rawgeti(L, -1, 1) == LUA_TUSERDATA);
+    int ctx_idx = lua_gettop(L);
+    lcore_select_ctx *ctx = lua_touserdata(L, ctx_idx);
+    int pos = 1;
+    for (; pos <= ctx->n; pos++) {
+        lua_getiuservalue(L, ctx_idx, pos);
+        bool found = lua_rawequal(L, -1, mq_idx);
+        lua_pop(L, 1);
+        if (found) {
+            break;
+        }
+    }
+    HAPAssert(pos <= ctx->n);
+    lua_State *co = lcore_select_release(L, ctx_idx, true);
+    HAPAssert(co);
+    if (luai_unlikely(!lua_checkstack(L, narg + 1))) {
+        luaL_error(L, "stack overflow");
+    }
+    lua_pushinteger(L, pos);
+    for (int i = 0; i < narg; i++) {
+        lua_pushvalue(L, arg_idx + i);
     }
+    lcore_mq_resume(L, co, narg + 1, LC_PRIO_NORMAL);
+    lua_settop(L, ctx_idx - 2);
+    return true;
+}
 
-    if ((HAPTime)deadline <= HAPPlatformClockGetCurrent()) {
-        lua_pushboolean(L, false);
-        lua_pushliteral(L, "timeout");
-        return 2;
+/**
+ * Deliver the message at the top 'narg' values to all coroutines waiting in mq:recv()
+ * or mq:recvUntil(), or the first coroutine waiting in core.select().
+ *
+ * @return false if no coroutines are waiting.
+ */
+static bool lcore_mq_deliver(lua_State *L, int mq_idx, int narg) {
+    int arg_idx = lua_gettop(L) - narg + 1;
+    lua_getuservalue(L, mq_idx);
+    if (lua_getfield(L, -1, "wait") != LUA_TTABLE) {
+        lua_pop(L, 1);
+        // Only one of the coroutines waiting in core.select() takes the message.
+        bool delivered = lcore_mq_deliver_select(L, mq_idx, lua_gettop(L), arg_idx, narg);
+        lua_pop(L, 1);
+        return delivered;
     }
-    return lcore_mq_wait(L, 1, true, (HAPTime)deadline);
+    int wait_idx = lua_gettop(L);
+    lua_pushnil(L);
+    lua_setfield(L, wait_idx - 1, "wait");  // que.wait = nil
+    int waiting = luaL_len(L, wait_idx);
+    for (int i = 1; i <= waiting; i++) {
+        HAPAssert(lua_geti(L, wait_idx, i) == LUA_TUSERDATA);
+        lcore_mq_wait_ctx *ctx = lua_touserdata(L, -1);
+        lua_State *co = ctx->co;
+        bool with_status = ctx->with_status;
+        lcore_mq_waitctx_release(L, -1, true);
+        lua_pop(L, 1);
+        int nargs = narg + with_status;
+        if (luai_unlikely(!lua_checkstack(L, nargs))) {
+            luaL_error(L, "stack overflow");
+        }
+        if (with_status) {
+            lua_pushboolean(L, true);
+        }
+        for (int j = 0; j < narg; j++) {
+            lua_pushvalue(L, arg_idx + j);
+        }
+        if (co) {
+            lcore_mq_resume(L, co, nargs, LC_PRIO_NORMAL);
+        }
+        lua_settop(L, wait_idx);
+    }
+    lua_pop(L, 2);
+    return true;
 }
 
-static int lcore_mq_tostring(lua_State *L) {
-    lcore_mq *obj = luaL_checkudata(L, 1, LUA_MQ_OBJ_NAME);
-    lua_pushfstring(L, "message queue (%p)", obj);
-    return 1;
+static int finishsend(lua_State *L, int status, lua_KContext extra) {
+    return 0;
 }
 
-/*
+static int lcore_mq_send(lua_State *L) {
+    lcore_mq *obj = luaL_checkudata(L, 1, LUA_MQ_OBJ_NAME);
+    int narg = lua_gettop(L) - 1;
+
+    if (lcore_mq_deliver(L, 1, narg)) {
+        return 0;
+    }
+    if (obj->count < obj->size) {
+        lcore_mq_push(L, 1, obj, 2, narg);
+        return 0;
+    }
+
+    // The queue is full, wait until a receiver takes a message out.
+    HAPAssert(lua_getuservalue(L, 1) == LUA_TTABLE);
+    int store_idx = lua_gettop(L);
+    int type = lua_getfield(L, store_idx, "sendwait");
+    if (type == LUA_TNIL) {
+        lua_pop(L, 1);
+        lua_createtable(L, 1, 0);
+        lua_pushvalue(L, -1);
+        lua_setfield(L, store_idx, "sendwait");
+    } else {
+        HAPAssert(type == LUA_TTABLE);
+    }
+    int wait_idx = lua_gettop(L);
+    lcore_mq_send_ctx *ctx = lua_newuserdatauv(L, sizeof(*ctx), narg);
+    ctx->co = L;
+    ctx->nargs = narg;
+    for (int i = 1; i <= narg; i++) {
+        lua_pushvalue(L, 1 + i);
+        lua_setiuservalue(L, -2, i);
+    }
+    lua_rawseti(L, wait_idx, luaL_len(L, wait_idx) + 1);
+    lua_settop(L, 0);
+    return lua_yieldk(L, 0, 0, finishsend);
+}
+
+static int lcore_mq_try_send(lua_State *L) {
+    lcore_mq *obj = luaL_checkudata(L, 1, LUA_MQ_OBJ_NAME);
+    int narg = lua_gettop(L) - 1;
+
+    if (lcore_mq_deliver(L, 1, narg)) {
+        lua_pushboolean(L, true);
+    } else if (obj->count < obj->size) {
+        lcore_mq_push(L, 1, obj, 2, narg);
+        lua_pushboolean(L, true);
+    } else {
+        lua_pushboolean(L, false);
+    }
+    return 1;
+}
+
+static int lcore_mq_recv(lua_State *L) {
+    lcore_mq *obj = luaL_checkudata(L, 1, LUA_MQ_OBJ_NAME);
+    if (lua_gettop(L) != 1) {
+        luaL_error(L, "invalid arguements");
+    }
+    if (obj->count == 0) {
+        return lcore_mq_wait(L, 1, false, 0);
+    } else {
+        return lcore_mq_recv_ready(L, 1, obj, false);
+    }
+}
+
+static int lcore_mq_recv_until(lua_State *L) {
+    lcore_mq *obj = luaL_checkudata(L, 1, LUA_MQ_OBJ_NAME);
+    lua_Integer deadline = luaL_checkinteger(L, 2);
+    luaL_argcheck(L, deadline >= 0, 2, "deadline out of range");
+    if (lua_gettop(L) != 2) {
+        luaL_error(L, "invalid arguements");
+    }
+    if (obj->count != 0) {
+        return lcore_mq_recv_ready(L, 1, obj, true);
+    }
+
+    if ((HAPTime)deadline <= HAPPlatformClockGetCurrent()) {
+        lua_pushboolean(L, false);
+        lua_pushliteral(L, "timeout");
+        return 2;
+    }
+    return lcore_mq_wait(L, 1, true, (HAPTime)deadline);
+}
+
+static int lcore_select_timeout_resume(lua_State *L) {
+    lcore_select_ctx *ctx = lua_touserdata(L, 1);
+    lua_pop(L, 1);
+
+    if (lua_rawgetp(L, LUA_REGISTRYINDEX, ctx) != LUA_TUSERDATA) {
+        lua_pop(L, 1);
+        return 0;
+    }
+    lua_State *co = lcore_select_release(L, -1, false);
+    lua_pop(L, 1);
+    if (!co) {
+        return 0;
+    }
+
+    lua_pushboolean(L, false);
+    lua_pushliteral(L, "timeout");
+    lcore_mq_resume(L, co, 2, LC_PRIO_LOW);
+    return 0;
+}
+
+static void lcore_select_timeout_cb(app_timer_ref timer, void *context) {
+    lcore_select_ctx *ctx = context;
+    if (!ctx->co) {
+        return;
+    }
+    lua_State *L = lc_getmainthread(ctx->co);
+
+    ctx->timer = NULL;
+
+    HAPAssert(lua_gettop(L) == 0);
+
+    lc_pushtraceback(L);
+    lua_pushcfunction(L, lcore_select_timeout_resume);
+    lua_pushlightuserdata(L, ctx);
+    int status = lua_pcall(L, 1, 0, 1);
+    if (luai_unlikely(status != LUA_OK)) {
+        HAPLogError(&lcore_log, "%s: %s", __func__, lua_tostring(L, -1));
+    }
+
+    lua_settop(L, 0);
+    lc_collectgarbage(L);
+}
+
+static int lcore_select(lua_State *L) {
+    luaL_checktype(L, 1, LUA_TTABLE);
+    lua_Integer deadline = luaL_optinteger(L, 2, 0);
+    luaL_argcheck(L, deadline >= 0, 2, "deadline out of range");
+    bool has_deadline = !lua_isnoneornil(L, 2);
+    lua_settop(L, 2);
+
+    int n = luaL_len(L, 1);
+    luaL_argcheck(L, n > 0 || has_deadline, 1, "nothing to wait");
+    for (int i = 1; i <= n; i++) {
+        lua_rawgeti(L, 1, i);
+        lcore_mq *obj = luaL_testudata(L, -1, LUA_MQ_OBJ_NAME);
+        if (luai_unlikely(!obj)) {
+            luaL_error(L, "bad element #%d (message queue expected, got %s)", i, luaL_typename(L, -1));
+        }
+        if (obj->count != 0) {
+            lua_pushinteger(L, i);
+            return lcore_mq_recv_ready(L, -2, obj, false) + 1;
+        }
+        lua_pop(L, 1);
+    }
+
+    if (has_deadline && (HAPTime)deadline <= HAPPlatformClockGetCurrent()) {
+        lua_pushboolean(L, false);
+        lua_pushliteral(L, "timeout");
+        return 2;
+    }
+
+    lcore_select_ctx *ctx = lua_newuserdatauv(L, sizeof(*ctx), n);
+    int ctx_idx = lua_gettop(L);
+    ctx->wait.next = NULL;
+    ctx->co = L;
+    ctx->timer = NULL;
+    ctx->n = n;
+    for (int i = 1; i <= n; i++) {
+        lua_rawgeti(L, 1, i);
+        lua_pushvalue(L, -1);
+        lua_setiuservalue(L, ctx_idx, i);
+        HAPAssert(lua_getuservalue(L, -1) == LUA_TTABLE);
+        int type = lua_getfield(L, -1, "select");
+        if (type == LUA_TNIL) {
+            lua_pop(L, 1);
+            lua_createtable(L, 1, 0);
+            lua_pushvalue(L, -1);
+            lua_setfield(L, -3, "select");
+        } else {
+            HAPAssert(type == LUA_TTABLE);
+        }
+        lua_pushvalue(L, ctx_idx);
+        lua_rawseti(L, -2, luaL_len(L, -2) + 1);
+        lua_pop(L, 3);
+    }
+    lua_pushvalue(L, ctx_idx);
+    lua_rawsetp(L, LUA_REGISTRYINDEX, ctx);
+    lc_context_state state = lc_wait_add(L, &ctx->wait, lcore_select_cancel);
+    if (luai_unlikely(state != LC_CONTEXT_ACTIVE)) {
+        lcore_select_release(L, ctx_idx, false);
+        lua_pushboolean(L, false);
+        lua_pushstring(L, lc_context_strerror(state));
+        return 2;
+    }
+    if (has_deadline) {
+        if (luai_unlikely(app_timer_register(&ctx->timer,
+            deadline, lcore_select_timeout_cb, ctx) != kHAPError_None)) {
+            lcore_select_release(L, ctx_idx, false);
+            luaL_error(L, "failed to create a timer");
+        }
+    }
+    lua_settop(L, 0);
+    return lua_yield(L, 0);
+}
+
+static int lcore_mq_tostring(lua_State *L) {
+    lcore_mq *obj = luaL_checkudata(L, 1, LUA_MQ_OBJ_NAME);
+    lua_pushfstring(L, "message queue (%p)", obj);
+    return 1;
+}
+
+/*
  * metamethods for message queue object
  */
 static const luaL_Reg lcore_mq_metameth[] = {
@@ -560,6 +1261,7 @@ static const luaL_Reg lcore_mq_metameth[] = {
  */
 static const luaL_Reg lcore_mq_meth[] = {
     {"send", lcore_mq_send},
+    {"trySend", lcore_mq_try_send},
     {"recv", lcore_mq_recv},
     {"recvUntil", lcore_mq_recv_until},
     {NULL, NULL},
@@ -574,6 +1276,579 @@ static void lcore_mq_createmeta(lua_State *L) {
     lua_pop(L, 1);  /* pop metatable */
 }
 
+/**
+ * Stop waiting in core.gather() and put the coroutine into the ready queue.
+ */
+static void lcore_gather_wakeup(lcore_gather_ctx *ctx, lc_prio prio) {
+    lua_State *co = ctx->co;
+    ctx->co = NULL;
+    if (ctx->timer) {
+        app_timer_deregister(ctx->timer);
+        ctx->timer = NULL;
+    }
+    lua_pushnil(co);
+    lua_rawsetp(co, LUA_REGISTRYINDEX, ctx);
+    lc_wakeup(co, 0, prio);
+}
+
+static int finishtask(lua_State *L, int status, lua_KContext extra) {
+    // stack <task, msgh, ...>
+    lcore_task *task = lua_touserdata(L, 1);
+    int nres = lua_gettop(L) - 2;
+    bool ok = status == LUA_OK || status == LUA_YIELD;
+    if (!ok) {
+        HAPLogDebug(&lcore_log, "%s: %s", __func__, lua_tostring(L, -1));
+    }
+
+    lua_createtable(L, nres + 1, 1);
+    lua_pushboolean(L, ok);
+    lua_rawseti(L, -2, 1);
+    for (int i = 1; i <= nres; i++) {
+        lua_pushvalue(L, 2 + i);
+        lua_rawseti(L, -2, i + 1);
+    }
+    lua_pushinteger(L, nres + 1);
+    lua_setfield(L, -2, "n");
+    lua_setiuservalue(L, 1, 1);
+    task->done = true;
+
+    if (lua_getiuservalue(L, 1, 2) == LUA_TTABLE) {
+        int waiting = luaL_len(L, -1);
+        for (int i = 1; i <= waiting; i++) {
+            lua_rawgeti(L, -1, i);
+            lcore_gather_ctx *ctx = lua_touserdata(L, -1);
+            lua_pop(L, 1);
+            if (ctx->co && --ctx->remaining == 0) {
+                lcore_gather_wakeup(ctx, LC_PRIO_NORMAL);
+            }
+        }
+        lua_pushnil(L);
+        lua_setiuservalue(L, 1, 2);
+    }
+    return 0;
+}
+
+static int lcore_task_entry(lua_State *L) {
+    // stack <task, fn, ...>
+    int narg = lua_gettop(L) - 2;
+    lc_pushtraceback(L);
+    lua_insert(L, 2);
+    return finishtask(L, lua_pcallk(L, narg, LUA_MULTRET, 2, 0, finishtask), 0);
+}
+
+static int lcore_spawn(lua_State *L) {
+    luaL_checktype(L, 1, LUA_TFUNCTION);
+    int narg = lua_gettop(L);
+
+    lua_State *co = lc_newthread(L);
+    lcore_task *task = lua_newuserdatauv(L, sizeof(*task), 2);
+    task->done = false;
+    luaL_setmetatable(L, LUA_TASK_NAME);
+
+    if (luai_unlikely(!lua_checkstack(co, narg + 2) || !lua_checkstack(L, narg + 1))) {
+        luaL_error(L, "stack overflow");
+    }
+    lua_pushcfunction(co, lcore_task_entry);
+    lua_pushvalue(L, -1);
+    for (int i = 1; i <= narg; i++) {
+        lua_pushvalue(L, i);
+    }
+    lua_xmove(L, co, narg + 1);
+
+    // the task inherits the context of the current coroutine
+    lc_pushcontext(L, L);
+    lc_setcontext(L, co);
+
+    lc_wakeup(co, narg + 1, LC_PRIO_NORMAL);
+    return 1;
+}
+
+static void lcore_gather_timeout_cb(app_timer_ref timer, void *context) {
+    lcore_gather_ctx *ctx = context;
+    ctx->timer = NULL;
+    if (!ctx->co) {
+        return;
+    }
+    ctx->timeout = true;
+    lcore_gather_wakeup(ctx, LC_PRIO_LOW);
+}
+
+static int finishgather(lua_State *L, int status, lua_KContext extra) {
+    // stack <tasks, deadline, ctx>
+    lcore_gather_ctx *ctx = lua_touserdata(L, 3);
+    if (ctx && ctx->timeout) {
+        lua_pushboolean(L, false);
+        lua_pushliteral(L, "timeout");
+        return 2;
+    }
+
+    int n = luaL_len(L, 1);
+    lua_createtable(L, n, 0);
+    for (int i = 1; i <= n; i++) {
+        lua_rawgeti(L, 1, i);
+        HAPAssert(lua_getiuservalue(L, -1, 1) == LUA_TTABLE);
+        lua_rawseti(L, -3, i);
+        lua_pop(L, 1);
+    }
+    return 1;
+}
+
+static int lcore_gather(lua_State *L) {
+    luaL_checktype(L, 1, LUA_TTABLE);
+    lua_Integer deadline = luaL_optinteger(L, 2, 0);
+    luaL_argcheck(L, deadline >= 0, 2, "deadline out of range");
+    bool has_deadline = !lua_isnoneornil(L, 2);
+    lua_settop(L, 2);
+
+    int n = luaL_len(L, 1);
+    int remaining = 0;
+    for (int i = 1; i <= n; i++) {
+        lua_rawgeti(L, 1, i);
+        lcore_task *task = luaL_testudata(L, -1, LUA_TASK_NAME);
+        if (luai_unlikely(!task)) {
+            luaL_error(L, "bad element #%d (task expected, got %s)", i, luaL_typename(L, -1));
+        }
+        if (!task->done) {
+            remaining++;
+        }
+        lua_pop(L, 1);
+    }
+
+    if (remaining == 0) {
+        lua_pushnil(L);
+        return finishgather(L, LUA_OK, 0);
+    }
+
+    if (has_deadline && (HAPTime)deadline <= HAPPlatformClockGetCurrent()) {
+        lua_pushboolean(L, false);
+        lua_pushliteral(L, "timeout");
+        return 2;
+    }
+
+    lcore_gather_ctx *ctx = lua_newuserdatauv(L, sizeof(*ctx), 0);
+    int ctx_idx = lua_gettop(L);
+    ctx->co = L;
+    ctx->timer = NULL;
+    ctx->remaining = remaining;
+    ctx->timeout = false;
+    for (int i = 1; i <= n; i++) {
+        lua_rawgeti(L, 1, i);
+        lcore_task *task = lua_touserdata(L, -1);
+        if (!task->done) {
+            if (lua_getiuservalue(L, -1, 2) == LUA_TNIL) {
+                lua_pop(L, 1);
+                lua_createtable(L, 1, 0);
+                lua_pushvalue(L, -1);
+                lua_setiuservalue(L, -3, 2);
+            }
+            lua_pushvalue(L, ctx_idx);
+            lua_rawseti(L, -2, luaL_len(L, -2) + 1);
+            lua_pop(L, 1);
+        }
+        lua_pop(L, 1);
+    }
+    lua_pushvalue(L, ctx_idx);
+    lua_rawsetp(L, LUA_REGISTRYINDEX, ctx);
+    if (has_deadline) {
+        if (luai_unlikely(app_timer_register(&ctx->timer,
+            deadline, lcore_gather_timeout_cb, ctx) != kHAPError_None)) {
+            ctx->co = NULL;
+            lua_pushnil(L);
+            lua_rawsetp(L, LUA_REGISTRYINDEX, ctx);
+            luaL_error(L, "failed to create a timer");
+        }
+    }
+    return lua_yieldk(L, 0, 0, finishgather);
+}
+
+static int lcore_task_tostring(lua_State *L) {
+    lcore_task *task = luaL_checkudata(L, 1, LUA_TASK_NAME);
+    lua_pushfstring(L, task->done ? "task (%p, done)" : "task (%p)", task);
+    return 1;
+}
+
+static int lcore_task_done(lua_State *L) {
+    lcore_task *task = luaL_checkudata(L, 1, LUA_TASK_NAME);
+    lua_pushboolean(L, task->done);
+    return 1;
+}
+
+/*
+ * metamethods for task object
+ */
+static const luaL_Reg lcore_task_metameth[] = {
+    {"__index", NULL},  /* place holder */
+    {"__tostring", lcore_task_tostring},
+    {NULL, NULL}
+};
+
+/*
+ * methods for task object
+ */
+static const luaL_Reg lcore_task_meth[] = {
+    {"done", lcore_task_done},
+    {NULL, NULL},
+};
+
+static void lcore_task_createmeta(lua_State *L) {
+    luaL_newmetatable(L, LUA_TASK_NAME);  /* metatable for task object */
+    luaL_setfuncs(L, lcore_task_metameth, 0);  /* add metamethods to new metatable */
+    luaL_newlibtable(L, lcore_task_meth);  /* create method table */
+    luaL_setfuncs(L, lcore_task_meth, 0);  /* add task object methods to method table */
+    lua_setfield(L, -2, "__index");  /* metatable.__index = method table */
+    lua_pop(L, 1);  /* pop metatable */
+}
+
+static int lcore_create_context(lua_State *L) {
+    lua_Integer deadline = luaL_optinteger(L, 1, 0);
+    luaL_argcheck(L, deadline >= 0, 1, "deadline out of range");
+
+    lc_newcontext(L, deadline);
+    return 1;
+}
+
+static int lcore_get_context(lua_State *L) {
+    lc_pushcontext(L, L);
+    return 1;
+}
+
+static int lcore_set_context(lua_State *L) {
+    if (!lua_isnoneornil(L, 1)) {
+        luaL_checkudata(L, 1, LC_CONTEXT_NAME);
+    }
+    lua_settop(L, 1);
+    lc_setcontext(L, L);
+    return 0;
+}
+
+static int lcore_context_cancel(lua_State *L) {
+    lc_context *ctx = luaL_checkudata(L, 1, LC_CONTEXT_NAME);
+    lc_cancelcontext(L, ctx, LC_CONTEXT_CANCELLED);
+    return 0;
+}
+
+static int lcore_context_err(lua_State *L) {
+    lc_context *ctx = luaL_checkudata(L, 1, LC_CONTEXT_NAME);
+    const char *err = lc_context_strerror(ctx->state);
+    if (err) {
+        lua_pushstring(L, err);
+    } else {
+        lua_pushnil(L);
+    }
+    return 1;
+}
+
+static int lcore_context_tostring(lua_State *L) {
+    lc_context *ctx = luaL_checkudata(L, 1, LC_CONTEXT_NAME);
+    lua_pushfstring(L, "context (%p)", ctx);
+    return 1;
+}
+
+/*
+ * metamethods for context object
+ */
+static const luaL_Reg lcore_context_metameth[] = {
+    {"__index", NULL},  /* place holder */
+    {"__tostring", lcore_context_tostring},
+    {NULL, NULL}
+};
+
+/*
+ * methods for context object
+ */
+static const luaL_Reg lcore_context_meth[] = {
+    {"cancel", lcore_context_cancel},
+    {"err", lcore_context_err},
+    {NULL, NULL},
+};
+
+static void lcore_context_createmeta(lua_State *L) {
+    luaL_newmetatable(L, LC_CONTEXT_NAME);  /* metatable for context object */
+    luaL_setfuncs(L, lcore_context_metameth, 0);  /* add metamethods to new metatable */
+    luaL_newlibtable(L, lcore_context_meth);  /* create method table */
+    luaL_setfuncs(L, lcore_context_meth, 0);  /* add context object methods to method table */
+    lua_setfield(L, -2, "__index");  /* metatable.__index = method table */
+    lua_pop(L, 1);  /* pop metatable */
+}
+
+/**
+ * Operations run by core.offload().
+ */
+typedef enum {
+    LCORE_OFFLOAD_HASH,
+    LCORE_OFFLOAD_CIPHER,
+    LCORE_OFFLOAD_BASE64_ENCODE,
+    LCORE_OFFLOAD_BASE64_DECODE,
+} lcore_offload_op;
+
+static const char *lcore_offload_op_strs[] = {
+    "hash",
+    "cipher",
+    "base64encode",
+    "base64decode",
+    NULL,
+};
+
+/**
+ * Job of core.offload().
+ *
+ * The job is anchored in the registry until it is done, even if the wait
+ * is cancelled, the input string is kept in the uservalue.
+ * Only the worker touches the job between submitting and done.
+ */
+typedef struct {
+    lc_wait wait;
+    lcore_offload_op op;
+    bool inited;            /* whether the md/cipher context is initialized */
+    bool ok;
+    lua_State *mL;
+    lua_State *co;          /* NULL if the wait is done or cancelled */
+    union {
+        pal_md_ctx md;
+        pal_cipher_ctx cipher;
+    } ctx;
+    const char *in;
+    size_t inlen;
+    char *out;
+    size_t outcap;
+    size_t outlen;
+} lcore_offload_job;
+
+static void lcore_offload_run(void *arg) {
+    lcore_offload_job *job = arg;
+    switch (job->op) {
+    case LCORE_OFFLOAD_HASH:
+        job->ok = pal_md_update(&job->ctx.md, job->in, job->inlen) &&
+            pal_md_digest(&job->ctx.md, (uint8_t *)job->out);
+        job->outlen = pal_md_get_size(&job->ctx.md);
+        break;
+    case LCORE_OFFLOAD_CIPHER: {
+        size_t outlen = job->outcap;
+        job->ok = pal_cipher_update(&job->ctx.cipher, job->in, job->inlen, job->out, &outlen);
+        if (job->ok) {
+            size_t finlen = job->outcap - outlen;
+            job->ok = pal_cipher_finish(&job->ctx.cipher, job->out + outlen, &finlen);
+            job->outlen = outlen + finlen;
+        }
+    } break;
+    case LCORE_OFFLOAD_BASE64_ENCODE:
+        util_base64_encode(job->in, job->inlen, job->out, job->outcap, &job->outlen);
+        job->ok = true;
+        break;
+    case LCORE_OFFLOAD_BASE64_DECODE:
+        job->ok = util_base64_decode(job->in, job->inlen,
+            job->out, job->outcap, &job->outlen) == kHAPError_None;
+        break;
+    }
+}
+
+static int lcore_offload_done_pcall(lua_State *L) {
+    lcore_offload_job *job = lua_touserdata(L, 1);
+    bool cancelled = lua_toboolean(L, 2);
+
+    // keep the job in the stack until the result is pushed
+    HAPAssert(lua_rawgetp(L, LUA_REGISTRYINDEX, job) == LUA_TUSERDATA);
+    lua_pushnil(L);
+    lua_rawsetp(L, LUA_REGISTRYINDEX, job);
+
+    lua_State *co = job->co;
+    if (!co) {
+        return 0;
+    }
+    job->co = NULL;
+    lc_wait_remove(&job->wait);
+    if (cancelled) {
+        lcore_wakeup_cancelled(co, LC_CONTEXT_CANCELLED);
+        return 0;
+    }
+    lua_pushboolean(L, job->ok);
+    if (job->ok) {
+        lua_pushlstring(L, job->out, job->outlen);
+    } else {
+        lua_pushfstring(L, "failed to %s", lcore_offload_op_strs[job->op]);
+    }
+    lua_xmove(L, co, 2);
+    lc_wakeup(co, 2, LC_PRIO_NORMAL);
+    return 0;
+}
+
+static void lcore_offload_done(void *arg, bool cancelled) {
+    lcore_offload_job *job = arg;
+    lua_State *L = job->mL;
+
+    HAPAssert(lua_gettop(L) == 0);
+    lua_pushcfunction(L, lcore_offload_done_pcall);
+    lua_pushlightuserdata(L, job);
+    lua_pushboolean(L, cancelled);
+    int status = lua_pcall(L, 2, 0, 0);
+    if (luai_unlikely(status != LUA_OK)) {
+        HAPLogError(&lcore_log, "%s: %s", __func__, lua_tostring(L, -1));
+    }
+    lua_settop(L, 0);
+    lc_collectgarbage(L);
+}
+
+static void lcore_offload_cancel(lua_State *L, lc_wait *wait, lc_context_state state) {
+    lcore_offload_job *job = (lcore_offload_job *)wait;
+    lua_State *co = job->co;
+    job->co = NULL;
+    lcore_wakeup_cancelled(co, state);
+}
+
+static int finishoffload(lua_State *L, int status, lua_KContext extra) {
+    lcore_checkcancelled(L);
+    if (!lua_toboolean(L, -2)) {
+        lua_error(L);
+    }
+    return 1;
+}
+
+static void lcore_offload_init_cipher(lua_State *L, lcore_offload_job *job, int *input_idx) {
+    pal_cipher_type type = luaL_checkoption(L, 2, NULL, lcipher_type_strs);
+    pal_cipher_operation op = luaL_checkoption(L, 3, NULL, lcipher_op_strs);
+    size_t keylen;
+    const char *key = luaL_checklstring(L, 4, &keylen);
+    if (luai_unlikely(!pal_cipher_ctx_init(&job->ctx.cipher, type))) {
+        luaL_error(L, "failed to create a %s cipher", lcipher_type_strs[type]);
+    }
+    job->inited = true;
+    if (pal_cipher_get_key_len(&job->ctx.cipher) != keylen) {
+        luaL_error(L, "invalid key length");
+    }
+
+    *input_idx = 5;
+    const char *iv = NULL;
+    size_t ivlen = 0;
+    size_t iv_expected_len = pal_cipher_get_iv_len(&job->ctx.cipher);
+    if (iv_expected_len != 0) {
+        iv = luaL_checklstring(L, 5, &ivlen);
+        if (iv_expected_len != ivlen) {
+            luaL_error(L, "invalid IV length");
+        }
+        *input_idx = 6;
+    }
+    luaL_checkstring(L, *input_idx);
+
+    if (luai_unlikely(!pal_cipher_begin(&job->ctx.cipher, op,
+        (const uint8_t *)key, (const uint8_t *)iv))) {
+        luaL_error(L, "failed to begin a %s process", lcipher_op_strs[op]);
+    }
+}
+
+static int lcore_offload(lua_State *L) {
+    lcore_offload_op op = luaL_checkoption(L, 1, NULL, lcore_offload_op_strs);
+
+    lcore_offload_job *job = lua_newuserdatauv(L, sizeof(*job), 1);
+    int job_idx = lua_gettop(L);
+    job->op = op;
+    job->inited = false;
+    job->ok = false;
+    job->mL = lc_getmainthread(L);
+    job->co = NULL;
+    job->out = NULL;
+    job->outlen = 0;
+    luaL_setmetatable(L, LUA_OFFLOAD_JOB_NAME);
+
+    int input_idx = 2;
+    switch (op) {
+    case LCORE_OFFLOAD_HASH: {
+        pal_md_type type = luaL_checkoption(L, 2, NULL, lhash_type_strs);
+        luaL_checkstring(L, 3);
+        size_t keylen = 0;
+        const char *key = luaL_optlstring(L, 4, NULL, &keylen);
+        if (luai_unlikely(!pal_md_ctx_init(&job->ctx.md, type, key, keylen))) {
+            luaL_error(L, "failed to create a %s context", lhash_type_strs[type]);
+        }
+        job->inited = true;
+        input_idx = 3;
+    } break;
+    case LCORE_OFFLOAD_CIPHER:
+        lcore_offload_init_cipher(L, job, &input_idx);
+        break;
+    default:
+        break;
+    }
+    job->in = luaL_checklstring(L, input_idx, &job->inlen);
+    lua_pushvalue(L, input_idx);
+    lua_setiuservalue(L, job_idx, 1);
+
+    switch (op) {
+    case LCORE_OFFLOAD_HASH:
+        job->outcap = pal_md_get_size(&job->ctx.md);
+        break;
+    case LCORE_OFFLOAD_CIPHER: {
+        size_t blocksize = pal_cipher_get_block_size(&job->ctx.cipher);
+        if (luai_unlikely(blocksize > ((~(size_t)0) - job->inlen) / 2)) {
+            luaL_error(L, "result too large");
+        }
+        job->outcap = job->inlen + blocksize * 2;
+    } break;
+    case LCORE_OFFLOAD_BASE64_ENCODE:
+        job->outcap = util_base64_encoded_len(job->inlen);
+        break;
+    case LCORE_OFFLOAD_BASE64_DECODE:
+        job->outcap = job->inlen;
+        break;
+    }
+    job->out = pal_mem_alloc(job->outcap ? job->outcap : 1);
+    if (luai_unlikely(!job->out)) {
+        luaL_error(L, "failed to alloc memory");
+    }
+
+    lc_context_state state = lc_wait_add(L, &job->wait, lcore_offload_cancel);
+    if (luai_unlikely(state != LC_CONTEXT_ACTIVE)) {
+        luaL_error(L, "%s", lc_context_strerror(state));
+    }
+    lua_pushvalue(L, job_idx);
+    lua_rawsetp(L, LUA_REGISTRYINDEX, job);
+    if (luai_unlikely(!pal_worker_submit(lcore_offload_run, lcore_offload_done, job))) {
+        lua_pushnil(L);
+        lua_rawsetp(L, LUA_REGISTRYINDEX, job);
+        lc_wait_remove(&job->wait);
+        luaL_error(L, "failed to submit the job");
+    }
+    job->co = L;
+
+    // the job is kept in the stack until the coroutine is resumed
+    return lua_yieldk(L, 0, 0, finishoffload);
+}
+
+static int lcore_offload_job_gc(lua_State *L) {
+    lcore_offload_job *job = luaL_checkudata(L, 1, LUA_OFFLOAD_JOB_NAME);
+    if (job->inited) {
+        switch (job->op) {
+        case LCORE_OFFLOAD_HASH:
+            pal_md_ctx_deinit(&job->ctx.md);
+            break;
+        case LCORE_OFFLOAD_CIPHER:
+            pal_cipher_ctx_deinit(&job->ctx.cipher);
+            break;
+        default:
+            break;
+        }
+        job->inited = false;
+    }
+    if (job->out) {
+        pal_mem_free(job->out);
+        job->out = NULL;
+    }
+    return 0;
+}
+
+/*
+ * metamethods for offload job
+ */
+static const luaL_Reg lcore_offload_job_metameth[] = {
+    {"__gc", lcore_offload_job_gc},
+    {NULL, NULL}
+};
+
+static void lcore_offload_job_createmeta(lua_State *L) {
+    luaL_newmetatable(L, LUA_OFFLOAD_JOB_NAME);  /* metatable for offload job */
+    luaL_setfuncs(L, lcore_offload_job_metameth, 0);  /* add metamethods to new metatable */
+    lua_pop(L, 1);  /* pop metatable */
+}
+
 static const luaL_Reg lcore_funcs[] = {
     {"time", lcore_time},
     {"exit", lcore_exit},
@@ -581,6 +1856,21 @@ static const luaL_Reg lcore_funcs[] = {
     {"sleep", lcore_sleep},
     {"createTimer", lcore_create_timer},
     {"createMQ", lcore_create_mq},
+    {"getTimerStats", lcore_get_timer_stats},
+    {"getSchedulerStats", lcore_get_scheduler_stats},
+    {"configureGC", lcore_configure_gc},
+    {"getGCStats", lcore_get_gc_stats},
+    {"memstats", lcore_memstats},
+    {"createMemTag", lcore_create_mem_tag},
+    {"setMemTag", lcore_set_mem_tag},
+    {"getMemTag", lcore_get_mem_tag},
+    {"select", lcore_select},
+    {"spawn", lcore_spawn},
+    {"gather", lcore_gather},
+    {"createContext", lcore_create_context},
+    {"getContext", lcore_get_context},
+    {"setContext", lcore_set_context},
+    {"offload", lcore_offload},
     {NULL, NULL},
 };
 
@@ -588,5 +1878,8 @@ LUAMOD_API int luaopen_core(lua_State *L) {
     luaL_newlib(L, lcore_funcs);
     lcore_timer_createmeta(L);
     lcore_mq_createmeta(L);
+    lcore_task_createmeta(L);
+    lcore_context_createmeta(L);
+    lcore_offload_job_createmeta(L);
     return 1;
 }
@@ -23,9 +23,10 @@ static const HAPLogObject ldns_log = {
 };
 
 typedef struct ldns_resolve_context {
+    lc_wait wait;
     lua_State *co;
     pal_dns_req_ctx *req;
-    HAPPlatformTimerRef timer;
+    app_timer_ref timer;
 } ldns_resolve_context;
 
 static int ldns_response(lua_State *L) {
@@ -60,8 +61,9 @@ void ldns_response_cb(pal_err err, const char *addr, pal_net_addr_family af, voi
     lua_State *L = lc_getmainthread(co);
 
     if (ctx->timer) {
-        HAPPlatformTimerDeregister(ctx->timer);
+        app_timer_deregister(ctx->timer);
     }
+    lc_wait_remove(&ctx->wait);
 
     HAPAssert(lua_gettop(L) == 0);
 
@@ -80,13 +82,24 @@ void ldns_response_cb(pal_err err, const char *addr, pal_net_addr_family af, voi
     lc_collectgarbage(L);
 }
 
-static void ldns_timeout_timer_cb(HAPPlatformTimerRef timer, void *context) {
+static void ldns_timeout_timer_cb(app_timer_ref timer, void *context) {
     ldns_resolve_context *ctx = context;
-    ctx->timer = 0;
+    ctx->timer = NULL;
     pal_dns_cancel_request(ctx->req);
     ldns_response_cb(PAL_ERR_TIMEOUT, NULL, PAL_NET_ADDR_FAMILY_UNSPEC, ctx);
 }
 
+static void ldns_resolve_cancel(lua_State *L, lc_wait *wait, lc_context_state state) {
+    ldns_resolve_context *ctx = (ldns_resolve_context *)wait;
+    if (ctx->timer) {
+        app_timer_deregister(ctx->timer);
+        ctx->timer = NULL;
+    }
+    pal_dns_cancel_request(ctx->req);
+    lua_pushstring(ctx->co, lc_context_strerror(state));
+    lc_wakeup(ctx->co, 1, LC_PRIO_NORMAL);
+}
+
 static int finishresolve(lua_State *L, int status, lua_KContext extra) {
     if (lua_isstring(L, -1)) {
         lua_error(L);
@@ -102,14 +115,20 @@ static int ldns_resolve(lua_State *L) {
     pal_net_addr_family af = luaL_checkoption(L, 3, "", ldns_family_strs);
 
     ldns_resolve_context *ctx = lua_newuserdata(L, sizeof(*ctx));
-    if (luai_unlikely(HAPPlatformTimerRegister(&ctx->timer,
+    lc_context_state state = lc_wait_add(L, &ctx->wait, ldns_resolve_cancel);
+    if (luai_unlikely(state != LC_CONTEXT_ACTIVE)) {
+        luaL_error(L, "%s", lc_context_strerror(state));
+    }
+    if (luai_unlikely(app_timer_register(&ctx->timer,
         HAPPlatformClockGetCurrent() + timeout,
         ldns_timeout_timer_cb, ctx) != kHAPError_None)) {
+        lc_wait_remove(&ctx->wait);
         luaL_error(L, "failed to create a timeout timer");
     }
     ctx->req = pal_dns_start_request(hostname, af, ldns_response_cb, ctx);
     if (luai_unlikely(!ctx->req)) {
-        HAPPlatformTimerDeregister(ctx->timer);
+        app_timer_deregister(ctx->timer);
+        lc_wait_remove(&ctx->wait);
         luaL_error(L, "failed to start DNS resolution request");
     }
     ctx->co = L;
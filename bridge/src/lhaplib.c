@@ -4,6 +4,7 @@
 // you may not use this file except in compliance with the License.
 // See [CONTRIBUTORS.md] for the list of homekit-bridge project authors.
 
+#include <stdlib.h>
 #include <lualib.h>
 #include <lauxlib.h>
 #include <pal/hap.h>
@@ -12,11 +13,24 @@
 #include <HAP.h>
 #include <HAPCharacteristic.h>
 #include <HAPAccessorySetup.h>
+#include <HAPAccessoryServer+Internal.h>
 
 #include "app_int.h"
 #include "lc.h"
 
 #define LHAP_READ_REQUESTS_MAX 32
+#define LHAP_ACC_READ_REQUESTS_MAX 4    /* default in-flight reads of an accessory */
+#define LHAP_READ_QUEUE_MAX 128         /* default queued reads */
+#define LHAP_READ_DEADLINE 5000         /* default milliseconds a read may wait in the queue */
+#define LHAP_READ_HIST_NUM 8            /* number of the histogram buckets */
+#define LHAP_EVENTS_MAX 32              /* events coalesced in a window */
+#define LHAP_EVENT_WINDOW 5             /* default milliseconds to coalesce the events */
+
+#ifdef CONFIG_HAP_LOOPBACK
+#define LHAP_LOOPBACK_SESSIONS 4        /* sessions of the loopback server */
+#define LHAP_LOOPBACK_RESPONSES_MAX 64  /* responses kept by the loopback server */
+#define LHAP_LOOPBACK_STR_MAX 64        /* bytes of a string value kept by the loopback server */
+#endif
 
 #define lhap_optfunction(L, n) luaL_opt(L, lhap_checkfunction, n, false)
 #define lhap_optarray(L, n) luaL_opt(L, lhap_checkarray, n, 0)
@@ -24,7 +38,17 @@
 #define LHAP_ACCESSORY_NAME "HAPAccessory*"
 #define LHAP_SERVICE_NAME "HAPService*"
 #define LHAP_CHARACTERISTIC_NAME "HAPCharacteristic*"
+#define LHAP_CHAR_PROTOTYPE_NAME "HAPCharacteristicPrototype*"
+#define LHAP_REQUEST_NAME "HAPRequest*"
 #define LHAP_NVS_NAMESPACE "bridge::lhaplib"
+#define LHAP_SESSION_CONTEXTS "_SESSION_CONTEXTS"
+#define LHAP_ACCESSORIES "_ACCESSORIES"
+
+// Time in milliseconds the value pushed by hap.updateValue() answers reads, if the cache is disabled.
+#define LHAP_CACHE_PUSHED_TTL 1000
+
+// Round up the size of a structure followed by an extension.
+#define LHAP_ALIGN_UP(size) (((size) + sizeof(uint64_t) - 1) / sizeof(uint64_t) * sizeof(uint64_t))
 
 /**
  * Default number of services and characteristics contained in the accessory.
@@ -34,10 +58,19 @@
 #define LHAP_CHAR_WRITE_CNT_DFT ((size_t) 2)
 #define LHAP_CHAR_NOTIFY_CNT_DFT ((size_t) 0)
 
+// The IP sessions take at most 1/4 of the free heap at start,
+// a session keeps at least 16 characteristic contexts and a slot for every event notification.
+#define LHAP_IP_SESSIONS_MEM_DIV 4
+#define LHAP_IP_CHARS_MIN ((size_t) 16)
+
+// Idle IP sessions kept allocated by default, the sessions grow after a connection is accepted,
+// so the reserve takes the connections accepted before that.
+#define LHAP_IP_SESSIONS_RESERVE ((size_t) 2)
+
 /**
- * Default maxium number of bridged accessories.
+ * Maxium number of bridged accessories, a bridge has at most 150 accessories including itself.
  */
-#define LHAP_BRIDGED_ACCS_MAX_CNT_DFT ((size_t) 10)
+#define LHAP_BRIDGED_ACCS_MAX ((size_t) 149)
 
 /**
  * IID constants.
@@ -410,6 +443,9 @@ const HAPService pairingService = {
 
 #define LHAP_BRIDGED_ACCESSORY_IID_DFT 2
 
+// Number of instance IDs reserved in NVS at once, the unused ones are skipped after a reboot.
+#define LHAP_IID_RESERVE_NUM 64
+
 #define LHAP_CASE_CHAR_FORMAT_CODE(format, ptr, code) \
     case kHAPCharacteristicFormat_ ## format: \
         { HAP ## format ## Characteristic *p = (HAP ## format ## Characteristic *)ptr; code; } break;
@@ -710,6 +746,9 @@ static const struct lhap_char_integer_val_range {
 };
 
 typedef struct lhap_desc lhap_desc;
+#ifdef CONFIG_HAP_LOOPBACK
+typedef struct lhap_loopback lhap_loopback;
+#endif
 
 typedef struct lhap_read_request {
     lhap_desc *desc;
@@ -719,16 +758,85 @@ typedef struct lhap_read_request {
     const HAPService *service;
     const HAPBaseCharacteristic *characteristic;
     const void *pfunc;
+    HAPTime queued;             /* time when the read is queued */
     struct lhap_read_request *next;
 } lhap_read_request;
 
+/**
+ * Extension of an accessory, placed after the accessory structure.
+ *
+ * The readMany callback is kept in the registry with the extension as the key.
+ */
+typedef struct lhap_accessory_ext {
+    const HAPAccessory *accessory;
+    bool has_read_many;
+    bool served;                        /* the accessory is served by the server */
+    size_t num_reads;                   /* number of the reads batched in this server turn */
+    lhap_read_request *reads_head;
+    lhap_read_request **reads_ptail;
+    struct lhap_accessory_ext *next;    /* next accessory with batched reads */
+
+    size_t num_in_flight;               /* reads running the read callbacks */
+    size_t num_queued;                  /* reads waiting for the scheduler */
+    lhap_read_request *queue_head;
+    lhap_read_request **queue_ptail;
+    struct lhap_accessory_ext *sched_next;  /* next accessory in the round-robin list */
+} lhap_accessory_ext;
+
+/**
+ * Reads passed to a readMany callback.
+ */
+typedef struct lhap_read_batch {
+    lhap_desc *desc;
+    const HAPAccessory *accessory;
+    uint32_t generation;        /* generation of the server when the readMany call starts */
+    size_t num;
+    lhap_read_request reads[];
+} lhap_read_batch;
+
+/**
+ * Event waiting for the coalescing window, a NULL session means all sessions.
+ */
+typedef struct lhap_event {
+    uint64_t aid;
+    uint64_t sid;
+    uint64_t cid;
+    HAPSessionRef *session;
+} lhap_event;
+
+/**
+ * Entry of the attribute index, sorted by (aid, iid).
+ */
+typedef struct lhap_attr {
+    uint64_t aid;
+    uint64_t iid;
+    const HAPService *service;
+    const HAPBaseCharacteristic *characteristic;
+} lhap_attr;
+
+/**
+ * Range of the reserved instance IDs, [next, end).
+ */
+typedef struct lhap_iid_range {
+    uint64_t next;
+    uint64_t end;
+} lhap_iid_range;
+
 typedef struct lhap_desc {
     bool started;
+    uint32_t generation;        /* increased when the server is released */
 
     HAPAccessory *primary_acc;
-    HAPAccessory **bridged_accs;
+    HAPAccessory **bridged_accs;    /* replaced in place by hap.reconfigure() */
     size_t num_bridged_accs;
 
+    lhap_attr *attrs;           /* index of the characteristics created by lhap_new_char() */
+    size_t num_attrs;
+
+    // Instance IDs are allocated from the ranges reserved in NVS,
+    // index 0 is for the services and characteristics, 1 is for the bridged accessories.
+    lhap_iid_range iid_ranges[2];
+
     lua_State *mL;
     lua_State *co;
     HAPPlatform platform;
@@ -736,15 +844,95 @@ typedef struct lhap_desc {
     HAPAccessoryServerOptions server_options;
     HAPAccessoryServerCallbacks server_cbs;
 
-    HAPPlatformTimerRef read_requests_timer;
-    lhap_read_request *read_requests_head;
-    lhap_read_request **read_requests_ptail;
+    // Reads over the limits are queued per accessory,
+    // the accessories with queued reads are served in round-robin.
+    app_timer_ref read_sched_timer;
+    HAPTime read_sched_deadline;
+    lhap_accessory_ext *sched_head;
+    lhap_accessory_ext **sched_ptail;
     size_t num_read_requests;
     size_t max_read_requests;
+    size_t max_acc_read_requests;
+    size_t num_queued_reads;
+    size_t max_queued_reads;
+    HAPTime read_deadline;      /* 0 means no deadline */
+    size_t reads_dispatched;    /* queued reads dispatched */
+    size_t reads_rejected;      /* reads rejected for the full queue */
+    size_t reads_expired;       /* queued reads failed for the deadline */
+    size_t read_depth_hist[LHAP_READ_HIST_NUM];
+    size_t read_wait_hist[LHAP_READ_HIST_NUM];
+
+    lhap_read_request *free_read_requests;  /* pool of the read requests */
+    size_t num_free_read_requests;
+    size_t read_request_allocs; /* read requests allocated when the pool is empty */
+
+    lhap_read_request *read_waiters;    /* reads waiting for the same read in flight */
+    size_t reads_collapsed;
+
+    lhap_accessory_ext *read_batches;   /* accessories with batched reads */
+    bool read_batches_scheduled;
+    size_t num_batched_reads;   /* reads waiting for the readMany calls */
+    size_t reads_batched;
+    size_t read_many_calls;
+    size_t reads_handled;       /* reads dispatched to Lua */
+    size_t read_allocs;         /* Lua allocations while dispatching the reads */
+    size_t read_alloc_bytes;
+
+    // Events raised in the window are de-duplicated and raised in one run loop turn.
+    app_timer_ref event_timer;
+    HAPTime event_window;       /* 0 means raising the events at once */
+    size_t num_events;
+    lhap_event events[LHAP_EVENTS_MAX];
+    size_t events_raised;       /* events raised by the bridge */
+    size_t events_delivered;    /* events passed to the accessory server */
+
+    // The buffers of the IP sessions are sized by the characteristics and allocated on demand,
+    // a reserve of idle sessions is kept ahead of the connections.
+    size_t ip_max_sessions;
+    size_t ip_reserve_sessions; /* idle sessions kept allocated to accept the connections */
+    size_t ip_max_contexts;     /* 0 means sizing by the characteristics */
+    size_t ip_max_notify;
+    size_t ip_sized_contexts;   /* contexts the accessories need, before capped by the memory */
+    size_t ip_num_contexts;
+    size_t ip_num_notify;
+    size_t ip_num_active;
+    uint32_t ip_active_slots;   /* bitmap of the sessions in use */
+    void *ip_pool;              /* buffers of the released sessions, linked by their first bytes */
+    size_t ip_num_pooled;
+    size_t ip_peak_sessions;    /* most sessions allocated at once */
+    bool ip_resize_scheduled;
+
+    size_t writes_debounced;    /* writes answered without calling the write callbacks */
+    size_t writes_dispatched;   /* debounced writes passed to the write callbacks */
+
+    HAPTime cache_ttl;          /* default TTL of the value caches */
+    size_t cache_hits;
+    size_t cache_stale_hits;
+    size_t cache_misses;
+    size_t cache_refreshes;
+
+#ifdef CONFIG_HAP_LOOPBACK
+    lhap_loopback *loopback;    /* loopback server of the tests, it replaces the accessory server */
+#endif
 } lhap_desc;
 
 static lhap_desc gv_lhap_desc;
 
+/**
+ * Whether the loopback server of the tests takes the place of the accessory server.
+ */
+static inline bool lhap_is_loopback(const lhap_desc *desc) {
+#ifdef CONFIG_HAP_LOOPBACK
+    return desc->loopback != NULL;
+#else
+    return false;
+#endif
+}
+
+// Upper bounds of the histogram buckets, the last bucket has no bound.
+static const HAPTime lhap_read_depth_bounds[LHAP_READ_HIST_NUM - 1] = {0, 1, 2, 4, 8, 16, 32};
+static const HAPTime lhap_read_wait_bounds[LHAP_READ_HIST_NUM - 1] = {10, 50, 100, 250, 500, 1000, 5000};
+
 static bool lhap_checkfunction(lua_State *L, int arg) {
     luaL_checktype(L, arg, LUA_TFUNCTION);
     return true;
@@ -755,62 +943,228 @@ static size_t lhap_checkarray(lua_State *L, int arg) {
     return lua_rawlen(L, arg);
 }
 
+static lua_Integer lhap_opt_limit(lua_State *L, int idx, const char *k, lua_Integer def, lua_Integer min) {
+    lua_getfield(L, idx, k);
+    lua_Integer v = luaL_optinteger(L, -1, def);
+    if (v < min || v > INT32_MAX) {
+        luaL_error(L, "'%s' out of range", k);
+    }
+    lua_pop(L, 1);
+    return v;
+}
+
+static size_t lhap_ip_session_bytes(const lhap_desc *desc) {
+    return sizeof(HAPIPCharacteristicContextRef) * desc->ip_num_contexts +
+        sizeof(HAPIPEventNotificationRef) * desc->ip_num_notify +
+        PAL_HAP_IP_SESSION_STORAGE_INBOUND_BUFSIZE +
+        PAL_HAP_IP_SESSION_STORAGE_OUTBOUND_BUFSIZE +
+        PAL_HAP_IP_SESSION_STORAGE_SCRATCH_BUFSIZE;
+}
+
+/**
+ * Take the buffers of a session from the pool, or allocate them if the pool is empty.
+ */
+static void *lhap_ip_block_get(lhap_desc *desc) {
+    void *block = desc->ip_pool;
+    if (block) {
+        desc->ip_pool = *(void **)block;
+        desc->ip_num_pooled--;
+        return block;
+    }
+    return pal_mem_alloc(lhap_ip_session_bytes(desc));
+}
+
+/**
+ * Put the buffers of a session back to the pool, the pool holds at most the reserve.
+ */
+static void lhap_ip_block_put(lhap_desc *desc, void *block) {
+    if (desc->ip_num_pooled >= desc->ip_reserve_sessions) {
+        pal_mem_free(block);
+        return;
+    }
+    *(void **)block = desc->ip_pool;
+    desc->ip_pool = block;
+    desc->ip_num_pooled++;
+}
+
+static void lhap_ip_pool_clear(lhap_desc *desc) {
+    while (desc->ip_pool) {
+        void *block = desc->ip_pool;
+        desc->ip_pool = *(void **)block;
+        pal_mem_free(block);
+    }
+    desc->ip_num_pooled = 0;
+}
+
+/**
+ * Lay out the buffers of the session in one block, the contexts go first for the alignment.
+ */
+static bool lhap_ip_session_alloc(lhap_desc *desc, HAPIPSession *session) {
+    char *block = lhap_ip_block_get(desc);
+    if (!block) {
+        return false;
+    }
+    session->contexts = (HAPIPCharacteristicContextRef *)block;
+    session->numContexts = desc->ip_num_contexts;
+    block += sizeof(HAPIPCharacteristicContextRef) * desc->ip_num_contexts;
+    session->eventNotifications = (HAPIPEventNotificationRef *)block;
+    session->numEventNotifications = desc->ip_num_notify;
+    block += sizeof(HAPIPEventNotificationRef) * desc->ip_num_notify;
+    session->inboundBuffer.bytes = block;
+    session->inboundBuffer.numBytes = PAL_HAP_IP_SESSION_STORAGE_INBOUND_BUFSIZE;
+    block += PAL_HAP_IP_SESSION_STORAGE_INBOUND_BUFSIZE;
+    session->outboundBuffer.bytes = block;
+    session->outboundBuffer.numBytes = PAL_HAP_IP_SESSION_STORAGE_OUTBOUND_BUFSIZE;
+    block += PAL_HAP_IP_SESSION_STORAGE_OUTBOUND_BUFSIZE;
+    session->scratchBuffer.bytes = block;
+    session->scratchBuffer.numBytes = PAL_HAP_IP_SESSION_STORAGE_SCRATCH_BUFSIZE;
+    return true;
+}
+
+static void lhap_ip_session_free(lhap_desc *desc, HAPIPSession *session) {
+    lhap_ip_block_put(desc, session->contexts);
+    HAPRawBufferZero(session, sizeof(*session));
+}
+
+/**
+ * Get the index of the IP session containing the HAP session, or -1 if it is not an IP session.
+ */
+static int lhap_ip_session_slot(lhap_desc *desc, HAPSessionRef *session) {
+    HAPIPAccessoryServerStorage *storage = desc->server_options.ip.accessoryServerStorage;
+    if (!storage) {
+        return -1;
+    }
+    for (size_t i = 0; i < storage->numSessions; i++) {
+        if ((char *)session >= (char *)&storage->sessions[i] && (char *)session < (char *)&storage->sessions[i + 1]) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Resize the sessions to keep the reserve of idle sessions.
+ *
+ * The server picks a session among the first numSessions, so the sessions grow
+ * and shrink at the tail, and a tail session in use stops the shrinking.
+ */
+static void lhap_ip_resize(lhap_desc *desc) {
+    HAPIPAccessoryServerStorage *storage = desc->server_options.ip.accessoryServerStorage;
+    while (storage->numSessions < desc->ip_max_sessions &&
+        storage->numSessions - desc->ip_num_active < desc->ip_reserve_sessions) {
+        if (!lhap_ip_session_alloc(desc, &storage->sessions[storage->numSessions])) {
+            HAPLogError(&lhap_log, "%s: Failed to alloc IP session.", __func__);
+            break;
+        }
+        storage->numSessions++;
+    }
+    while (storage->numSessions > 1 &&
+        storage->numSessions - desc->ip_num_active > desc->ip_reserve_sessions &&
+        !(desc->ip_active_slots & (1U << (storage->numSessions - 1)))) {
+        storage->numSessions--;
+        lhap_ip_session_free(desc, &storage->sessions[storage->numSessions]);
+    }
+    desc->ip_peak_sessions = HAPMax(desc->ip_peak_sessions, storage->numSessions);
+}
+
+static void lhap_ip_resize_cb(void *_Nullable context, size_t contextSize) {
+    HAPPrecondition(context);
+    HAPPrecondition(contextSize == sizeof(lhap_desc *));
+    lhap_desc *desc = *(lhap_desc **)context;
+
+    desc->ip_resize_scheduled = false;
+    // The sessions are resized between the callbacks of a running server only.
+    if (!desc->started || !desc->server_options.ip.accessoryServerStorage ||
+        HAPAccessoryServerGetState(&desc->server) != kHAPAccessoryServerState_Running) {
+        return;
+    }
+    lhap_ip_resize(desc);
+}
+
+/**
+ * Schedule a resize of the sessions, the session in the callback of the server is left untouched.
+ */
+static void lhap_ip_schedule_resize(lhap_desc *desc) {
+    if (desc->ip_resize_scheduled) {
+        return;
+    }
+    if (HAPPlatformRunLoopScheduleCallback(lhap_ip_resize_cb, &desc, sizeof(desc)) != kHAPError_None) {
+        HAPLogError(&lhap_log, "%s: Failed to schedule the resize of the IP sessions.", __func__);
+        return;
+    }
+    desc->ip_resize_scheduled = true;
+}
+
+static void lhap_ip_session_accept(lhap_desc *desc, HAPSessionRef *session) {
+    int slot = lhap_ip_session_slot(desc, session);
+    if (slot < 0) {
+        return;
+    }
+    desc->ip_active_slots |= 1U << slot;
+    desc->ip_num_active++;
+    lhap_ip_schedule_resize(desc);
+}
+
+static void lhap_ip_session_invalidate(lhap_desc *desc, HAPSessionRef *session) {
+    int slot = lhap_ip_session_slot(desc, session);
+    if (slot < 0 || !(desc->ip_active_slots & (1U << slot))) {
+        return;
+    }
+    desc->ip_active_slots &= ~(1U << slot);
+    desc->ip_num_active--;
+    lhap_ip_schedule_resize(desc);
+}
+
 static void
-lhap_init_ip(HAPAccessoryServerOptions *options, size_t num_contexts, size_t num_notify) {
-    HAPPrecondition(options);
-    HAPPrecondition(num_contexts);
-    HAPPrecondition(num_notify);
+lhap_init_ip(lhap_desc *desc) {
+    HAPPrecondition(desc);
+    HAPPrecondition(desc->ip_num_contexts);
+    HAPPrecondition(desc->ip_num_notify);
 
     static HAPIPAccessoryServerStorage serverStorage;
 
-    size_t num_sessions = PAL_HAP_IP_SESSION_STORAGE_NUM_ELEMENTS;
-    HAPIPSession *sessions = pal_mem_alloc(sizeof(HAPIPSession) * num_sessions);
+    // The session structures are allocated for the maximum sessions,
+    // the buffers only for the reserve, the others on demand.
+    HAPIPSession *sessions = pal_mem_alloc(sizeof(HAPIPSession) * desc->ip_max_sessions);
     HAPAssert(sessions);
-    char *inbounds = pal_mem_alloc(PAL_HAP_IP_SESSION_STORAGE_INBOUND_BUFSIZE * num_sessions);
-    HAPAssert(inbounds);
-    char *outbounds = pal_mem_alloc(PAL_HAP_IP_SESSION_STORAGE_OUTBOUND_BUFSIZE * num_sessions);
-    HAPAssert(outbounds);
-    char *scratches = pal_mem_alloc(PAL_HAP_IP_SESSION_STORAGE_SCRATCH_BUFSIZE * num_sessions);
-    HAPAssert(scratches);
-    HAPIPCharacteristicContextRef *contexts =
-        pal_mem_alloc(sizeof(HAPIPCharacteristicContextRef) * num_contexts * num_sessions);
-    HAPAssert(contexts);
-    HAPIPEventNotificationRef *eventNotifications =
-        pal_mem_alloc(sizeof(HAPIPEventNotificationRef) * num_notify * num_sessions);
-    HAPAssert(eventNotifications);
-    for (size_t i = 0; i < num_sessions; i++) {
-        sessions[i].inboundBuffer.bytes = inbounds + PAL_HAP_IP_SESSION_STORAGE_INBOUND_BUFSIZE * i;
-        sessions[i].inboundBuffer.numBytes = PAL_HAP_IP_SESSION_STORAGE_INBOUND_BUFSIZE;
-        sessions[i].outboundBuffer.bytes = outbounds + PAL_HAP_IP_SESSION_STORAGE_OUTBOUND_BUFSIZE * i;
-        sessions[i].outboundBuffer.numBytes = PAL_HAP_IP_SESSION_STORAGE_OUTBOUND_BUFSIZE;
-        sessions[i].scratchBuffer.bytes = scratches + PAL_HAP_IP_SESSION_STORAGE_SCRATCH_BUFSIZE * i;
-        sessions[i].scratchBuffer.numBytes = PAL_HAP_IP_SESSION_STORAGE_SCRATCH_BUFSIZE;
-        sessions[i].contexts = contexts + num_contexts * i;
-        sessions[i].numContexts = num_contexts;
-        sessions[i].eventNotifications = eventNotifications + num_notify * i;
-        sessions[i].numEventNotifications = num_notify;
-    }
+    HAPRawBufferZero(sessions, sizeof(HAPIPSession) * desc->ip_max_sessions);
     serverStorage.sessions = sessions;
-    serverStorage.numSessions = num_sessions;
+    serverStorage.numSessions = 0;
+
+    desc->server_options.ip.transport = &kHAPAccessoryServerTransport_IP;
+    desc->server_options.ip.accessoryServerStorage = &serverStorage;
+    desc->ip_num_active = 0;
+    desc->ip_active_slots = 0;
+    desc->ip_peak_sessions = 0;
+    lhap_ip_resize(desc);
+    if (serverStorage.numSessions == 0) {
+        HAPLogError(&lhap_log, "%s: Failed to alloc IP session.", __func__);
+        HAPFatalError();
+    }
 
-    options->ip.transport = &kHAPAccessoryServerTransport_IP;
-    options->ip.accessoryServerStorage = &serverStorage;
+    HAPLogInfo(&lhap_log, "IP session: %zu bytes, %zu of %zu sessions allocated.",
+        lhap_ip_session_bytes(desc), serverStorage.numSessions, desc->ip_max_sessions);
 }
 
 static void
-lhap_deinit_ip(HAPAccessoryServerOptions *options) {
-    HAPPrecondition(options);
-
-    HAPIPAccessoryServerStorage *storage = options->ip.accessoryServerStorage;
-    pal_mem_free(storage->sessions[0].inboundBuffer.bytes);
-    pal_mem_free(storage->sessions[0].outboundBuffer.bytes);
-    pal_mem_free(storage->sessions[0].scratchBuffer.bytes);
-    pal_mem_free(storage->sessions[0].contexts);
-    pal_mem_free(storage->sessions[0].eventNotifications);
+lhap_deinit_ip(lhap_desc *desc) {
+    HAPPrecondition(desc);
+
+    HAPIPAccessoryServerStorage *storage = desc->server_options.ip.accessoryServerStorage;
+    if (!storage) {
+        return;
+    }
+    for (size_t i = 0; i < storage->numSessions; i++) {
+        lhap_ip_session_free(desc, &storage->sessions[i]);
+    }
+    // The buffers of the next server may be sized differently.
+    lhap_ip_pool_clear(desc);
     pal_mem_free(storage->sessions);
     storage->sessions = NULL;
     storage->numSessions = 0;
-    HAPRawBufferZero(options, sizeof(*options));
+    desc->ip_num_active = 0;
+    desc->ip_active_slots = 0;
+    HAPRawBufferZero(&desc->server_options, sizeof(desc->server_options));
 }
 
 static void lhap_rawsetp_reset(lua_State *L, int idx, const void *p) {
@@ -963,8 +1317,25 @@ static const lc_table_kv lhap_char_props_kvs[] = {
     {NULL, LC_TNONE, NULL},
 };
 
+/**
+ * Request passed to the callbacks.
+ *
+ * It is a userdata with fixed layout instead of a table, so it is created by one allocation.
+ */
+typedef struct lhap_request {
+    HAPTransportType transportType;
+    HAPSessionRef *session;
+    bool has_remote;
+    bool remote;
+    bool has_sid;
+    bool has_cid;
+    uint64_t aid;
+    uint64_t sid;
+    uint64_t cid;
+} lhap_request;
+
 static void
-lhap_create_request_table(
+lhap_push_request(
         lua_State *L,
         HAPTransportType transportType,
         HAPSessionRef *session,
@@ -972,29 +1343,47 @@ lhap_create_request_table(
         const HAPAccessory *accessory,
         const HAPService *service,
         const HAPBaseCharacteristic *characteristic) {
-    lua_createtable(L, 0, 2 + (remote ? 1 : 0) + (service ? 1 : 0) + (characteristic ? 1 : 0));
-    lua_pushstring(L, lhap_transport_type_strs[transportType]);
-    lua_setfield(L, -2, "transportType");
-    if (remote) {
-        lua_pushboolean(L, *remote);
-        lua_setfield(L, -2, "remote");
-    }
-    lua_pushlightuserdata(L, session);
-    lua_setfield(L, -2, "session");
-    lua_pushinteger(L, accessory->aid);
-    lua_setfield(L, -2, "aid");
-    if (service) {
-        lua_pushinteger(L, service->iid);
-        lua_setfield(L, -2, "sid");
-    }
-    if (characteristic) {
-        lua_pushinteger(L, characteristic->iid);
-        lua_setfield(L, -2, "cid");
+    lhap_request *request = lua_newuserdatauv(L, sizeof(*request), 0);
+    request->transportType = transportType;
+    request->session = session;
+    request->has_remote = remote != NULL;
+    request->remote = remote ? *remote : false;
+    request->has_sid = service != NULL;
+    request->has_cid = characteristic != NULL;
+    request->aid = accessory->aid;
+    request->sid = service ? service->iid : 0;
+    request->cid = characteristic ? characteristic->iid : 0;
+    luaL_setmetatable(L, LHAP_REQUEST_NAME);
+}
+
+static int lhap_request_index(lua_State *L) {
+    lhap_request *request = luaL_checkudata(L, 1, LHAP_REQUEST_NAME);
+    const char *key = luaL_checkstring(L, 2);
+
+    if (HAPStringAreEqual(key, "aid")) {
+        lua_pushinteger(L, request->aid);
+    } else if (HAPStringAreEqual(key, "sid") && request->has_sid) {
+        lua_pushinteger(L, request->sid);
+    } else if (HAPStringAreEqual(key, "cid") && request->has_cid) {
+        lua_pushinteger(L, request->cid);
+    } else if (HAPStringAreEqual(key, "transportType")) {
+        lua_pushstring(L, lhap_transport_type_strs[request->transportType]);
+    } else if (HAPStringAreEqual(key, "session") && request->session) {
+        lua_pushlightuserdata(L, request->session);
+    } else if (HAPStringAreEqual(key, "remote") && request->has_remote) {
+        lua_pushboolean(L, request->remote);
+    } else {
+        lua_pushnil(L);
     }
+    return 1;
 }
 
 typedef struct lhap_call_context {
     bool in_progress;
+    bool refresh;               /* refresh the value cache, without response */
+    bool debounced;             /* debounced write, it has been answered */
+    uint16_t cache_version;     /* version of the value cache when the call starts */
+    uint32_t generation;        /* generation of the server when the call starts */
     HAPTransportType transportType;
     lhap_desc *desc;
     HAPSessionRef *session;
@@ -1013,6 +1402,75 @@ union lhap_char_value {
     } str;
 };
 
+#ifdef CONFIG_HAP_LOOPBACK
+/**
+ * Response or event recorded by the loopback server.
+ */
+typedef struct lhap_loopback_response {
+    char kind;                  /* 'r' for reads, 'w' for writes, 'e' for events */
+    HAPError err;
+    HAPCharacteristicFormat format;
+    HAPSessionRef *session;     /* NULL for the events of all sessions */
+    uint64_t aid;
+    uint64_t iid;
+    union lhap_char_value value;
+    char str[LHAP_LOOPBACK_STR_MAX];
+} lhap_loopback_response;
+
+/**
+ * Loopback server, it takes the place of the accessory server in the tests.
+ *
+ * The requests are handled in the run loop like the accessory server does,
+ * the responses and the events are recorded instead of being sent.
+ */
+struct lhap_loopback {
+    HAPSessionRef sessions[LHAP_LOOPBACK_SESSIONS];
+    size_t num_resps;
+    lhap_loopback_response resps[LHAP_LOOPBACK_RESPONSES_MAX];
+};
+
+static void lhap_loopback_record(
+        lhap_desc *desc,
+        char kind,
+        HAPSessionRef *session,
+        uint64_t aid,
+        uint64_t iid,
+        HAPCharacteristicFormat format,
+        HAPError err,
+        const union lhap_char_value *val) {
+    lhap_loopback *lb = desc->loopback;
+    if (lb->num_resps == LHAP_LOOPBACK_RESPONSES_MAX) {
+        HAPLogError(&lhap_log, "%s: Too many responses.", __func__);
+        return;
+    }
+    lhap_loopback_response *resp = &lb->resps[lb->num_resps++];
+    HAPRawBufferZero(resp, sizeof(*resp));
+    resp->kind = kind;
+    resp->err = err;
+    resp->format = format;
+    resp->session = session;
+    resp->aid = aid;
+    resp->iid = iid;
+    if (err != kHAPError_None || !val) {
+        return;
+    }
+    resp->value = *val;
+    switch (format) {
+    case kHAPCharacteristicFormat_Data:
+    case kHAPCharacteristicFormat_String:
+    case kHAPCharacteristicFormat_TLV8:
+        resp->value.str.len = HAPMin(val->str.len, sizeof(resp->str));
+        if (resp->value.str.len) {
+            HAPRawBufferCopyBytes(resp->str, val->str.data, resp->value.str.len);
+        }
+        resp->value.str.data = resp->str;
+        break;
+    default:
+        break;
+    }
+}
+#endif
+
 static bool lhap_char_value_is_valid(lua_State *L, int idx, HAPCharacteristicFormat format) {
     bool is_valid = false;
     switch (format) {
@@ -1061,8 +1519,134 @@ lhap_char_value_get(lua_State *L, int idx, HAPCharacteristicFormat format, union
     return valid;
 }
 
+/**
+ * Value cache of a characteristic, placed after the characteristic structure.
+ *
+ * String values are anchored in the registry with the cache as the key.
+ */
+typedef struct lhap_char_cache {
+    int32_t ttl;                /* TTL in milliseconds, negative means the default TTL */
+    bool valid;
+    bool refreshing;
+    bool pushed;                /* the value is pushed by hap.updateValue() */
+    uint16_t version;           /* increased when the value is stored */
+    const HAPAccessory *reading;    /* accessory of the read in flight */
+    HAPTime updated;
+    union lhap_char_value value;
+} lhap_char_cache;
+
+static size_t lhap_char_cache_offset(HAPCharacteristicFormat format) {
+    return LHAP_ALIGN_UP(lhap_characteristic_struct_size[format]);
+}
+
+static lhap_char_cache *lhap_char_get_cache(const HAPBaseCharacteristic *characteristic) {
+    return (lhap_char_cache *)((char *)characteristic + lhap_char_cache_offset(characteristic->format));
+}
+
+/**
+ * Write debounce of a characteristic, placed after the value cache.
+ *
+ * The writes in the window are answered at once, and the latest value is
+ * passed to the write callback when the window closes. The pending value
+ * is kept in the registry with the debounce as the key.
+ */
+typedef struct lhap_char_debounce {
+    uint32_t window;            /* window in milliseconds, 0 disables the debounce */
+    bool running;               /* the write callback is running */
+    bool pending;               /* a value is waiting for the window or the running callback */
+    bool remote;
+    app_timer_ref timer;
+    lhap_desc *desc;
+    HAPTransportType transportType;
+    const HAPAccessory *accessory;
+    const HAPService *service;
+    const HAPBaseCharacteristic *characteristic;
+    const void *pfunc;
+} lhap_char_debounce;
+
+static size_t lhap_char_debounce_offset(HAPCharacteristicFormat format) {
+    return lhap_char_cache_offset(format) + LHAP_ALIGN_UP(sizeof(lhap_char_cache));
+}
+
+static lhap_char_debounce *lhap_char_get_debounce(const HAPBaseCharacteristic *characteristic) {
+    return (lhap_char_debounce *)((char *)characteristic + lhap_char_debounce_offset(characteristic->format));
+}
+
+static HAPTime lhap_char_cache_ttl(const lhap_desc *desc, const lhap_char_cache *cache) {
+    return cache->ttl < 0 ? desc->cache_ttl : (HAPTime)cache->ttl;
+}
+
+static void lhap_char_cache_push(lua_State *L, const HAPBaseCharacteristic *characteristic) {
+    lhap_char_cache *cache = lhap_char_get_cache(characteristic);
+    switch (characteristic->format) {
+    case kHAPCharacteristicFormat_Bool:
+        lua_pushboolean(L, cache->value.boolean);
+        break;
+    case kHAPCharacteristicFormat_Float:
+        lua_pushnumber(L, cache->value.number);
+        break;
+    case kHAPCharacteristicFormat_Data:
+    case kHAPCharacteristicFormat_String:
+    case kHAPCharacteristicFormat_TLV8:
+        lua_rawgetp(L, LUA_REGISTRYINDEX, cache);
+        break;
+    default:
+        lua_pushinteger(L, cache->value.integer);
+        break;
+    }
+}
+
+/**
+ * Store the value at the given index to the cache.
+ *
+ * @return whether the cached value is changed.
+ */
+static bool lhap_char_cache_store(lua_State *L, int idx, const HAPBaseCharacteristic *characteristic) {
+    lhap_char_cache *cache = lhap_char_get_cache(characteristic);
+    idx = lua_absindex(L, idx);
+    union lhap_char_value val;
+    if (!lhap_char_value_get(L, idx, characteristic->format, &val)) {
+        return false;
+    }
+    bool changed = !cache->valid;
+    switch (characteristic->format) {
+    case kHAPCharacteristicFormat_Bool:
+        changed = changed || cache->value.boolean != val.boolean;
+        break;
+    case kHAPCharacteristicFormat_Float:
+        changed = changed || cache->value.number != val.number;
+        break;
+    case kHAPCharacteristicFormat_Data:
+    case kHAPCharacteristicFormat_String:
+    case kHAPCharacteristicFormat_TLV8:
+        if (!changed) {
+            lua_rawgetp(L, LUA_REGISTRYINDEX, cache);
+            changed = !lua_rawequal(L, -1, idx);
+            lua_pop(L, 1);
+        }
+        lua_pushvalue(L, idx);
+        lua_rawsetp(L, LUA_REGISTRYINDEX, cache);
+        break;
+    default:
+        changed = changed || cache->value.integer != val.integer;
+        break;
+    }
+    cache->value = val;
+    cache->valid = true;
+    cache->pushed = false;
+    cache->version++;
+    cache->updated = HAPPlatformClockGetCurrent();
+    return changed;
+}
+
+static void lhap_char_cache_invalidate(const HAPBaseCharacteristic *characteristic) {
+    lhap_char_cache *cache = lhap_char_get_cache(characteristic);
+    cache->valid = false;
+    cache->pushed = false;
+}
+
 static HAPError lhap_char_response_read_request(
-        HAPAccessoryServerRef *server,
+        lhap_desc *desc,
         HAPTransportType transportType,
         HAPSessionRef *session,
         const HAPAccessory *accessory,
@@ -1072,6 +1656,16 @@ static HAPError lhap_char_response_read_request(
         union lhap_char_value *val) {
     HAPPrecondition(err != kHAPError_None || val);
 
+#ifdef CONFIG_HAP_LOOPBACK
+    if (desc->loopback) {
+        lhap_loopback_record(desc, 'r', session, accessory->aid,
+            ((const HAPBaseCharacteristic *)characteristic)->iid,
+            ((const HAPBaseCharacteristic *)characteristic)->format, err, val);
+        return kHAPError_None;
+    }
+#endif
+
+    HAPAccessoryServerRef *server = &desc->server;
     switch (((HAPBaseCharacteristic *)characteristic)->format) {
     case kHAPCharacteristicFormat_Bool:
         err = HAPBoolCharacteristicResponseReadRequest(server, transportType,
@@ -1125,74 +1719,394 @@ static HAPError lhap_char_response_read_request(
     return err;
 }
 
-static void lhap_schedule_read_requests_cb(HAPPlatformTimerRef timer, void* context);
+static lhap_accessory_ext *lhap_accessory_get_ext(const HAPAccessory *accessory) {
+    return (lhap_accessory_ext *)((char *)accessory + LHAP_ALIGN_UP(sizeof(HAPAccessory)));
+}
 
-int lhap_char_handle_read_finish(lua_State *L, int status, lua_KContext _ctx) {
-    lhap_call_context *ctx = (lhap_call_context *)_ctx;
-    lhap_desc *desc = ctx->desc;
-    HAPCharacteristicFormat format = ((HAPBaseCharacteristic *)ctx->characteristic)->format;
-    HAPError err = kHAPError_None;
-    if (status != LUA_OK && status != LUA_YIELD) {
-        HAPLogError(&lhap_log, "%s: %s", __func__, lua_tostring(L, -1));
-        err = kHAPError_Unknown;
-    } else if (!lhap_char_value_is_valid(L, -1, format)) {
-        err = kHAPError_InvalidData;
-    }
-    if (ctx->in_progress == false) {
-        lua_pushinteger(L, err);
-        return 2;
-    }
-    union lhap_char_value val;
-    if (err == kHAPError_None) {
-        int valid = lhap_char_value_get(L, -1, format, &val);
-        if (!valid) {
-            err = kHAPError_InvalidData;
-        }
-    }
-    err = lhap_char_response_read_request(&desc->server, ctx->transportType, ctx->session,
-        ctx->accessory, ctx->service, ctx->characteristic, err, &val);
-    if (err != kHAPError_None) {
-        HAPLogError(&lhap_log, "%s: Failed to response read request, error code: %d.", __func__, err);
-    }
-    desc->num_read_requests--;
-    if (desc->num_read_requests == 0) {
-        if (HAPPlatformTimerRegister(
-                &ctx->desc->read_requests_timer,
-                HAPPlatformClockGetCurrent(),
-                lhap_schedule_read_requests_cb,
-                desc)) {
-            HAPLogError(&lhap_log, "%s: Failed to register schedule read requests timer.", __func__);
-            HAPFatalError();
-        }
+/**
+ * Push the served accessory.
+ *
+ * The served accessories are anchored in the registry by their pointers, the call
+ * contexts keep the accessory they push, so it outlives hap.reconfigure() until the call finishes.
+ */
+static void lhap_push_accessory(lua_State *L, const HAPAccessory *accessory) {
+    lua_getfield(L, LUA_REGISTRYINDEX, LHAP_ACCESSORIES);
+    int type = lua_rawgetp(L, -1, accessory);
+    HAPAssert(type == LUA_TUSERDATA);
+    lua_remove(L, -2);
+}
+
+static void lhap_event_deliver(lhap_desc *desc, uint64_t aid, uint64_t sid, uint64_t cid, HAPSessionRef *session) {
+    desc->events_delivered++;
+#ifdef CONFIG_HAP_LOOPBACK
+    if (desc->loopback) {
+        lhap_loopback_record(desc, 'e', session, aid, cid, 0, kHAPError_None, NULL);
+        return;
     }
-    lua_pushinteger(L, err);
-    return 1;
+#endif
+    HAPAccessoryServerRaiseEventByIID(&desc->server, cid, sid, aid, session);
 }
 
-static int lhap_char_handle_read(lua_State *L) {
-    // stack: <call_ctx, traceback, func, request>
-    lua_KContext call_ctx = (lua_KContext)lua_touserdata(L, 1);
-    int status = lua_pcallk(L, 1, 1, 2, call_ctx, lhap_char_handle_read_finish);
-    return lhap_char_handle_read_finish(L, status, call_ctx);
+static void lhap_event_flush(lhap_desc *desc) {
+    for (size_t i = 0; i < desc->num_events; i++) {
+        lhap_event *e = &desc->events[i];
+        lhap_event_deliver(desc, e->aid, e->sid, e->cid, e->session);
+    }
+    desc->num_events = 0;
 }
 
-static int lhap_char_handle_read_pcall(lua_State *L) {
+static void lhap_event_flush_cb(app_timer_ref timer, void *context) {
+    lhap_desc *desc = context;
+    desc->event_timer = NULL;
+    if (desc->started) {
+        lhap_event_flush(desc);
+    }
+}
+
+/**
+ * Raise an event, it is merged with the same event raised in the window.
+ *
+ * An event for all sessions takes the place of the events for a session,
+ * so a characteristic has one event for all sessions or one event per session.
+ */
+static void lhap_event_raise(lhap_desc *desc, uint64_t aid, uint64_t sid, uint64_t cid, HAPSessionRef *session) {
+    desc->events_raised++;
+    if (desc->event_window == 0) {
+        lhap_event_deliver(desc, aid, sid, cid, session);
+        return;
+    }
+    if (session == NULL) {
+        bool merged = false;
+        size_t n = 0;
+        for (size_t i = 0; i < desc->num_events; i++) {
+            lhap_event *e = &desc->events[i];
+            if (e->aid == aid && e->cid == cid) {
+                if (merged) {
+                    continue;
+                }
+                merged = true;
+                e->session = NULL;
+            }
+            desc->events[n++] = *e;
+        }
+        desc->num_events = n;
+        if (merged) {
+            return;
+        }
+    } else {
+        for (size_t i = 0; i < desc->num_events; i++) {
+            lhap_event *e = &desc->events[i];
+            if (e->aid == aid && e->cid == cid && (e->session == NULL || e->session == session)) {
+                return;
+            }
+        }
+    }
+    if (desc->num_events == LHAP_EVENTS_MAX) {
+        lhap_event_flush(desc);
+    }
+    desc->events[desc->num_events++] = (lhap_event) {
+        .aid = aid,
+        .sid = sid,
+        .cid = cid,
+        .session = session,
+    };
+    if (!desc->event_timer && app_timer_register(&desc->event_timer,
+        HAPPlatformClockGetCurrent() + desc->event_window, lhap_event_flush_cb, desc) != kHAPError_None) {
+        HAPLogError(&lhap_log, "%s: Failed to register event timer.", __func__);
+        lhap_event_flush(desc);
+    }
+}
+
+/**
+ * Drop the events raised for the session, the session is invalidated.
+ */
+static void lhap_event_drop_session(lhap_desc *desc, HAPSessionRef *session) {
+    size_t n = 0;
+    for (size_t i = 0; i < desc->num_events; i++) {
+        if (desc->events[i].session != session) {
+            desc->events[n++] = desc->events[i];
+        }
+    }
+    desc->num_events = n;
+}
+
+/**
+ * Drop the events raised for the accessory, the accessory is removed.
+ */
+static void lhap_event_drop_accessory(lhap_desc *desc, uint64_t aid) {
+    size_t n = 0;
+    for (size_t i = 0; i < desc->num_events; i++) {
+        if (desc->events[i].aid != aid) {
+            desc->events[n++] = desc->events[i];
+        }
+    }
+    desc->num_events = n;
+}
+
+static void lhap_read_done(lhap_desc *desc, const HAPAccessory *accessory);
+static void lhap_read_sched_arm(lhap_desc *desc, HAPTime deadline);
+
+/**
+ * Push the table of the contexts bound to the session.
+ */
+static void lhap_session_push_contexts(lua_State *L, HAPSessionRef *session) {
+    luaL_getsubtable(L, LUA_REGISTRYINDEX, LHAP_SESSION_CONTEXTS);
+    if (lua_rawgetp(L, -1, session) == LUA_TNIL) {
+        lua_pop(L, 1);
+        lua_createtable(L, 0, 1);
+        lua_createtable(L, 0, 1);
+        lua_pushliteral(L, "k");
+        lua_setfield(L, -2, "__mode");
+        lua_setmetatable(L, -2);
+        lua_pushvalue(L, -1);
+        lua_rawsetp(L, -3, session);
+    }
+    lua_remove(L, -2);
+}
+
+/**
+ * Bind a new context to the handler coroutine "co",
+ * the context is cancelled when the session is invalidated.
+ *
+ * Contexts of a session are kept in a table with weak keys,
+ * so the context is released once the handler finishes.
+ * The value on the top of the stack is popped and kept with the context,
+ * it is the call context of a read, or true.
+ */
+static void lhap_session_bind_context(lua_State *L, lua_State *co, HAPSessionRef *session) {
+    lhap_session_push_contexts(L, session);
+    lua_insert(L, -2);
+    // stack: <session contexts, value>
+    lc_newcontext(L, 0);
+    lua_pushvalue(L, -1);
+    lua_pushvalue(L, -3);
+    lua_rawset(L, -5);
+    lc_setcontext(L, co);
+    lua_pop(L, 2);
+}
+
+/**
+ * Check if the reads of other sessions wait for the read of the characteristic.
+ */
+static bool lhap_char_has_waiters(
+        lhap_desc *desc,
+        const HAPAccessory *accessory,
+        const HAPCharacteristic *characteristic) {
+    for (lhap_read_request *w = desc->read_waiters; w; w = w->next) {
+        if (w->accessory == accessory && w->characteristic == characteristic) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static int lhap_session_cancel_contexts(lua_State *L) {
+    HAPSessionRef *session = lua_touserdata(L, 1);
+    if (lua_getfield(L, LUA_REGISTRYINDEX, LHAP_SESSION_CONTEXTS) != LUA_TTABLE) {
+        return 0;
+    }
+    if (lua_rawgetp(L, -1, session) != LUA_TTABLE) {
+        return 0;
+    }
+    lua_pushnil(L);
+    lua_rawsetp(L, -3, session);
+
+    lua_pushnil(L);
+    while (lua_next(L, -2)) {
+        // The session is not answered, a read shared by other sessions keeps running for them.
+        if (lua_type(L, -1) == LUA_TUSERDATA) {
+            lhap_call_context *ctx = lua_touserdata(L, -1);
+            ctx->session = NULL;
+            if (lhap_char_has_waiters(ctx->desc, ctx->accessory, ctx->characteristic)) {
+                lua_pop(L, 1);
+                continue;
+            }
+        }
+        // The key is a readMany batch, the other reads of the batch are still answered.
+        if (lua_isboolean(L, -1) && !lua_toboolean(L, -1)) {
+            lhap_read_batch *batch = lua_touserdata(L, -2);
+            for (size_t i = 0; i < batch->num; i++) {
+                if (batch->reads[i].session == session) {
+                    batch->reads[i].session = NULL;
+                }
+            }
+            lua_pop(L, 1);
+            continue;
+        }
+        lua_pop(L, 1);
+        lc_cancelcontext(L, luaL_checkudata(L, -1, LC_CONTEXT_NAME), LC_CONTEXT_CANCELLED);
+    }
+    return 0;
+}
+
+static lhap_read_request *lhap_read_request_new(lhap_desc *desc) {
+    lhap_read_request *request = desc->free_read_requests;
+    if (request) {
+        desc->free_read_requests = request->next;
+        desc->num_free_read_requests--;
+        return request;
+    }
+    desc->read_request_allocs++;
+    return pal_mem_alloc(sizeof(*request));
+}
+
+static void lhap_read_request_free(lhap_desc *desc, lhap_read_request *request) {
+    if (desc->num_free_read_requests == LHAP_READ_REQUESTS_MAX) {
+        pal_mem_free(request);
+        return;
+    }
+    request->next = desc->free_read_requests;
+    desc->free_read_requests = request;
+    desc->num_free_read_requests++;
+}
+
+/**
+ * Answer the reads waiting for the read in flight of the characteristic.
+ */
+static void lhap_char_response_waiters(
+        lhap_desc *desc,
+        const HAPAccessory *accessory,
+        const HAPCharacteristic *characteristic,
+        HAPError err,
+        union lhap_char_value *val) {
+    lhap_char_get_cache(characteristic)->reading = NULL;
+    for (lhap_read_request **pw = &desc->read_waiters; *pw;) {
+        lhap_read_request *w = *pw;
+        if (w->accessory != accessory || w->characteristic != characteristic) {
+            pw = &w->next;
+            continue;
+        }
+        *pw = w->next;
+        HAPError rerr = lhap_char_response_read_request(desc, w->transportType, w->session,
+            w->accessory, w->service, w->characteristic, err, val);
+        if (rerr != kHAPError_None) {
+            HAPLogError(&lhap_log, "%s: Failed to response read request, error code: %d.", __func__, rerr);
+        }
+        lhap_read_request_free(desc, w);
+    }
+}
+
+/**
+ * Attach the read to the read in flight of the same characteristic.
+ *
+ * @return true if the read is attached, it is answered when the read in flight finishes.
+ */
+static bool lhap_char_attach_read(
+        lhap_desc *desc,
+        HAPTransportType transportType,
+        HAPSessionRef *session,
+        const HAPAccessory *accessory,
+        const HAPService *service,
+        const HAPBaseCharacteristic *characteristic) {
+    if (lhap_char_get_cache(characteristic)->reading != accessory) {
+        return false;
+    }
+    lhap_read_request *w = lhap_read_request_new(desc);
+    if (!w) {
+        return false;
+    }
+    w->desc = desc;
+    w->transportType = transportType;
+    w->session = session;
+    w->accessory = accessory;
+    w->service = service;
+    w->characteristic = characteristic;
+    w->pfunc = NULL;
+    w->next = desc->read_waiters;
+    desc->read_waiters = w;
+    desc->reads_collapsed++;
+    return true;
+}
+
+int lhap_char_handle_read_finish(lua_State *L, int status, lua_KContext _ctx) {
+    lhap_call_context *ctx = (lhap_call_context *)_ctx;
+    lhap_desc *desc = ctx->desc;
+    HAPCharacteristicFormat format = ((HAPBaseCharacteristic *)ctx->characteristic)->format;
+    // The reads of a stopped server are not answered or counted.
+    bool current = ctx->generation == desc->generation;
+    HAPError err = kHAPError_None;
+    if (status != LUA_OK && status != LUA_YIELD) {
+        HAPLogError(&lhap_log, "%s: %s", __func__, lua_tostring(L, -1));
+        err = kHAPError_Unknown;
+    } else if (!lhap_char_value_is_valid(L, -1, format)) {
+        err = kHAPError_InvalidData;
+    }
+    if (ctx->refresh) {
+        const HAPBaseCharacteristic *characteristic = (const HAPBaseCharacteristic *)ctx->characteristic;
+        lhap_char_get_cache(characteristic)->refreshing = false;
+        // The stale value is kept if the refresh fails, a removed accessory raises no events.
+        if (err == kHAPError_None && lhap_char_cache_store(L, -1, characteristic) &&
+            current && lhap_accessory_get_ext(ctx->accessory)->served) {
+            lhap_event_raise(desc, ctx->accessory->aid, ctx->service->iid, characteristic->iid, NULL);
+        }
+        return 0;
+    }
+    if (err == kHAPError_None &&
+        lhap_char_cache_ttl(desc, lhap_char_get_cache((const HAPBaseCharacteristic *)ctx->characteristic))) {
+        lhap_char_cache_store(L, -1, ctx->characteristic);
+    }
+    if (ctx->in_progress == false) {
+        lua_pushinteger(L, err);
+        return 2;
+    }
+    if (!current) {
+        return 0;
+    }
+    union lhap_char_value val;
+    if (err == kHAPError_None) {
+        int valid = lhap_char_value_get(L, -1, format, &val);
+        if (!valid) {
+            err = kHAPError_InvalidData;
+        }
+    }
+    lhap_char_response_waiters(desc, ctx->accessory, ctx->characteristic, err, &val);
+    // The session of the read is invalidated.
+    if (ctx->session) {
+        err = lhap_char_response_read_request(desc, ctx->transportType, ctx->session,
+            ctx->accessory, ctx->service, ctx->characteristic, err, &val);
+        if (err != kHAPError_None) {
+            HAPLogError(&lhap_log, "%s: Failed to response read request, error code: %d.", __func__, err);
+        }
+    }
+    lhap_read_done(desc, ctx->accessory);
+    lua_pushinteger(L, err);
+    return 1;
+}
+
+static int lhap_char_handle_read(lua_State *L) {
+    // stack: <call_ctx, traceback, func, request>
+    lua_KContext call_ctx = (lua_KContext)lua_touserdata(L, 1);
+    int status = lua_pcallk(L, 1, 1, 2, call_ctx, lhap_char_handle_read_finish);
+    return lhap_char_handle_read_finish(L, status, call_ctx);
+}
+
+static int lhap_char_handle_read_pcall(lua_State *L) {
     lhap_call_context *_call_ctx  = lua_touserdata(L, 1);
     const void *pfunc = lua_touserdata(L, 2);
     lua_pop(L, 2);
 
     lua_State *co = lc_newthread(L);
+    lc_setpriority(co, _call_ctx->refresh ? LC_PRIO_LOW : LC_PRIO_HIGH);
     lua_pushcfunction(co, lhap_char_handle_read);
     lhap_call_context *call_ctx = lua_newuserdata(co, sizeof(*call_ctx));
     *call_ctx = *_call_ctx;
+    call_ctx->generation = call_ctx->desc->generation;
+    lhap_push_accessory(co, call_ctx->accessory);
+    lua_setuservalue(co, -2);
+    if (call_ctx->session) {
+        lua_pushvalue(co, -1);
+        lua_xmove(co, L, 1);
+        lhap_session_bind_context(L, co, call_ctx->session);
+    }
 
     lc_pushtraceback(co);
 
     // push the function
     HAPAssert(lua_rawgetp(co, LUA_REGISTRYINDEX, pfunc) == LUA_TFUNCTION);
+    lc_applytag(co, -1);
 
     // push the table request
-    lhap_create_request_table(co, call_ctx->transportType, call_ctx->session, NULL,
+    lhap_push_request(co, call_ctx->transportType, call_ctx->session, NULL,
         call_ctx->accessory, call_ctx->service, call_ctx->characteristic);
 
     int status, nres;
@@ -1202,6 +2116,9 @@ static int lhap_char_handle_read_pcall(lua_State *L) {
         return nres;
     case LUA_YIELD:
         call_ctx->in_progress = true;
+        if (!call_ctx->refresh) {
+            lhap_char_get_cache(call_ctx->characteristic)->reading = call_ctx->accessory;
+        }
         lua_pushinteger(L, kHAPError_InProgress);
         return 1;
     default:
@@ -1223,6 +2140,7 @@ HAPError lhap_char_raw_handleRead(
     HAPAssert(lua_gettop(L) == 0);
 
     desc->num_read_requests++;
+    lhap_accessory_get_ext(accessory)->num_in_flight++;
 
     lhap_call_context call_ctx = {
         .in_progress = in_progress,
@@ -1234,46 +2152,716 @@ HAPError lhap_char_raw_handleRead(
         .characteristic = characteristic,
     };
 
+    // Measure the allocations until the read is answered or the callback yields.
+    app_alloc_stats before, after;
+    app_alloc_get_stats(&before);
+
     lua_pushcfunction(L, lhap_char_handle_read_pcall);
     lua_pushlightuserdata(L, (void *)&call_ctx);
     lua_pushlightuserdata(L, (void *)pfunc);
     int status = lua_pcall(L, 2, LUA_MULTRET, 0);
+
+    app_alloc_get_stats(&after);
+    desc->reads_handled++;
+    desc->read_allocs += after.allocs - before.allocs;
+    desc->read_alloc_bytes += after.alloc_bytes - before.alloc_bytes;
+
     if (status != LUA_OK) {
         HAPLogError(&lhap_log, "%s: %s", __func__, lua_tostring(L, -1));
+        lhap_read_done(desc, accessory);
         return kHAPError_Unknown;
     }
-    HAPAssert(lua_isinteger(L, -1));
-    HAPError err = lua_tointeger(L, -1);
+    HAPAssert(lua_isinteger(L, -1));
+    HAPError err = lua_tointeger(L, -1);
+
+    if (!in_progress && err != kHAPError_InProgress) {
+        lhap_read_done(desc, accessory);
+    }
+
+    return err;
+}
+
+static void lhap_char_cache_refresh_cb(void *_Nullable context, size_t contextSize) {
+    HAPPrecondition(context);
+    HAPPrecondition(contextSize == sizeof(lhap_read_request));
+    lhap_read_request *request = context;
+    lhap_desc *desc = request->desc;
+    lhap_char_cache *cache = lhap_char_get_cache(request->characteristic);
+    lua_State *L = desc->mL;
+
+    // The accessory is kept until the refresh runs, a removed accessory is not refreshed.
+    if (!desc->started || !lhap_accessory_get_ext(request->accessory)->served) {
+        cache->refreshing = false;
+        lhap_rawsetp_reset(L, LUA_REGISTRYINDEX, &cache->refreshing);
+        return;
+    }
+
+    HAPAssert(lua_gettop(L) == 0);
+
+    desc->cache_refreshes++;
+
+    lhap_call_context call_ctx = {
+        .refresh = true,
+        .transportType = request->transportType,
+        .desc = desc,
+        .accessory = request->accessory,
+        .service = request->service,
+        .characteristic = request->characteristic,
+    };
+
+    lua_pushcfunction(L, lhap_char_handle_read_pcall);
+    lua_pushlightuserdata(L, &call_ctx);
+    lua_pushlightuserdata(L, (void *)request->pfunc);
+    int status = lua_pcall(L, 2, 0, 0);
+    if (status != LUA_OK) {
+        HAPLogError(&lhap_log, "%s: %s", __func__, lua_tostring(L, -1));
+        cache->refreshing = false;
+    }
+    lua_settop(L, 0);
+    lhap_rawsetp_reset(L, LUA_REGISTRYINDEX, &cache->refreshing);
+    lc_collectgarbage(L);
+}
+
+/**
+ * Serve the read request from the value cache.
+ *
+ * A stale value is served too, and a refresh is scheduled.
+ *
+ * @return true if the cached value is pushed.
+ */
+static bool lhap_char_cache_read(
+        lhap_desc *desc,
+        HAPTransportType transportType,
+        const HAPAccessory *accessory,
+        const HAPService *service,
+        const HAPBaseCharacteristic *characteristic,
+        const void *pfunc) {
+    lhap_char_cache *cache = lhap_char_get_cache(characteristic);
+    HAPTime ttl = lhap_char_cache_ttl(desc, cache);
+    // The debounced value is served until the write callback finishes.
+    lhap_char_debounce *d = lhap_char_get_debounce(characteristic);
+    bool debouncing = d->pending || d->running;
+    if (!ttl && !cache->pushed && !debouncing) {
+        return false;
+    }
+    if (!cache->valid) {
+        desc->cache_misses++;
+        return false;
+    }
+    HAPTime age = HAPPlatformClockGetCurrent() - cache->updated;
+    if (debouncing || age < ttl || (cache->pushed && age < LHAP_CACHE_PUSHED_TTL)) {
+        desc->cache_hits++;
+    } else if (!ttl) {
+        // The pushed value expires, the cache is disabled.
+        lhap_char_cache_invalidate(characteristic);
+        desc->cache_misses++;
+        return false;
+    } else {
+        desc->cache_stale_hits++;
+        if (!cache->refreshing) {
+            lhap_read_request request = {
+                .desc = desc,
+                .transportType = transportType,
+                .accessory = accessory,
+                .service = service,
+                .characteristic = characteristic,
+                .pfunc = pfunc,
+            };
+            if (HAPPlatformRunLoopScheduleCallback(lhap_char_cache_refresh_cb,
+                &request, sizeof(request)) == kHAPError_None) {
+                cache->refreshing = true;
+                lhap_push_accessory(desc->mL, accessory);
+                lua_rawsetp(desc->mL, LUA_REGISTRYINDEX, &cache->refreshing);
+            }
+        }
+    }
+    lhap_char_cache_push(desc->mL, characteristic);
+    lua_pushinteger(desc->mL, kHAPError_None);
+    return true;
+}
+
+static void lhap_hist_observe(size_t hist[], const HAPTime bounds[], HAPTime val) {
+    size_t i = 0;
+    while (i < LHAP_READ_HIST_NUM - 1 && val > bounds[i]) {
+        i++;
+    }
+    hist[i]++;
+}
+
+/**
+ * Answer the batched reads of the accessory with the error, and free them.
+ */
+static void lhap_accessory_fail_reads(lhap_desc *desc, lhap_accessory_ext *ext, HAPError err) {
+    while (ext->reads_head) {
+        lhap_read_request *request = ext->reads_head;
+        ext->reads_head = request->next;
+        lhap_char_response_waiters(desc, request->accessory, request->characteristic, err, NULL);
+        if (request->session) {
+            HAPError rerr = lhap_char_response_read_request(desc, request->transportType,
+                request->session, request->accessory, request->service, request->characteristic, err, NULL);
+            if (rerr != kHAPError_None) {
+                HAPLogError(&lhap_log, "%s: Failed to response read request, error code: %d.", __func__, rerr);
+            }
+        }
+        lhap_read_request_free(desc, request);
+    }
+    ext->reads_ptail = &ext->reads_head;
+    desc->num_batched_reads -= ext->num_reads;
+    ext->num_reads = 0;
+}
+
+/**
+ * Fail the batched reads of the accessory waiting longer than the deadline.
+ */
+static void lhap_accessory_expire_reads(lhap_desc *desc, lhap_accessory_ext *ext, HAPTime now) {
+    while (ext->reads_head && now - ext->reads_head->queued >= desc->read_deadline) {
+        lhap_read_request *request = ext->reads_head;
+        ext->reads_head = request->next;
+        if (ext->reads_head == NULL) {
+            ext->reads_ptail = &ext->reads_head;
+        }
+        ext->num_reads--;
+        desc->num_batched_reads--;
+        lhap_hist_observe(desc->read_wait_hist, lhap_read_wait_bounds, now - request->queued);
+        lhap_char_response_waiters(desc, request->accessory, request->characteristic, kHAPError_Busy, NULL);
+        if (request->session) {
+            HAPError err = lhap_char_response_read_request(desc, request->transportType,
+                request->session, request->accessory, request->service, request->characteristic,
+                kHAPError_Busy, NULL);
+            if (err != kHAPError_None) {
+                HAPLogError(&lhap_log, "%s: Failed to response read request, error code: %d.", __func__, err);
+            }
+        }
+        lhap_read_request_free(desc, request);
+        desc->reads_expired++;
+    }
+}
+
+/**
+ * Drop the batched reads of the session.
+ *
+ * A read waited by the reads of other sessions is still passed to readMany, without the session.
+ */
+static void lhap_read_batches_drop_session(lhap_desc *desc, HAPSessionRef *session) {
+    for (lhap_accessory_ext **pext = &desc->read_batches; *pext;) {
+        lhap_accessory_ext *ext = *pext;
+        ext->reads_ptail = &ext->reads_head;
+        for (lhap_read_request **pr = &ext->reads_head; *pr;) {
+            lhap_read_request *request = *pr;
+            if (request->session != session) {
+                ext->reads_ptail = &request->next;
+                pr = &request->next;
+            } else if (lhap_char_has_waiters(desc, request->accessory, request->characteristic)) {
+                request->session = NULL;
+                ext->reads_ptail = &request->next;
+                pr = &request->next;
+            } else {
+                *pr = request->next;
+                lhap_char_get_cache(request->characteristic)->reading = NULL;
+                ext->num_reads--;
+                desc->num_batched_reads--;
+                lhap_read_request_free(desc, request);
+            }
+        }
+        if (ext->num_reads == 0) {
+            *pext = ext->next;
+            ext->next = NULL;
+        } else {
+            pext = &ext->next;
+        }
+    }
+}
+
+static int lhap_accessory_read_many_finish(lua_State *L, int status, lua_KContext _ctx) {
+    lhap_read_batch *batch = (lhap_read_batch *)_ctx;
+    lhap_desc *desc = batch->desc;
+    bool current = batch->generation == desc->generation;
+    bool ok = true;
+    if (status != LUA_OK && status != LUA_YIELD) {
+        HAPLogError(&lhap_log, "%s: %s", __func__, lua_tostring(L, -1));
+        ok = false;
+    } else if (!lua_istable(L, -1)) {
+        HAPLogError(&lhap_log, "%s: readMany must return an array of values.", __func__);
+        ok = false;
+    }
+    for (size_t i = 0; i < batch->num; i++) {
+        lhap_read_request *request = &batch->reads[i];
+        const HAPBaseCharacteristic *characteristic = request->characteristic;
+        HAPError err = ok ? kHAPError_None : kHAPError_Unknown;
+        union lhap_char_value val;
+        if (ok) {
+            lua_geti(L, -1, i + 1);
+            if (!lhap_char_value_is_valid(L, -1, characteristic->format) ||
+                !lhap_char_value_get(L, -1, characteristic->format, &val)) {
+                err = kHAPError_InvalidData;
+            } else if (lhap_char_cache_ttl(desc, lhap_char_get_cache(characteristic))) {
+                lhap_char_cache_store(L, -1, characteristic);
+            }
+        }
+        // The reads are dropped when the server stops or the session is invalidated.
+        if (current) {
+            lhap_char_response_waiters(desc, request->accessory, characteristic, err, &val);
+        }
+        if (current && request->session) {
+            err = lhap_char_response_read_request(desc, request->transportType, request->session,
+                request->accessory, request->service, characteristic, err, &val);
+            if (err != kHAPError_None) {
+                HAPLogError(&lhap_log, "%s: Failed to response read request, error code: %d.", __func__, err);
+            }
+        }
+        if (ok) {
+            lua_pop(L, 1);
+        }
+    }
+    if (current) {
+        lhap_read_done(desc, batch->accessory);
+    }
+    return 0;
+}
+
+static int lhap_accessory_read_many(lua_State *L) {
+    // stack: <batch, traceback, func, requests>
+    lua_KContext batch = (lua_KContext)lua_touserdata(L, 1);
+    int status = lua_pcallk(L, 1, 1, 2, batch, lhap_accessory_read_many_finish);
+    return lhap_accessory_read_many_finish(L, status, batch);
+}
+
+static int lhap_accessory_read_many_pcall(lua_State *L) {
+    lhap_desc *desc = lua_touserdata(L, 1);
+    lhap_accessory_ext *ext = lua_touserdata(L, 2);
+    lua_pop(L, 2);
+
+    lua_State *co = lc_newthread(L);
+    lc_setpriority(co, LC_PRIO_HIGH);
+    lua_pushcfunction(co, lhap_accessory_read_many);
+    lhap_read_batch *batch = lua_newuserdata(co, sizeof(*batch) + sizeof(lhap_read_request) * ext->num_reads);
+    batch->desc = desc;
+    batch->accessory = ext->accessory;
+    batch->generation = desc->generation;
+    batch->num = 0;
+    lhap_push_accessory(co, ext->accessory);
+    lua_setuservalue(co, -2);
+    lc_pushtraceback(co);
+    HAPAssert(lua_rawgetp(co, LUA_REGISTRYINDEX, ext) == LUA_TFUNCTION);
+    lc_applytag(co, -1);
+
+    // push the array of the requests
+    lua_createtable(co, ext->num_reads, 0);
+    lua_Integer i = 1;
+    for (lhap_read_request *request = ext->reads_head; request; request = request->next, i++) {
+        lhap_push_request(co, request->transportType, request->session, NULL,
+            request->accessory, request->service, request->characteristic);
+        lua_rawseti(co, -2, i);
+    }
+
+    // The reads of the batch are not answered when their sessions are invalidated.
+    lua_pushvalue(co, 2);
+    lua_xmove(co, L, 1);
+    for (lhap_read_request *request = ext->reads_head; request; request = request->next) {
+        if (request->session) {
+            lhap_session_push_contexts(L, request->session);
+            lua_pushvalue(L, -2);
+            lua_pushboolean(L, false);
+            lua_rawset(L, -3);
+            lua_pop(L, 1);
+        }
+    }
+    lua_pop(L, 1);
+
+    // Nothing raises errors from here, the batch owns the reads.
+    while (ext->reads_head) {
+        lhap_read_request *request = ext->reads_head;
+        ext->reads_head = request->next;
+        batch->reads[batch->num++] = *request;
+        lhap_read_request_free(desc, request);
+    }
+    ext->reads_ptail = &ext->reads_head;
+    desc->num_batched_reads -= ext->num_reads;
+    ext->num_reads = 0;
+
+    // A readMany call counts as one read in flight of the accessory.
+    desc->num_read_requests++;
+    ext->num_in_flight++;
+    desc->read_many_calls++;
+    int status, nres;
+    status = lc_resume(co, L, 4, &nres);
+    if (luai_unlikely(status != LUA_OK && status != LUA_YIELD)) {
+        lua_error(L);
+    }
+    return 0;
+}
+
+/**
+ * Pass the batched reads to the readMany callbacks, in the limits of the reads in flight.
+ *
+ * The batches over the limits wait for the reads in flight, until the deadline.
+ */
+static void lhap_read_batches_dispatch(lhap_desc *desc, HAPTime now) {
+    lua_State *L = desc->mL;
+    HAPTime oldest = 0;
+    for (lhap_accessory_ext **pext = &desc->read_batches; *pext;) {
+        lhap_accessory_ext *ext = *pext;
+        if (desc->read_deadline) {
+            lhap_accessory_expire_reads(desc, ext, now);
+        }
+        if (ext->num_reads &&
+            (desc->num_read_requests >= desc->max_read_requests ||
+            ext->num_in_flight >= desc->max_acc_read_requests)) {
+            if (oldest == 0 || ext->reads_head->queued < oldest) {
+                oldest = ext->reads_head->queued;
+            }
+            pext = &ext->next;
+            continue;
+        }
+        *pext = ext->next;
+        ext->next = NULL;
+        if (ext->num_reads == 0) {
+            continue;
+        }
+
+        lua_pushcfunction(L, lhap_accessory_read_many_pcall);
+        lua_pushlightuserdata(L, desc);
+        lua_pushlightuserdata(L, ext);
+        int status = lua_pcall(L, 2, 0, 0);
+        if (status != LUA_OK) {
+            HAPLogError(&lhap_log, "%s: %s", __func__, lua_tostring(L, -1));
+        }
+        // the reads not passed to readMany
+        lhap_accessory_fail_reads(desc, ext, kHAPError_Unknown);
+        lua_settop(L, 0);
+    }
+    if (desc->read_deadline && oldest) {
+        lhap_read_sched_arm(desc, oldest + desc->read_deadline);
+    }
+}
+
+static void lhap_flush_read_batches_cb(void *_Nullable context, size_t contextSize) {
+    HAPPrecondition(context);
+    HAPPrecondition(contextSize == sizeof(lhap_desc *));
+    lhap_desc *desc = *(lhap_desc **)context;
+
+    desc->read_batches_scheduled = false;
+    if (!desc->started) {
+        return;
+    }
+
+    HAPAssert(lua_gettop(desc->mL) == 0);
+    lhap_read_batches_dispatch(desc, HAPPlatformClockGetCurrent());
+    lc_collectgarbage(desc->mL);
+}
+
+static bool lhap_read_batches_schedule(lhap_desc *desc) {
+    if (desc->read_batches_scheduled) {
+        return true;
+    }
+    if (HAPPlatformRunLoopScheduleCallback(lhap_flush_read_batches_cb, &desc, sizeof(desc)) != kHAPError_None) {
+        HAPLogError(&lhap_log, "%s: Failed to schedule readMany calls.", __func__);
+        return false;
+    }
+    desc->read_batches_scheduled = true;
+    return true;
+}
+
+/**
+ * Batch the read to the readMany callback of the accessory.
+ *
+ * The reads of an accessory in the same server turn are passed to one readMany call,
+ * the batched reads count against the limits of the queued reads.
+ *
+ * @return kHAPError_InProgress if the read is batched.
+ * @return kHAPError_Busy if the queue is full or it misses the deadline.
+ */
+static HAPError lhap_accessory_batch_read(
+        lhap_desc *desc,
+        lhap_accessory_ext *ext,
+        HAPTransportType transportType,
+        HAPSessionRef *session,
+        const HAPService *service,
+        const HAPBaseCharacteristic *characteristic) {
+    HAPTime now = HAPPlatformClockGetCurrent();
+    if (desc->num_queued_reads + desc->num_batched_reads >= desc->max_queued_reads ||
+        (desc->read_deadline && ext->reads_head && now - ext->reads_head->queued >= desc->read_deadline)) {
+        desc->reads_rejected++;
+        return kHAPError_Busy;
+    }
+    if (!lhap_read_batches_schedule(desc)) {
+        return kHAPError_OutOfResources;
+    }
+    lhap_read_request *request = lhap_read_request_new(desc);
+    if (!request) {
+        return kHAPError_OutOfResources;
+    }
+    request->desc = desc;
+    request->transportType = transportType;
+    request->session = session;
+    request->accessory = ext->accessory;
+    request->service = service;
+    request->characteristic = characteristic;
+    request->pfunc = NULL;
+    request->queued = now;
+    request->next = NULL;
+    *(ext->reads_ptail) = request;
+    ext->reads_ptail = &request->next;
+    if (ext->num_reads == 0) {
+        ext->next = desc->read_batches;
+        desc->read_batches = ext;
+    }
+    ext->num_reads++;
+    desc->num_batched_reads++;
+    lhap_char_get_cache(characteristic)->reading = ext->accessory;
+    desc->reads_batched++;
+    return kHAPError_InProgress;
+}
+
+static void lhap_read_sched_cb(app_timer_ref timer, void *context);
+
+/**
+ * Arm the scheduler timer, an earlier deadline replaces the armed one.
+ */
+static void lhap_read_sched_arm(lhap_desc *desc, HAPTime deadline) {
+    if (desc->read_sched_timer) {
+        if (desc->read_sched_deadline <= deadline) {
+            return;
+        }
+        app_timer_deregister(desc->read_sched_timer);
+        desc->read_sched_timer = NULL;
+    }
+    if (app_timer_register(&desc->read_sched_timer, deadline, lhap_read_sched_cb, desc) != kHAPError_None) {
+        HAPLogError(&lhap_log, "%s: Failed to register read scheduler timer.", __func__);
+        HAPFatalError();
+    }
+    desc->read_sched_deadline = deadline;
+}
+
+/**
+ * A read running the read callback is answered.
+ */
+static void lhap_read_done(lhap_desc *desc, const HAPAccessory *accessory) {
+    HAPAssert(desc->num_read_requests > 0);
+    desc->num_read_requests--;
+    lhap_accessory_get_ext(accessory)->num_in_flight--;
+    if (desc->num_queued_reads) {
+        lhap_read_sched_arm(desc, HAPPlatformClockGetCurrent());
+    }
+    if (desc->read_batches) {
+        lhap_read_batches_schedule(desc);
+    }
+}
 
-    if (!in_progress && err != kHAPError_InProgress) {
-        desc->num_read_requests--;
+/**
+ * Queue the read to the accessory.
+ *
+ * @return kHAPError_InProgress if the read is queued.
+ * @return kHAPError_Busy if the queue is full or it misses the deadline.
+ */
+static HAPError lhap_read_enqueue(
+        lhap_desc *desc,
+        lhap_accessory_ext *ext,
+        HAPTransportType transportType,
+        HAPSessionRef *session,
+        const HAPService *service,
+        const HAPBaseCharacteristic *characteristic,
+        const void *pfunc) {
+    HAPTime now = HAPPlatformClockGetCurrent();
+    if (desc->num_queued_reads >= desc->max_queued_reads ||
+        (desc->read_deadline && ext->queue_head && now - ext->queue_head->queued >= desc->read_deadline)) {
+        desc->reads_rejected++;
+        return kHAPError_Busy;
+    }
+    lhap_read_request *request = lhap_read_request_new(desc);
+    if (!request) {
+        return kHAPError_OutOfResources;
     }
+    request->desc = desc;
+    request->transportType = transportType;
+    request->session = session;
+    request->accessory = ext->accessory;
+    request->service = service;
+    request->characteristic = characteristic;
+    request->pfunc = pfunc;
+    request->queued = now;
+    request->next = NULL;
+    *(ext->queue_ptail) = request;
+    ext->queue_ptail = &request->next;
+    if (ext->num_queued == 0) {
+        ext->sched_next = NULL;
+        *(desc->sched_ptail) = ext;
+        desc->sched_ptail = &ext->sched_next;
+    }
+    ext->num_queued++;
+    lhap_hist_observe(desc->read_depth_hist, lhap_read_depth_bounds, desc->num_queued_reads);
+    desc->num_queued_reads++;
+    if (desc->read_deadline) {
+        lhap_read_sched_arm(desc, now + desc->read_deadline);
+    }
+    return kHAPError_InProgress;
+}
 
-    return err;
+static lhap_read_request *lhap_read_dequeue(lhap_desc *desc, lhap_accessory_ext *ext) {
+    lhap_read_request *request = ext->queue_head;
+    ext->queue_head = request->next;
+    if (ext->queue_head == NULL) {
+        ext->queue_ptail = &ext->queue_head;
+    }
+    ext->num_queued--;
+    desc->num_queued_reads--;
+    return request;
 }
 
-static void lhap_schedule_read_requests_cb(HAPPlatformTimerRef timer, void* context) {
-    lhap_desc *desc = context;
+/**
+ * Remove the accessories without queued reads from the round-robin list.
+ */
+static void lhap_read_sched_prune(lhap_desc *desc) {
+    desc->sched_ptail = &desc->sched_head;
+    for (lhap_accessory_ext **pext = &desc->sched_head; *pext;) {
+        lhap_accessory_ext *ext = *pext;
+        if (ext->num_queued) {
+            desc->sched_ptail = &ext->sched_next;
+            pext = &ext->sched_next;
+        } else {
+            *pext = ext->sched_next;
+            ext->sched_next = NULL;
+        }
+    }
+}
+
+/**
+ * Fail the queued reads waiting longer than the deadline.
+ *
+ * @return the time when the oldest remaining read was queued, or 0 if there is none.
+ */
+static HAPTime lhap_read_sched_expire(lhap_desc *desc, HAPTime now) {
+    HAPTime oldest = 0;
+    bool pruned = false;
+    for (lhap_accessory_ext *ext = desc->sched_head; ext; ext = ext->sched_next) {
+        while (ext->queue_head && now - ext->queue_head->queued >= desc->read_deadline) {
+            lhap_read_request *request = lhap_read_dequeue(desc, ext);
+            lhap_hist_observe(desc->read_wait_hist, lhap_read_wait_bounds, now - request->queued);
+            HAPError err = lhap_char_response_read_request(desc, request->transportType,
+                request->session, request->accessory, request->service, request->characteristic,
+                kHAPError_Busy, NULL);
+            if (err != kHAPError_None) {
+                HAPLogError(&lhap_log, "%s: Failed to response read request, error code: %d.", __func__, err);
+            }
+            lhap_read_request_free(desc, request);
+            desc->reads_expired++;
+        }
+        if (ext->queue_head) {
+            if (oldest == 0 || ext->queue_head->queued < oldest) {
+                oldest = ext->queue_head->queued;
+            }
+        } else {
+            pruned = true;
+        }
+    }
+    if (pruned) {
+        lhap_read_sched_prune(desc);
+    }
+    return oldest;
+}
 
-    while (desc->read_requests_ptail != &desc->read_requests_head) {
-        lhap_read_request *request = desc->read_requests_head;
-        desc->read_requests_head = request->next;
-        if (desc->read_requests_head == NULL) {
-            desc->read_requests_ptail = &desc->read_requests_head;
+/**
+ * Dispatch the queued reads in round-robin, one read of an accessory a time,
+ * until the limits are reached.
+ */
+static void lhap_read_sched_dispatch(lhap_desc *desc, HAPTime now) {
+    size_t num_accs = 0;
+    for (lhap_accessory_ext *ext = desc->sched_head; ext; ext = ext->sched_next) {
+        num_accs++;
+    }
+    size_t num_busy = 0;  /* accessories skipped in a row for their limits */
+    while (desc->sched_head && num_busy < num_accs &&
+        desc->num_read_requests < desc->max_read_requests) {
+        lhap_accessory_ext *ext = desc->sched_head;
+        desc->sched_head = ext->sched_next;
+        if (desc->sched_head == NULL) {
+            desc->sched_ptail = &desc->sched_head;
+        }
+        ext->sched_next = NULL;
+        if (ext->num_in_flight >= desc->max_acc_read_requests) {
+            *(desc->sched_ptail) = ext;
+            desc->sched_ptail = &ext->sched_next;
+            num_busy++;
+            continue;
         }
+        num_busy = 0;
+        lhap_read_request *request = lhap_read_dequeue(desc, ext);
+        if (ext->num_queued) {
+            *(desc->sched_ptail) = ext;
+            desc->sched_ptail = &ext->sched_next;
+        } else {
+            num_accs--;
+        }
+        lhap_hist_observe(desc->read_wait_hist, lhap_read_wait_bounds, now - request->queued);
+        desc->reads_dispatched++;
+
         HAPError err = lhap_char_raw_handleRead(true, desc, request->transportType, request->session,
             request->accessory, request->service, request->characteristic, request->pfunc);
         if (err != kHAPError_None && err != kHAPError_InProgress) {
             HAPLogError(&lhap_log, "%s: Failed to handle read request, error code: %d.", __func__, err);
-            err = lhap_char_response_read_request(&desc->server, request->transportType, request->session,
+            err = lhap_char_response_read_request(desc, request->transportType, request->session,
                 request->accessory, request->service, request->characteristic, err, NULL);
             if (err != kHAPError_None) {
                 HAPLogError(&lhap_log, "%s: Failed to response read request, error code: %d.", __func__, err);
             }
         }
-        pal_mem_free(request);
+        lhap_read_request_free(desc, request);
         lua_settop(desc->mL, 0);
-        lc_collectgarbage(desc->mL);
+    }
+}
+
+static void lhap_read_sched_cb(app_timer_ref timer, void *context) {
+    lhap_desc *desc = context;
+    desc->read_sched_timer = NULL;
+    if (!desc->started) {
+        return;
+    }
+    HAPAssert(lua_gettop(desc->mL) == 0);
+
+    HAPTime now = HAPPlatformClockGetCurrent();
+    if (desc->read_deadline) {
+        lhap_read_sched_expire(desc, now);
+    }
+    lhap_read_sched_dispatch(desc, now);
+    if (desc->read_batches) {
+        lhap_read_batches_dispatch(desc, now);
+    }
+    lc_collectgarbage(desc->mL);
+
+    // the reads still queued fail at the deadline
+    if (desc->read_deadline && desc->num_queued_reads) {
+        HAPTime oldest = lhap_read_sched_expire(desc, now);
+        if (oldest) {
+            lhap_read_sched_arm(desc, oldest + desc->read_deadline);
+        }
+    }
+}
+
+/**
+ * Drop the queued reads of the session.
+ */
+static void lhap_read_sched_drop_session(lhap_desc *desc, HAPSessionRef *session) {
+    bool pruned = false;
+    for (lhap_accessory_ext *ext = desc->sched_head; ext; ext = ext->sched_next) {
+        ext->queue_ptail = &ext->queue_head;
+        for (lhap_read_request **pr = &ext->queue_head; *pr;) {
+            lhap_read_request *request = *pr;
+            if (request->session == session) {
+                *pr = request->next;
+                ext->num_queued--;
+                desc->num_queued_reads--;
+                lhap_read_request_free(desc, request);
+            } else {
+                ext->queue_ptail = &request->next;
+                pr = &request->next;
+            }
+        }
+        if (ext->num_queued == 0) {
+            pruned = true;
+        }
+    }
+    if (pruned) {
+        lhap_read_sched_prune(desc);
     }
 }
 
@@ -1290,24 +2878,24 @@ HAPError lhap_char_base_handleRead(
     lua_State *L = desc->mL;
     HAPAssert(lua_gettop(L) == 0);
 
-    if (desc->num_read_requests == desc->max_read_requests) {
-        lhap_read_request *request = pal_mem_alloc(sizeof(*request));
-        if (!request) {
-            return kHAPError_OutOfResources;
-        }
-        request->desc = desc;
-        request->transportType = transportType;
-        request->session = session;
-        request->accessory = accessory;
-        request->service = service,
-        request->characteristic = characteristic;
-        request->pfunc = pfunc;
-        request->next = NULL;
-        *(desc->read_requests_ptail) = request;
-        desc->read_requests_ptail = &request->next;
+    if (lhap_char_cache_read(desc, transportType, accessory, service, characteristic, pfunc)) {
+        return kHAPError_None;
+    }
+
+    if (lhap_char_attach_read(desc, transportType, session, accessory, service, characteristic)) {
         return kHAPError_InProgress;
     }
 
+    lhap_accessory_ext *ext = lhap_accessory_get_ext(accessory);
+    if (ext->has_read_many) {
+        return lhap_accessory_batch_read(desc, ext, transportType, session, service, characteristic);
+    }
+
+    if (desc->num_read_requests >= desc->max_read_requests ||
+        ext->num_in_flight >= desc->max_acc_read_requests || ext->num_queued) {
+        return lhap_read_enqueue(desc, ext, transportType, session, service, characteristic, pfunc);
+    }
+
     return lhap_char_raw_handleRead(false, desc, transportType,
         session, accessory, service, characteristic, pfunc);
 }
@@ -1504,17 +3092,57 @@ end:
     return err;
 }
 
+static void lhap_char_debounce_cb(app_timer_ref timer, void *context);
+
+static void lhap_char_debounce_arm(lhap_char_debounce *d, HAPTime deadline) {
+    if (d->timer) {
+        return;
+    }
+    if (app_timer_register(&d->timer, deadline, lhap_char_debounce_cb, d) != kHAPError_None) {
+        HAPLogError(&lhap_log, "%s: Failed to register write debounce timer.", __func__);
+        HAPFatalError();
+    }
+}
+
 int lhap_char_handle_write_finish(lua_State *L, int status, lua_KContext _ctx) {
     lhap_call_context *ctx = (lhap_call_context *)_ctx;
+    // The writes of a stopped server are not answered.
+    bool current = ctx->generation == ctx->desc->generation;
     HAPError err = kHAPError_None;
+    // Drop the cached value unless the write callback updated it.
+    const HAPBaseCharacteristic *characteristic = ctx->characteristic;
+    if (lhap_char_get_cache(characteristic)->version == ctx->cache_version) {
+        lhap_char_cache_invalidate(characteristic);
+    }
     if (status != LUA_OK && status != LUA_YIELD) {
         HAPLogError(&lhap_log, "%s: %s", __func__, lua_tostring(L, -1));
         err = kHAPError_Unknown;
     }
+    if (ctx->debounced) {
+        // The values written while the callback is running are collapsed into one follow-up.
+        lhap_char_debounce *d = lhap_char_get_debounce(characteristic);
+        d->running = false;
+        if (d->pending && current) {
+            lhap_char_debounce_arm(d, HAPPlatformClockGetCurrent());
+        }
+        if (ctx->in_progress) {
+            return 0;
+        }
+    }
     if (ctx->in_progress == false) {
         lua_pushinteger(L, err);
         return 1;
     }
+    if (!current) {
+        return 0;
+    }
+#ifdef CONFIG_HAP_LOOPBACK
+    if (ctx->desc->loopback) {
+        lhap_loopback_record(ctx->desc, 'w', ctx->session, ctx->accessory->aid,
+            characteristic->iid, characteristic->format, err, NULL);
+        return 0;
+    }
+#endif
     err = HAPCharacteristicResponseWriteRequest(&ctx->desc->server, ctx->transportType,
         ctx->session, ctx->accessory, ctx->service, ctx->characteristic, err);
     if (err != kHAPError_None) {
@@ -1537,13 +3165,23 @@ static int lhap_char_handle_write_pcall(lua_State *L) {
     lua_pop(L, 3);
 
     lua_State *co = lc_newthread(L);
+    lc_setpriority(co, LC_PRIO_HIGH);
+    if (_call_ctx->session) {
+        lua_pushboolean(L, true);
+        lhap_session_bind_context(L, co, _call_ctx->session);
+    }
     lua_pushcfunction(co, lhap_char_handle_write);
     lhap_call_context *call_ctx = lua_newuserdata(co, sizeof(*call_ctx));
     *call_ctx = *_call_ctx;
+    call_ctx->cache_version = lhap_char_get_cache(call_ctx->characteristic)->version;
+    call_ctx->generation = call_ctx->desc->generation;
+    lhap_push_accessory(co, call_ctx->accessory);
+    lua_setuservalue(co, -2);
 
     lc_pushtraceback(co);
     HAPAssert(lua_rawgetp(co, LUA_REGISTRYINDEX, pfunc) == LUA_TFUNCTION);
-    lhap_create_request_table(co, call_ctx->transportType, call_ctx->session, &remote,
+    lc_applytag(co, -1);
+    lhap_push_request(co, call_ctx->transportType, call_ctx->session, &remote,
         call_ctx->accessory, call_ctx->service, call_ctx->characteristic);
 
     lua_pushvalue(L, 1);
@@ -1565,6 +3203,95 @@ static int lhap_char_handle_write_pcall(lua_State *L) {
     }
 }
 
+/**
+ * Keep the value on the top of the stack as the pending value of the debounce.
+ *
+ * The window starts from the first write, so the callback is called
+ * at least once a window while the values keep coming.
+ */
+static void lhap_char_debounce_write(
+        lua_State *L,
+        lhap_desc *desc,
+        lhap_char_debounce *d,
+        HAPTransportType transportType,
+        bool remote,
+        const HAPAccessory *accessory,
+        const HAPService *service,
+        const HAPBaseCharacteristic *characteristic,
+        const void *pfunc) {
+    if (d->pending) {
+        desc->writes_debounced++;
+    }
+    // Serve the reads with the written value until the callback finishes.
+    lhap_char_cache_store(L, -1, characteristic);
+    lhap_char_get_cache(characteristic)->pushed = true;
+    lua_rawsetp(L, LUA_REGISTRYINDEX, d);
+    d->pending = true;
+    d->desc = desc;
+    d->transportType = transportType;
+    d->remote = remote;
+    d->accessory = accessory;
+    d->service = service;
+    d->characteristic = characteristic;
+    d->pfunc = pfunc;
+    if (!d->running) {
+        lhap_char_debounce_arm(d, HAPPlatformClockGetCurrent() + d->window);
+    }
+}
+
+static void lhap_char_debounce_cb(app_timer_ref timer, void *context) {
+    lhap_char_debounce *d = context;
+    lhap_desc *desc = d->desc;
+    d->timer = NULL;
+    if (!desc->started || d->running || !d->pending) {
+        return;
+    }
+
+    lua_State *L = desc->mL;
+    HAPAssert(lua_gettop(L) == 0);
+
+    lhap_call_context call_ctx = {
+        .in_progress = false,
+        .debounced = true,
+        .transportType = d->transportType,
+        .desc = desc,
+        .accessory = d->accessory,
+        .service = d->service,
+        .characteristic = d->characteristic,
+    };
+
+    lua_pushcfunction(L, lhap_char_handle_write_pcall);
+    lua_rawgetp(L, LUA_REGISTRYINDEX, d);
+    lua_pushlightuserdata(L, &call_ctx);
+    lua_pushlightuserdata(L, (void *)d->pfunc);
+    lua_pushboolean(L, d->remote);
+    lua_pushnil(L);
+    lua_rawsetp(L, LUA_REGISTRYINDEX, d);
+    d->pending = false;
+    d->running = true;
+    desc->writes_dispatched++;
+    int status = lua_pcall(L, 4, 1, 0);
+    if (status != LUA_OK) {
+        HAPLogError(&lhap_log, "%s: %s", __func__, lua_tostring(L, -1));
+        d->running = false;
+    }
+    lua_settop(L, 0);
+    lc_collectgarbage(L);
+}
+
+/**
+ * Drop the pending value of the debounce.
+ */
+static void lhap_char_debounce_reset(lua_State *L, lhap_char_debounce *d) {
+    if (d->timer) {
+        app_timer_deregister(d->timer);
+        d->timer = NULL;
+    }
+    d->running = false;
+    d->pending = false;
+    lhap_rawsetp_reset(L, LUA_REGISTRYINDEX, d);
+}
+
 static HAP_RESULT_USE_CHECK
 HAPError lhap_char_base_handleWrite(
         lhap_desc *desc,
@@ -1578,6 +3305,14 @@ HAPError lhap_char_base_handleWrite(
         const void *pfunc) {
     lua_State *L = desc->mL;
 
+    lhap_char_debounce *d = lhap_char_get_debounce(characteristic);
+    if (d->window) {
+        lhap_char_debounce_write(L, desc, d, transportType, remote, accessory, service, characteristic, pfunc);
+        lua_settop(L, 0);
+        lc_collectgarbage(L);
+        return kHAPError_None;
+    }
+
     lhap_call_context call_ctx = {
         .in_progress = false,
         .transportType = transportType,
@@ -1744,6 +3479,7 @@ HAPError lhap_char_TLV8_handleWrite(
 // This definitation is only used to register characteristic callbacks.
 #define LHAP_CASE_CHAR_REGISTER_CB(L, arg, ptr, format, cb) \
 LHAP_CASE_CHAR_FORMAT_CODE(format, ptr, \
+    lc_bindtag(L, arg); \
     lua_pushvalue(L, arg); \
     lua_rawsetp(L, LUA_REGISTRYINDEX, &p->callbacks.cb); \
     p->callbacks.cb = lhap_char_ ## format ## _ ## cb)
@@ -1758,9 +3494,10 @@ static int lhap_accessory_pcall_identify(lua_State *L) {
     // push the identify function
     HAPAssert(lua_rawgetp(co, LUA_REGISTRYINDEX,
         &(accessory->callbacks.identify)) == LUA_TFUNCTION);
+    lc_applytag(co, -1);
 
     // push the table request
-    lhap_create_request_table(co, request->transportType,
+    lhap_push_request(co, request->transportType,
         request->session, &request->remote, accessory, NULL, NULL);
 
     int status, nres;
@@ -1826,12 +3563,17 @@ static void lhap_server_handle_session_accept(
 
     HAPAssert(lua_gettop(L) == 0);
 
-    lua_pushcfunction(L, lhap_server_handle_session_pcall);
-    lua_pushlightuserdata(L, session);
-    lua_pushlightuserdata(L, &desc->server_cbs.handleSessionAccept);
-    int status = lua_pcall(L, 2, 0, 0);
-    if (status != LUA_OK) {
-        HAPLogError(&lhap_log, "%s: %s", __func__, lua_tostring(L, -1));
+    lhap_ip_session_accept(desc, session);
+
+    if (lua_rawgetp(L, LUA_REGISTRYINDEX, &desc->server_cbs.handleSessionAccept) == LUA_TFUNCTION) {
+        lua_pop(L, 1);
+        lua_pushcfunction(L, lhap_server_handle_session_pcall);
+        lua_pushlightuserdata(L, session);
+        lua_pushlightuserdata(L, &desc->server_cbs.handleSessionAccept);
+        int status = lua_pcall(L, 2, 0, 0);
+        if (status != LUA_OK) {
+            HAPLogError(&lhap_log, "%s: %s", __func__, lua_tostring(L, -1));
+        }
     }
 
     lua_settop(L, 0);
@@ -1851,13 +3593,41 @@ static void lhap_server_handle_session_invalid(
 
     HAPAssert(lua_gettop(L) == 0);
 
-    lua_pushcfunction(L, lhap_server_handle_session_pcall);
+    lhap_ip_session_invalidate(desc, session);
+    lhap_event_drop_session(desc, session);
+
+    // drop the queued and batched reads, and the reads waiting for other reads
+    lhap_read_sched_drop_session(desc, session);
+    for (lhap_read_request **pw = &desc->read_waiters; *pw;) {
+        lhap_read_request *w = *pw;
+        if (w->session == session) {
+            *pw = w->next;
+            lhap_read_request_free(desc, w);
+        } else {
+            pw = &w->next;
+        }
+    }
+    lhap_read_batches_drop_session(desc, session);
+
+    // cancel the handlers still waiting on the session
+    lua_pushcfunction(L, lhap_session_cancel_contexts);
     lua_pushlightuserdata(L, session);
-    lua_pushlightuserdata(L, &desc->server_cbs.handleSessionInvalidate);
-    int status = lua_pcall(L, 2, 0, 0);
+    int status = lua_pcall(L, 1, 0, 0);
     if (status != LUA_OK) {
         HAPLogError(&lhap_log, "%s: %s", __func__, lua_tostring(L, -1));
     }
+    lua_settop(L, 0);
+
+    if (lua_rawgetp(L, LUA_REGISTRYINDEX, &desc->server_cbs.handleSessionInvalidate) == LUA_TFUNCTION) {
+        lua_pop(L, 1);
+        lua_pushcfunction(L, lhap_server_handle_session_pcall);
+        lua_pushlightuserdata(L, session);
+        lua_pushlightuserdata(L, &desc->server_cbs.handleSessionInvalidate);
+        status = lua_pcall(L, 2, 0, 0);
+        if (status != LUA_OK) {
+            HAPLogError(&lhap_log, "%s: %s", __func__, lua_tostring(L, -1));
+        }
+    }
 
     lua_settop(L, 0);
     lc_collectgarbage(L);
@@ -1870,12 +3640,15 @@ static void lhap_reset_server_cb(lua_State *L, HAPAccessoryServerCallbacks *cbs)
     lua_rawsetp(L, LUA_REGISTRYINDEX, &cbs->handleSessionInvalidate);
 }
 
+static bool lhap_is_builtin_service(const HAPService *service) {
+    return service == &accessoryInformationService || service == &pairingService ||
+        service == &hapProtocolInformationService;
+}
+
 static void
 lhap_count_attr(const HAPAccessory *acc, size_t *attr, size_t *readable, size_t *writable, size_t *notify) {
     for (const HAPService * const *pserv = acc->services; *pserv; pserv++) {
-        const HAPService *serv = *pserv;
-        if (serv == &accessoryInformationService || serv == &pairingService ||
-            serv == &hapProtocolInformationService) {
+        if (lhap_is_builtin_service(*pserv)) {
             continue;
         }
         (*attr)++;
@@ -1896,6 +3669,72 @@ lhap_count_attr(const HAPAccessory *acc, size_t *attr, size_t *readable, size_t
     }
 }
 
+static size_t lhap_index_accessory(const HAPAccessory *acc, lhap_attr *attrs) {
+    size_t n = 0;
+    for (const HAPService * const *pserv = acc->services; *pserv; pserv++) {
+        // Only the characteristics created by lhap_new_char() are indexed.
+        if (lhap_is_builtin_service(*pserv)) {
+            continue;
+        }
+        for (const HAPBaseCharacteristic * const *pchar =
+            (const HAPBaseCharacteristic * const *)(*pserv)->characteristics; *pchar; pchar++, n++) {
+            if (attrs) {
+                attrs[n] = (lhap_attr) {
+                    .aid = acc->aid,
+                    .iid = (*pchar)->iid,
+                    .service = *pserv,
+                    .characteristic = *pchar,
+                };
+            }
+        }
+    }
+    return n;
+}
+
+static int lhap_attr_cmp(const void *a, const void *b) {
+    const lhap_attr *x = a;
+    const lhap_attr *y = b;
+    if (x->aid != y->aid) {
+        return x->aid < y->aid ? -1 : 1;
+    }
+    return x->iid < y->iid ? -1 : (x->iid > y->iid ? 1 : 0);
+}
+
+/**
+ * Build the attribute index of the primary accessory and the bridged accessories,
+ * so the characteristics are found by binary search.
+ *
+ * The index in use is replaced on success, the caller frees it.
+ */
+static bool lhap_build_index(lhap_desc *desc, HAPAccessory * const *bridged_accs) {
+    size_t n = lhap_index_accessory(desc->primary_acc, NULL);
+    if (bridged_accs) {
+        for (HAPAccessory * const *pacc = bridged_accs; *pacc; pacc++) {
+            n += lhap_index_accessory(*pacc, NULL);
+        }
+    }
+    lhap_attr *attrs = pal_mem_alloc(sizeof(lhap_attr) * HAPMax(n, 1));
+    if (!attrs) {
+        return false;
+    }
+    size_t i = lhap_index_accessory(desc->primary_acc, attrs);
+    if (bridged_accs) {
+        for (HAPAccessory * const *pacc = bridged_accs; *pacc; pacc++) {
+            i += lhap_index_accessory(*pacc, attrs + i);
+        }
+    }
+    qsort(attrs, n, sizeof(lhap_attr), lhap_attr_cmp);
+    desc->attrs = attrs;
+    desc->num_attrs = n;
+    return true;
+}
+
+static void lhap_free_index(lhap_desc *desc) {
+    pal_mem_free(desc->attrs);
+    desc->attrs = NULL;
+    desc->num_attrs = 0;
+}
+
 static void lhap_server_handle_update_state(HAPAccessoryServerRef *server, void *_Nullable context) {
     HAPPrecondition(context);
     HAPPrecondition(server);
@@ -1944,9 +3783,12 @@ static int lhap_new_accessory(lua_State *L) {
     size_t nservices = lhap_checkarray(L, 9);
     luaL_argcheck(L, nservices, 9, "empty services");
     bool has_identify = lhap_optfunction(L, 10);
+    bool has_read_many = lhap_optfunction(L, 11);
 
-    HAPAccessory *accessory = lua_newuserdatauv(L, sizeof(HAPAccessory), 7);
+    size_t size = LHAP_ALIGN_UP(sizeof(HAPAccessory)) + sizeof(lhap_accessory_ext);
+    HAPAccessory *accessory = lua_newuserdatauv(L, size, 7);
     luaL_setmetatable(L, LHAP_ACCESSORY_NAME);
+    HAPRawBufferZero(accessory, size);
     for (size_t i = 3, j = 1; i <= 8; i++, j++) {
         lua_pushvalue(L, i);
         lua_setiuservalue(L, -2, j);
@@ -1978,9 +3820,21 @@ static int lhap_new_accessory(lua_State *L) {
 
     accessory->callbacks.identify = has_identify ? lhap_accessory_on_identify : NULL;
     if (has_identify) {
+        lc_bindtag(L, 10);
         lua_pushvalue(L, 10);
         lua_rawsetp(L, LUA_REGISTRYINDEX, &(accessory->callbacks.identify));
     }
+
+    lhap_accessory_ext *ext = lhap_accessory_get_ext(accessory);
+    ext->accessory = accessory;
+    ext->reads_ptail = &ext->reads_head;
+    ext->queue_ptail = &ext->queue_head;
+    ext->has_read_many = has_read_many;
+    if (has_read_many) {
+        lc_bindtag(L, 11);
+        lua_pushvalue(L, 11);
+        lua_rawsetp(L, LUA_REGISTRYINDEX, ext);
+    }
     return 1;
 }
 
@@ -1990,22 +3844,35 @@ static int lhap_accessory_gc(lua_State *L) {
     if (accessory->callbacks.identify) {
         lhap_rawsetp_reset(L, LUA_REGISTRYINDEX, &(accessory->callbacks.identify));
     }
+    lhap_accessory_ext *ext = lhap_accessory_get_ext(accessory);
+    if (ext->has_read_many) {
+        lhap_rawsetp_reset(L, LUA_REGISTRYINDEX, ext);
+    }
     return 0;
 }
 
-static const lhap_service_type *lhap_get_service_type(const char *s) {
-    for (int i = 0; i < HAPArrayCount(lhap_service_type_tab);
-        i++) {
-        if (HAPStringAreEqual(s, lhap_service_type_tab[i].name)) {
-            return lhap_service_type_tab + i;
-        }
-    }
-    return NULL;
+/**
+ * Look up the type by the name in the type index built by luaopen_hap().
+ *
+ * The names are interned Lua strings, so the lookup is a hash of the string pointer.
+ */
+static const void *lhap_lookup_type(lua_State *L, int idx, const void *tab) {
+    luaL_checkstring(L, idx);
+    lua_rawgetp(L, LUA_REGISTRYINDEX, tab);
+    lua_pushvalue(L, idx);
+    lua_rawget(L, -2);
+    const void *type = lua_touserdata(L, -1);
+    lua_pop(L, 2);
+    return type;
+}
+
+static inline const lhap_service_type *lhap_get_service_type(lua_State *L, int idx) {
+    return lhap_lookup_type(L, idx, lhap_service_type_tab);
 }
 
 static int lhap_new_service(lua_State *L) {
     uint64_t iid = luaL_checkinteger(L, 1);
-    const lhap_service_type *type = lhap_get_service_type(luaL_checkstring(L, 2));
+    const lhap_service_type *type = lhap_get_service_type(L, 2);
     luaL_argcheck(L, type, 2, "unknown type");
     luaL_checktype(L, 3, LUA_TBOOLEAN);
     luaL_checktype(L, 4, LUA_TBOOLEAN);
@@ -2067,40 +3934,22 @@ static int lhap_service_link_services(lua_State *L) {
     return 1;
 }
 
-static const lhap_characteristic_type *lhap_get_char_type(const char *s) {
-    for (int i = 0; i < HAPArrayCount(lhap_characteristic_type_tab);
-        i++) {
-        if (HAPStringAreEqual(s, lhap_characteristic_type_tab[i].name)) {
-            return lhap_characteristic_type_tab + i;
-        }
-    }
-    return NULL;
+static inline const lhap_characteristic_type *lhap_get_char_type(lua_State *L, int idx) {
+    return lhap_lookup_type(L, idx, lhap_characteristic_type_tab);
 }
 
-static int lhap_new_char(lua_State *L) {
-    uint64_t iid = luaL_checkinteger(L, 1);
-    HAPCharacteristicFormat format = luaL_checkoption(L, 2, NULL, lhap_characteristic_format_strs);
-    const lhap_characteristic_type *type = lhap_get_char_type(luaL_checkstring(L, 3));
-    luaL_argcheck(L, type, 3, "unknown type");
-    luaL_checktype(L, 4, LUA_TTABLE);
-    bool has_read = lhap_optfunction(L, 5);
-    bool has_write = lhap_optfunction(L, 6);
-
-    HAPBaseCharacteristic *characteristic = lua_newuserdatauv(L,
-        lhap_characteristic_struct_size[format], format == kHAPCharacteristicFormat_UInt8 ? 3 : 1);
-    luaL_setmetatable(L, LHAP_CHARACTERISTIC_NAME);
-    HAPRawBufferZero(characteristic, lhap_characteristic_struct_size[format]);
-    characteristic->iid = iid;
-    characteristic->format = format;
-    characteristic->characteristicType = type->type;
-    characteristic->debugDescription = type->debugDescription;
-    lc_traverse_table(L, 4, lhap_char_props_kvs, &characteristic->properties);
-
-    if (has_read) {
+/**
+ * Register the read and write callbacks of the characteristic.
+ *
+ * @param read Stack index of the read callback, 0 if there is no one.
+ * @param write Stack index of the write callback, 0 if there is no one.
+ */
+static void lhap_char_register_cbs(lua_State *L, HAPBaseCharacteristic *characteristic, int read, int write) {
+    if (read) {
 #define LHAP_CASE_CHAR_REGISTER_READ_CB(format) \
-    LHAP_CASE_CHAR_REGISTER_CB(L, 5, characteristic, format, handleRead)
+    LHAP_CASE_CHAR_REGISTER_CB(L, read, characteristic, format, handleRead)
 
-    switch (format) {
+    switch (characteristic->format) {
         LHAP_CASE_CHAR_REGISTER_READ_CB(Data)
         LHAP_CASE_CHAR_REGISTER_READ_CB(Bool)
         LHAP_CASE_CHAR_REGISTER_READ_CB(UInt8)
@@ -2116,28 +3965,122 @@ static int lhap_new_char(lua_State *L) {
 #undef LHAP_CASE_CHAR_REGISTER_READ_CB
     }
 
-    if (has_write) {
-#define LHAP_CASE_CHAR_REGISTER_WRITE_CB(format) \
-    LHAP_CASE_CHAR_REGISTER_CB(L, 6, characteristic, format, handleWrite)
+    if (write) {
+#define LHAP_CASE_CHAR_REGISTER_WRITE_CB(format) \
+    LHAP_CASE_CHAR_REGISTER_CB(L, write, characteristic, format, handleWrite)
+
+    switch (characteristic->format) {
+        LHAP_CASE_CHAR_REGISTER_WRITE_CB(Data)
+        LHAP_CASE_CHAR_REGISTER_WRITE_CB(Bool)
+        LHAP_CASE_CHAR_REGISTER_WRITE_CB(UInt8)
+        LHAP_CASE_CHAR_REGISTER_WRITE_CB(UInt16)
+        LHAP_CASE_CHAR_REGISTER_WRITE_CB(UInt32)
+        LHAP_CASE_CHAR_REGISTER_WRITE_CB(UInt64)
+        LHAP_CASE_CHAR_REGISTER_WRITE_CB(Int)
+        LHAP_CASE_CHAR_REGISTER_WRITE_CB(Float)
+        LHAP_CASE_CHAR_REGISTER_WRITE_CB(String)
+        LHAP_CASE_CHAR_REGISTER_WRITE_CB(TLV8)
+    }
+
+#undef LHAP_CASE_CHAR_REGISTER_WRITE_CB
+    }
+
+    // TODO(Zebin Wu): Register sub/unsub callbacks.
+}
+
+/**
+ * New a characteristic userdata with the value cache and the write debounce.
+ */
+static HAPBaseCharacteristic *lhap_char_newuserdata(lua_State *L, HAPCharacteristicFormat format, int nuvalue) {
+    size_t size = lhap_char_debounce_offset(format) + sizeof(lhap_char_debounce);
+    HAPBaseCharacteristic *characteristic = lua_newuserdatauv(L, size, nuvalue);
+    luaL_setmetatable(L, LHAP_CHARACTERISTIC_NAME);
+    HAPRawBufferZero(characteristic, size);
+    lhap_char_get_cache(characteristic)->ttl = -1;
+    return characteristic;
+}
+
+static int lhap_new_char(lua_State *L) {
+    uint64_t iid = luaL_checkinteger(L, 1);
+    HAPCharacteristicFormat format = luaL_checkoption(L, 2, NULL, lhap_characteristic_format_strs);
+    const lhap_characteristic_type *type = lhap_get_char_type(L, 3);
+    luaL_argcheck(L, type, 3, "unknown type");
+    luaL_checktype(L, 4, LUA_TTABLE);
+    bool has_read = lhap_optfunction(L, 5);
+    bool has_write = lhap_optfunction(L, 6);
+
+    HAPBaseCharacteristic *characteristic = lhap_char_newuserdata(L,
+        format, format == kHAPCharacteristicFormat_UInt8 ? 3 : 1);
+    characteristic->iid = iid;
+    characteristic->format = format;
+    characteristic->characteristicType = type->type;
+    characteristic->debugDescription = type->debugDescription;
+    lc_traverse_table(L, 4, lhap_char_props_kvs, &characteristic->properties);
+    lhap_char_register_cbs(L, characteristic, has_read ? 5 : 0, has_write ? 6 : 0);
+    return 1;
+}
+
+/**
+ * The prototype is followed by a flag which is set once it is instantiated.
+ */
+static bool *lhap_char_prototype_instantiated(const HAPBaseCharacteristic *prototype) {
+    return (bool *)((char *)prototype + lhap_characteristic_struct_size[prototype->format]);
+}
+
+static int lhap_new_char_prototype(lua_State *L) {
+    HAPCharacteristicFormat format = luaL_checkoption(L, 1, NULL, lhap_characteristic_format_strs);
+    const lhap_characteristic_type *type = lhap_get_char_type(L, 2);
+    luaL_argcheck(L, type, 2, "unknown type");
+    luaL_checktype(L, 3, LUA_TTABLE);
+
+    // The prototype is a bare characteristic without IID and callbacks,
+    // the user values keep the metadata shared with the instances.
+    size_t size = lhap_characteristic_struct_size[format] + sizeof(bool);
+    HAPBaseCharacteristic *prototype = lua_newuserdatauv(L,
+        size, format == kHAPCharacteristicFormat_UInt8 ? 3 : 1);
+    luaL_setmetatable(L, LHAP_CHAR_PROTOTYPE_NAME);
+    HAPRawBufferZero(prototype, size);
+    prototype->format = format;
+    prototype->characteristicType = type->type;
+    prototype->debugDescription = type->debugDescription;
+    lc_traverse_table(L, 3, lhap_char_props_kvs, &prototype->properties);
+    return 1;
+}
+
+static int lhap_char_prototype_new(lua_State *L) {
+    HAPBaseCharacteristic *prototype = luaL_checkudata(L, 1, LHAP_CHAR_PROTOTYPE_NAME);
+    uint64_t iid = luaL_checkinteger(L, 2);
+    bool has_read = lhap_optfunction(L, 3);
+    bool has_write = lhap_optfunction(L, 4);
+
+    // The last user value is the prototype, it keeps the shared metadata alive,
+    // the others keep the metadata overridden by the instance.
+    int nuvalue = prototype->format == kHAPCharacteristicFormat_UInt8 ? 4 : 2;
+    HAPBaseCharacteristic *characteristic = lhap_char_newuserdata(L, prototype->format, nuvalue);
+    HAPRawBufferCopyBytes(characteristic, prototype, lhap_characteristic_struct_size[prototype->format]);
+    characteristic->iid = iid;
+    lua_pushvalue(L, 1);
+    lua_setiuservalue(L, -2, nuvalue);
+    *lhap_char_prototype_instantiated(prototype) = true;
+    lhap_char_register_cbs(L, characteristic, has_read ? 3 : 0, has_write ? 4 : 0);
+    return 1;
+}
 
-    switch (format) {
-        LHAP_CASE_CHAR_REGISTER_WRITE_CB(Data)
-        LHAP_CASE_CHAR_REGISTER_WRITE_CB(Bool)
-        LHAP_CASE_CHAR_REGISTER_WRITE_CB(UInt8)
-        LHAP_CASE_CHAR_REGISTER_WRITE_CB(UInt16)
-        LHAP_CASE_CHAR_REGISTER_WRITE_CB(UInt32)
-        LHAP_CASE_CHAR_REGISTER_WRITE_CB(UInt64)
-        LHAP_CASE_CHAR_REGISTER_WRITE_CB(Int)
-        LHAP_CASE_CHAR_REGISTER_WRITE_CB(Float)
-        LHAP_CASE_CHAR_REGISTER_WRITE_CB(String)
-        LHAP_CASE_CHAR_REGISTER_WRITE_CB(TLV8)
+/**
+ * Check the characteristic or the prototype whose metadata is set.
+ *
+ * The instances point to the metadata of the prototype, so the prototype
+ * can not be changed once it is instantiated.
+ */
+static HAPBaseCharacteristic *lhap_char_check_meta(lua_State *L, int idx) {
+    HAPBaseCharacteristic *characteristic = luaL_testudata(L, idx, LHAP_CHAR_PROTOTYPE_NAME);
+    if (!characteristic) {
+        return luaL_checkudata(L, idx, LHAP_CHARACTERISTIC_NAME);
     }
-
-#undef LHAP_CASE_CHAR_REGISTER_READ_CB
+    if (*lhap_char_prototype_instantiated(characteristic)) {
+        luaL_error(L, "the prototype is instantiated");
     }
-
-    // TODO(Zebin Wu): Register sub/unsub callbacks.
-    return 1;
+    return characteristic;
 }
 
 static int lhap_char_gc(lua_State *L) {
@@ -2166,11 +4109,32 @@ static int lhap_char_gc(lua_State *L) {
 
 #undef LHAP_RESET_CHAR_CBS
 
+    lhap_rawsetp_reset(L, LUA_REGISTRYINDEX, lhap_char_get_cache(characteristic));
+    lhap_char_debounce_reset(L, lhap_char_get_debounce(characteristic));
     return 0;
 }
 
-static int lhap_char_set_mfg_desc(lua_State *L) {
+static int lhap_char_set_cache_ttl(lua_State *L) {
+    HAPBaseCharacteristic *characteristic = luaL_checkudata(L, 1, LHAP_CHARACTERISTIC_NAME);
+    lua_Integer ttl = luaL_checkinteger(L, 2);
+    luaL_argcheck(L, ttl >= 0 && ttl <= INT32_MAX, 2, "TTL out of range");
+    lhap_char_get_cache(characteristic)->ttl = ttl;
+    lua_pushvalue(L, 1);
+    return 1;
+}
+
+static int lhap_char_set_write_debounce(lua_State *L) {
     HAPBaseCharacteristic *characteristic = luaL_checkudata(L, 1, LHAP_CHARACTERISTIC_NAME);
+    lua_Integer window = luaL_checkinteger(L, 2);
+    luaL_argcheck(L, window >= 0 && window <= INT32_MAX, 2, "window out of range");
+    luaL_argcheck(L, characteristic->properties.writable, 1, "not writable");
+    lhap_char_get_debounce(characteristic)->window = window;
+    lua_pushvalue(L, 1);
+    return 1;
+}
+
+static int lhap_char_set_mfg_desc(lua_State *L) {
+    HAPBaseCharacteristic *characteristic = lhap_char_check_meta(L, 1);
     const char *mfgDesc = luaL_checkstring(L, 2);
     lua_setiuservalue(L, 1, 1);
     characteristic->manufacturerDescription = mfgDesc;
@@ -2178,7 +4142,7 @@ static int lhap_char_set_mfg_desc(lua_State *L) {
 }
 
 static int lhap_char_set_units(lua_State *L) {
-    HAPBaseCharacteristic *characteristic = luaL_checkudata(L, 1, LHAP_CHARACTERISTIC_NAME);
+    HAPBaseCharacteristic *characteristic = lhap_char_check_meta(L, 1);
     HAPCharacteristicFormat format = characteristic->format;
     if (format < kHAPCharacteristicFormat_UInt8 ||
         format > kHAPCharacteristicFormat_Float) {
@@ -2201,7 +4165,7 @@ static int lhap_char_set_units(lua_State *L) {
 }
 
 static int lhap_char_set_contraints(lua_State *L) {
-    HAPBaseCharacteristic *characteristic = luaL_checkudata(L, 1, LHAP_CHARACTERISTIC_NAME);
+    HAPBaseCharacteristic *characteristic = lhap_char_check_meta(L, 1);
     HAPCharacteristicFormat format = characteristic->format;
     switch (format) {
     LHAP_CASE_CHAR_FORMAT_CODE(String, characteristic, p->constraints.maxLength = luaL_checkinteger(L, 2))
@@ -2244,7 +4208,7 @@ static int lhap_char_set_contraints(lua_State *L) {
 }
 
 static int lhap_char_set_valid_vals(lua_State *L) {
-    HAPBaseCharacteristic *_characteristic = luaL_checkudata(L, 1, LHAP_CHARACTERISTIC_NAME);
+    HAPBaseCharacteristic *_characteristic = lhap_char_check_meta(L, 1);
     if (_characteristic->format != kHAPCharacteristicFormat_UInt8) {
         luaL_error(L, "attempt to set valid values for not 'UInt8' format characteristic");
     }
@@ -2282,7 +4246,7 @@ static int lhap_char_set_valid_vals(lua_State *L) {
 }
 
 static int lhap_set_valid_vals_ranges(lua_State *L) {
-    HAPBaseCharacteristic *_characteristic = luaL_checkudata(L, 1, LHAP_CHARACTERISTIC_NAME);
+    HAPBaseCharacteristic *_characteristic = lhap_char_check_meta(L, 1);
     if (_characteristic->format != kHAPCharacteristicFormat_UInt8) {
         luaL_error(L, "attempt to set valid values for not 'UInt8' format characteristic");
     }
@@ -2347,64 +4311,98 @@ static int lhap_accessory_is_valid(lua_State *L) {
     return 1;
 }
 
-static int lhap_start(lua_State *L) {
-    lhap_desc *desc = &gv_lhap_desc;
-    if (desc->started) {
-        luaL_error(L, "HAP is already started");
+/**
+ * New a NULL-terminated array of the n bridged accessories in the table at @p idx,
+ * with room for @p size accessories. The array is pushed onto the stack.
+ */
+static HAPAccessory **lhap_new_bridged_accs(lua_State *L, int idx, size_t n, size_t size) {
+    HAPAccessory **accs = lua_newuserdata(L, sizeof(HAPAccessory *) * (size + 1));
+    for (size_t i = 1; i <= n; i++) {
+        lua_geti(L, idx, i);
+        accs[i - 1] = luaL_checkudata(L, -1, LHAP_ACCESSORY_NAME);
+        if (!HAPBridgedAccessoryIsValid(accs[i - 1])) {
+            luaL_error(L, "bridgedAccessories[%d]: invalid definition", i);
+        }
+        lua_pop(L, 1);
     }
+    accs[n] = NULL;
+    return accs;
+}
 
-    desc->primary_acc = luaL_checkudata(L, 1, LHAP_ACCESSORY_NAME);
-    luaL_argcheck(L, HAPRegularAccessoryIsValid(desc->primary_acc), 1, "invalid primary accessory");
-    desc->num_bridged_accs = lhap_optarray(L, 2);
-    luaL_checktype(L, 3, LUA_TBOOLEAN);
-    bool conf_changed = lua_toboolean(L, 3);
-    bool has_session_accept = lhap_optfunction(L, 4);
-    bool has_session_invalid = lhap_optfunction(L, 5);
-
-    desc->bridged_accs = NULL;
-    if (desc->num_bridged_accs) {
-        desc->bridged_accs = lua_newuserdata(L, sizeof(HAPAccessory *) * (desc->num_bridged_accs + 1));
-        lua_pushvalue(L, 2);
-        lua_setuservalue(L, -2);
-        for (size_t i = 1; i <= desc->num_bridged_accs; i++) {
-            lua_geti(L, 2, i);
-            desc->bridged_accs[i - 1] = luaL_checkudata(L, -1, LHAP_ACCESSORY_NAME);
-            if (!HAPBridgedAccessoryIsValid(desc->bridged_accs[i - 1])) {
-                luaL_error(L, "bridgedAccessories[%d]: invalid definition", i);
-            }
-            lua_pop(L, 1);
-        }
-        desc->bridged_accs[desc->num_bridged_accs] = NULL;
-        lua_rawsetp(L, LUA_REGISTRYINDEX, &desc->bridged_accs);
+/**
+ * Serve the primary accessory at @p primary and the bridged accessories in the array at @p bridged,
+ * they replace the served accessories anchored in the registry.
+ */
+static void lhap_serve_accessories(lua_State *L, int primary, int bridged, size_t n) {
+    lua_createtable(L, 0, n + 1);
+    const HAPAccessory *acc = lua_touserdata(L, primary);
+    lua_pushvalue(L, primary);
+    lua_rawsetp(L, -2, acc);
+    lhap_accessory_get_ext(acc)->served = true;
+    for (size_t i = 1; i <= n; i++) {
+        lua_geti(L, bridged, i);
+        acc = lua_touserdata(L, -1);
+        lua_rawsetp(L, -2, acc);
+        lhap_accessory_get_ext(acc)->served = true;
     }
+    lua_setfield(L, LUA_REGISTRYINDEX, LHAP_ACCESSORIES);
+}
 
-    lua_pushvalue(L, 1);
-    lua_rawsetp(L, LUA_REGISTRYINDEX, &desc->primary_acc);
+static void lhap_read_sched_init(lhap_desc *desc) {
+    desc->num_read_requests = 0;
+    desc->num_queued_reads = 0;
+    desc->sched_head = NULL;
+    desc->sched_ptail = &desc->sched_head;
+}
 
-    if (has_session_accept) {
-        lua_pushvalue(L, 4);
-        lua_rawsetp(L, LUA_REGISTRYINDEX, &desc->server_cbs.handleSessionAccept);
+/**
+ * Cap the characteristic contexts of a session by the free memory,
+ * the sessions take at most 1/LHAP_IP_SESSIONS_MEM_DIV of the free heap.
+ *
+ * The event notification slots are never capped, a characteristic without a slot
+ * loses its subscriptions, so the launch fails if the memory can't cover them.
+ */
+static void lhap_ip_size_by_memory(lua_State *L, lhap_desc *desc, size_t *num_contexts, size_t num_notify) {
+    size_t free_size = pal_mem_get_free_size();
+    if (!free_size) {
+        return;
     }
-    if (has_session_invalid) {
-        lua_pushvalue(L, 5);
-        lua_rawsetp(L, LUA_REGISTRYINDEX, &desc->server_cbs.handleSessionInvalidate);
+    size_t budget = free_size / LHAP_IP_SESSIONS_MEM_DIV / desc->ip_max_sessions;
+    size_t fixed = PAL_HAP_IP_SESSION_STORAGE_INBOUND_BUFSIZE +
+        PAL_HAP_IP_SESSION_STORAGE_OUTBOUND_BUFSIZE +
+        PAL_HAP_IP_SESSION_STORAGE_SCRATCH_BUFSIZE +
+        sizeof(HAPIPEventNotificationRef) * num_notify;
+    size_t need = fixed + sizeof(HAPIPCharacteristicContextRef) * *num_contexts;
+    if (need <= budget) {
+        return;
     }
+    // A session keeps a minimum of contexts for the small requests.
+    size_t min_contexts = HAPMin(*num_contexts, LHAP_IP_CHARS_MIN);
+    if (budget < fixed + sizeof(HAPIPCharacteristicContextRef) * min_contexts) {
+        luaL_error(L, "not enough memory for %d IP sessions with %d event notifications: "
+            "%I bytes free, %I bytes needed a session", (int)desc->ip_max_sessions, (int)num_notify,
+            (lua_Integer)free_size, (lua_Integer)(fixed + sizeof(HAPIPCharacteristicContextRef) * min_contexts));
+    }
+    *num_contexts = HAPMax((budget - fixed) / sizeof(HAPIPCharacteristicContextRef), min_contexts);
+    HAPLogInfo(&lhap_log, "%s: %zu bytes free, %zu contexts a session.", __func__, free_size, *num_contexts);
+}
 
-    desc->server_cbs.handleSessionAccept = has_session_accept ? lhap_server_handle_session_accept : NULL;
-    desc->server_cbs.handleSessionInvalidate = has_session_invalid ? lhap_server_handle_session_invalid : NULL;
-    desc->server_cbs.handleUpdatedState = lhap_server_handle_update_state;
-
+/**
+ * Count the characteristic contexts and the event notification slots a session needs
+ * for the primary accessory and the bridged accessories, within the limits.
+ */
+static void lhap_ip_count(lhap_desc *desc, const HAPAccessory *primary_acc,
+    HAPAccessory * const *bridged_accs, size_t *num_contexts, size_t *num_notify) {
     size_t num_attr = LHAP_ATTR_CNT_DFT;
     size_t num_readable = LHAP_CHAR_READ_CNT_DFT;
     size_t num_writable = LHAP_CHAR_WRITE_CNT_DFT;
-    size_t num_notify = LHAP_CHAR_NOTIFY_CNT_DFT;
+    *num_notify = LHAP_CHAR_NOTIFY_CNT_DFT;
 
-    lhap_count_attr(desc->primary_acc, &num_attr, &num_readable, &num_writable, &num_notify);
+    lhap_count_attr(primary_acc, &num_attr, &num_readable, &num_writable, num_notify);
 
-    if (desc->bridged_accs) {
-        for (const HAPAccessory * const *pacc =
-            (const HAPAccessory * const *)desc->bridged_accs; *pacc; pacc++) {
-            lhap_count_attr(*pacc, &num_attr, &num_readable, &num_writable, &num_notify);
+    if (bridged_accs) {
+        for (HAPAccessory * const *pacc = bridged_accs; *pacc; pacc++) {
+            lhap_count_attr(*pacc, &num_attr, &num_readable, &num_writable, num_notify);
         }
     }
 
@@ -2414,8 +4412,42 @@ static int lhap_start(lua_State *L) {
     if (num_writable == 0) {
         num_writable = 1;
     }
-    if (num_notify == 0) {
-        num_notify = 1;
+    if (*num_notify == 0) {
+        *num_notify = 1;
+    }
+
+    // A request carries at most the readable or writable characteristics,
+    // the caps trade the size of large requests for the memory of the sessions.
+    *num_contexts = HAPMax(num_readable, num_writable);
+    if (desc->ip_max_contexts && *num_contexts > desc->ip_max_contexts) {
+        *num_contexts = desc->ip_max_contexts;
+    }
+    if (desc->ip_max_notify && *num_notify > desc->ip_max_notify) {
+        *num_notify = desc->ip_max_notify;
+    }
+}
+
+/**
+ * Size the buffers of the IP sessions by the characteristics of the accessories.
+ */
+static void lhap_size_ip(lua_State *L, lhap_desc *desc) {
+    size_t num_contexts, num_notify;
+    lhap_ip_count(desc, desc->primary_acc, desc->bridged_accs, &num_contexts, &num_notify);
+    desc->ip_sized_contexts = num_contexts;
+    lhap_ip_size_by_memory(L, desc, &num_contexts, num_notify);
+
+    desc->ip_num_contexts = num_contexts;
+    desc->ip_num_notify = num_notify;
+}
+
+/**
+ * Size the sessions, build the attribute index, create and start the accessory server.
+ */
+static void lhap_launch_server(lua_State *L, lhap_desc *desc, bool conf_changed) {
+    lhap_size_ip(L, desc);
+
+    if (!lhap_build_index(desc, desc->bridged_accs)) {
+        luaL_error(L, "failed to build the attribute index");
     }
 
     pal_hap_init_platform(&desc->platform);
@@ -2425,7 +4457,9 @@ static int lhap_start(lua_State *L) {
     HAPPlatformAccessorySetupLoadSetupCode(desc->platform.accessorySetup, &setupCode);
     HAPLog(&lhap_log, "Setup code: %s", setupCode.stringValue);
 
-    lhap_init_ip(&desc->server_options, HAPMax(num_readable, num_writable), num_notify);
+    lhap_init_ip(desc);
+    HAPLogInfo(&lhap_log, "%zu bridged accessories, %zu characteristics indexed.",
+        desc->num_bridged_accs, desc->num_attrs);
     desc->server_options.maxPairings = kHAPPairingStorage_MinElements;
 
     // Initialize accessory server.
@@ -2444,65 +4478,494 @@ static int lhap_start(lua_State *L) {
         HAPAccessoryServerStart(&desc->server, desc->primary_acc);
     }
 
+    lhap_read_sched_init(desc);
+}
+
+static int lhap_start(lua_State *L) {
+    lhap_desc *desc = &gv_lhap_desc;
+    if (desc->started) {
+        luaL_error(L, "HAP is already started");
+    }
+
+    desc->primary_acc = luaL_checkudata(L, 1, LHAP_ACCESSORY_NAME);
+    luaL_argcheck(L, HAPRegularAccessoryIsValid(desc->primary_acc), 1, "invalid primary accessory");
+    desc->num_bridged_accs = lhap_optarray(L, 2);
+    luaL_argcheck(L, desc->num_bridged_accs <= LHAP_BRIDGED_ACCS_MAX, 2, "too many bridged accessories");
+    luaL_checktype(L, 3, LUA_TBOOLEAN);
+    bool conf_changed = lua_toboolean(L, 3);
+    bool has_session_accept = lhap_optfunction(L, 4);
+    bool has_session_invalid = lhap_optfunction(L, 5);
+
+    // A bridge has room for all the bridged accessories, hap.reconfigure() replaces them in place.
+    desc->bridged_accs = NULL;
+    if (desc->num_bridged_accs || desc->primary_acc->category == kHAPAccessoryCategory_Bridges) {
+        desc->bridged_accs = lhap_new_bridged_accs(L, 2, desc->num_bridged_accs, LHAP_BRIDGED_ACCS_MAX);
+        lua_rawsetp(L, LUA_REGISTRYINDEX, &desc->bridged_accs);
+    }
+    lhap_serve_accessories(L, 1, 2, desc->num_bridged_accs);
+
+    lua_pushvalue(L, 1);
+    lua_rawsetp(L, LUA_REGISTRYINDEX, &desc->primary_acc);
+
+    if (has_session_accept) {
+        lua_pushvalue(L, 4);
+        lua_rawsetp(L, LUA_REGISTRYINDEX, &desc->server_cbs.handleSessionAccept);
+    }
+    if (has_session_invalid) {
+        lua_pushvalue(L, 5);
+        lua_rawsetp(L, LUA_REGISTRYINDEX, &desc->server_cbs.handleSessionInvalidate);
+    }
+
+    desc->server_cbs.handleSessionAccept = lhap_server_handle_session_accept;
+    desc->server_cbs.handleSessionInvalidate = lhap_server_handle_session_invalid;
+    desc->server_cbs.handleUpdatedState = lhap_server_handle_update_state;
+
+    lhap_launch_server(L, desc, conf_changed);
+
+    desc->mL = lc_getmainthread(L);
+    desc->co = L;
+    return lua_yieldk(L, 0, (lua_KContext)desc, lhap_start_finish);
+}
+
+/**
+ * Reset the reads of the accessory, the reads in flight are never answered.
+ */
+static void lhap_accessory_reset_reads(lhap_desc *desc, const HAPAccessory *acc) {
+    lhap_accessory_ext *ext = lhap_accessory_get_ext(acc);
+    while (ext->queue_head) {
+        lhap_read_request_free(desc, lhap_read_dequeue(desc, ext));
+    }
+    ext->num_in_flight = 0;
+    ext->sched_next = NULL;
+}
+
+static void lhap_char_reset_state(lua_State *L, const HAPAccessory *acc) {
+    for (const HAPService * const *pserv = acc->services; *pserv; pserv++) {
+        if (lhap_is_builtin_service(*pserv)) {
+            continue;
+        }
+        for (const HAPBaseCharacteristic * const *pchar =
+            (const HAPBaseCharacteristic * const *)(*pserv)->characteristics; *pchar; pchar++) {
+            lhap_char_get_cache(*pchar)->reading = NULL;
+            lhap_char_debounce_reset(L, lhap_char_get_debounce(*pchar));
+        }
+    }
+}
+
+/**
+ * Release the accessory server, and drop the reads, writes and events of the accessories.
+ */
+static void lhap_release_server(lua_State *L, lhap_desc *desc) {
+    // Release accessory server.
+    if (!lhap_is_loopback(desc)) {
+        HAPAccessoryServerRelease(&desc->server);
+    }
+
+    // The reads in flight are never answered, the pending writes and events are dropped.
+    desc->generation++;
+    if (desc->event_timer) {
+        app_timer_deregister(desc->event_timer);
+        desc->event_timer = NULL;
+    }
+    desc->num_events = 0;
+    if (desc->read_sched_timer) {
+        app_timer_deregister(desc->read_sched_timer);
+        desc->read_sched_timer = NULL;
+    }
+    lhap_char_reset_state(L, desc->primary_acc);
+    lhap_accessory_reset_reads(desc, desc->primary_acc);
+    lhap_accessory_get_ext(desc->primary_acc)->served = false;
+    if (desc->bridged_accs) {
+        for (HAPAccessory **pacc = desc->bridged_accs; *pacc; pacc++) {
+            lhap_char_reset_state(L, *pacc);
+            lhap_accessory_reset_reads(desc, *pacc);
+            lhap_accessory_get_ext(*pacc)->served = false;
+        }
+    }
+    desc->sched_head = NULL;
+    desc->sched_ptail = &desc->sched_head;
     desc->num_read_requests = 0;
-    desc->max_read_requests = LHAP_READ_REQUESTS_MAX;
-    desc->read_requests_head = NULL;
-    desc->read_requests_ptail = &desc->read_requests_head;
+    while (desc->read_waiters) {
+        lhap_read_request *w = desc->read_waiters;
+        desc->read_waiters = w->next;
+        lhap_read_request_free(desc, w);
+    }
+    while (desc->read_batches) {
+        lhap_accessory_ext *ext = desc->read_batches;
+        desc->read_batches = ext->next;
+        ext->next = NULL;
+        while (ext->reads_head) {
+            lhap_read_request *request = ext->reads_head;
+            ext->reads_head = request->next;
+            lhap_read_request_free(desc, request);
+        }
+        ext->reads_ptail = &ext->reads_head;
+        ext->num_reads = 0;
+    }
+    desc->num_batched_reads = 0;
+    while (desc->free_read_requests) {
+        lhap_read_request *request = desc->free_read_requests;
+        desc->free_read_requests = request->next;
+        pal_mem_free(request);
+    }
+    desc->num_free_read_requests = 0;
+
+    lhap_deinit_ip(desc);
+    lhap_free_index(desc);
+#ifdef CONFIG_HAP_LOOPBACK
+    pal_mem_free(desc->loopback);
+    desc->loopback = NULL;
+#endif
+
+    HAPRawBufferZero(&desc->server, sizeof(desc->server));
+}
+
+static int lhap_stop_finish(lua_State *L, int status, lua_KContext extra) {
+    lhap_desc *desc = (lhap_desc *)extra;
+
+    lhap_release_server(L, desc);
+
+    lhap_rawsetp_reset(L, LUA_REGISTRYINDEX, &desc->primary_acc);
+    lhap_rawsetp_reset(L, LUA_REGISTRYINDEX, &desc->bridged_accs);
+    lua_pushnil(L);
+    lua_setfield(L, LUA_REGISTRYINDEX, LHAP_ACCESSORIES);
+
+    lhap_reset_server_cb(L, &desc->server_cbs);
+    HAPRawBufferZero(&desc->server_cbs, sizeof(desc->server_cbs));
+
+    desc->primary_acc = NULL;
+    desc->bridged_accs = NULL;
+    desc->num_bridged_accs = 0;
+    desc->co = NULL;
+    desc->mL = NULL;
+    desc->started = false;
+    return 0;
+}
+
+static int lhap_stop(lua_State *L) {
+    lhap_desc *desc = &gv_lhap_desc;
+
+    if (!desc->started) {
+        luaL_error(L, "HAP is not started.");
+    }
+
+    // Deliver the events waiting for the window.
+    lhap_event_flush(desc);
+
+    if (lhap_is_loopback(desc)) {
+        return lhap_stop_finish(L, LUA_OK, (lua_KContext)desc);
+    }
+
+    // Stop accessory server.
+    HAPAccessoryServerStop(&desc->server);
+
+    desc->co = L;
+    return lua_yieldk(L, 0, (lua_KContext)desc, lhap_stop_finish);
+}
+
+/**
+ * Stop serving the bridged accessory removed by hap.reconfigure().
+ *
+ * The queued and batched reads fail, the pending writes and events are dropped.
+ * The reads and writes running the callbacks keep the accessory in their call contexts,
+ * they are answered when the callbacks return.
+ */
+static void lhap_accessory_retire(lua_State *L, lhap_desc *desc, const HAPAccessory *acc) {
+    lhap_accessory_ext *ext = lhap_accessory_get_ext(acc);
+    ext->served = false;
+    while (ext->queue_head) {
+        lhap_read_request *request = lhap_read_dequeue(desc, ext);
+        HAPError err = lhap_char_response_read_request(desc, request->transportType,
+            request->session, request->accessory, request->service, request->characteristic,
+            kHAPError_InvalidState, NULL);
+        if (err != kHAPError_None) {
+            HAPLogError(&lhap_log, "%s: Failed to response read request, error code: %d.", __func__, err);
+        }
+        lhap_read_request_free(desc, request);
+    }
+    lhap_read_sched_prune(desc);
+    if (ext->num_reads) {
+        for (lhap_accessory_ext **pext = &desc->read_batches; *pext; pext = &(*pext)->next) {
+            if (*pext == ext) {
+                *pext = ext->next;
+                break;
+            }
+        }
+        ext->next = NULL;
+        lhap_accessory_fail_reads(desc, ext, kHAPError_InvalidState);
+    }
+    lhap_char_reset_state(L, acc);
+    lhap_event_drop_accessory(desc, acc->aid);
+}
+
+static bool lhap_accessory_in(const HAPAccessory *acc, HAPAccessory * const *accs) {
+    for (HAPAccessory * const *pacc = accs; *pacc; pacc++) {
+        if (*pacc == acc) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static int lhap_reconfigure(lua_State *L) {
+    lhap_desc *desc = &gv_lhap_desc;
+
+    if (!desc->started) {
+        luaL_error(L, "HAP is not started.");
+    }
+    if (!desc->bridged_accs) {
+        luaL_error(L, "the primary accessory is not a bridge");
+    }
+    size_t n = lhap_optarray(L, 1);
+    luaL_argcheck(L, n <= LHAP_BRIDGED_ACCS_MAX, 1, "too many bridged accessories");
+    lua_settop(L, 1);
+    HAPAccessory **accs = lhap_new_bridged_accs(L, 1, n, n);
+
+    // The accessories in both sets are kept as they are, with their value caches and reads in flight.
+    size_t kept = 0;
+    for (size_t i = 0; i < n; i++) {
+        for (size_t j = 0; j < i; j++) {
+            if (accs[j]->aid == accs[i]->aid) {
+                luaL_error(L, "bridgedAccessories[%d]: duplicate aid %d", (int)(i + 1), (int)accs[i]->aid);
+            }
+        }
+        if (lhap_accessory_in(accs[i], desc->bridged_accs)) {
+            kept++;
+        }
+    }
+    size_t added = n - kept;
+    size_t removed = desc->num_bridged_accs - kept;
+    if (added == 0 && removed == 0) {
+        lua_pushboolean(L, false);
+        return 1;
+    }
+
+    // The sessions are not resized while the server is running,
+    // the accessories added must fit in the slots of the sessions.
+    size_t num_contexts, num_notify;
+    lhap_ip_count(desc, desc->primary_acc, accs, &num_contexts, &num_notify);
+    if (num_notify > desc->ip_num_notify || num_contexts > desc->ip_sized_contexts) {
+        luaL_error(L, "the bridged accessories need %d event notifications and %d contexts a session, "
+            "the sessions have %d and %d, restart the server to serve them",
+            (int)num_notify, (int)num_contexts, (int)desc->ip_num_notify, (int)desc->ip_sized_contexts);
+    }
+
+    lhap_attr *attrs = desc->attrs;
+    if (!lhap_build_index(desc, accs)) {
+        luaL_error(L, "failed to build the attribute index");
+    }
+    pal_mem_free(attrs);
+    HAPLogInfo(&lhap_log, "Reconfiguring bridged accessories: %zu kept, %zu added, %zu removed.",
+        kept, added, removed);
+
+    for (HAPAccessory **pacc = desc->bridged_accs; *pacc; pacc++) {
+        if (!lhap_accessory_in(*pacc, accs)) {
+            lhap_accessory_retire(L, desc, *pacc);
+        }
+    }
+
+    // The accessory server serves the array in place, the sessions are kept.
+    HAPRawBufferCopyBytes(desc->bridged_accs, accs, sizeof(HAPAccessory *) * (n + 1));
+    desc->num_bridged_accs = n;
+    lua_rawgetp(L, LUA_REGISTRYINDEX, &desc->primary_acc);
+    lhap_serve_accessories(L, lua_gettop(L), 1, n);
+
+    // The controllers fetch the accessories again when the configuration number changes.
+    if (!lhap_is_loopback(desc)) {
+        HAPError err = HAPAccessoryServerIncrementCN(desc->platform.keyValueStore);
+        if (err != kHAPError_None) {
+            HAPLogError(&lhap_log, "%s: Failed to increase the configuration number, error code: %d.",
+                __func__, err);
+        }
+        HAPAccessoryServerUpdateAdvertisingData(&desc->server);
+    }
+    lua_pushboolean(L, true);
+    return 1;
+}
+
+static int lhap_at_exit(lua_State *L) {
+    lhap_desc *desc = &gv_lhap_desc;
+
+    if (!desc->started) {
+        return 0;
+    }
+    return lhap_stop(L);
+}
 
-    desc->mL = lc_getmainthread(L);
-    desc->co = L;
-    return lua_yieldk(L, 0, (lua_KContext)desc, lhap_start_finish);
+static const lhap_attr *lhap_find_attr(lhap_desc *desc, uint64_t aid, uint64_t cid) {
+    const lhap_attr key = { .aid = aid, .iid = cid };
+    size_t lo = 0, hi = desc->num_attrs;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        int cmp = lhap_attr_cmp(&desc->attrs[mid], &key);
+        if (cmp == 0) {
+            return &desc->attrs[mid];
+        } else if (cmp < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return NULL;
 }
 
-static int lhap_stop_finish(lua_State *L, int status, lua_KContext extra) {
-    lhap_desc *desc = (lhap_desc *)extra;
+static const HAPBaseCharacteristic *lhap_find_char(lhap_desc *desc, uint64_t aid, uint64_t cid) {
+    const lhap_attr *attr = lhap_find_attr(desc, aid, cid);
+    return attr ? attr->characteristic : NULL;
+}
 
-    // Release accessory server.
-    HAPAccessoryServerRelease(&desc->server);
+static const HAPAccessory *lhap_find_accessory(lhap_desc *desc, uint64_t aid) {
+    if (desc->primary_acc->aid == aid) {
+        return desc->primary_acc;
+    }
+    if (desc->bridged_accs) {
+        for (HAPAccessory **pacc = desc->bridged_accs; *pacc; pacc++) {
+            if ((*pacc)->aid == aid) {
+                return *pacc;
+            }
+        }
+    }
+    return NULL;
+}
 
-    lhap_deinit_ip(&desc->server_options);
+static int lhap_raise_event(lua_State *L) {
+    HAPSessionRef *session = NULL;
+    lhap_desc *desc = &gv_lhap_desc;
 
-    lhap_rawsetp_reset(L, LUA_REGISTRYINDEX, &desc->primary_acc);
-    lhap_rawsetp_reset(L, LUA_REGISTRYINDEX, &desc->bridged_accs);
+    if (!desc->started) {
+        luaL_error(L, "HAP is not started.");
+    }
 
-    lhap_reset_server_cb(L, &desc->server_cbs);
-    HAPRawBufferZero(&desc->server_cbs, sizeof(desc->server_cbs));
+    uint64_t aid = luaL_checkinteger(L, 1);
+    uint64_t sid = luaL_checkinteger(L, 2);
+    uint64_t cid = luaL_checkinteger(L, 3);
+    if (!lua_isnoneornil(L, 4)) {
+        luaL_checktype(L, 4, LUA_TLIGHTUSERDATA);
+        session = lua_touserdata(L, 4);
+    }
 
-    HAPRawBufferZero(&desc->server, sizeof(desc->server));
+    // The value is read again for the event.
+    const HAPBaseCharacteristic *characteristic = lhap_find_char(desc, aid, cid);
+    if (characteristic) {
+        lhap_char_cache_invalidate(characteristic);
+    }
 
-    desc->primary_acc = NULL;
-    desc->bridged_accs = NULL;
-    desc->num_bridged_accs = 0;
-    desc->co = NULL;
-    desc->mL = NULL;
-    desc->started = false;
+    lhap_event_raise(desc, aid, sid, cid, session);
     return 0;
 }
 
-static int lhap_stop(lua_State *L) {
+static int lhap_raise_events(lua_State *L) {
+    HAPSessionRef *session = NULL;
     lhap_desc *desc = &gv_lhap_desc;
 
     if (!desc->started) {
         luaL_error(L, "HAP is not started.");
     }
 
-    // Stop accessory server.
-    HAPAccessoryServerStop(&desc->server);
+    luaL_checktype(L, 1, LUA_TTABLE);
+    if (!lua_isnoneornil(L, 2)) {
+        luaL_checktype(L, 2, LUA_TLIGHTUSERDATA);
+        session = lua_touserdata(L, 2);
+    }
 
-    desc->co = L;
-    return lua_yieldk(L, 0, (lua_KContext)desc, lhap_stop_finish);
+    lua_Integer n = luaL_len(L, 1);
+    for (lua_Integer i = 1; i <= n; i++) {
+        luaL_argcheck(L, lua_geti(L, 1, i) == LUA_TTABLE, 1, "events must be arrays of {aid, sid, cid}");
+        uint64_t iids[3];
+        for (int j = 0; j < 3; j++) {
+            lua_geti(L, -1, j + 1);
+            int isnum;
+            iids[j] = lua_tointegerx(L, -1, &isnum);
+            luaL_argcheck(L, isnum, 1, "events must be arrays of {aid, sid, cid}");
+            lua_pop(L, 1);
+        }
+        lua_pop(L, 1);
+
+        // The value is read again for the event.
+        const HAPBaseCharacteristic *characteristic = lhap_find_char(desc, iids[0], iids[2]);
+        if (characteristic) {
+            lhap_char_cache_invalidate(characteristic);
+        }
+        lhap_event_raise(desc, iids[0], iids[1], iids[2], session);
+    }
+    return 0;
 }
 
-static int lhap_at_exit(lua_State *L) {
-    lhap_desc *desc = &gv_lhap_desc;
+static int lhap_set_event_window(lua_State *L) {
+    lua_Integer window = luaL_checkinteger(L, 1);
+    luaL_argcheck(L, window >= 0 && window <= INT32_MAX, 1, "window out of range");
+    gv_lhap_desc.event_window = window;
+    return 0;
+}
 
-    if (!desc->started) {
-        return 0;
+static int lhap_set_ip_session_limits(lua_State *L) {
+    lhap_desc *desc = &gv_lhap_desc;
+    luaL_checktype(L, 1, LUA_TTABLE);
+    if (desc->started) {
+        luaL_error(L, "HAP is started.");
     }
-    return lhap_stop(L);
+
+    size_t max = lhap_opt_limit(L, 1, "max", desc->ip_max_sessions, 1);
+    size_t reserve = lhap_opt_limit(L, 1, "reserve", HAPMin(desc->ip_reserve_sessions, max), 1);
+    desc->ip_max_contexts = lhap_opt_limit(L, 1, "maxContexts", desc->ip_max_contexts, 0);
+    desc->ip_max_notify = lhap_opt_limit(L, 1, "maxEventNotifications", desc->ip_max_notify, 0);
+    luaL_argcheck(L, max <= PAL_HAP_IP_SESSION_STORAGE_NUM_ELEMENTS, 1, "'max' out of range");
+    luaL_argcheck(L, reserve <= max, 1, "'reserve' out of range");
+    desc->ip_max_sessions = max;
+    desc->ip_reserve_sessions = reserve;
+    return 0;
 }
 
-static int lhap_raise_event(lua_State *L) {
+static int lhap_get_ip_session_stats(lua_State *L) {
+    lhap_desc *desc = &gv_lhap_desc;
+    HAPIPAccessoryServerStorage *storage = desc->server_options.ip.accessoryServerStorage;
+    size_t allocated = storage ? storage->numSessions : 0;
+    size_t bytes = desc->started ? lhap_ip_session_bytes(desc) : 0;
+
+    lua_createtable(L, 0, 13);
+    lua_pushinteger(L, desc->ip_max_sessions);
+    lua_setfield(L, -2, "max");
+    lua_pushinteger(L, desc->ip_reserve_sessions);
+    lua_setfield(L, -2, "reserve");
+    lua_pushinteger(L, desc->ip_num_active);
+    lua_setfield(L, -2, "active");
+    lua_pushinteger(L, allocated);
+    lua_setfield(L, -2, "allocated");
+    lua_pushinteger(L, desc->ip_num_pooled);
+    lua_setfield(L, -2, "pooled");
+    lua_pushinteger(L, desc->ip_peak_sessions);
+    lua_setfield(L, -2, "peak");
+    lua_pushinteger(L, desc->started ? desc->ip_num_contexts : 0);
+    lua_setfield(L, -2, "contexts");
+    lua_pushinteger(L, desc->started ? desc->ip_num_notify : 0);
+    lua_setfield(L, -2, "eventNotifications");
+    lua_pushinteger(L, bytes);
+    lua_setfield(L, -2, "sessionBytes");
+    lua_pushinteger(L, bytes * (allocated + desc->ip_num_pooled));
+    lua_setfield(L, -2, "allocatedBytes");
+    lua_pushinteger(L, bytes * PAL_HAP_IP_SESSION_STORAGE_NUM_ELEMENTS);
+    lua_setfield(L, -2, "defaultBytes");
+    HAPPlatformTCPStreamManagerRef tcp = desc->started ? desc->platform.ip.tcpStreamManager : NULL;
+    lua_pushinteger(L, tcp && HAPPlatformTCPStreamManagerIsListenerOpen(tcp) ?
+        HAPPlatformTCPStreamManagerGetListenerPort(tcp) : 0);
+    lua_setfield(L, -2, "port");
+    return 1;
+}
+
+static int lhap_get_event_stats(lua_State *L) {
+    lhap_desc *desc = &gv_lhap_desc;
+
+    lua_createtable(L, 0, 3);
+    lua_pushinteger(L, desc->event_window);
+    lua_setfield(L, -2, "window");
+    lua_pushinteger(L, desc->events_raised);
+    lua_setfield(L, -2, "raised");
+    lua_pushinteger(L, desc->events_delivered);
+    lua_setfield(L, -2, "delivered");
+    return 1;
+}
+
+static int lhap_update_value(lua_State *L) {
     HAPSessionRef *session = NULL;
     lhap_desc *desc = &gv_lhap_desc;
 
@@ -2513,41 +4976,193 @@ static int lhap_raise_event(lua_State *L) {
     uint64_t aid = luaL_checkinteger(L, 1);
     uint64_t sid = luaL_checkinteger(L, 2);
     uint64_t cid = luaL_checkinteger(L, 3);
-    if (!lua_isnoneornil(L, 4)) {
-        luaL_checktype(L, 4, LUA_TLIGHTUSERDATA);
-        session = lua_touserdata(L, 4);
+    luaL_checkany(L, 4);
+    if (!lua_isnoneornil(L, 5)) {
+        luaL_checktype(L, 5, LUA_TLIGHTUSERDATA);
+        session = lua_touserdata(L, 5);
     }
 
-    HAPAccessoryServerRaiseEventByIID(&desc->server, cid, sid, aid, session);
+    const HAPBaseCharacteristic *characteristic = lhap_find_char(desc, aid, cid);
+    if (!characteristic) {
+        luaL_error(L, "characteristic not found");
+    }
+    union lhap_char_value val;
+    luaL_argcheck(L, lhap_char_value_is_valid(L, 4, characteristic->format) &&
+        lhap_char_value_get(L, 4, characteristic->format, &val), 4, "invalid value");
+    bool changed = lhap_char_cache_store(L, 4, characteristic);
+    lhap_char_get_cache(characteristic)->pushed = true;
+
+    // The event is skipped if the value is not changed.
+    if (changed) {
+        lhap_event_raise(desc, aid, sid, cid, session);
+    }
+    lua_pushboolean(L, changed);
+    return 1;
+}
+
+static int lhap_set_cache_ttl(lua_State *L) {
+    lua_Integer ttl = luaL_checkinteger(L, 1);
+    luaL_argcheck(L, ttl >= 0 && ttl <= INT32_MAX, 1, "TTL out of range");
+    gv_lhap_desc.cache_ttl = ttl;
     return 0;
 }
 
-static int lhap_get_new_iid(lua_State *L) {
-    bool bridgedAcc = false;
-    if (lua_gettop(L) == 1) {
-        luaL_checktype(L, 1, LUA_TBOOLEAN);
-        bridgedAcc = lua_toboolean(L, 1);
+static int lhap_set_read_limits(lua_State *L) {
+    lhap_desc *desc = &gv_lhap_desc;
+    luaL_checktype(L, 1, LUA_TTABLE);
+
+    desc->max_read_requests = lhap_opt_limit(L, 1, "maxInFlight", desc->max_read_requests, 1);
+    desc->max_acc_read_requests = lhap_opt_limit(L, 1, "maxPerAccessory", desc->max_acc_read_requests, 1);
+    desc->max_queued_reads = lhap_opt_limit(L, 1, "maxQueued", desc->max_queued_reads, 0);
+    desc->read_deadline = lhap_opt_limit(L, 1, "deadline", desc->read_deadline, 0);
+    if (desc->started && desc->num_queued_reads) {
+        lhap_read_sched_arm(desc, HAPPlatformClockGetCurrent());
+    }
+    if (desc->started && desc->read_batches) {
+        lhap_read_batches_schedule(desc);
+    }
+    return 0;
+}
+
+static void lhap_push_hist(lua_State *L, const size_t hist[], const HAPTime bounds[]) {
+    lua_createtable(L, LHAP_READ_HIST_NUM, 0);
+    for (size_t i = 0; i < LHAP_READ_HIST_NUM; i++) {
+        lua_createtable(L, 0, 2);
+        if (i < LHAP_READ_HIST_NUM - 1) {
+            lua_pushinteger(L, bounds[i]);
+            lua_setfield(L, -2, "le");
+        }
+        lua_pushinteger(L, hist[i]);
+        lua_setfield(L, -2, "count");
+        lua_rawseti(L, -2, i + 1);
     }
+}
+
+static int lhap_get_read_sched_stats(lua_State *L) {
+    lhap_desc *desc = &gv_lhap_desc;
+
+    lua_createtable(L, 0, 11);
+    lua_pushinteger(L, desc->max_read_requests);
+    lua_setfield(L, -2, "maxInFlight");
+    lua_pushinteger(L, desc->max_acc_read_requests);
+    lua_setfield(L, -2, "maxPerAccessory");
+    lua_pushinteger(L, desc->max_queued_reads);
+    lua_setfield(L, -2, "maxQueued");
+    lua_pushinteger(L, desc->read_deadline);
+    lua_setfield(L, -2, "deadline");
+    lua_pushinteger(L, desc->num_queued_reads);
+    lua_setfield(L, -2, "queued");
+    lua_pushinteger(L, desc->reads_dispatched);
+    lua_setfield(L, -2, "dispatched");
+    lua_pushinteger(L, desc->reads_rejected);
+    lua_setfield(L, -2, "rejected");
+    lua_pushinteger(L, desc->reads_expired);
+    lua_setfield(L, -2, "expired");
+    lhap_push_hist(L, desc->read_depth_hist, lhap_read_depth_bounds);
+    lua_setfield(L, -2, "depth");
+    lhap_push_hist(L, desc->read_wait_hist, lhap_read_wait_bounds);
+    lua_setfield(L, -2, "wait");
+    return 1;
+}
+
+static int lhap_get_read_stats(lua_State *L) {
+    lhap_desc *desc = &gv_lhap_desc;
+
+    lua_createtable(L, 0, 9);
+    lua_pushinteger(L, desc->num_read_requests);
+    lua_setfield(L, -2, "inFlight");
+    lua_pushinteger(L, desc->reads_collapsed);
+    lua_setfield(L, -2, "collapsed");
+    lua_pushinteger(L, desc->reads_batched);
+    lua_setfield(L, -2, "batched");
+    lua_pushinteger(L, desc->read_many_calls);
+    lua_setfield(L, -2, "readManyCalls");
+    lua_pushinteger(L, desc->reads_handled);
+    lua_setfield(L, -2, "handled");
+    lua_pushinteger(L, desc->read_allocs);
+    lua_setfield(L, -2, "allocs");
+    lua_pushinteger(L, desc->read_alloc_bytes);
+    lua_setfield(L, -2, "allocBytes");
+    lua_pushinteger(L, desc->num_free_read_requests);
+    lua_setfield(L, -2, "pooled");
+    lua_pushinteger(L, desc->read_request_allocs);
+    lua_setfield(L, -2, "requestAllocs");
+    return 1;
+}
+
+static int lhap_get_write_stats(lua_State *L) {
+    lhap_desc *desc = &gv_lhap_desc;
+
+    lua_createtable(L, 0, 2);
+    lua_pushinteger(L, desc->writes_debounced);
+    lua_setfield(L, -2, "debounced");
+    lua_pushinteger(L, desc->writes_dispatched);
+    lua_setfield(L, -2, "dispatched");
+    return 1;
+}
+
+static int lhap_get_cache_stats(lua_State *L) {
+    lhap_desc *desc = &gv_lhap_desc;
+
+    lua_createtable(L, 0, 5);
+    lua_pushinteger(L, desc->cache_ttl);
+    lua_setfield(L, -2, "ttl");
+    lua_pushinteger(L, desc->cache_hits);
+    lua_setfield(L, -2, "hits");
+    lua_pushinteger(L, desc->cache_stale_hits);
+    lua_setfield(L, -2, "staleHits");
+    lua_pushinteger(L, desc->cache_misses);
+    lua_setfield(L, -2, "misses");
+    lua_pushinteger(L, desc->cache_refreshes);
+    lua_setfield(L, -2, "refreshes");
+    return 1;
+}
+
+/**
+ * Reserve the next range of instance IDs.
+ *
+ * NVS keeps the last reserved instance ID, so the reserved ones are
+ * never reused even if they are not allocated before a reboot.
+ */
+static bool lhap_iid_reserve(lhap_desc *desc, bool bridgedAcc) {
     pal_nvs_handle *handle = pal_nvs_open(LHAP_NVS_NAMESPACE);
     if (luai_unlikely(!handle)) {
-        luaL_error(L, "failed to open NVS handle");
+        HAPLogError(&lhap_log, "%s: Failed to open NVS handle.", __func__);
+        return false;
     }
     const char *key = bridgedAcc ? "aid" : "iid";
-    size_t len = pal_nvs_get_len(handle, key);
-    uint64_t iid = bridgedAcc ? LHAP_BRIDGED_ACCESSORY_IID_DFT : (LHAP_ATTR_CNT_DFT + 1);
-    if (len) {
-        if (luai_unlikely(!pal_nvs_get(handle, key, &iid, sizeof(iid)))) {
-            pal_nvs_close(handle);
-            luaL_error(L, "failed to get iid from NVS");
-        }
-        iid += 1;
+    uint64_t last = (bridgedAcc ? LHAP_BRIDGED_ACCESSORY_IID_DFT : (LHAP_ATTR_CNT_DFT + 1)) - 1;
+    if (pal_nvs_get_len(handle, key) && luai_unlikely(!pal_nvs_get(handle, key, &last, sizeof(last)))) {
+        HAPLogError(&lhap_log, "%s: Failed to get %s from NVS.", __func__, key);
+        pal_nvs_close(handle);
+        return false;
     }
-    if (luai_unlikely(!pal_nvs_set(handle, key, &iid, sizeof(iid)))) {
+    uint64_t end = last + LHAP_IID_RESERVE_NUM;
+    if (luai_unlikely(!pal_nvs_set(handle, key, &end, sizeof(end)))) {
+        HAPLogError(&lhap_log, "%s: Failed to set %s to NVS.", __func__, key);
         pal_nvs_close(handle);
-        luaL_error(L, "failed to set iid to NVS");
+        return false;
     }
     pal_nvs_close(handle);
-    lua_pushinteger(L, iid);
+
+    lhap_iid_range *range = &desc->iid_ranges[bridgedAcc];
+    range->next = last + 1;
+    range->end = end + 1;
+    return true;
+}
+
+static int lhap_get_new_iid(lua_State *L) {
+    lhap_desc *desc = &gv_lhap_desc;
+    bool bridgedAcc = false;
+    if (lua_gettop(L) == 1) {
+        luaL_checktype(L, 1, LUA_TBOOLEAN);
+        bridgedAcc = lua_toboolean(L, 1);
+    }
+    lhap_iid_range *range = &desc->iid_ranges[bridgedAcc];
+    if (range->next == range->end && luai_unlikely(!lhap_iid_reserve(desc, bridgedAcc))) {
+        luaL_error(L, "failed to reserve instance IDs");
+    }
+    lua_pushinteger(L, range->next++);
     return 1;
 }
 
@@ -2583,17 +5198,277 @@ static int lhap_restore_factory_settings(lua_State *L) {
         luaL_error(L, "failed to erase '%s'", LHAP_NVS_NAMESPACE);
     }
     pal_nvs_close(handle);
+    HAPRawBufferZero(desc->iid_ranges, sizeof(desc->iid_ranges));
+    return 0;
+}
+
+#ifdef CONFIG_HAP_LOOPBACK
+/**
+ * Request of the loopback server, handled in the run loop.
+ */
+typedef struct lhap_loopback_request {
+    char kind;                  /* 'r' for reads, 'w' for writes, 'i' for invalidating the session */
+    lua_State *L;               /* main thread */
+    int ref;                    /* reference of the written value in the registry */
+    HAPSessionRef *session;
+    uint64_t aid;
+    uint64_t iid;
+} lhap_loopback_request;
+
+/**
+ * Get the key of the read or write callback in the registry,
+ * or NULL if the characteristic has no such callback.
+ */
+static const void *lhap_char_cb_key(const HAPBaseCharacteristic *characteristic, bool write) {
+    const void *key = NULL;
+
+#define LHAP_CASE_CHAR_CB_KEY(format) \
+    LHAP_CASE_CHAR_FORMAT_CODE(format, characteristic, \
+        if (write) { \
+            key = p->callbacks.handleWrite ? &p->callbacks.handleWrite : NULL; \
+        } else { \
+            key = p->callbacks.handleRead ? &p->callbacks.handleRead : NULL; \
+        } \
+    )
+
+    switch (characteristic->format) {
+    LHAP_CASE_CHAR_CB_KEY(Data)
+    LHAP_CASE_CHAR_CB_KEY(Bool)
+    LHAP_CASE_CHAR_CB_KEY(UInt8)
+    LHAP_CASE_CHAR_CB_KEY(UInt16)
+    LHAP_CASE_CHAR_CB_KEY(UInt32)
+    LHAP_CASE_CHAR_CB_KEY(UInt64)
+    LHAP_CASE_CHAR_CB_KEY(Int)
+    LHAP_CASE_CHAR_CB_KEY(Float)
+    LHAP_CASE_CHAR_CB_KEY(String)
+    LHAP_CASE_CHAR_CB_KEY(TLV8)
+    }
+
+#undef LHAP_CASE_CHAR_CB_KEY
+
+    return key;
+}
+
+static void lhap_loopback_handle_request_cb(void *_Nullable context, size_t contextSize) {
+    HAPPrecondition(context);
+    HAPPrecondition(contextSize == sizeof(lhap_loopback_request));
+    lhap_loopback_request *request = context;
+    lhap_desc *desc = &gv_lhap_desc;
+
+    if (!desc->loopback) {
+        luaL_unref(request->L, LUA_REGISTRYINDEX, request->ref);
+        return;
+    }
+
+    lua_State *L = desc->mL;
+    HAPAssert(lua_gettop(L) == 0);
+
+    if (request->kind == 'i') {
+        lhap_server_handle_session_invalid(&desc->server, request->session, desc);
+        return;
+    }
+
+    const lhap_attr *attr = lhap_find_attr(desc, request->aid, request->iid);
+    const HAPAccessory *accessory = lhap_find_accessory(desc, request->aid);
+    const void *key = attr ? lhap_char_cb_key(attr->characteristic, request->kind == 'w') : NULL;
+    HAPCharacteristicFormat format = attr ? attr->characteristic->format : 0;
+    HAPError err = kHAPError_InvalidState;
+    union lhap_char_value val;
+    if (request->kind == 'w') {
+        lua_rawgeti(L, LUA_REGISTRYINDEX, request->ref);
+        luaL_unref(L, LUA_REGISTRYINDEX, request->ref);
+        if (key) {
+            err = lhap_char_base_handleWrite(desc, &desc->server, kHAPTransportType_IP, request->session,
+                false, accessory, attr->service, attr->characteristic, key);
+        }
+    } else if (key) {
+        err = lhap_char_base_handleRead(desc, &desc->server, kHAPTransportType_IP, request->session,
+            accessory, attr->service, attr->characteristic, key);
+        if (err == kHAPError_None && !lhap_char_value_get(L, -2, format, &val)) {
+            err = kHAPError_InvalidData;
+        }
+    }
+    if (err != kHAPError_InProgress) {
+        lhap_loopback_record(desc, request->kind, request->session, request->aid, request->iid,
+            format, err, err == kHAPError_None ? &val : NULL);
+    }
+    lua_settop(L, 0);
+    lc_collectgarbage(L);
+}
+
+static int lhap_loopback_schedule(lua_State *L, char kind) {
+    lhap_desc *desc = &gv_lhap_desc;
+
+    if (!desc->loopback) {
+        luaL_error(L, "the loopback server is not started");
+    }
+    lua_Integer session = luaL_checkinteger(L, 1);
+    luaL_argcheck(L, session >= 1 && session <= LHAP_LOOPBACK_SESSIONS, 1, "session out of range");
+
+    lhap_loopback_request request = {
+        .kind = kind,
+        .L = lc_getmainthread(L),
+        .ref = LUA_NOREF,
+        .session = &desc->loopback->sessions[session - 1],
+    };
+    if (kind != 'i') {
+        request.aid = luaL_checkinteger(L, 2);
+        request.iid = luaL_checkinteger(L, 3);
+    }
+    if (kind == 'w') {
+        luaL_checkany(L, 4);
+        lua_settop(L, 4);
+        request.ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
+    if (HAPPlatformRunLoopScheduleCallback(lhap_loopback_handle_request_cb,
+        &request, sizeof(request)) != kHAPError_None) {
+        luaL_unref(L, LUA_REGISTRYINDEX, request.ref);
+        luaL_error(L, "failed to schedule the request");
+    }
+    return 0;
+}
+
+static int lhap_start_loopback(lua_State *L) {
+    lhap_desc *desc = &gv_lhap_desc;
+    if (desc->started) {
+        luaL_error(L, "HAP is already started");
+    }
+
+    HAPAccessory *primary_acc = luaL_checkudata(L, 1, LHAP_ACCESSORY_NAME);
+    luaL_argcheck(L, HAPRegularAccessoryIsValid(primary_acc), 1, "invalid primary accessory");
+    size_t n = lhap_optarray(L, 2);
+    luaL_argcheck(L, n <= LHAP_BRIDGED_ACCS_MAX, 2, "too many bridged accessories");
+    bool has_session_invalid = lhap_optfunction(L, 3);
+
+    HAPAccessory **bridged_accs = NULL;
+    if (n || primary_acc->category == kHAPAccessoryCategory_Bridges) {
+        bridged_accs = lhap_new_bridged_accs(L, 2, n, LHAP_BRIDGED_ACCS_MAX);
+        lua_rawsetp(L, LUA_REGISTRYINDEX, &desc->bridged_accs);
+    }
+    lhap_serve_accessories(L, 1, 2, n);
+    desc->primary_acc = primary_acc;
+    desc->bridged_accs = bridged_accs;
+    desc->num_bridged_accs = n;
+    lhap_size_ip(L, desc);
+
+    lhap_loopback *loopback = pal_mem_alloc(sizeof(*loopback));
+    if (!loopback) {
+        luaL_error(L, "failed to alloc the loopback server");
+    }
+    HAPRawBufferZero(loopback, sizeof(*loopback));
+    lua_pushvalue(L, 1);
+    lua_rawsetp(L, LUA_REGISTRYINDEX, &desc->primary_acc);
+    if (has_session_invalid) {
+        lua_pushvalue(L, 3);
+        lua_rawsetp(L, LUA_REGISTRYINDEX, &desc->server_cbs.handleSessionInvalidate);
+    }
+    if (!lhap_build_index(desc, bridged_accs)) {
+        pal_mem_free(loopback);
+        luaL_error(L, "failed to build the attribute index");
+    }
+    lhap_read_sched_init(desc);
+    desc->loopback = loopback;
+    desc->mL = lc_getmainthread(L);
+    desc->started = true;
     return 0;
 }
 
+static int lhap_loopback_read(lua_State *L) {
+    return lhap_loopback_schedule(L, 'r');
+}
+
+static int lhap_loopback_write(lua_State *L) {
+    return lhap_loopback_schedule(L, 'w');
+}
+
+static int lhap_loopback_invalidate(lua_State *L) {
+    return lhap_loopback_schedule(L, 'i');
+}
+
+static int lhap_loopback_responses(lua_State *L) {
+    lhap_loopback *lb = gv_lhap_desc.loopback;
+    if (!lb) {
+        luaL_error(L, "the loopback server is not started");
+    }
+
+    lua_createtable(L, lb->num_resps, 0);
+    for (size_t i = 0; i < lb->num_resps; i++) {
+        lhap_loopback_response *resp = &lb->resps[i];
+        lua_createtable(L, 0, 6);
+        lua_pushstring(L, resp->kind == 'r' ? "read" : (resp->kind == 'w' ? "write" : "event"));
+        lua_setfield(L, -2, "kind");
+        if (resp->session) {
+            lua_pushinteger(L, resp->session - lb->sessions + 1);
+            lua_setfield(L, -2, "session");
+        }
+        lua_pushinteger(L, resp->aid);
+        lua_setfield(L, -2, "aid");
+        lua_pushinteger(L, resp->iid);
+        lua_setfield(L, -2, "iid");
+        lua_pushinteger(L, resp->err);
+        lua_setfield(L, -2, "err");
+        if (resp->kind == 'r' && resp->err == kHAPError_None) {
+            switch (resp->format) {
+            case kHAPCharacteristicFormat_Bool:
+                lua_pushboolean(L, resp->value.boolean);
+                break;
+            case kHAPCharacteristicFormat_Float:
+                lua_pushnumber(L, resp->value.number);
+                break;
+            case kHAPCharacteristicFormat_Data:
+            case kHAPCharacteristicFormat_String:
+            case kHAPCharacteristicFormat_TLV8:
+                lua_pushlstring(L, resp->value.str.data, resp->value.str.len);
+                break;
+            default:
+                lua_pushinteger(L, resp->value.integer);
+                break;
+            }
+            lua_setfield(L, -2, "value");
+        }
+        lua_rawseti(L, -2, i + 1);
+    }
+    lb->num_resps = 0;
+    return 1;
+}
+
+static const luaL_Reg haploopbacklib[] = {
+    {"start", lhap_start_loopback},
+    {"read", lhap_loopback_read},
+    {"write", lhap_loopback_write},
+    {"invalidate", lhap_loopback_invalidate},
+    {"responses", lhap_loopback_responses},
+    {NULL, NULL},
+};
+
+LUAMOD_API int luaopen_haploopback(lua_State *L) {
+    luaL_newlib(L, haploopbacklib);
+    return 1;
+}
+#endif  // CONFIG_HAP_LOOPBACK
+
 static const luaL_Reg haplib[] = {
     {"newAccessory", lhap_new_accessory},
     {"newService", lhap_new_service},
     {"newCharacteristic", lhap_new_char},
+    {"newCharacteristicPrototype", lhap_new_char_prototype},
     {"accessoryIsValid", lhap_accessory_is_valid},
     {"start", lhap_start},
     {"stop", lhap_stop},
+    {"reconfigure", lhap_reconfigure},
     {"raiseEvent", lhap_raise_event},
+    {"raiseEvents", lhap_raise_events},
+    {"setEventWindow", lhap_set_event_window},
+    {"getEventStats", lhap_get_event_stats},
+    {"setIPSessionLimits", lhap_set_ip_session_limits},
+    {"getIPSessionStats", lhap_get_ip_session_stats},
+    {"updateValue", lhap_update_value},
+    {"setCacheTTL", lhap_set_cache_ttl},
+    {"getCacheStats", lhap_get_cache_stats},
+    {"getReadStats", lhap_get_read_stats},
+    {"setReadLimits", lhap_set_read_limits},
+    {"getReadSchedStats", lhap_get_read_sched_stats},
+    {"getWriteStats", lhap_get_write_stats},
     {"getNewInstanceID", lhap_get_new_iid},
     {"getSetupCode", lhap_get_setup_code},
     {"restoreFactorySettings", lhap_restore_factory_settings},
@@ -2637,6 +5512,22 @@ static const luaL_Reg lhap_char_metameth[] = {
     {NULL, NULL}
 };
 
+/*
+ * metamethods for characteristic prototype
+ */
+static const luaL_Reg lhap_char_prototype_metameth[] = {
+    {"__index", NULL},  /* place holder */
+    {NULL, NULL}
+};
+
+/*
+ * metamethods for request
+ */
+static const luaL_Reg lhap_request_metameth[] = {
+    {"__index", lhap_request_index},
+    {NULL, NULL}
+};
+
 /*
  * methods for characteristic
  */
@@ -2646,6 +5537,21 @@ static const luaL_Reg lhap_char_meth[] = {
     {"setContraints", lhap_char_set_contraints},
     {"setValidVals", lhap_char_set_valid_vals},
     {"setValidValsRanges", lhap_set_valid_vals_ranges},
+    {"setCacheTTL", lhap_char_set_cache_ttl},
+    {"setWriteDebounce", lhap_char_set_write_debounce},
+    {NULL, NULL},
+};
+
+/*
+ * methods for characteristic prototype
+ */
+static const luaL_Reg lhap_char_prototype_meth[] = {
+    {"setMfgDesc", lhap_char_set_mfg_desc},
+    {"setUnits", lhap_char_set_units},
+    {"setContraints", lhap_char_set_contraints},
+    {"setValidVals", lhap_char_set_valid_vals},
+    {"setValidValsRanges", lhap_set_valid_vals_ranges},
+    {"new", lhap_char_prototype_new},
     {NULL, NULL},
 };
 
@@ -2667,12 +5573,45 @@ static void lhap_createmeta(lua_State *L) {
     luaL_setfuncs(L, lhap_char_meth, 0);  /* add characteristic methods to method table */
     lua_setfield(L, -2, "__index");  /* metatable.__index = method table */
     lua_pop(L, 1);  /* pop metatable */
+
+    luaL_newmetatable(L, LHAP_CHAR_PROTOTYPE_NAME);  /* metatable for characteristic prototype */
+    luaL_setfuncs(L, lhap_char_prototype_metameth, 0);  /* add metamethods to new metatable */
+    luaL_newlibtable(L, lhap_char_prototype_meth);  /* create method table */
+    luaL_setfuncs(L, lhap_char_prototype_meth, 0);  /* add prototype methods to method table */
+    lua_setfield(L, -2, "__index");  /* metatable.__index = method table */
+    lua_pop(L, 1);  /* pop metatable */
+
+    luaL_newmetatable(L, LHAP_REQUEST_NAME);  /* metatable for request */
+    luaL_setfuncs(L, lhap_request_metameth, 0);  /* add metamethods to new metatable */
+    lua_pop(L, 1);  /* pop metatable */
 }
 
 LUAMOD_API int luaopen_hap(lua_State *L) {
+    gv_lhap_desc.max_read_requests = LHAP_READ_REQUESTS_MAX;
+    gv_lhap_desc.max_acc_read_requests = LHAP_ACC_READ_REQUESTS_MAX;
+    gv_lhap_desc.max_queued_reads = LHAP_READ_QUEUE_MAX;
+    gv_lhap_desc.read_deadline = LHAP_READ_DEADLINE;
+    gv_lhap_desc.event_window = LHAP_EVENT_WINDOW;
+    gv_lhap_desc.ip_max_sessions = PAL_HAP_IP_SESSION_STORAGE_NUM_ELEMENTS;
+    gv_lhap_desc.ip_reserve_sessions = LHAP_IP_SESSIONS_RESERVE;
+
     luaL_newlib(L, haplib);
     lhap_createmeta(L);
 
+    /* build type indexes */
+    lua_createtable(L, 0, HAPArrayCount(lhap_service_type_tab));
+    for (size_t i = 0; i < HAPArrayCount(lhap_service_type_tab); i++) {
+        lua_pushlightuserdata(L, (void *)(lhap_service_type_tab + i));
+        lua_setfield(L, -2, lhap_service_type_tab[i].name);
+    }
+    lua_rawsetp(L, LUA_REGISTRYINDEX, lhap_service_type_tab);
+    lua_createtable(L, 0, HAPArrayCount(lhap_characteristic_type_tab));
+    for (size_t i = 0; i < HAPArrayCount(lhap_characteristic_type_tab); i++) {
+        lua_pushlightuserdata(L, (void *)(lhap_characteristic_type_tab + i));
+        lua_setfield(L, -2, lhap_characteristic_type_tab[i].name);
+    }
+    lua_rawsetp(L, LUA_REGISTRYINDEX, lhap_characteristic_type_tab);
+
     /* set services */
     for (const lhap_lightuserdata *ud = lhap_accessory_services_userdatas;
         ud->ptr; ud++) {
@@ -7,6 +7,8 @@
 #include <lauxlib.h>
 #include <pal/md.h>
 
+#include "app_int.h"
+
 #define LUA_HASH_OBJ_NAME "HashObject*"
 
 #define LHASH_GET_OBJ(L, idx) \
@@ -19,7 +21,7 @@ typedef struct {
     pal_md_ctx ctx;
 } lhash_obj;
 
-static const char *lhash_type_strs[] = {
+const char *lhash_type_strs[] = {
     "MD4",
     "MD5",
     "SHA1",
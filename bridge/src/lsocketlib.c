@@ -15,7 +15,9 @@
 #define LUA_SOCKET_OBJECT_NAME "Socket*"
 
 typedef struct {
+    lc_wait wait;       /* wait of the coroutine receiving data */
     bool destroyed;
+    lua_State *co;
     pal_socket_obj socket;
     luaL_Buffer B;
 } lsocket_obj;
@@ -49,6 +51,7 @@ static int lsocket_create(lua_State *L) {
         luaL_error(L, "failed to initalize socket object");
     }
     obj->destroyed = false;
+    obj->wait.next = NULL;
 
     return 1;
 }
@@ -192,6 +195,7 @@ static int lsocket_obj_accept(lua_State *L) {
     lsocket_obj *new_o = lua_newuserdata(L, sizeof(lsocket_obj));
     luaL_setmetatable(L, LUA_SOCKET_OBJECT_NAME);
     new_o->destroyed = false;
+    new_o->wait.next = NULL;
 
     pal_err err = pal_socket_accept(&obj->socket, &new_o->socket, addr,
         sizeof(addr), &port, lsocket_accepted_cb, L);
@@ -322,9 +326,12 @@ static int lsocket_obj_sendto(lua_State *L) {
 
 static void lsocket_recved_cb(pal_socket_obj *o, pal_err err,
     const char *addr, uint16_t port, size_t len, void *arg) {
-    lua_State *co = arg;
+    lsocket_obj *obj = arg;
+    lua_State *co = obj->co;
     lua_State *L = lc_getmainthread(co);
 
+    lc_wait_remove(&obj->wait);
+
     HAPAssert(lua_gettop(L) == 0);
     int narg = 1;
     if (err == PAL_ERR_OK) {
@@ -373,6 +380,23 @@ static int finishrecv(lua_State *L, int status, lua_KContext extra) {
     return 0;
 }
 
+static void lsocket_recv_cancel(lua_State *L, lc_wait *wait, lc_context_state state) {
+    lsocket_obj *obj = (lsocket_obj *)wait;
+    pal_socket_cancel_recv(&obj->socket);
+    lua_pushinteger(obj->co, state == LC_CONTEXT_TIMEOUT ? PAL_ERR_TIMEOUT : PAL_ERR_CANCELLED);
+    lc_wakeup(obj->co, 1, LC_PRIO_NORMAL);
+}
+
+static int lsocket_obj_wait_recv(lua_State *L, lsocket_obj *obj, bool isrecvfrom) {
+    lc_context_state state = lc_wait_add(L, &obj->wait, lsocket_recv_cancel);
+    if (luai_unlikely(state != LC_CONTEXT_ACTIVE)) {
+        pal_socket_cancel_recv(&obj->socket);
+        lua_pushinteger(L, state == LC_CONTEXT_TIMEOUT ? PAL_ERR_TIMEOUT : PAL_ERR_CANCELLED);
+        return finishrecv(L, LUA_OK, (lua_KContext)isrecvfrom);
+    }
+    return lua_yieldk(L, 0, (lua_KContext)isrecvfrom, finishrecv);
+}
+
 static int lsocket_obj_recv(lua_State *L) {
     lsocket_obj *obj = lsocket_obj_get(L, 1);
     lua_Integer maxlen = luaL_checkinteger(L, 2);
@@ -380,15 +404,16 @@ static int lsocket_obj_recv(lua_State *L) {
 
     luaL_buffinit(L, &obj->B);
     size_t len = maxlen;
+    obj->co = L;
     pal_err err = pal_socket_recv(&obj->socket,
-        luaL_prepbuffsize(&obj->B, maxlen), &len, lsocket_recved_cb, L);
+        luaL_prepbuffsize(&obj->B, maxlen), &len, lsocket_recved_cb, obj);
     switch (err) {
     case PAL_ERR_OK:
         luaL_addsize(&obj->B, len);
         luaL_pushresult(&obj->B);
         return 1;
     case PAL_ERR_IN_PROGRESS:
-        return lua_yieldk(L, 0, (lua_KContext)false, finishrecv);
+        return lsocket_obj_wait_recv(L, obj, false);
     default:
         lua_pushstring(L, pal_err_string(err));
         return lua_error(L);
@@ -404,9 +429,10 @@ static int lsocket_obj_recvfrom(lua_State *L) {
     uint16_t port;
     luaL_buffinit(L, &obj->B);
     size_t len = maxlen;
+    obj->co = L;
     pal_err err = pal_socket_recvfrom(&obj->socket,
         luaL_prepbuffsize(&obj->B, maxlen), &len, addr, sizeof(addr),
-        &port, lsocket_recved_cb, L);
+        &port, lsocket_recved_cb, obj);
     switch (err) {
     case PAL_ERR_OK:
         luaL_addsize(&obj->B, len);
@@ -415,7 +441,7 @@ static int lsocket_obj_recvfrom(lua_State *L) {
         lua_pushinteger(L, port);
         return 3;
     case PAL_ERR_IN_PROGRESS:
-        return lua_yieldk(L, 0, (lua_KContext)true, finishrecv);
+        return lsocket_obj_wait_recv(L, obj, true);
     default:
         lua_pushstring(L, pal_err_string(err));
         return lua_error(L);
@@ -430,6 +456,7 @@ static int lsocket_obj_readable(lua_State *L) {
 
 static int lsocket_obj_destroy(lua_State *L) {
     lsocket_obj *obj = lsocket_obj_get(L, 1);
+    lc_wait_remove(&obj->wait);
     pal_socket_obj_deinit(&obj->socket);
     obj->destroyed = true;
     return 0;
@@ -438,6 +465,7 @@ static int lsocket_obj_destroy(lua_State *L) {
 static int lsocket_obj_gc(lua_State *L) {
     lsocket_obj *obj = luaL_checkudata(L, 1, LUA_SOCKET_OBJECT_NAME);
     if (!obj->destroyed) {
+        lc_wait_remove(&obj->wait);
         pal_socket_obj_deinit(&obj->socket);
         obj->destroyed = true;
     }
@@ -44,12 +44,13 @@ const char *lstream_client_type_strs[] = {
 };
 
 typedef struct lstream_client {
+    lc_wait wait;       /* wait of the coroutine reading or writing */
     bool host_is_addr;
     bool sock_inited;
     lstream_client_state state;
     lstream_client_type type;
     uint16_t port;
-    HAPPlatformTimerRef timer;
+    app_timer_ref timer;
     lua_State *co;
     const char *host;
     pal_dns_req_ctx *dns_req;
@@ -192,9 +193,10 @@ static int lstream_client_buffer_push(lua_State *L, lstream_client *client, size
 
 static void lstream_client_cleanup(lstream_client *client) {
     client->state = LSTREAM_CLIENT_NONE;
+    lc_wait_remove(&client->wait);
     if (client->timer) {
-        HAPPlatformTimerDeregister(client->timer);
-        client->timer = 0;
+        app_timer_deregister(client->timer);
+        client->timer = NULL;
     }
     if (client->dns_req) {
         pal_dns_cancel_request(client->dns_req);
@@ -213,8 +215,8 @@ static void lstream_client_create_finish(lstream_client *client, const char *err
     HAPPrecondition(client->co);
 
     if (client->timer) {
-        HAPPlatformTimerDeregister(client->timer);
-        client->timer = 0;
+        app_timer_deregister(client->timer);
+        client->timer = NULL;
     }
 
     if (errmsg) {
@@ -392,9 +394,9 @@ static void lstream_client_dns_response_cb(pal_err err, const char *addr,
     }
 }
 
-static void lstream_client_timeout_timer_cb(HAPPlatformTimerRef timer, void *context) {
+static void lstream_client_timeout_timer_cb(app_timer_ref timer, void *context) {
     lstream_client *client = context;
-    client->timer = 0;
+    client->timer = NULL;
     lstream_client_create_finish(client, "timeout");
 }
 
@@ -430,11 +432,11 @@ static int lstream_client_create(lua_State *L) {
     client->sock_inited = false;
     client->co = NULL;
     client->dns_req = NULL;
-    client->timer = 0;
+    client->timer = NULL;
     client->state = LSTREAM_CLIENT_NONE;
     client->allocf = lua_getallocf(L, &client->alloc_ud);
 
-    if (luai_unlikely(HAPPlatformTimerRegister(&client->timer,
+    if (luai_unlikely(app_timer_register(&client->timer,
         HAPPlatformClockGetCurrent() + timeout,
         lstream_client_timeout_timer_cb, client) != kHAPError_None)) {
         luaL_error(L, "failed to create a timeout timer");
@@ -443,8 +445,8 @@ static int lstream_client_create(lua_State *L) {
     client->dns_req = pal_dns_start_request(host, PAL_NET_ADDR_FAMILY_UNSPEC,
         lstream_client_dns_response_cb, client);
     if (luai_unlikely(!client->dns_req)) {
-        HAPPlatformTimerDeregister(client->timer);
-        client->timer = 0;
+        app_timer_deregister(client->timer);
+        client->timer = NULL;
         luaL_error(L, "failed to start DNS resolution request");
     }
     client->state = LSTREAM_CLIENT_DNS_RESOLVING;
@@ -475,6 +477,8 @@ static void lstream_client_write_sent_cb(pal_socket_obj *o, pal_err err, size_t
     lua_State *co = client->co;
     lua_State *L = lc_getmainthread(co);
 
+    lc_wait_remove(&client->wait);
+
     HAPAssert(lua_gettop(L) == 0);
     lua_pushinteger(co, err);
     int status, nres;
@@ -487,6 +491,17 @@ static void lstream_client_write_sent_cb(pal_socket_obj *o, pal_err err, size_t
     lc_collectgarbage(L);
 }
 
+static pal_err lstream_client_cancel_err(lc_context_state state) {
+    return state == LC_CONTEXT_TIMEOUT ? PAL_ERR_TIMEOUT : PAL_ERR_CANCELLED;
+}
+
+static void lstream_client_write_cancel(lua_State *L, lc_wait *wait, lc_context_state state) {
+    lstream_client *client = (lstream_client *)wait;
+    pal_socket_cancel_send(&client->sock);
+    lua_pushinteger(client->co, lstream_client_cancel_err(state));
+    lc_wakeup(client->co, 1, LC_PRIO_NORMAL);
+}
+
 static int finishwrite(lua_State *L, int status, lua_KContext extra) {
     lstream_client *client = (lstream_client *)extra;
     client->co = NULL;
@@ -510,9 +525,16 @@ static int lstream_client_write(lua_State *L) {
     switch (err) {
     case PAL_ERR_OK:
         return 0;
-    case PAL_ERR_IN_PROGRESS:
+    case PAL_ERR_IN_PROGRESS: {
         client->co = L;
+        lc_context_state state = lc_wait_add(L, &client->wait, lstream_client_write_cancel);
+        if (luai_unlikely(state != LC_CONTEXT_ACTIVE)) {
+            pal_socket_cancel_send(&client->sock);
+            lua_pushinteger(L, lstream_client_cancel_err(state));
+            return finishwrite(L, LUA_OK, (lua_KContext)client);
+        }
         return lua_yieldk(L, 0, (lua_KContext)client, finishwrite);
+    }
     default:
         lua_pushstring(L, pal_err_string(err));
         return lua_error(L);
@@ -527,6 +549,8 @@ static void lstream_client_read_recved_cb(pal_socket_obj *o, pal_err err,
     lua_State *co = client->co;
     lua_State *L = lc_getmainthread(co);
 
+    lc_wait_remove(&client->wait);
+
     HAPAssert(lua_gettop(L) == 0);
     int narg = 1;
     if (err == PAL_ERR_OK) {
@@ -545,6 +569,13 @@ static void lstream_client_read_recved_cb(pal_socket_obj *o, pal_err err,
     lc_collectgarbage(L);
 }
 
+static void lstream_client_read_cancel(lua_State *L, lc_wait *wait, lc_context_state state) {
+    lstream_client *client = (lstream_client *)wait;
+    pal_socket_cancel_recv(&client->sock);
+    lua_pushinteger(client->co, lstream_client_cancel_err(state));
+    lc_wakeup(client->co, 1, LC_PRIO_NORMAL);
+}
+
 static int finishread(lua_State *L, int status, lua_KContext extra) {
     lstream_client *client = (lstream_client *)extra;
     client->co = NULL;
@@ -584,6 +615,12 @@ static int lstream_client_async_read(lua_State *L, lstream_client *client, size_
     pal_err err = pal_socket_recv(&client->sock, buf, &len, lstream_client_read_recved_cb, client);
     if (err == PAL_ERR_IN_PROGRESS) {
         client->co = L;
+        lc_context_state state = lc_wait_add(L, &client->wait, lstream_client_read_cancel);
+        if (luai_unlikely(state != LC_CONTEXT_ACTIVE)) {
+            pal_socket_cancel_recv(&client->sock);
+            lua_pushinteger(L, lstream_client_cancel_err(state));
+            return k(L, 1, (lua_KContext)client);
+        }
         return lua_yieldk(L, 0, (lua_KContext)client, k);
     }
 
@@ -12,6 +12,7 @@ extern "C" {
 #endif
 
 #include <stdlib.h>
+#include <esp_heap_caps.h>
 
 /**
  * Allocate size bytes and return a pointer to the allocated memory.
@@ -42,6 +43,17 @@ extern "C" {
  */
 #define pal_mem_free(ptr) free(ptr)
 
+/**
+ * Get the free heap size in bytes, 0 if it is unknown.
+ */
+#define pal_mem_get_free_size() heap_caps_get_free_size(MALLOC_CAP_DEFAULT)
+
+/**
+ * Get the memory used by the process in bytes, the used heap on ESP.
+ */
+#define pal_mem_get_used_size() \
+    (heap_caps_get_total_size(MALLOC_CAP_DEFAULT) - heap_caps_get_free_size(MALLOC_CAP_DEFAULT))
+
 #ifdef __cplusplus
 }
 #endif
@@ -36,6 +36,7 @@
 #include <pal/ssl.h>
 #include <pal/ssl_int.h>
 #include <pal/dns.h>
+#include <pal/worker.h>
 #include <pal/net_if_int.h>
 
 #include <HAPPlatformRunLoop+Init.h>
@@ -106,10 +107,11 @@ void app_main_task(void *arg) {
     HAPPlatformRunLoopCreate();
     pal_ssl_init();
     pal_dns_init();
+    pal_worker_init();
     pal_net_if_init();
 
     // Initialize application.
-    app_init(APP_SPIFFS_DIR_PATH);
+    app_init(APP_SPIFFS_DIR_PATH, APP_ALLOC_SYSTEM);
     app_register_exec_cmd();
 
     // Execute default command.
@@ -119,6 +121,9 @@ void app_main_task(void *arg) {
     HAPPlatformRunLoopRun();
     // Run loop stopped explicitly by calling function HAPPlatformRunLoopStop.
 
+    // Wait for the running jobs before the application releases their buffers.
+    pal_worker_deinit();
+
     // De-initialize application.
     app_deinit();
 
@@ -0,0 +1,45 @@
+// Copyright (c) 2021-2022 Zebin Wu and homekit-bridge contributors
+//
+// Licensed under the Apache License, Version 2.0 (the “License”);
+// you may not use this file except in compliance with the License.
+// See [CONTRIBUTORS.md] for the list of homekit-bridge project authors.
+
+#include <pal/worker.h>
+#include <pal/mem.h>
+#include <HAPPlatform.h>
+
+// There is not enough memory for the stacks of worker threads,
+// the jobs are run in the run loop, and done in the next iteration.
+
+typedef struct {
+    pal_worker_run_cb run_cb;
+    pal_worker_done_cb done_cb;
+    void *arg;
+} pal_worker_job;
+
+static void pal_worker_job_run(void* _Nullable context, size_t contextSize) {
+    HAPPrecondition(context);
+    HAPPrecondition(contextSize == sizeof(pal_worker_job));
+    pal_worker_job *job = context;
+
+    job->run_cb(job->arg);
+    job->done_cb(job->arg, false);
+}
+
+void pal_worker_init() {
+}
+
+void pal_worker_deinit() {
+}
+
+bool pal_worker_submit(pal_worker_run_cb run_cb, pal_worker_done_cb done_cb, void *arg) {
+    HAPPrecondition(run_cb);
+    HAPPrecondition(done_cb);
+
+    pal_worker_job job = {
+        .run_cb = run_cb,
+        .done_cb = done_cb,
+        .arg = arg,
+    };
+    return HAPPlatformRunLoopScheduleCallback(pal_worker_job_run, &job, sizeof(job)) == kHAPError_None;
+}
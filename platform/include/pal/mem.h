@@ -56,6 +56,20 @@ void *pal_mem_realloc(void *ptr, size_t size);
 void pal_mem_free(void *p);
 #endif
 
+#ifndef pal_mem_get_free_size
+/**
+ * Get the free heap size in bytes, 0 if it is unknown.
+ */
+size_t pal_mem_get_free_size(void);
+#endif
+
+#ifndef pal_mem_get_used_size
+/**
+ * Get the memory used by the process in bytes, the resident set size on Linux, 0 if it is unknown.
+ */
+size_t pal_mem_get_used_size(void);
+#endif
+
 #ifdef __cplusplus
 }
 #endif
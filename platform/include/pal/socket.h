@@ -325,6 +325,24 @@ pal_err pal_socket_recv(pal_socket_obj *o, void *buf, size_t *len,
 pal_err pal_socket_recvfrom(pal_socket_obj *o, void *buf, size_t *len, char *addr,
     size_t addrlen, uint16_t *port, pal_socket_recved_cb recved_cb, void *arg);
 
+/**
+ * Cancel the pending receive.
+ *
+ * The callback of the receive will not be called.
+ *
+ * @param o The pointer to the socket object.
+ */
+void pal_socket_cancel_recv(pal_socket_obj *o);
+
+/**
+ * Cancel the callbacks of the pending sends.
+ *
+ * The pending data is still sent, but the callbacks will not be called.
+ *
+ * @param o The pointer to the socket object.
+ */
+void pal_socket_cancel_send(pal_socket_obj *o);
+
 /**
  * Whether the socket is readable.
  *
@@ -0,0 +1,62 @@
+// Copyright (c) 2021-2022 Zebin Wu and homekit-bridge contributors
+//
+// Licensed under the Apache License, Version 2.0 (the “License”);
+// you may not use this file except in compliance with the License.
+// See [CONTRIBUTORS.md] for the list of homekit-bridge project authors.
+
+#ifndef PLATFORM_INCLUDE_PAL_WORKER_H_
+#define PLATFORM_INCLUDE_PAL_WORKER_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+
+/**
+ * A function to run off the run loop.
+ *
+ * It must not call any function other than the thread-safe ones,
+ * such as pal_mem_*(), pal_md_*() and pal_cipher_*() with its own context.
+ *
+ * @param arg The last paramter of pal_worker_submit().
+ */
+typedef void (*pal_worker_run_cb)(void *arg);
+
+/**
+ * A callback called in the run loop when the job is done.
+ *
+ * @param arg The last paramter of pal_worker_submit().
+ * @param cancelled Whether the job is dropped by pal_worker_deinit() before it runs.
+ */
+typedef void (*pal_worker_done_cb)(void *arg, bool cancelled);
+
+/**
+ * Initialize worker module.
+ */
+void pal_worker_init();
+
+/**
+ * De-initialize worker module.
+ *
+ * The running jobs are waited to finish, the done callbacks of the finished
+ * jobs are called, and the queued jobs are cancelled.
+ */
+void pal_worker_deinit();
+
+/**
+ * Submit a job to the worker threads.
+ *
+ * @param run_cb A function called in a worker thread.
+ * @param done_cb A callback called in the run loop after @p run_cb returns.
+ * @param arg The value to be passed as the argument to @p run_cb and @p done_cb.
+ * @return true on success.
+ * @return false on failure.
+ */
+bool pal_worker_submit(pal_worker_run_cb run_cb, pal_worker_done_cb done_cb, void *arg);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // PLATFORM_INCLUDE_PAL_WORKER_H_
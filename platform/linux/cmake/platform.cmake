@@ -11,6 +11,11 @@ set(CONFIG_POSIX ON)
 set(CONFIG_OPENSSL ON)
 set(CONFIG_MBEDTLS OFF)
 
+# nvs engine, ON: a single append-only log, OFF: a file per namespace
+if(NOT DEFINED CONFIG_NVS_LOG)
+    set(CONFIG_NVS_LOG OFF)
+endif()
+
 # set the work directory
 set(BRIDGE_WORK_DIR "/usr/local/lib/${TARGET}")
 
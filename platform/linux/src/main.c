@@ -19,6 +19,7 @@
 #include <pal/ssl.h>
 #include <pal/ssl_int.h>
 #include <pal/dns.h>
+#include <pal/worker.h>
 #include <pal/nvs_int.h>
 #include <pal/net_if_int.h>
 
@@ -32,10 +33,12 @@ static const char *help = \
     "usage: %s [options] [script [args]]\n"
     "options:\n"
     "  -d, --dir    set the working directory\n"
+    "  -a, --alloc  set the Lua allocator: slab (default) or system\n"
     "  -h, --help   display this help and exit\n";
 
 static const char *progname = "homekit-bridge";
 static const char *workdir = BRIDGE_WORK_DIR;
+static app_allocator allocator = APP_ALLOC_SLAB;
 
 static void usage(const char* message) {
     if (message) {
@@ -62,6 +65,16 @@ static int doargs(int argc, char *argv[]) {
                 usage("'-d' needs argument");
                 exit(EXIT_FAILURE);
             }
+        } else if (!strcmp(argv[i], "-a") || !strcmp(argv[i], "--alloc")) {
+            const char *name = argv[++i];
+            if (name && !strcmp(name, "slab")) {
+                allocator = APP_ALLOC_SLAB;
+            } else if (name && !strcmp(name, "system")) {
+                allocator = APP_ALLOC_SYSTEM;
+            } else {
+                usage("'-a' needs argument 'slab' or 'system'");
+                exit(EXIT_FAILURE);
+            }
         } else if (argv[i][0] == '-') {
             usage(argv[i]);
             exit(EXIT_FAILURE);
@@ -95,11 +108,12 @@ int main(int argc, char *argv[]) {
     HAPPlatformRunLoopCreate();
     pal_ssl_init();
     pal_dns_init();
+    pal_worker_init();
     pal_nvs_init(".nvs");
     pal_net_if_init();
 
     // Initialize application.
-    app_init(workdir);
+    app_init(workdir, allocator);
 
     // Execute command.
     if (argc == parsed) {
@@ -115,6 +129,9 @@ int main(int argc, char *argv[]) {
     HAPPlatformRunLoopRun();
     // Run loop stopped explicitly by calling function HAPPlatformRunLoopStop.
 
+    // Wait for the running jobs before the application releases their buffers.
+    pal_worker_deinit();
+
     // De-initialize application.
     app_deinit();
 
@@ -0,0 +1,41 @@
+// Copyright (c) 2021-2022 Zebin Wu and homekit-bridge contributors
+//
+// Licensed under the Apache License, Version 2.0 (the “License”);
+// you may not use this file except in compliance with the License.
+// See [CONTRIBUTORS.md] for the list of homekit-bridge project authors.
+
+#include <stdio.h>
+#include <unistd.h>
+#include <pal/mem.h>
+
+/**
+ * The available memory of the system, it counts the reclaimable page cache
+ * unlike _SC_AVPHYS_PAGES, so it does not vary with the state of the cache.
+ */
+size_t pal_mem_get_free_size(void) {
+    FILE *fp = fopen("/proc/meminfo", "r");
+    if (!fp) {
+        return 0;
+    }
+    char line[128];
+    unsigned long kb = 0;
+    while (fgets(line, sizeof(line), fp)) {
+        if (sscanf(line, "MemAvailable: %lu kB", &kb) == 1) {
+            break;
+        }
+    }
+    fclose(fp);
+    return kb * 1024;
+}
+
+size_t pal_mem_get_used_size(void) {
+    FILE *fp = fopen("/proc/self/statm", "r");
+    if (!fp) {
+        return 0;
+    }
+    unsigned long size, resident;
+    int n = fscanf(fp, "%lu %lu", &size, &resident);
+    fclose(fp);
+    long pagesize = sysconf(_SC_PAGESIZE);
+    return n == 2 && pagesize > 0 ? resident * (size_t)pagesize : 0;
+}
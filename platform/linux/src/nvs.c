@@ -44,6 +44,8 @@ struct pal_nvs_handle {
 
 static bool ginited;
 static char *gnvs_dir;
+static size_t gcommits;         /* number of the committed handles */
+static size_t gwritten;         /* number of bytes written by commits */
 static LIST_HEAD(pal_nvs_handle_list_head, pal_nvs_handle) ghandle_list_head;
 
 static ssize_t read_all(int fd, void *buf, size_t len) {
@@ -72,6 +74,8 @@ void pal_nvs_init(const char *dir) {
     memcpy(gnvs_dir, dir, len);
     gnvs_dir[len] = '\0';
     LIST_INIT(&ghandle_list_head);
+    gcommits = 0;
+    gwritten = 0;
     ginited = true;
 }
 
@@ -83,6 +87,7 @@ void pal_nvs_deinit() {
         pal_nvs_close(cur);
     }
     LIST_INIT(&ghandle_list_head);
+    HAPLogInfo(&logObject, "%zu commits, %zu bytes written.", gcommits, gwritten);
     pal_mem_free(gnvs_dir);
     ginited = false;
 }
@@ -389,6 +394,7 @@ static bool write_all_to_tmp_file(int fd, const char *path, const char *dir, con
         NVS_LOG_ERR("Error writing temporary file %s in %s.", path, dir);
         return false;
     }
+    gwritten += len;
     return true;
 }
 
@@ -529,6 +535,7 @@ bool pal_nvs_commit(pal_nvs_handle *handle) {
     HAPPlatformFileManagerCloseDirFreeSafe(dir);
 
     handle->changed = false;
+    gcommits++;
     return true;
 
 err1:
@@ -0,0 +1,1091 @@
+// Copyright (c) 2021-2022 Zebin Wu and homekit-bridge contributors
+//
+// Licensed under the Apache License, Version 2.0 (the “License”);
+// you may not use this file except in compliance with the License.
+// See [CONTRIBUTORS.md] for the list of homekit-bridge project authors.
+
+// Log-structured NVS engine.
+//
+// All namespaces are stored in one log file. A commit appends the records of
+// the changed keys followed by a commit record, each record has a CRC-32.
+// At the startup the log is replayed into an in-memory index of the value
+// offsets, and the tail after the last complete commit is truncated.
+// The log is synchronized before a commit returns, and it is compacted
+// in the background when the garbage exceeds the live data: the live records
+// are copied to a new log a few namespaces per run loop callback, the commits
+// in the meantime are appended to both logs, and the new log replaces the log
+// once all namespaces are copied.
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/queue.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pal/mem.h>
+#include <pal/nvs.h>
+#include <pal/nvs_int.h>
+
+#include <HAPPlatform.h>
+#include <HAPPlatformFileManager.h>
+
+static const HAPLogObject logObject = { .subsystem = kHAPPlatform_LogSubsystem, .category = "nvs" };
+
+#define NVS_LOG_ERR(fmt, arg...) \
+    HAPLogError(&logObject, "%s: " fmt, __func__, ##arg)
+
+#define PAL_NVS_MAGIC "nvl1"
+#define PAL_NVS_MAGIC_LEN sizeof(PAL_NVS_MAGIC) - 1
+
+#define PAL_NVS_LOG_FILE "nvs.log"
+#define PAL_NVS_LOG_TMP_FILE "nvs.log-tmp"
+
+// Delay in milliseconds of the group fsync, the commits in the delay share one fsync.
+// 0 synchronizes the log before the commit returns, the HAP key-value store
+// relies on it to keep the pairings, so a group fsync is only opted in by the build.
+#ifndef PAL_NVS_SYNC_DELAY
+#define PAL_NVS_SYNC_DELAY 0
+#endif
+
+// The log is compacted when the garbage exceeds both this size and the live data.
+#define PAL_NVS_COMPACT_MIN_GARBAGE ((size_t) 64 * 1024)
+
+// Bytes copied by a step of the compaction, a namespace is copied in one step.
+#define PAL_NVS_COMPACT_STEP ((size_t) 16 * 1024)
+
+enum {
+    PAL_NVS_REC_SET = 1,    /* set the value of a key */
+    PAL_NVS_REC_DEL,        /* remove a key */
+    PAL_NVS_REC_ERASE,      /* remove all keys of the namespace */
+    PAL_NVS_REC_COMMIT,     /* end of a commit of the namespace */
+};
+
+/**
+ * Record header, followed by the namespace, the key and the value.
+ */
+typedef struct {
+    uint32_t crc;           /* CRC-32 of the rest of the record */
+    uint8_t type;
+    uint8_t name_len;
+    uint8_t key_len;
+    uint8_t reserved;
+    uint32_t value_len;
+} pal_nvs_rec_hdr;
+
+/**
+ * Live key in the log.
+ */
+struct pal_nvs_entry {
+    char key[PAL_NVS_KEY_MAX_LEN + 1];
+    size_t len;
+    off_t offset;           /* offset of the value in the log */
+    off_t new_offset;       /* offset of the value in the compacted log */
+    SLIST_ENTRY(pal_nvs_entry) list_entry;
+};
+
+/**
+ * Namespace in the log.
+ */
+struct pal_nvs_ns {
+    char name[PAL_NVS_NAME_MAX_LEN + 1];
+    SLIST_HEAD(pal_nvs_entry_list_head, pal_nvs_entry) entry_list_head;
+    bool compacted;         /* the live records are in the compacted log */
+    LIST_ENTRY(pal_nvs_ns) list_entry;
+};
+
+struct pal_nvs_item {
+    char key[PAL_NVS_KEY_MAX_LEN + 1];
+    size_t len;
+    bool dirty;             /* the value is not committed */
+    SLIST_ENTRY(pal_nvs_item) list_entry;
+    char value[0];
+};
+
+struct pal_nvs_handle {
+    char name[PAL_NVS_NAME_MAX_LEN + 1];
+    uint32_t using_count;
+    bool changed;
+    bool erased;            /* all keys are removed since the last commit */
+    SLIST_HEAD(pal_nvs_item_list_head, pal_nvs_item) item_list_head;
+    SLIST_HEAD(, pal_nvs_item) removed_list_head;   /* keys removed since the last commit */
+    LIST_ENTRY(pal_nvs_handle) list_entry;
+};
+
+static bool ginited;
+static char *gnvs_dir;
+static LIST_HEAD(pal_nvs_handle_list_head, pal_nvs_handle) ghandle_list_head;
+
+static struct {
+    int fd;
+    off_t size;             /* size of the log */
+    size_t live;            /* bytes of the magic and the live records */
+    HAPPlatformTimerRef sync_timer;
+    bool compact_scheduled;
+    int compact_fd;         /* compacted log being written, -1 if no compaction is running */
+    off_t compact_size;     /* size of the compacted log */
+    size_t commits;
+    size_t written;         /* bytes written by the commits and the compactions */
+    size_t compactions;
+    LIST_HEAD(pal_nvs_ns_list_head, pal_nvs_ns) ns_list_head;
+} glog;
+
+static void pal_nvs_compact_abort(void);
+
+static uint32_t pal_nvs_crc32(uint32_t crc, const void *buf, size_t len) {
+    const uint8_t *p = buf;
+    crc = ~crc;
+    while (len--) {
+        crc ^= *p++;
+        for (int k = 0; k < 8; k++) {
+            crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+        }
+    }
+    return ~crc;
+}
+
+static inline size_t pal_nvs_rec_size(size_t name_len, size_t key_len, size_t value_len) {
+    return sizeof(pal_nvs_rec_hdr) + name_len + key_len + value_len;
+}
+
+static ssize_t pread_all(int fd, void *buf, size_t len, off_t offset) {
+    ssize_t rc;
+    size_t readbytes = 0;
+
+    while (readbytes < len) {
+        do {
+            rc = pread(fd, buf + readbytes, len - readbytes, offset + readbytes);
+        } while (rc == -1 && errno == EINTR);
+        if (rc < 0) {
+            return rc;
+        } else if (rc == 0) {
+            break;
+        }
+        readbytes += rc;
+    }
+    return readbytes;
+}
+
+static ssize_t pwrite_all(int fd, const void *buf, size_t len, off_t offset) {
+    ssize_t rc;
+    size_t written = 0;
+
+    while (written < len) {
+        do {
+            rc = pwrite(fd, buf + written, len - written, offset + written);
+        } while (rc == -1 && errno == EINTR);
+        if (rc < 0) {
+            return rc;
+        } else if (rc == 0) {
+            break;
+        }
+        written += rc;
+    }
+    return written;
+}
+
+static bool pal_nvs_fsync(int fd, const char *what) {
+    int e;
+    do {
+        e = fsync(fd);
+    } while (e == -1 && errno == EINTR);
+    if (e) {
+        int _errno = errno;
+        HAPAssert(e == -1);
+        NVS_LOG_ERR("fsync of %s failed: %d.", what, _errno);
+        return false;
+    }
+    return true;
+}
+
+static struct pal_nvs_ns *pal_nvs_find_ns(const char *name, bool create) {
+    struct pal_nvs_ns *ns;
+    LIST_FOREACH(ns, &glog.ns_list_head, list_entry) {
+        if (!strcmp(ns->name, name)) {
+            return ns;
+        }
+    }
+    if (!create) {
+        return NULL;
+    }
+    ns = pal_mem_alloc(sizeof(*ns));
+    if (!ns) {
+        NVS_LOG_ERR("Failed to alloc memory.");
+        return NULL;
+    }
+    snprintf(ns->name, sizeof(ns->name), "%s", name);
+    SLIST_INIT(&ns->entry_list_head);
+    // The records of a namespace created in a compaction are appended to both logs.
+    ns->compacted = glog.compact_fd >= 0;
+    LIST_INSERT_HEAD(&glog.ns_list_head, ns, list_entry);
+    return ns;
+}
+
+static void pal_nvs_free_ns(struct pal_nvs_ns *ns) {
+    for (struct pal_nvs_entry *t = SLIST_FIRST(&ns->entry_list_head); t;) {
+        struct pal_nvs_entry *cur = t;
+        t = SLIST_NEXT(t, list_entry);
+        pal_mem_free(cur);
+    }
+    LIST_REMOVE(ns, list_entry);
+    pal_mem_free(ns);
+}
+
+/**
+ * Remove the key from the index, the record of the key becomes garbage.
+ */
+static void pal_nvs_index_del(struct pal_nvs_ns *ns, const char *key) {
+    size_t name_len = strlen(ns->name);
+    for (struct pal_nvs_entry **t = &SLIST_FIRST(&ns->entry_list_head); *t;
+        t = &SLIST_NEXT(*t, list_entry)) {
+        if (!strcmp((*t)->key, key)) {
+            struct pal_nvs_entry *cur = *t;
+            *t = SLIST_NEXT(cur, list_entry);
+            glog.live -= pal_nvs_rec_size(name_len, strlen(cur->key), cur->len);
+            pal_mem_free(cur);
+            return;
+        }
+    }
+}
+
+static void pal_nvs_index_erase(struct pal_nvs_ns *ns) {
+    size_t name_len = strlen(ns->name);
+    struct pal_nvs_entry *t;
+    SLIST_FOREACH(t, &ns->entry_list_head, list_entry) {
+        glog.live -= pal_nvs_rec_size(name_len, strlen(t->key), t->len);
+    }
+    pal_nvs_free_ns(ns);
+}
+
+static struct pal_nvs_entry *pal_nvs_index_set(struct pal_nvs_ns *ns, const char *key, size_t len, off_t offset) {
+    pal_nvs_index_del(ns, key);
+    struct pal_nvs_entry *entry = pal_mem_alloc(sizeof(*entry));
+    if (!entry) {
+        NVS_LOG_ERR("Failed to alloc memory.");
+        return NULL;
+    }
+    snprintf(entry->key, sizeof(entry->key), "%s", key);
+    entry->len = len;
+    entry->offset = offset;
+    SLIST_INSERT_HEAD(&ns->entry_list_head, entry, list_entry);
+    glog.live += pal_nvs_rec_size(strlen(ns->name), strlen(key), len);
+    return entry;
+}
+
+/**
+ * Read and check the record at @p offset.
+ *
+ * @return the size of the record, or 0 if the record is torn or corrupted.
+ */
+static size_t pal_nvs_read_rec(off_t offset, pal_nvs_rec_hdr *hdr,
+    char name[PAL_NVS_NAME_MAX_LEN + 1], char key[PAL_NVS_KEY_MAX_LEN + 1]) {
+    if (offset + (off_t)sizeof(*hdr) > glog.size ||
+        pread_all(glog.fd, hdr, sizeof(*hdr), offset) != sizeof(*hdr)) {
+        return 0;
+    }
+    if (hdr->type < PAL_NVS_REC_SET || hdr->type > PAL_NVS_REC_COMMIT ||
+        hdr->name_len == 0 || hdr->name_len > PAL_NVS_NAME_MAX_LEN ||
+        hdr->key_len > PAL_NVS_KEY_MAX_LEN ||
+        (hdr->type == PAL_NVS_REC_SET) != (hdr->key_len > 0 && hdr->value_len > 0) ||
+        (hdr->type == PAL_NVS_REC_DEL && hdr->key_len == 0)) {
+        return 0;
+    }
+    size_t size = pal_nvs_rec_size(hdr->name_len, hdr->key_len, hdr->value_len);
+    if (offset + (off_t)size > glog.size) {
+        return 0;
+    }
+
+    uint32_t crc = pal_nvs_crc32(0, (char *)hdr + sizeof(hdr->crc), sizeof(*hdr) - sizeof(hdr->crc));
+    off_t pos = offset + sizeof(*hdr);
+    if (pread_all(glog.fd, name, hdr->name_len, pos) != hdr->name_len) {
+        return 0;
+    }
+    name[hdr->name_len] = '\0';
+    crc = pal_nvs_crc32(crc, name, hdr->name_len);
+    pos += hdr->name_len;
+    if (pread_all(glog.fd, key, hdr->key_len, pos) != hdr->key_len) {
+        return 0;
+    }
+    key[hdr->key_len] = '\0';
+    crc = pal_nvs_crc32(crc, key, hdr->key_len);
+    pos += hdr->key_len;
+    char buf[256];
+    for (size_t remain = hdr->value_len; remain;) {
+        size_t n = remain < sizeof(buf) ? remain : sizeof(buf);
+        if (pread_all(glog.fd, buf, n, pos) != n) {
+            return 0;
+        }
+        crc = pal_nvs_crc32(crc, buf, n);
+        pos += n;
+        remain -= n;
+    }
+    return crc == hdr->crc ? size : 0;
+}
+
+/**
+ * Replay the log into the index, the tail after the last complete commit is truncated.
+ */
+static bool pal_nvs_replay(void) {
+    pal_nvs_rec_hdr hdr;
+    char name[PAL_NVS_NAME_MAX_LEN + 1];
+    char key[PAL_NVS_KEY_MAX_LEN + 1];
+
+    // Find the end of the last complete commit.
+    off_t end = PAL_NVS_MAGIC_LEN;
+    for (off_t offset = end;;) {
+        size_t size = pal_nvs_read_rec(offset, &hdr, name, key);
+        if (size == 0) {
+            break;
+        }
+        offset += size;
+        if (hdr.type == PAL_NVS_REC_COMMIT) {
+            end = offset;
+        }
+    }
+
+    glog.live = PAL_NVS_MAGIC_LEN;
+    for (off_t offset = PAL_NVS_MAGIC_LEN; offset < end;) {
+        size_t size = pal_nvs_read_rec(offset, &hdr, name, key);
+        HAPAssert(size);
+        struct pal_nvs_ns *ns = pal_nvs_find_ns(name, hdr.type == PAL_NVS_REC_SET);
+        switch (hdr.type) {
+        case PAL_NVS_REC_SET:
+            if (!ns || !pal_nvs_index_set(ns, key, hdr.value_len, offset + size - hdr.value_len)) {
+                return false;
+            }
+            break;
+        case PAL_NVS_REC_DEL:
+            if (ns) {
+                pal_nvs_index_del(ns, key);
+            }
+            break;
+        case PAL_NVS_REC_ERASE:
+            if (ns) {
+                pal_nvs_index_erase(ns);
+            }
+            break;
+        default:
+            break;
+        }
+        offset += size;
+    }
+
+    if (end < glog.size) {
+        HAPLog(&logObject, "Truncate the incomplete commit at %lld, %lld bytes dropped.",
+            (long long)end, (long long)(glog.size - end));
+        if (ftruncate(glog.fd, end)) {
+            int _errno = errno;
+            NVS_LOG_ERR("ftruncate failed: %d.", _errno);
+            return false;
+        }
+        glog.size = end;
+    }
+    return true;
+}
+
+static bool pal_nvs_open_log(void) {
+    // Create directory.
+    HAPError err = HAPPlatformFileManagerCreateDirectory(gnvs_dir);
+    if (err) {
+        HAPAssert(err == kHAPError_Unknown);
+        NVS_LOG_ERR("Create directory %s failed.", gnvs_dir);
+        return false;
+    }
+
+    char path[256];
+    snprintf(path, sizeof(path), "%s/%s", gnvs_dir, PAL_NVS_LOG_FILE);
+    do {
+        glog.fd = open(path, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+    } while (glog.fd == -1 && errno == EINTR);
+    if (glog.fd < 0) {
+        int _errno = errno;
+        NVS_LOG_ERR("open %s failed: %d.", path, _errno);
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(glog.fd, &st)) {
+        int _errno = errno;
+        NVS_LOG_ERR("fstat %s failed: %d.", path, _errno);
+        goto err;
+    }
+    glog.size = st.st_size;
+
+    if (glog.size == 0) {
+        if (pwrite_all(glog.fd, PAL_NVS_MAGIC, PAL_NVS_MAGIC_LEN, 0) != PAL_NVS_MAGIC_LEN ||
+            !pal_nvs_fsync(glog.fd, path)) {
+            NVS_LOG_ERR("Failed to write the magic to %s.", path);
+            goto err;
+        }
+        glog.size = PAL_NVS_MAGIC_LEN;
+        glog.live = PAL_NVS_MAGIC_LEN;
+        return true;
+    }
+
+    char magic[PAL_NVS_MAGIC_LEN];
+    if (pread_all(glog.fd, magic, sizeof(magic), 0) != sizeof(magic) ||
+        memcmp(magic, PAL_NVS_MAGIC, sizeof(magic))) {
+        NVS_LOG_ERR("Invalid data format.");
+        goto err;
+    }
+    if (!pal_nvs_replay()) {
+        goto err;
+    }
+    return true;
+
+err:
+    close(glog.fd);
+    glog.fd = -1;
+    return false;
+}
+
+void pal_nvs_init(const char *dir) {
+    HAPPrecondition(ginited == false);
+    size_t len = strlen(dir);
+    gnvs_dir = pal_mem_alloc(len + 1);
+    HAPAssert(gnvs_dir);
+    memcpy(gnvs_dir, dir, len);
+    gnvs_dir[len] = '\0';
+    LIST_INIT(&ghandle_list_head);
+    HAPRawBufferZero(&glog, sizeof(glog));
+    LIST_INIT(&glog.ns_list_head);
+    glog.fd = -1;
+    glog.compact_fd = -1;
+    if (!pal_nvs_open_log()) {
+        NVS_LOG_ERR("Failed to open the log in %s.", gnvs_dir);
+    }
+    ginited = true;
+}
+
+void pal_nvs_deinit() {
+    HAPPrecondition(ginited == true);
+    for (struct pal_nvs_handle *t = LIST_FIRST(&ghandle_list_head); t;) {
+        struct pal_nvs_handle *cur = t;
+        t = LIST_NEXT(t, list_entry);
+        pal_nvs_close(cur);
+    }
+    LIST_INIT(&ghandle_list_head);
+    if (glog.sync_timer) {
+        HAPPlatformTimerDeregister(glog.sync_timer);
+        glog.sync_timer = 0;
+    }
+    pal_nvs_compact_abort();
+    if (glog.fd >= 0) {
+        pal_nvs_fsync(glog.fd, PAL_NVS_LOG_FILE);
+        close(glog.fd);
+    }
+    HAPLogInfo(&logObject, "%zu commits, %zu bytes written, %zu compactions.",
+        glog.commits, glog.written, glog.compactions);
+    while (!LIST_EMPTY(&glog.ns_list_head)) {
+        pal_nvs_free_ns(LIST_FIRST(&glog.ns_list_head));
+    }
+    pal_mem_free(gnvs_dir);
+    ginited = false;
+}
+
+static void pal_nvs_remove_all_items(pal_nvs_handle *handle) {
+    for (struct pal_nvs_item *t = SLIST_FIRST(&handle->item_list_head); t;) {
+        struct pal_nvs_item *cur = t;
+        t = SLIST_NEXT(t, list_entry);
+        pal_mem_free(cur);
+    }
+    SLIST_INIT(&handle->item_list_head);
+}
+
+static void pal_nvs_remove_all_removed(pal_nvs_handle *handle) {
+    for (struct pal_nvs_item *t = SLIST_FIRST(&handle->removed_list_head); t;) {
+        struct pal_nvs_item *cur = t;
+        t = SLIST_NEXT(t, list_entry);
+        pal_mem_free(cur);
+    }
+    SLIST_INIT(&handle->removed_list_head);
+}
+
+pal_nvs_handle *pal_nvs_open(const char *name) {
+    HAPPrecondition(ginited);
+    HAPPrecondition(name);
+    size_t name_len = strlen(name);
+    HAPPrecondition(name_len > 0 && name_len <= PAL_NVS_NAME_MAX_LEN);
+
+    if (glog.fd < 0) {
+        NVS_LOG_ERR("The log is not opened.");
+        return NULL;
+    }
+
+    pal_nvs_handle *handle;
+    LIST_FOREACH(handle, &ghandle_list_head, list_entry) {
+        if (!strcmp(handle->name, name)) {
+            handle->using_count++;
+            return handle;
+        }
+    }
+
+    handle = pal_mem_alloc(sizeof(*handle));
+    if (!handle) {
+        NVS_LOG_ERR("Failed to alloc NVS handle.");
+        return NULL;
+    }
+    memcpy(handle->name, name, name_len);
+    handle->name[name_len] = '\0';
+
+    handle->using_count = 1;
+    handle->changed = false;
+    handle->erased = false;
+    SLIST_INIT(&handle->item_list_head);
+    SLIST_INIT(&handle->removed_list_head);
+
+    struct pal_nvs_ns *ns = pal_nvs_find_ns(name, false);
+    if (ns) {
+        struct pal_nvs_entry *t;
+        SLIST_FOREACH(t, &ns->entry_list_head, list_entry) {
+            struct pal_nvs_item *item = pal_mem_alloc(sizeof(*item) + t->len);
+            if (!item) {
+                NVS_LOG_ERR("Failed to alloc memory.");
+                goto err;
+            }
+            if (pread_all(glog.fd, item->value, t->len, t->offset) != t->len) {
+                int _errno = errno;
+                NVS_LOG_ERR("read '%s' of '%s' failed: %d.", t->key, name, _errno);
+                pal_mem_free(item);
+                goto err;
+            }
+            snprintf(item->key, sizeof(item->key), "%s", t->key);
+            item->len = t->len;
+            item->dirty = false;
+            SLIST_INSERT_HEAD(&handle->item_list_head, item, list_entry);
+        }
+    }
+
+    LIST_INSERT_HEAD(&ghandle_list_head, handle, list_entry);
+    return handle;
+
+err:
+    pal_nvs_remove_all_items(handle);
+    pal_mem_free(handle);
+    return NULL;
+}
+
+static struct pal_nvs_item *pal_nvs_find_key(pal_nvs_handle *handle, const char *key) {
+    struct pal_nvs_item *t;
+    SLIST_FOREACH(t, &handle->item_list_head, list_entry) {
+        if (!strcmp(t->key, key)) {
+            return t;
+        }
+    }
+    return NULL;
+}
+
+bool pal_nvs_get(pal_nvs_handle *handle, const char *key, void *buf, size_t len) {
+    HAPPrecondition(handle);
+    HAPPrecondition(key);
+    size_t key_len = strlen(key);
+    HAPPrecondition(key_len > 0 && key_len <= PAL_NVS_KEY_MAX_LEN);
+    HAPPrecondition(buf);
+    HAPPrecondition(len);
+
+    struct pal_nvs_item *item = pal_nvs_find_key(handle, key);
+    if (item) {
+        HAPAssert(len == item->len);
+        memcpy(buf, item->value, len);
+        return true;
+    }
+
+    HAPLog(&logObject, "No key '%s' in name '%s'.", key, handle->name);
+    return false;
+}
+
+size_t pal_nvs_get_len(pal_nvs_handle *handle, const char *key) {
+    HAPPrecondition(handle);
+    HAPPrecondition(key);
+    size_t key_len = strlen(key);
+    HAPPrecondition(key_len > 0 && key_len <= PAL_NVS_KEY_MAX_LEN);
+
+    struct pal_nvs_item *item = pal_nvs_find_key(handle, key);
+    if (item) {
+        return item->len;
+    }
+    return 0;
+}
+
+bool pal_nvs_set(pal_nvs_handle *handle, const char *key, const void *value, size_t len) {
+    HAPPrecondition(handle);
+    HAPPrecondition(key);
+    size_t keylen = strlen(key);
+    HAPPrecondition(keylen > 0 && keylen <= PAL_NVS_KEY_MAX_LEN);
+    HAPPrecondition(value);
+    HAPPrecondition(len);
+
+    for (struct pal_nvs_item **t = &SLIST_FIRST(&handle->item_list_head); *t;
+        t = &SLIST_NEXT(*t, list_entry)) {
+        if (!strcmp((*t)->key, key)) {
+            if ((*t)->len != len) {
+                struct pal_nvs_item *item = pal_mem_realloc(*t, sizeof(**t) + len);
+                if (!item) {
+                    NVS_LOG_ERR("Failed to alloc memory.");
+                    return false;
+                }
+                *t = item;
+                (*t)->len = len;
+            } else if (!memcmp((*t)->value, value, len)) {
+                return true;
+            }
+            memcpy((*t)->value, value, len);
+            (*t)->dirty = true;
+            handle->changed = true;
+            return true;
+        }
+    }
+
+    struct pal_nvs_item *item = pal_mem_alloc(sizeof(*item) + len);
+    if (!item) {
+        NVS_LOG_ERR("Failed to alloc memory.");
+        return false;
+    }
+    item->len = len;
+    item->dirty = true;
+    SLIST_INSERT_HEAD(&handle->item_list_head, item, list_entry);
+    memcpy(item->key, key, keylen);
+    item->key[keylen] = '\0';
+    memcpy(item->value, value, len);
+    handle->changed = true;
+    return true;
+}
+
+bool pal_nvs_remove(pal_nvs_handle *handle, const char *key) {
+    HAPPrecondition(handle);
+    HAPPrecondition(key);
+    size_t key_len = strlen(key);
+    HAPPrecondition(key_len > 0 && key_len <= PAL_NVS_KEY_MAX_LEN);
+
+    for (struct pal_nvs_item **t = &SLIST_FIRST(&handle->item_list_head); *t;
+        t = &SLIST_NEXT(*t, list_entry)) {
+        if (!strcmp((*t)->key, key)) {
+            struct pal_nvs_item *cur = *t;
+            *t = SLIST_NEXT(cur, list_entry);
+            // Keep the key to append a removal record on the commit.
+            cur->len = 0;
+            SLIST_INSERT_HEAD(&handle->removed_list_head, cur, list_entry);
+            handle->changed = true;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool pal_nvs_erase(pal_nvs_handle *handle) {
+    HAPPrecondition(handle);
+
+    if (SLIST_FIRST(&handle->item_list_head) || SLIST_FIRST(&handle->removed_list_head)) {
+        handle->changed = true;
+        handle->erased = true;
+    }
+    pal_nvs_remove_all_items(handle);
+    pal_nvs_remove_all_removed(handle);
+    return true;
+}
+
+static void pal_nvs_sync_timer_cb(HAPPlatformTimerRef timer, void *_Nullable context) {
+    glog.sync_timer = 0;
+    pal_nvs_fsync(glog.fd, PAL_NVS_LOG_FILE);
+}
+
+static void pal_nvs_compact_path(char *buf, size_t len) {
+    snprintf(buf, len, "%s/%s", gnvs_dir, PAL_NVS_LOG_TMP_FILE);
+}
+
+/**
+ * Drop the compacted log, the log is kept as it is.
+ */
+static void pal_nvs_compact_abort(void) {
+    if (glog.compact_fd < 0) {
+        return;
+    }
+    char tmp_path[256];
+    pal_nvs_compact_path(tmp_path, sizeof(tmp_path));
+    close(glog.compact_fd);
+    glog.compact_fd = -1;
+    remove(tmp_path);
+}
+
+/**
+ * Create the compacted log, the namespaces are copied to it by the steps.
+ */
+static bool pal_nvs_compact_begin(void) {
+    char tmp_path[256];
+    pal_nvs_compact_path(tmp_path, sizeof(tmp_path));
+
+    int fd;
+    do {
+        fd = open(tmp_path, O_CREAT | O_RDWR | O_TRUNC, S_IRUSR | S_IWUSR);
+    } while (fd == -1 && errno == EINTR);
+    if (fd < 0) {
+        int _errno = errno;
+        NVS_LOG_ERR("open %s failed: %d.", tmp_path, _errno);
+        return false;
+    }
+    glog.compact_fd = fd;
+    if (pwrite_all(fd, PAL_NVS_MAGIC, PAL_NVS_MAGIC_LEN, 0) != PAL_NVS_MAGIC_LEN) {
+        NVS_LOG_ERR("Failed to write %s.", tmp_path);
+        pal_nvs_compact_abort();
+        return false;
+    }
+    glog.compact_size = PAL_NVS_MAGIC_LEN;
+
+    struct pal_nvs_ns *ns;
+    LIST_FOREACH(ns, &glog.ns_list_head, list_entry) {
+        ns->compacted = false;
+    }
+    return true;
+}
+
+/**
+ * Copy the live records of the namespace to the compacted log as one commit.
+ *
+ * @return the bytes written, or 0 if it fails.
+ */
+static size_t pal_nvs_compact_ns(struct pal_nvs_ns *ns) {
+    size_t name_len = strlen(ns->name);
+    off_t size = glog.compact_size;
+    struct pal_nvs_entry *t;
+    SLIST_FOREACH(t, &ns->entry_list_head, list_entry) {
+        size_t key_len = strlen(t->key);
+        size_t rec_size = pal_nvs_rec_size(name_len, key_len, t->len);
+        char *buf = pal_mem_alloc(rec_size);
+        if (!buf) {
+            NVS_LOG_ERR("Failed to alloc memory.");
+            return 0;
+        }
+        pal_nvs_rec_hdr *hdr = (pal_nvs_rec_hdr *)buf;
+        char *p = buf + sizeof(*hdr);
+        HAPRawBufferZero(hdr, sizeof(*hdr));
+        hdr->type = PAL_NVS_REC_SET;
+        hdr->name_len = name_len;
+        hdr->key_len = key_len;
+        hdr->value_len = t->len;
+        memcpy(p, ns->name, name_len);
+        memcpy(p + name_len, t->key, key_len);
+        if (pread_all(glog.fd, p + name_len + key_len, t->len, t->offset) != t->len) {
+            pal_mem_free(buf);
+            return 0;
+        }
+        hdr->crc = pal_nvs_crc32(0, buf + sizeof(hdr->crc), rec_size - sizeof(hdr->crc));
+        ssize_t rc = pwrite_all(glog.compact_fd, buf, rec_size, size);
+        pal_mem_free(buf);
+        if (rc != rec_size) {
+            return 0;
+        }
+        t->new_offset = size + rec_size - t->len;
+        size += rec_size;
+    }
+
+    char rec[sizeof(pal_nvs_rec_hdr) + PAL_NVS_NAME_MAX_LEN];
+    pal_nvs_rec_hdr *hdr = (pal_nvs_rec_hdr *)rec;
+    HAPRawBufferZero(hdr, sizeof(*hdr));
+    hdr->type = PAL_NVS_REC_COMMIT;
+    hdr->name_len = name_len;
+    memcpy(rec + sizeof(*hdr), ns->name, name_len);
+    size_t rec_size = pal_nvs_rec_size(name_len, 0, 0);
+    hdr->crc = pal_nvs_crc32(0, rec + sizeof(hdr->crc), rec_size - sizeof(hdr->crc));
+    if (pwrite_all(glog.compact_fd, rec, rec_size, size) != rec_size) {
+        return 0;
+    }
+    size += rec_size;
+
+    size_t written = size - glog.compact_size;
+    glog.compact_size = size;
+    ns->compacted = true;
+    return written;
+}
+
+/**
+ * Replace the log with the compacted log.
+ */
+static bool pal_nvs_compact_finish(void) {
+    char tmp_path[256];
+    char path[256];
+    pal_nvs_compact_path(tmp_path, sizeof(tmp_path));
+    snprintf(path, sizeof(path), "%s/%s", gnvs_dir, PAL_NVS_LOG_FILE);
+
+    if (!pal_nvs_fsync(glog.compact_fd, tmp_path)) {
+        return false;
+    }
+    if (rename(tmp_path, path)) {
+        int _errno = errno;
+        NVS_LOG_ERR("rename of %s to %s failed: %d.", tmp_path, path, _errno);
+        return false;
+    }
+    DIR *dir = opendir(gnvs_dir);
+    if (dir) {
+        pal_nvs_fsync(dirfd(dir), gnvs_dir);
+        HAPPlatformFileManagerCloseDirFreeSafe(dir);
+    }
+
+    // The new log is in place, the appended records are synchronized with it.
+    if (glog.sync_timer) {
+        HAPPlatformTimerDeregister(glog.sync_timer);
+        glog.sync_timer = 0;
+    }
+    close(glog.fd);
+    glog.fd = glog.compact_fd;
+    glog.compact_fd = -1;
+    struct pal_nvs_ns *ns;
+    LIST_FOREACH(ns, &glog.ns_list_head, list_entry) {
+        struct pal_nvs_entry *t;
+        SLIST_FOREACH(t, &ns->entry_list_head, list_entry) {
+            t->offset = t->new_offset;
+        }
+    }
+    HAPLogInfo(&logObject, "Compacted the log from %lld to %lld bytes.",
+        (long long)glog.size, (long long)glog.compact_size);
+    glog.size = glog.compact_size;
+    glog.compactions++;
+    return true;
+}
+
+/**
+ * Copy the namespaces not copied yet, at most PAL_NVS_COMPACT_STEP bytes unless
+ * a namespace is larger, and finish the compaction when all are copied.
+ *
+ * @return true if the compaction is not finished and another step is needed.
+ */
+static bool pal_nvs_compact_step(void) {
+    size_t copied = 0;
+    while (copied < PAL_NVS_COMPACT_STEP) {
+        struct pal_nvs_ns *ns;
+        LIST_FOREACH(ns, &glog.ns_list_head, list_entry) {
+            if (!ns->compacted) {
+                break;
+            }
+        }
+        if (!ns) {
+            if (!pal_nvs_compact_finish()) {
+                NVS_LOG_ERR("Failed to replace the log.");
+                pal_nvs_compact_abort();
+            }
+            return false;
+        }
+        size_t written = pal_nvs_compact_ns(ns);
+        if (!written) {
+            NVS_LOG_ERR("Failed to copy '%s' to the compacted log.", ns->name);
+            pal_nvs_compact_abort();
+            return false;
+        }
+        glog.written += written;
+        copied += written;
+    }
+    return true;
+}
+
+static bool pal_nvs_compact_needed(void) {
+    size_t garbage = glog.size - glog.live;
+    return garbage > PAL_NVS_COMPACT_MIN_GARBAGE && garbage > glog.live;
+}
+
+static void pal_nvs_compact_schedule(void);
+
+static void pal_nvs_compact_cb(void *_Nullable context, size_t contextSize) {
+    glog.compact_scheduled = false;
+    if (!ginited || glog.fd < 0) {
+        return;
+    }
+    if (glog.compact_fd < 0 && (!pal_nvs_compact_needed() || !pal_nvs_compact_begin())) {
+        return;
+    }
+    if (pal_nvs_compact_step()) {
+        pal_nvs_compact_schedule();
+    }
+}
+
+static void pal_nvs_compact_schedule(void) {
+    if (glog.compact_scheduled) {
+        return;
+    }
+    if (HAPPlatformRunLoopScheduleCallback(pal_nvs_compact_cb, NULL, 0) != kHAPError_None) {
+        NVS_LOG_ERR("Failed to schedule the compaction.");
+        pal_nvs_compact_abort();
+        return;
+    }
+    glog.compact_scheduled = true;
+}
+
+/**
+ * Synchronize the log, or later to share the fsync with the next commits
+ * if the group fsync is enabled, and compact the log if there is too much garbage.
+ *
+ * @return false if the log fails to synchronize.
+ */
+static bool pal_nvs_after_commit(void) {
+    bool synced = true;
+    if (PAL_NVS_SYNC_DELAY == 0) {
+        synced = pal_nvs_fsync(glog.fd, PAL_NVS_LOG_FILE);
+    } else if (!glog.sync_timer) {
+        HAPTime deadline = HAPPlatformClockGetCurrent() + PAL_NVS_SYNC_DELAY;
+        if (HAPPlatformTimerRegister(&glog.sync_timer, deadline, pal_nvs_sync_timer_cb, NULL) != kHAPError_None) {
+            glog.sync_timer = 0;
+            synced = pal_nvs_fsync(glog.fd, PAL_NVS_LOG_FILE);
+        }
+    }
+
+    if (glog.compact_fd < 0 && pal_nvs_compact_needed()) {
+        pal_nvs_compact_schedule();
+    }
+    return synced;
+}
+
+static char *pal_nvs_put_rec(char *p, uint8_t type, const char *name, size_t name_len,
+    const char *key, size_t key_len, const void *value, size_t value_len) {
+    pal_nvs_rec_hdr *hdr = (pal_nvs_rec_hdr *)p;
+    HAPRawBufferZero(hdr, sizeof(*hdr));
+    hdr->type = type;
+    hdr->name_len = name_len;
+    hdr->key_len = key_len;
+    hdr->value_len = value_len;
+    char *q = p + sizeof(*hdr);
+    memcpy(q, name, name_len);
+    q += name_len;
+    if (key_len) {
+        memcpy(q, key, key_len);
+        q += key_len;
+    }
+    if (value_len) {
+        memcpy(q, value, value_len);
+        q += value_len;
+    }
+    hdr->crc = pal_nvs_crc32(0, p + sizeof(hdr->crc), q - p - sizeof(hdr->crc));
+    return q;
+}
+
+bool pal_nvs_commit(pal_nvs_handle *handle) {
+    HAPPrecondition(handle);
+
+    if (handle->changed == false) {
+        return true;
+    }
+    if (glog.fd < 0) {
+        NVS_LOG_ERR("The log is not opened.");
+        return false;
+    }
+
+    // Size the records of the commit.
+    size_t name_len = strlen(handle->name);
+    size_t size = pal_nvs_rec_size(name_len, 0, 0) * (handle->erased ? 2 : 1);
+    struct pal_nvs_item *t;
+    SLIST_FOREACH(t, &handle->removed_list_head, list_entry) {
+        size += pal_nvs_rec_size(name_len, strlen(t->key), 0);
+    }
+    SLIST_FOREACH(t, &handle->item_list_head, list_entry) {
+        if (t->dirty) {
+            size += pal_nvs_rec_size(name_len, strlen(t->key), t->len);
+        }
+    }
+
+    char *buf = pal_mem_alloc(size);
+    if (!buf) {
+        NVS_LOG_ERR("Failed to alloc memory.");
+        return false;
+    }
+    char *p = buf;
+    if (handle->erased) {
+        p = pal_nvs_put_rec(p, PAL_NVS_REC_ERASE, handle->name, name_len, NULL, 0, NULL, 0);
+    }
+    SLIST_FOREACH(t, &handle->removed_list_head, list_entry) {
+        p = pal_nvs_put_rec(p, PAL_NVS_REC_DEL, handle->name, name_len, t->key, strlen(t->key), NULL, 0);
+    }
+    SLIST_FOREACH(t, &handle->item_list_head, list_entry) {
+        if (t->dirty) {
+            p = pal_nvs_put_rec(p, PAL_NVS_REC_SET, handle->name, name_len,
+                t->key, strlen(t->key), t->value, t->len);
+        }
+    }
+    p = pal_nvs_put_rec(p, PAL_NVS_REC_COMMIT, handle->name, name_len, NULL, 0, NULL, 0);
+    HAPAssert(p == buf + size);
+
+    ssize_t rc = pwrite_all(glog.fd, buf, size, glog.size);
+    if (rc != size) {
+        int _errno = errno;
+        pal_mem_free(buf);
+        NVS_LOG_ERR("Append to the log failed: %d.", _errno);
+        // Drop the partial records, the replay drops them as well if this fails.
+        if (ftruncate(glog.fd, glog.size)) {
+            _errno = errno;
+            NVS_LOG_ERR("ftruncate failed: %d.", _errno);
+        }
+        return false;
+    }
+
+    // A compaction in progress gets the commit as well, the values are indexed at both offsets.
+    off_t compact_offset = -1;
+    if (glog.compact_fd >= 0) {
+        if (pwrite_all(glog.compact_fd, buf, size, glog.compact_size) == size) {
+            compact_offset = glog.compact_size;
+            glog.compact_size += size;
+            glog.written += size;
+        } else {
+            NVS_LOG_ERR("Append to the compacted log failed, the compaction is dropped.");
+            pal_nvs_compact_abort();
+        }
+    }
+    pal_mem_free(buf);
+
+    // Apply the commit to the index in the order of the records.
+    off_t offset = glog.size;
+    struct pal_nvs_ns *ns = pal_nvs_find_ns(handle->name, false);
+    if (handle->erased) {
+        if (ns) {
+            pal_nvs_index_erase(ns);
+            ns = NULL;
+        }
+        offset += pal_nvs_rec_size(name_len, 0, 0);
+    }
+    SLIST_FOREACH(t, &handle->removed_list_head, list_entry) {
+        if (ns) {
+            pal_nvs_index_del(ns, t->key);
+        }
+        offset += pal_nvs_rec_size(name_len, strlen(t->key), 0);
+    }
+    SLIST_FOREACH(t, &handle->item_list_head, list_entry) {
+        if (!t->dirty) {
+            continue;
+        }
+        size_t rec_size = pal_nvs_rec_size(name_len, strlen(t->key), t->len);
+        if (!ns) {
+            ns = pal_nvs_find_ns(handle->name, true);
+        }
+        struct pal_nvs_entry *entry = ns ? pal_nvs_index_set(ns, t->key, t->len, offset + rec_size - t->len) : NULL;
+        if (!entry) {
+            // The log has the commit, the index is rebuilt from it at the next startup.
+            NVS_LOG_ERR("Failed to index '%s' of '%s'.", t->key, handle->name);
+        } else if (compact_offset >= 0) {
+            entry->new_offset = compact_offset + (offset - glog.size) + rec_size - t->len;
+        }
+        t->dirty = false;
+        offset += rec_size;
+    }
+    if (ns && SLIST_EMPTY(&ns->entry_list_head)) {
+        pal_nvs_free_ns(ns);
+    }
+    glog.size += size;
+    glog.commits++;
+    glog.written += size;
+
+    pal_nvs_remove_all_removed(handle);
+    handle->erased = false;
+    handle->changed = false;
+    return pal_nvs_after_commit();
+}
+
+void pal_nvs_close(pal_nvs_handle *handle) {
+    HAPPrecondition(handle);
+
+    if (handle->using_count > 1) {
+        handle->using_count--;
+        return;
+    }
+    pal_nvs_commit(handle);
+    LIST_REMOVE(handle, list_entry);
+    pal_nvs_remove_all_items(handle);
+    pal_nvs_remove_all_removed(handle);
+    pal_mem_free(handle);
+}
@@ -0,0 +1,145 @@
+// Copyright (c) 2021-2022 Zebin Wu and homekit-bridge contributors
+//
+// Licensed under the Apache License, Version 2.0 (the “License”);
+// you may not use this file except in compliance with the License.
+// See [CONTRIBUTORS.md] for the list of homekit-bridge project authors.
+
+#include <pthread.h>
+#include <sys/queue.h>
+#include <pal/worker.h>
+#include <pal/mem.h>
+#include <HAPPlatform.h>
+
+#define PAL_WORKER_THREADS 2
+
+typedef struct pal_worker_job {
+    pal_worker_run_cb run_cb;
+    pal_worker_done_cb done_cb;
+    void *arg;
+    STAILQ_ENTRY(pal_worker_job) list_entry;
+} pal_worker_job;
+
+static const HAPLogObject worker_log_obj = {
+    .subsystem = kHAPPlatform_LogSubsystem,
+    .category = "worker",
+};
+
+static bool ginited;
+static bool gstopping;
+static size_t gthreads;
+static pthread_t gtids[PAL_WORKER_THREADS];
+static pthread_mutex_t gmutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t gcond = PTHREAD_COND_INITIALIZER;
+static STAILQ_HEAD(, pal_worker_job) gjob_list_head = STAILQ_HEAD_INITIALIZER(gjob_list_head);
+static STAILQ_HEAD(, pal_worker_job) gdone_list_head = STAILQ_HEAD_INITIALIZER(gdone_list_head);
+
+static void pal_worker_job_finish(pal_worker_job *job, bool cancelled) {
+    pal_worker_done_cb done_cb = job->done_cb;
+    void *arg = job->arg;
+    pal_mem_free(job);
+    done_cb(arg, cancelled);
+}
+
+// One callback is scheduled per finished job, the job may be taken by pal_worker_deinit() before.
+static void pal_worker_job_done(void* _Nullable context, size_t contextSize) {
+    pthread_mutex_lock(&gmutex);
+    pal_worker_job *job = STAILQ_FIRST(&gdone_list_head);
+    if (job) {
+        STAILQ_REMOVE_HEAD(&gdone_list_head, list_entry);
+    }
+    pthread_mutex_unlock(&gmutex);
+
+    if (job) {
+        pal_worker_job_finish(job, false);
+    }
+}
+
+static void *pal_worker_thread(void *arg) {
+    pthread_mutex_lock(&gmutex);
+    for (;;) {
+        while (!gstopping && STAILQ_EMPTY(&gjob_list_head)) {
+            pthread_cond_wait(&gcond, &gmutex);
+        }
+        if (gstopping) {
+            break;
+        }
+        pal_worker_job *job = STAILQ_FIRST(&gjob_list_head);
+        STAILQ_REMOVE_HEAD(&gjob_list_head, list_entry);
+        pthread_mutex_unlock(&gmutex);
+
+        job->run_cb(job->arg);
+
+        pthread_mutex_lock(&gmutex);
+        STAILQ_INSERT_TAIL(&gdone_list_head, job, list_entry);
+        pthread_mutex_unlock(&gmutex);
+        HAPAssert(HAPPlatformRunLoopScheduleCallback(pal_worker_job_done, NULL, 0) == kHAPError_None);
+
+        pthread_mutex_lock(&gmutex);
+    }
+    pthread_mutex_unlock(&gmutex);
+    return NULL;
+}
+
+void pal_worker_init() {
+    HAPPrecondition(!ginited);
+    gstopping = false;
+    for (gthreads = 0; gthreads < PAL_WORKER_THREADS; gthreads++) {
+        if (pthread_create(&gtids[gthreads], NULL, pal_worker_thread, NULL)) {
+            HAPLogError(&worker_log_obj, "%s: Failed to create a worker thread.", __func__);
+            break;
+        }
+    }
+    ginited = true;
+}
+
+void pal_worker_deinit() {
+    HAPPrecondition(ginited);
+    pthread_mutex_lock(&gmutex);
+    gstopping = true;
+    pthread_cond_broadcast(&gcond);
+    pthread_mutex_unlock(&gmutex);
+
+    for (size_t i = 0; i < gthreads; i++) {
+        pthread_join(gtids[i], NULL);
+    }
+    gthreads = 0;
+
+    // The run loop is stopped, the scheduled callbacks will not run.
+    while (!STAILQ_EMPTY(&gdone_list_head)) {
+        pal_worker_job *job = STAILQ_FIRST(&gdone_list_head);
+        STAILQ_REMOVE_HEAD(&gdone_list_head, list_entry);
+        pal_worker_job_finish(job, false);
+    }
+    while (!STAILQ_EMPTY(&gjob_list_head)) {
+        pal_worker_job *job = STAILQ_FIRST(&gjob_list_head);
+        STAILQ_REMOVE_HEAD(&gjob_list_head, list_entry);
+        pal_worker_job_finish(job, true);
+    }
+    ginited = false;
+}
+
+bool pal_worker_submit(pal_worker_run_cb run_cb, pal_worker_done_cb done_cb, void *arg) {
+    HAPPrecondition(ginited);
+    HAPPrecondition(run_cb);
+    HAPPrecondition(done_cb);
+
+    if (gthreads == 0) {
+        HAPLogError(&worker_log_obj, "%s: No worker thread.", __func__);
+        return false;
+    }
+
+    pal_worker_job *job = pal_mem_alloc(sizeof(*job));
+    if (!job) {
+        HAPLogError(&worker_log_obj, "%s: Failed to alloc memory.", __func__);
+        return false;
+    }
+    job->run_cb = run_cb;
+    job->done_cb = done_cb;
+    job->arg = arg;
+
+    pthread_mutex_lock(&gmutex);
+    STAILQ_INSERT_TAIL(&gjob_list_head, job, list_entry);
+    pthread_cond_signal(&gcond);
+    pthread_mutex_unlock(&gmutex);
+    return true;
+}
@@ -1208,6 +1208,37 @@ pal_err pal_socket_recvfrom(pal_socket_obj *_o, void *buf, size_t *len, char *ad
     return err;
 }
 
+void pal_socket_cancel_recv(pal_socket_obj *_o) {
+    HAPPrecondition(_o);
+
+    pal_socket_obj_int *o = (pal_socket_obj_int *)_o;
+    HAPAssert(o->magic == PAL_SOCKET_OBJ_MAGIC);
+
+    if (!o->receiving) {
+        return;
+    }
+
+    SOCKET_LOG(Debug, o, "%s()", __func__);
+
+    if (o->timer) {
+        HAPPlatformTimerDeregister(o->timer);
+        o->timer = 0;
+    }
+    pal_socket_recv_reset(o);
+    o->cb = NULL;
+}
+
+void pal_socket_cancel_send(pal_socket_obj *_o) {
+    HAPPrecondition(_o);
+
+    pal_socket_obj_int *o = (pal_socket_obj_int *)_o;
+    HAPAssert(o->magic == PAL_SOCKET_OBJ_MAGIC);
+
+    for (pal_socket_mbuf *cur = o->mbuf_list_head; cur; cur = cur->next) {
+        cur->sent_cb = NULL;
+    }
+}
+
 bool pal_socket_readable(pal_socket_obj *_o) {
     HAPPrecondition(_o);
 
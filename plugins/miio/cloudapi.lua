@@ -67,56 +67,56 @@ local function randomBytes(m, n, count)
     return schar(tunpack(bytes))
 end
 
-local function createSignatureAppender(ctx)
-    local first = true
-    local function write(part)
-        if type(part) ~= "string" then
-            part = tostring(part)
-        end
-        ctx:update(part)
-    end
+---Create the appender of the signed message, the parts are joined by "&".
+---@return fun(part: any) append
+---@return fun(query: table) appendQuery
+---@return fun(): string message
+local function createSignatureAppender()
+    local parts = {}
     local function append(part)
-        if first then
-            first = false
-        else
-            ctx:update("&")
+        if #parts > 0 then
+            tinsert(parts, "&")
         end
-        write(part)
+        tinsert(parts, tostring(part))
     end
     local function appendQuery(query)
         for _, key in ipairs(urllib.sortQueryKeys(query)) do
             append(key)
-            ctx:update("=")
-            write(query[key])
+            tinsert(parts, "=")
+            tinsert(parts, tostring(query[key]))
         end
     end
-    return append, appendQuery
+    local function message()
+        return tconcat(parts)
+    end
+    return append, appendQuery, message
 end
 
+-- The signed messages carry the request data, so the digests run off the run loop.
+
 local function genSignatureARC4(method, path, signed_nonce, query)
-    local ctx = hash.create("SHA1")
-    local append, appendQuery = createSignatureAppender(ctx)
+    local append, appendQuery, message = createSignatureAppender()
     append(method)
     append(path)
     appendQuery(query)
     append(base64.encode(signed_nonce))
-    return base64.encode(ctx:digest())
+    return base64.encode(core.offload("hash", "SHA1", message()))
 end
 
 local function genSignature(path, nonce, signNonce, query)
-    local ctx = hash.create("SHA256", signNonce)
-    local append, appendQuery = createSignatureAppender(ctx)
+    local append, appendQuery, message = createSignatureAppender()
     append(path)
     append(base64.encode(signNonce))
     append(base64.encode(nonce))
     appendQuery(query)
-    return base64.encode(ctx:digest())
+    return base64.encode(core.offload("hash", "SHA256", message(), signNonce))
 end
 
 local function genNonce()
     return randomBytes(0, 255, 8) .. string.pack(">I4", floor(core.time() / 60000))
 end
 
+-- The input is short, the digest is cheaper than a round trip to the worker.
 local function signNonce(ssecurity, nonce)
     return hash.create("SHA256"):update(ssecurity):update(nonce):digest()
 end
@@ -471,7 +471,7 @@ function session:_request(path, data, encrypt)
     end
     assert(body, "missing body")
     if encrypt then
-        body = rc4ctx:crypt(base64.decode(body))
+        body = rc4ctx:crypt(core.offload("base64decode", body))
     end
     local resp = cjson.decode(body)
     if resp.code ~= 0 then
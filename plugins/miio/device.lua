@@ -40,47 +40,55 @@ local currentRuntime = nil
 ---@class MiioDevice Device object.
 local device = {}
 
----Get properties.
+---Request properties.
 ---@param obj MiioDevice
-local function getProps(obj)
-    local names = obj.names
-    obj.names = {}
-    local success, result = xpcall(obj.request, traceback, obj, "get_prop", tunpack(names))
-    if success == false then
-        obj.mq:send(success, result)
-        return
-    end
+---@param names string[] Property names.
+---@return table<string, any> props
+local function requestProps(obj, names)
+    local result = obj:request("get_prop", tunpack(names))
     local props = {}
     for i, value in ipairs(result) do
         props[names[i]] = value
     end
-    obj.mq:send(success, props)
+    return props
 end
 
----Get properties(MIOT).
+---Request properties(MIOT).
 ---@param obj MiioDevice
-local function getPropsMiot(obj)
+---@param names string[] Property names.
+---@return table<string, any> props
+local function requestPropsMiot(obj, names)
     local mapping = obj.mapping
     assert(mapping ~= nil, "missing mapping")
     local params = {}
-    for _, name in ipairs(obj.names) do
+    for _, name in ipairs(names) do
         tinsert(params, {
             did = name,
             siid = mapping[name].siid,
             piid = mapping[name].piid,
         })
     end
-    obj.names = {}
-    local success, result = xpcall(obj.request, traceback, obj, "get_properties", tunpack(params))
-    if success == false then
-        obj.mq:send(success, result)
-        return
-    end
     local props = {}
-    for _, prop in ipairs(result) do
+    for _, prop in ipairs(obj:request("get_properties", tunpack(params))) do
         props[prop.did] = prop.value
     end
-    obj.mq:send(success, props)
+    return props
+end
+
+---Get properties.
+---@param obj MiioDevice
+local function getProps(obj)
+    local names = obj.names
+    obj.names = {}
+    obj.mq:send(xpcall(requestProps, traceback, obj, names))
+end
+
+---Get properties(MIOT).
+---@param obj MiioDevice
+local function getPropsMiot(obj)
+    local names = obj.names
+    obj.names = {}
+    obj.mq:send(xpcall(requestPropsMiot, traceback, obj, names))
 end
 
 ---Set MIOT property mapping.
@@ -121,6 +129,26 @@ function device:getProp(name)
     return result[name]
 end
 
+---Get properties in one request.
+---@param names string[] Property names.
+---@return table<string, any> props Property name -> value.
+---@nodiscard
+function device:getProps(names)
+    local uniq = {}
+    local seen = {}
+    for _, name in ipairs(names) do
+        assert(type(name) == "string")
+        if not seen[name] then
+            seen[name] = true
+            tinsert(uniq, name)
+        end
+    end
+    if self.mapping then
+        return requestPropsMiot(self, uniq)
+    end
+    return requestProps(self, uniq)
+end
+
 ---Set property.
 ---@param name string Property name.
 ---@param value string|number|boolean Property value.
@@ -37,7 +37,7 @@ function M.gen(device, conf)
                 end, function (request, value)
                     device:setProp("fanSpeed", assert(tointeger(value), "value not a integer"))
                     raiseEvent(request.aid, request.sid, request.cid)
-                end):setContraints(1, 100, 1),
+                end):setContraints(1, 100, 1):setWriteDebounce(300),
                 SwingMode.new(iids.swingMode, function (request)
                     return device:getProp("swingMode") and SwingMode.value.Enabled or SwingMode.value.Disabled
                 end, function (request, value)
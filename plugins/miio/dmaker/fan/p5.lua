@@ -3,7 +3,7 @@ local Active = require "hap.char.Active"
 local RotationSpeed = require "hap.char.RotationSpeed"
 local SwingMode = require "hap.char.SwingMode"
 local tointeger = math.tointeger
-local raiseEvent = hap.raiseEvent
+local updateValue = hap.updateValue
 
 local M = {}
 
@@ -14,6 +14,24 @@ local M = {}
 function M.gen(device, conf)
     local iids = conf.iids
 
+    -- Characteristic instance ID -> property name and the conversion to the characteristic value.
+    local props = {
+        [iids.active] = { "power", function (power)
+            return power and Active.value.Active or Active.value.Inactive
+        end },
+        [iids.rotationSpeed] = { "speed", function (speed)
+            return speed
+        end },
+        [iids.swingMode] = { "roll_enable", function (enable)
+            return enable and SwingMode.value.Enabled or SwingMode.value.Disabled
+        end },
+    }
+
+    local function read(request)
+        local prop = props[request.cid]
+        return prop[2](device:getProp(prop[1]))
+    end
+
     return hap.newAccessory(
         conf.aid,
         "BridgedAccessory",
@@ -26,28 +44,35 @@ function M.gen(device, conf)
         {
             hap.AccessoryInformationService,
             hap.newService(iids.fan, "Fan", true, false, {
-                Active.new(iids.active, function (request)
-                    return device:getProp("power") and Active.value.Active or Active.value.Inactive
-                end, function (request, value)
+                Active.new(iids.active, read, function (request, value)
                     device:request("s_power", value == Active.value.Active)
-                    raiseEvent(request.aid, request.sid, request.cid)
+                    updateValue(request.aid, request.sid, request.cid, value)
                 end),
-                RotationSpeed.new(iids.rotationSpeed, function (request)
-                    return device:getProp("speed")
-                end, function (request, value)
+                RotationSpeed.new(iids.rotationSpeed, read, function (request, value)
                     device:request("s_speed", tointeger(value))
-                    raiseEvent(request.aid, request.sid, request.cid)
-                end):setContraints(1, 100, 1),
-                SwingMode.new(iids.swingMode, function (request)
-                    return device:getProp("roll_enable") and SwingMode.value.Enabled or SwingMode.value.Disabled
-                end, function (request, value)
+                    updateValue(request.aid, request.sid, request.cid, value)
+                end):setContraints(1, 100, 1):setWriteDebounce(300),
+                SwingMode.new(iids.swingMode, read, function (request, value)
                     device:request("s_roll", value == SwingMode.value.Enabled)
-                    raiseEvent(request.aid, request.sid, request.cid)
+                    updateValue(request.aid, request.sid, request.cid, value)
                 end)
             })
         },
         function (request)
             device.logger:info("Identify callback is called.")
+        end,
+        function (requests)
+            local names = {}
+            for i, request in ipairs(requests) do
+                names[i] = props[request.cid][1]
+            end
+            local values = device:getProps(names)
+            local results = {}
+            for i, request in ipairs(requests) do
+                local prop = props[request.cid]
+                results[i] = prop[2](values[prop[1]])
+            end
+            return results
         end
     )
 end
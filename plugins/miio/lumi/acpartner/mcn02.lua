@@ -7,7 +7,8 @@ local CoolThrholdTemp = require "hap.char.CoolingThresholdTemperature"
 local HeatThrholdTemp = require "hap.char.HeatingThresholdTemperature"
 local SwingMode = require "hap.char.SwingMode"
 local searchKey = require "util".searchKey
-local raiseEvent = hap.raiseEvent
+local raiseEvents = hap.raiseEvents
+local updateValue = hap.updateValue
 local tointeger = math.tointeger
 
 local M = {}
@@ -52,14 +53,17 @@ function M.gen(device, conf)
                     return valMapping.power[device:getProp("power")]
                 end, function (request, value)
                     device:setProp("power", searchKey(valMapping.power, value))
-                    raiseEvent(request.aid, request.sid, request.cid)
+                    updateValue(request.aid, request.sid, request.cid, value)
                     core.createTimer(function ()
-                        raiseEvent(request.aid, iids.heaterCooler, iids.curTemp)
-                        raiseEvent(request.aid, iids.heaterCooler, iids.tgtState)
-                        raiseEvent(request.aid, iids.heaterCooler, iids.curState)
-                        raiseEvent(request.aid, iids.heaterCooler, iids.coolThrTemp)
-                        raiseEvent(request.aid, iids.heaterCooler, iids.heatThrTemp)
-                        raiseEvent(request.aid, iids.heaterCooler, iids.swingMode)
+                        local aid, sid = request.aid, iids.heaterCooler
+                        raiseEvents({
+                            { aid, sid, iids.curTemp },
+                            { aid, sid, iids.tgtState },
+                            { aid, sid, iids.curState },
+                            { aid, sid, iids.coolThrTemp },
+                            { aid, sid, iids.heatThrTemp },
+                            { aid, sid, iids.swingMode },
+                        })
                     end):start(500)
                 end),
                 CurTemp.new(iids.curTemp, function (request)
@@ -88,25 +92,28 @@ function M.gen(device, conf)
                     return value
                 end, function (request, value)
                     device:setProp("mode", searchKey(valMapping.mode, value))
-                    raiseEvent(request.aid, request.sid, request.cid)
+                    updateValue(request.aid, request.sid, request.cid, value)
                     core.createTimer(function ()
-                        raiseEvent(request.aid, iids.heaterCooler, iids.curState)
-                        raiseEvent(request.aid, iids.heaterCooler, iids.coolThrTemp)
-                        raiseEvent(request.aid, iids.heaterCooler, iids.heatThrTemp)
+                        local aid, sid = request.aid, iids.heaterCooler
+                        raiseEvents({
+                            { aid, sid, iids.curState },
+                            { aid, sid, iids.coolThrTemp },
+                            { aid, sid, iids.heatThrTemp },
+                        })
                     end):start(500)
                 end),
                 CoolThrholdTemp.new(iids.coolThrTemp, function (request)
                     return device:getProp("tar_temp")
                 end, function (request, value)
                     device:setProp("tar_temp", assert(tointeger(value), "value not a integer"))
-                    raiseEvent(request.aid, request.sid, request.cid)
-                end):setContraints(16, 30, 1),
+                    updateValue(request.aid, request.sid, request.cid, value)
+                end):setContraints(16, 30, 1):setWriteDebounce(300),
                 HeatThrholdTemp.new(iids.heatThrTemp, function (request)
                     return device:getProp("tar_temp")
                 end, function (request, value)
                     device:setProp("tar_temp", assert(tointeger(value), "value not a integer"))
-                    raiseEvent(request.aid, request.sid, request.cid)
-                end):setContraints(16, 30, 1),
+                    updateValue(request.aid, request.sid, request.cid, value)
+                end):setContraints(16, 30, 1):setWriteDebounce(300),
                 SwingMode.new(iids.swingMode, function (request)
                     local ver_swing = device:getProp("ver_swing")
                     local value
@@ -118,7 +125,7 @@ function M.gen(device, conf)
                     return value
                 end, function (request, value)
                     device:setProp("ver_swing", searchKey(valMapping.ver_swing, value))
-                    raiseEvent(request.aid, request.sid, request.cid)
+                    updateValue(request.aid, request.sid, request.cid, value)
                 end)
             })
         },
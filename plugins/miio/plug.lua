@@ -1,6 +1,6 @@
 local hap = require "hap"
 local On = require "hap.char.On"
-local raiseEvent = hap.raiseEvent
+local updateValue = hap.updateValue
 
 local M = {}
 
@@ -32,7 +32,7 @@ function M.gen(device, conf)
                     return device:getOn()
                 end, function (request, value)
                     device:setOn(value)
-                    raiseEvent(request.aid, request.sid, request.cid)
+                    updateValue(request.aid, request.sid, request.cid, value)
                 end)
             })
         },
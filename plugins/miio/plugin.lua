@@ -3,12 +3,14 @@ local hapUtil = require "hap.util"
 local nvs = require "nvs"
 local device = require "miio.device"
 local cloudapi = require "miio.cloudapi"
-local traceback = debug.traceback
 local tinsert = table.insert
 
 local M = {}
 local logger = log.getLogger("miio.plugin")
 
+-- Interval in milliseconds to retry the devices failed at start.
+local RETRY_INTERVAL = 60000
+
 ---Miio accessory configuration.
 ---@class MiioAccessoryConf
 ---
@@ -29,9 +31,43 @@ local function gen(conf)
     return require("miio." .. conf.model).gen(device.create(conf.addr, conf.token), conf)
 end
 
+---Generate the accessories of the devices failed at start, and add them to the bridge.
+---@param confs MiioAccessoryConf[] Configurations of the failed devices.
+---@param accessories HAPAccessory[] Accessories of the plugin.
+---@param update fun(accessories: HAPAccessory[]): boolean
+local function retry(confs, accessories, update)
+    local timer
+    timer = core.createTimer(function ()
+        local updated = { table.unpack(accessories) }
+        local failed = {}
+        for _, conf in ipairs(confs) do
+            local success, result = pcall(gen, conf)
+            if success then
+                logger:info(("Device '%s' is online."):format(conf.name))
+                tinsert(updated, result)
+            else
+                tinsert(failed, conf)
+            end
+        end
+        if #failed < #confs then
+            -- The bridge can't serve them until restarted if the sessions have no room.
+            if not update(updated) then
+                return
+            end
+            accessories = updated
+        end
+        confs = failed
+        if #confs > 0 then
+            timer:start(RETRY_INTERVAL)
+        end
+    end)
+    timer:start(RETRY_INTERVAL)
+end
+
 ---Initialize plugin.
+---@param update fun(accessories: HAPAccessory[]): boolean Replace the accessories of the plugin.
 ---@return HAPAccessory[] bridgedAccessories Bridges Accessories.
-function M.init()
+function M.init(update)
     logger:info("Initialing ...")
 
     local confs = {}
@@ -53,7 +89,8 @@ function M.init()
         for _, device in ipairs(devices) do
             if device.ssid == ssid then
                 local sn = device.mac:gsub(":", "")
-                local handle <close> = nvs.open(sn)
+                -- The handle is kept until the new Instance IDs are flushed, it is closed when collected.
+                local handle = nvs.open(sn)
                 tinsert(confs, {
                     aid = hapUtil.getBridgedAccessoryIID(handle),
                     iids = hapUtil.getInstanceIDs(handle),
@@ -72,16 +109,28 @@ function M.init()
 
     device.init()
 
+    -- Generate the accessories concurrently, the results keep the order of the configurations.
+    local tasks = {}
+    for i, conf in ipairs(confs) do
+        tasks[i] = core.spawn(gen, conf)
+    end
+
     local accessories = {}
+    local failed = {}
 
-    for _, conf in ipairs(confs) do
-        local success, result = xpcall(gen, traceback, conf)
-        if success == false then
-            logger:error(result)
+    for i, result in ipairs(core.gather(tasks)) do
+        if result[1] == false then
+            logger:error(result[2])
+            tinsert(failed, confs[i])
         else
-            tinsert(accessories, result)
+            tinsert(accessories, result[2])
         end
     end
+
+    -- The devices offline at start are added to the bridge when they are online.
+    if #failed > 0 then
+        retry(failed, accessories, update)
+    end
     return accessories
 end
 
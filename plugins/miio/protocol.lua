@@ -318,9 +318,8 @@ local function sendWaiter(waiter, ...)
     if mq == nil then
         return
     end
-    local ok, err = pcall(mq.send, mq, ...)
-    if not ok then
-        logger:debug(("drop miio packet: %s"):format(tostring(err)))
+    if not mq:trySend(...) then
+        logger:debug("drop miio packet: the message queue is full")
     end
 end
 
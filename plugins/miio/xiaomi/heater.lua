@@ -5,6 +5,7 @@ local CurHeatCoolState = require "hap.char.CurrentHeaterCoolerState"
 local TgtHeatCoolState = require "hap.char.TargetHeaterCoolerState"
 local HeatThrholdTemp = require "hap.char.HeatingThresholdTemperature"
 local raiseEvent = hap.raiseEvent
+local updateValue = hap.updateValue
 local tointeger = math.tointeger
 
 local M = {}
@@ -32,7 +33,7 @@ function M.gen(device, conf)
                     return device:getProp("on") and Active.value.Active or Active.value.Inactive
                 end, function (request, value)
                     device:setProp("on", value == Active.value.Active)
-                    raiseEvent(request.aid, request.sid, request.cid)
+                    updateValue(request.aid, request.sid, request.cid, value)
                     core.createTimer(function ()
                         raiseEvent(request.aid, iids.heaterCooler, iids.curState)
                     end):start(500)
@@ -53,8 +54,8 @@ function M.gen(device, conf)
                     return device:getProp("tgtTemp")
                 end, function (request, value)
                     device:setProp("tgtTemp", assert(tointeger(value), "value not a integer"))
-                    raiseEvent(request.aid, request.sid, request.cid)
-                end):setContraints(18, 28, 1),
+                    updateValue(request.aid, request.sid, request.cid, value)
+                end):setContraints(18, 28, 1):setWriteDebounce(300),
             })
         },
         function (request)
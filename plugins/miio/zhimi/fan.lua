@@ -50,7 +50,7 @@ function M.gen(device, conf)
                 end, function (request, value)
                     device:setProp("speed_level", assert(tointeger(value), "value not a integer"))
                     raiseEvent(request.aid, request.sid, request.cid)
-                end):setContraints(1, 100, 1),
+                end):setContraints(1, 100, 1):setWriteDebounce(300),
                 SwingMode.new(iids.swingMode, function (request)
                     return valMapping.angle_enable[device:getProp("angle_enable")]
                 end, function (request, value)
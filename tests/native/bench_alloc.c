@@ -0,0 +1,124 @@
+// Copyright (c) 2021-2022 Zebin Wu and homekit-bridge contributors
+//
+// Licensed under the Apache License, Version 2.0 (the “License”);
+// you may not use this file except in compliance with the License.
+// See [CONTRIBUTORS.md] for the list of homekit-bridge project authors.
+
+// Benchmark of the resident set size of a Lua state under a long churn,
+// the system allocator against the slab allocator.
+//
+// A day of a bridge with 150 accessories is compressed into one step per
+// simulated minute: every accessory handles a read in a coroutine, decodes
+// a response of a variable length and keeps a short log, and one accessory
+// is rebuilt every hour. The RSS is process-wide, so run each allocator in
+// its own process and compare the last lines.
+//
+// usage: bench_alloc [system|slab [hours]]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <lauxlib.h>
+#include <lualib.h>
+#include <HAPPlatform.h>
+
+#include "app_int.h"
+
+#define BENCH_CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            exit(EXIT_FAILURE); \
+        } \
+    } while (0)
+
+static const char bench_load[] =
+    "local devices = {}\n"
+    "for i = 1, 150 do\n"
+    "    devices[i] = { aid = i + 1, state = {}, log = {} }\n"
+    "end\n"
+    "function step(minute)\n"
+    "    for i, dev in ipairs(devices) do\n"
+    "        local co = coroutine.wrap(function (req)\n"
+    "            coroutine.yield({ id = req.id, result = { \"on\", minute % 2 == 0, req.aid * 7 } })\n"
+    "        end)\n"
+    "        local resp = co({ id = minute, aid = dev.aid, iid = 21 })\n"
+    "        dev.state.on = resp.result[2]\n"
+    "        local payload = string.rep(\"x\", 32 + (i * 37 + minute) % 900)\n"
+    "        dev.state.raw = payload:sub(1, 16) .. minute\n"
+    "        dev.log[#dev.log + 1] = (\"%d: aid %d on=%s\"):format(minute, dev.aid, tostring(dev.state.on))\n"
+    "        if #dev.log > 16 then\n"
+    "            table.remove(dev.log, 1)\n"
+    "        end\n"
+    "    end\n"
+    "    if minute % 60 == 0 then\n"
+    "        local i = minute // 60 % #devices + 1\n"
+    "        devices[i] = { aid = devices[i].aid, state = {}, log = {} }\n"
+    "    end\n"
+    "end\n";
+
+static double bench_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static size_t bench_rss(void) {
+    FILE *fp = fopen("/proc/self/statm", "r");
+    BENCH_CHECK(fp);
+    unsigned long size, resident;
+    BENCH_CHECK(fscanf(fp, "%lu %lu", &size, &resident) == 2);
+    fclose(fp);
+    return resident * (size_t)sysconf(_SC_PAGESIZE);
+}
+
+static void bench_report(const char *label) {
+    app_alloc_stats stats;
+    app_alloc_get_stats(&stats);
+    printf("%s: rss %zu KB, live %zu KB, peak %zu KB, slabs %zu KB\n", label,
+        bench_rss() / 1024, stats.live / 1024, stats.peak / 1024, stats.slab_bytes / 1024);
+}
+
+int main(int argc, char *argv[]) {
+    app_allocator allocator = APP_ALLOC_SLAB;
+    if (argc > 1) {
+        if (!strcmp(argv[1], "system")) {
+            allocator = APP_ALLOC_SYSTEM;
+        } else {
+            BENCH_CHECK(!strcmp(argv[1], "slab"));
+        }
+    }
+    int hours = argc > 2 ? atoi(argv[2]) : 24;
+    BENCH_CHECK(hours > 0);
+
+    size_t rss_base = bench_rss();
+    lua_State *L = lua_newstate(app_alloc_init(allocator), NULL, luaL_makeseed(NULL));
+    BENCH_CHECK(L);
+    luaL_openlibs(L);
+    BENCH_CHECK(luaL_dostring(L, bench_load) == LUA_OK);
+    printf("allocator: %s, base rss %zu KB\n",
+        allocator == APP_ALLOC_SLAB ? "slab" : "system", rss_base / 1024);
+
+    char label[16];
+    double start = bench_now();
+    for (int minute = 0; minute < hours * 60; minute++) {
+        lua_getglobal(L, "step");
+        lua_pushinteger(L, minute);
+        BENCH_CHECK(lua_pcall(L, 1, 0, 0) == LUA_OK);
+        if (minute % 60 == 59) {
+            snprintf(label, sizeof(label), "hour %2d", minute / 60 + 1);
+            bench_report(label);
+        }
+    }
+    double elapsed = bench_now() - start;
+
+    lua_gc(L, LUA_GCCOLLECT);
+    bench_report("collected");
+    printf("%d simulated hours in %.3f s\n", hours, elapsed);
+
+    lua_close(L);
+    app_alloc_deinit();
+    return 0;
+}
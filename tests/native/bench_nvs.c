@@ -0,0 +1,87 @@
+// Copyright (c) 2021-2022 Zebin Wu and homekit-bridge contributors
+//
+// Licensed under the Apache License, Version 2.0 (the “License”);
+// you may not use this file except in compliance with the License.
+// See [CONTRIBUTORS.md] for the list of homekit-bridge project authors.
+
+// Benchmark of the NVS commits, it is built once per engine.
+//
+// Each commit rewrites one 64-byte value of a 16-key namespace, like the
+// HAP key-value store and the plugin caches do. Both engines synchronize
+// the data before the commit returns, and the engines log the number of
+// the bytes written on deinit.
+//
+// usage: bench_nvs [dir [commits]]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pal/nvs.h>
+#include <pal/nvs_int.h>
+#include <HAPPlatform.h>
+#include <HAPPlatformRunLoop+Init.h>
+
+#define BENCH_CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            exit(EXIT_FAILURE); \
+        } \
+    } while (0)
+
+#define BENCH_KEYS 16
+#define BENCH_VALUE_LEN 64
+
+static void bench_stop_cb(void *_Nullable context, size_t contextSize) {
+    HAPPlatformRunLoopStop();
+}
+
+// Run the callbacks scheduled by the commits, like the compaction of the log.
+static void bench_run_callbacks(void) {
+    BENCH_CHECK(HAPPlatformRunLoopScheduleCallback(bench_stop_cb, NULL, 0) == kHAPError_None);
+    HAPPlatformRunLoopRun();
+}
+
+static double bench_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[]) {
+    const char *dir = argc > 1 ? argv[1] : "bench_nvs.d";
+    int count = argc > 2 ? atoi(argv[2]) : 2000;
+
+    HAPPlatformRunLoopCreate();
+    pal_nvs_init(dir);
+    pal_nvs_handle *handle = pal_nvs_open("bench");
+    BENCH_CHECK(handle);
+    BENCH_CHECK(pal_nvs_erase(handle));
+
+    char key[8];
+    char value[BENCH_VALUE_LEN] = { 0 };
+    for (int i = 0; i < BENCH_KEYS; i++) {
+        snprintf(key, sizeof(key), "k%d", i);
+        BENCH_CHECK(pal_nvs_set(handle, key, value, sizeof(value)));
+    }
+    BENCH_CHECK(pal_nvs_commit(handle));
+
+    double start = bench_now();
+    for (int i = 0; i < count; i++) {
+        snprintf(key, sizeof(key), "k%d", i % BENCH_KEYS);
+        value[0] = i;
+        BENCH_CHECK(pal_nvs_set(handle, key, value, sizeof(value)));
+        BENCH_CHECK(pal_nvs_commit(handle));
+        if (i % 100 == 99) {
+            bench_run_callbacks();
+        }
+    }
+    double elapsed = bench_now() - start;
+    printf("%d commits in %.3f s: %.0f commits/s\n", count, elapsed, count / elapsed);
+
+    pal_nvs_close(handle);
+    pal_nvs_deinit();
+    HAPPlatformRunLoopRelease();
+    return 0;
+}
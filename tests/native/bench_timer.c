@@ -0,0 +1,133 @@
+// Copyright (c) 2021-2022 Zebin Wu and homekit-bridge contributors
+//
+// Licensed under the Apache License, Version 2.0 (the “License”);
+// you may not use this file except in compliance with the License.
+// See [CONTRIBUTORS.md] for the list of homekit-bridge project authors.
+
+// Benchmark of arming, cancelling and dispatching timers, one platform
+// timer per timer against the timing wheel of the bridge.
+//
+// The times are the CPU time of the process, so the dispatch does not
+// count the time the run loop sleeps until the deadlines.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <HAPPlatform.h>
+#include <HAPPlatformRunLoop+Init.h>
+
+#include "app_int.h"
+
+#define BENCH_CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            exit(EXIT_FAILURE); \
+        } \
+    } while (0)
+
+static double bench_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+// Spread of the deadlines of the dispatched timers, in milliseconds.
+#define BENCH_SPREAD 10
+
+static size_t bench_fired;
+static size_t bench_expected;
+
+static void bench_fire(void) {
+    if (++bench_fired == bench_expected) {
+        HAPPlatformRunLoopStop();
+    }
+}
+
+static void bench_platform_cb(HAPPlatformTimerRef timer, void *context) {
+    bench_fire();
+}
+
+static void bench_wheel_cb(app_timer_ref timer, void *context) {
+    bench_fire();
+}
+
+// Run the loop until all the armed timers are fired.
+static double bench_dispatch(size_t count) {
+    bench_fired = 0;
+    bench_expected = count;
+    double start = bench_now();
+    HAPPlatformRunLoopRun();
+    return bench_now() - start;
+}
+
+static void bench_platform(size_t count) {
+    HAPPlatformTimerRef *timers = malloc(sizeof(*timers) * count);
+    BENCH_CHECK(timers);
+    HAPTime now = HAPPlatformClockGetCurrent();
+
+    double t1 = bench_now();
+    for (size_t i = 0; i < count; i++) {
+        BENCH_CHECK(HAPPlatformTimerRegister(&timers[i], now + 1000 + i, bench_platform_cb, NULL) == kHAPError_None);
+    }
+    double t2 = bench_now();
+    for (size_t i = 0; i < count; i++) {
+        HAPPlatformTimerDeregister(timers[i]);
+    }
+    double t3 = bench_now();
+
+    now = HAPPlatformClockGetCurrent();
+    for (size_t i = 0; i < count; i++) {
+        BENCH_CHECK(HAPPlatformTimerRegister(&timers[i], now + i % BENCH_SPREAD, bench_platform_cb, NULL) ==
+            kHAPError_None);
+    }
+    double t4 = bench_dispatch(count);
+
+    printf("platform: arm %zu timers: %.3f ms cpu, cancel: %.3f ms cpu, dispatch: %.3f ms cpu, "
+        "platform timers: %zu\n", count, t2 - t1, t3 - t2, t4, count);
+    free(timers);
+}
+
+static void bench_wheel(size_t count) {
+    app_timer_ref *timers = malloc(sizeof(*timers) * count);
+    BENCH_CHECK(timers);
+    HAPTime now = HAPPlatformClockGetCurrent();
+    app_timer_stats before;
+    app_timer_get_stats(&before);
+
+    double t1 = bench_now();
+    for (size_t i = 0; i < count; i++) {
+        BENCH_CHECK(app_timer_register(&timers[i], now + 1000 + i, bench_wheel_cb, NULL) == kHAPError_None);
+    }
+    double t2 = bench_now();
+    for (size_t i = 0; i < count; i++) {
+        app_timer_deregister(timers[i]);
+    }
+    double t3 = bench_now();
+
+    now = HAPPlatformClockGetCurrent();
+    for (size_t i = 0; i < count; i++) {
+        BENCH_CHECK(app_timer_register(&timers[i], now + i % BENCH_SPREAD, bench_wheel_cb, NULL) == kHAPError_None);
+    }
+    app_timer_stats after;
+    app_timer_get_stats(&after);
+    double t4 = bench_dispatch(count);
+
+    printf("wheel:    arm %zu timers: %.3f ms cpu, cancel: %.3f ms cpu, dispatch: %.3f ms cpu, "
+        "platform timers: %zu\n", count, t2 - t1, t3 - t2, t4, after.platform_timers - before.platform_timers);
+    free(timers);
+}
+
+int main(int argc, char *argv[]) {
+    HAPPlatformRunLoopCreate();
+
+    static const size_t counts[] = { 100, 1000, 10000 };
+    for (size_t i = 0; i < HAPArrayCount(counts); i++) {
+        bench_platform(counts[i]);
+        bench_wheel(counts[i]);
+    }
+
+    app_timer_deinit();
+    HAPPlatformRunLoopRelease();
+    return 0;
+}
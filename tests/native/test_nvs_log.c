@@ -0,0 +1,283 @@
+// Copyright (c) 2021-2022 Zebin Wu and homekit-bridge contributors
+//
+// Licensed under the Apache License, Version 2.0 (the “License”);
+// you may not use this file except in compliance with the License.
+// See [CONTRIBUTORS.md] for the list of homekit-bridge project authors.
+
+// Tests of the log-structured NVS engine: the replay of the commits,
+// the truncation of a torn tail and the background compaction.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <pal/nvs.h>
+#include <pal/nvs_int.h>
+#include <HAPPlatform.h>
+#include <HAPPlatformRunLoop+Init.h>
+
+#define TEST_CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            exit(EXIT_FAILURE); \
+        } \
+    } while (0)
+
+static char test_dir[] = "test_nvs_log-XXXXXX";
+static char test_log[sizeof(test_dir) + 16];
+static char test_tmp_log[sizeof(test_dir) + 16];
+
+static off_t test_log_size(void) {
+    struct stat st;
+    TEST_CHECK(stat(test_log, &st) == 0);
+    return st.st_size;
+}
+
+static int test_get_int(pal_nvs_handle *handle, const char *key) {
+    int value;
+    if (pal_nvs_get_len(handle, key) != sizeof(value)) {
+        return -1;
+    }
+    TEST_CHECK(pal_nvs_get(handle, key, &value, sizeof(value)));
+    return value;
+}
+
+static void test_set_int(pal_nvs_handle *handle, const char *key, int value) {
+    TEST_CHECK(pal_nvs_set(handle, key, &value, sizeof(value)));
+}
+
+static void test_stop_cb(void *_Nullable context, size_t contextSize) {
+    HAPPlatformRunLoopStop();
+}
+
+// Run the callbacks scheduled by the commits, a step of the compaction runs in them.
+static void test_run_callbacks(void) {
+    TEST_CHECK(HAPPlatformRunLoopScheduleCallback(test_stop_cb, NULL, 0) == kHAPError_None);
+    HAPPlatformRunLoopRun();
+}
+
+// Run the steps of the compaction until the log is replaced.
+static int test_run_compaction(void) {
+    int steps = 0;
+    do {
+        test_run_callbacks();
+        steps++;
+        TEST_CHECK(steps < 100);
+    } while (access(test_tmp_log, F_OK) == 0);
+    return steps;
+}
+
+static void test_replay(void) {
+    pal_nvs_init(test_dir);
+    pal_nvs_handle *a = pal_nvs_open("a");
+    pal_nvs_handle *b = pal_nvs_open("b");
+    TEST_CHECK(a && b);
+    test_set_int(a, "x", 1);
+    test_set_int(a, "y", 2);
+    test_set_int(b, "x", 3);
+    TEST_CHECK(pal_nvs_commit(a));
+    TEST_CHECK(pal_nvs_commit(b));
+    TEST_CHECK(pal_nvs_remove(a, "y"));
+    test_set_int(a, "x", 5);
+    TEST_CHECK(pal_nvs_commit(a));
+    TEST_CHECK(pal_nvs_erase(b));
+    test_set_int(b, "z", 9);
+    pal_nvs_close(b);
+    pal_nvs_close(a);
+    pal_nvs_deinit();
+
+    pal_nvs_init(test_dir);
+    a = pal_nvs_open("a");
+    b = pal_nvs_open("b");
+    TEST_CHECK(test_get_int(a, "x") == 5);
+    TEST_CHECK(test_get_int(a, "y") == -1);
+    TEST_CHECK(test_get_int(b, "x") == -1);
+    TEST_CHECK(test_get_int(b, "z") == 9);
+    pal_nvs_close(b);
+    pal_nvs_close(a);
+    pal_nvs_deinit();
+}
+
+static void test_torn_tail(void) {
+    off_t size = test_log_size();
+
+    // A commit torn by a power loss leaves records without the commit record.
+    FILE *fp = fopen(test_log, "ab");
+    TEST_CHECK(fp);
+    TEST_CHECK(fwrite("torn record", 1, 11, fp) == 11);
+    TEST_CHECK(fclose(fp) == 0);
+
+    pal_nvs_init(test_dir);
+    TEST_CHECK(test_log_size() == size);
+    pal_nvs_handle *a = pal_nvs_open("a");
+    TEST_CHECK(test_get_int(a, "x") == 5);
+    test_set_int(a, "w", 7);
+    pal_nvs_close(a);
+    pal_nvs_deinit();
+
+    pal_nvs_init(test_dir);
+    a = pal_nvs_open("a");
+    TEST_CHECK(test_get_int(a, "x") == 5);
+    TEST_CHECK(test_get_int(a, "w") == 7);
+    pal_nvs_close(a);
+    pal_nvs_deinit();
+}
+
+// A power loss in the middle of a commit leaves a record cut short,
+// the replay keeps the commits before it and truncates the rest.
+static void test_torn_record(void) {
+    pal_nvs_init(test_dir);
+    pal_nvs_handle *c = pal_nvs_open("c");
+    test_set_int(c, "x", 1);
+    TEST_CHECK(pal_nvs_commit(c));
+    off_t committed = test_log_size();
+    test_set_int(c, "x", 2);
+    test_set_int(c, "y", 3);
+    TEST_CHECK(pal_nvs_commit(c));
+    off_t size = test_log_size();
+    pal_nvs_close(c);
+    pal_nvs_deinit();
+
+    // Cut the second record of the last commit in the middle, the first record is intact.
+    off_t record = (size - committed) / 3;
+    TEST_CHECK(truncate(test_log, committed + record + record / 2) == 0);
+
+    pal_nvs_init(test_dir);
+    TEST_CHECK(test_log_size() == committed);
+    c = pal_nvs_open("c");
+    TEST_CHECK(test_get_int(c, "x") == 1);
+    TEST_CHECK(test_get_int(c, "y") == -1);
+    TEST_CHECK(pal_nvs_erase(c));
+    pal_nvs_close(c);
+    pal_nvs_deinit();
+}
+
+static void test_compaction(void) {
+    pal_nvs_init(test_dir);
+    pal_nvs_handle *a = pal_nvs_open("a");
+    char value[1024];
+    for (int i = 0; i < 200; i++) {
+        memset(value, i, sizeof(value));
+        TEST_CHECK(pal_nvs_set(a, "big", value, sizeof(value)));
+        TEST_CHECK(pal_nvs_commit(a));
+    }
+    off_t size = test_log_size();
+    TEST_CHECK(size > 64 * 1024);
+    test_run_compaction();
+    TEST_CHECK(test_log_size() < size);
+    TEST_CHECK(test_get_int(a, "x") == 5);
+    pal_nvs_close(a);
+    pal_nvs_deinit();
+
+    pal_nvs_init(test_dir);
+    a = pal_nvs_open("a");
+    char out[sizeof(value)];
+    TEST_CHECK(pal_nvs_get_len(a, "big") == sizeof(out));
+    TEST_CHECK(pal_nvs_get(a, "big", out, sizeof(out)));
+    TEST_CHECK(memcmp(out, value, sizeof(out)) == 0);
+    TEST_CHECK(test_get_int(a, "x") == 5);
+    TEST_CHECK(test_get_int(a, "w") == 7);
+    pal_nvs_close(a);
+    pal_nvs_deinit();
+}
+
+// The commits between the steps of a compaction are kept in the compacted log,
+// in the namespaces copied before and after them.
+static void test_compaction_steps(void) {
+    char name[8];
+    char value[4096];
+    pal_nvs_handle *ns[8];
+    pal_nvs_init(test_dir);
+    for (int i = 0; i < 8; i++) {
+        snprintf(name, sizeof(name), "n%d", i);
+        ns[i] = pal_nvs_open(name);
+        TEST_CHECK(ns[i]);
+        memset(value, i, sizeof(value));
+        TEST_CHECK(pal_nvs_set(ns[i], "v", value, sizeof(value)));
+        test_set_int(ns[i], "i", i);
+        TEST_CHECK(pal_nvs_commit(ns[i]));
+    }
+    pal_nvs_handle *a = pal_nvs_open("a");
+    for (int i = 0; i < 100; i++) {
+        memset(value, i, sizeof(value));
+        TEST_CHECK(pal_nvs_set(a, "big", value, sizeof(value)));
+        TEST_CHECK(pal_nvs_commit(a));
+    }
+    off_t size = test_log_size();
+
+    // The first step copies a part of the namespaces, the log is not replaced yet.
+    test_run_callbacks();
+    TEST_CHECK(access(test_tmp_log, F_OK) == 0);
+    TEST_CHECK(test_log_size() >= size);
+
+    for (int i = 0; i < 8; i++) {
+        test_set_int(ns[i], "i", i + 100);
+        TEST_CHECK(pal_nvs_commit(ns[i]));
+    }
+    TEST_CHECK(pal_nvs_remove(ns[1], "v"));
+    TEST_CHECK(pal_nvs_commit(ns[1]));
+    TEST_CHECK(pal_nvs_erase(ns[6]));
+    test_set_int(ns[6], "e", 6);
+    TEST_CHECK(pal_nvs_commit(ns[6]));
+    pal_nvs_handle *created = pal_nvs_open("new");
+    test_set_int(created, "x", 42);
+    pal_nvs_close(created);
+
+    TEST_CHECK(test_run_compaction() > 1);
+    TEST_CHECK(test_log_size() < size);
+    for (int i = 0; i < 8; i++) {
+        pal_nvs_close(ns[i]);
+    }
+    pal_nvs_close(a);
+    pal_nvs_deinit();
+
+    pal_nvs_init(test_dir);
+    for (int i = 0; i < 8; i++) {
+        snprintf(name, sizeof(name), "n%d", i);
+        ns[i] = pal_nvs_open(name);
+        size_t len = pal_nvs_get_len(ns[i], "v");
+        if (i == 1 || i == 6) {
+            TEST_CHECK(len == 0);
+        } else {
+            char out[sizeof(value)];
+            TEST_CHECK(len == sizeof(out));
+            TEST_CHECK(pal_nvs_get(ns[i], "v", out, sizeof(out)));
+            TEST_CHECK(out[0] == i && out[sizeof(out) - 1] == i);
+        }
+        TEST_CHECK(test_get_int(ns[i], "i") == (i == 6 ? -1 : i + 100));
+    }
+    TEST_CHECK(test_get_int(ns[6], "e") == 6);
+    created = pal_nvs_open("new");
+    TEST_CHECK(test_get_int(created, "x") == 42);
+    pal_nvs_close(created);
+    for (int i = 0; i < 8; i++) {
+        pal_nvs_close(ns[i]);
+    }
+    a = pal_nvs_open("a");
+    char out[sizeof(value)];
+    TEST_CHECK(pal_nvs_get(a, "big", out, sizeof(out)));
+    TEST_CHECK(out[0] == 99);
+    pal_nvs_close(a);
+    pal_nvs_deinit();
+}
+
+int main(int argc, char *argv[]) {
+    HAPPlatformRunLoopCreate();
+    TEST_CHECK(mkdtemp(test_dir));
+    snprintf(test_log, sizeof(test_log), "%s/nvs.log", test_dir);
+    snprintf(test_tmp_log, sizeof(test_tmp_log), "%s/nvs.log-tmp", test_dir);
+
+    test_replay();
+    test_torn_tail();
+    test_torn_record();
+    test_compaction();
+    test_compaction_steps();
+
+    unlink(test_log);
+    rmdir(test_dir);
+    HAPPlatformRunLoopRelease();
+    printf("OK\n");
+    return 0;
+}
@@ -0,0 +1,94 @@
+// Copyright (c) 2021-2022 Zebin Wu and homekit-bridge contributors
+//
+// Licensed under the Apache License, Version 2.0 (the “License”);
+// you may not use this file except in compliance with the License.
+// See [CONTRIBUTORS.md] for the list of homekit-bridge project authors.
+
+// Tests of the worker threads: every submitted job gets its done callback,
+// the jobs still queued on deinit are cancelled.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pal/worker.h>
+#include <HAPPlatform.h>
+#include <HAPPlatformRunLoop+Init.h>
+
+#define TEST_CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            exit(EXIT_FAILURE); \
+        } \
+    } while (0)
+
+#define TEST_JOBS 16
+
+typedef struct {
+    bool ran;
+    int done;
+    bool cancelled;
+} test_job;
+
+static size_t test_done;
+
+static void test_run_cb(void *arg) {
+    test_job *job = arg;
+    usleep(10000);
+    job->ran = true;
+}
+
+static void test_done_cb(void *arg, bool cancelled) {
+    test_job *job = arg;
+    job->done++;
+    job->cancelled = cancelled;
+    if (++test_done == TEST_JOBS) {
+        HAPPlatformRunLoopStop();
+    }
+}
+
+static void test_submit(test_job *jobs) {
+    test_done = 0;
+    for (size_t i = 0; i < TEST_JOBS; i++) {
+        jobs[i] = (test_job) { 0 };
+        TEST_CHECK(pal_worker_submit(test_run_cb, test_done_cb, &jobs[i]));
+    }
+}
+
+static void test_done_in_loop(void) {
+    test_job jobs[TEST_JOBS];
+    pal_worker_init();
+    test_submit(jobs);
+    HAPPlatformRunLoopRun();
+    pal_worker_deinit();
+
+    for (size_t i = 0; i < TEST_JOBS; i++) {
+        TEST_CHECK(jobs[i].ran && jobs[i].done == 1 && !jobs[i].cancelled);
+    }
+}
+
+static void test_cancel_on_deinit(void) {
+    test_job jobs[TEST_JOBS];
+    pal_worker_init();
+    test_submit(jobs);
+    pal_worker_deinit();
+
+    // The run loop is not run, the finished and the queued jobs are done on deinit.
+    TEST_CHECK(test_done == TEST_JOBS);
+    size_t cancelled = 0;
+    for (size_t i = 0; i < TEST_JOBS; i++) {
+        TEST_CHECK(jobs[i].done == 1);
+        TEST_CHECK(jobs[i].ran != jobs[i].cancelled);
+        cancelled += jobs[i].cancelled;
+    }
+    TEST_CHECK(cancelled > 0);
+}
+
+int main(int argc, char *argv[]) {
+    HAPPlatformRunLoopCreate();
+    test_done_in_loop();
+    test_cancel_on_deinit();
+    HAPPlatformRunLoopRelease();
+    printf("OK\n");
+    return 0;
+}
@@ -1,5 +1,6 @@
 local suites = {
     "testcore",
+    "testhap",
     "testsocket",
     "teststream",
     "testnvs",
@@ -130,3 +130,389 @@ do
     assert(results.long[1] == true)
     assert(results.long[2] == "payload")
 end
+
+-- Benchmarks arming and cancelling timers on the timing wheel.
+do
+    local logger = log.getLogger("testcore")
+    local clock = os.clock
+    local count = 10000
+    local timers = {}
+    for i = 1, count do
+        timers[i] = core.createTimer(function () end)
+    end
+
+    local before = core.getTimerStats()
+    local t1 = clock()
+    for i = 1, count do
+        timers[i]:start(1000 + i)
+    end
+    local t2 = clock()
+    for i = 1, count do
+        timers[i]:stop()
+    end
+    local t3 = clock()
+    local after = core.getTimerStats()
+
+    assert(after.cancelled - before.cancelled == count)
+    assert(after.platformTimers - before.platformTimers <= 1)
+    logger:info(("arm %d timers: %.3f ms, cancel: %.3f ms, platform timers: %d"):format(
+        count, (t2 - t1) * 1000, (t3 - t2) * 1000, after.platformTimers - before.platformTimers))
+end
+
+-- Tests messages with various numbers of values keep their order.
+do
+    local mq = core.createMQ(4)
+
+    mq:send()
+    mq:send(1, nil, 3)
+    mq:send("a")
+    mq:send(nil)
+
+    assert(select("#", mq:recv()) == 0)
+    local a, b, c = mq:recv()
+    assert(a == 1 and b == nil and c == 3)
+    assert(mq:recv() == "a")
+    assert(select("#", mq:recv()) == 1)
+
+    -- wrap around the ring many times
+    for i = 1, 100 do
+        mq:send(i, i * 2, i * 3)
+        mq:send(-i)
+        local x, y, z = mq:recv()
+        assert(x == i and y == i * 2 and z == i * 3)
+        assert(mq:recv() == -i)
+    end
+end
+
+-- Tests trySend does not block on a full queue.
+do
+    local mq = core.createMQ(1)
+
+    assert(mq:trySend("first") == true)
+    assert(mq:trySend("second") == false)
+    assert(mq:recv() == "first")
+    assert(mq:trySend("third") == true)
+    assert(mq:recv() == "third")
+end
+
+-- Tests send waits until the full queue has space.
+do
+    local mq = core.createMQ(1)
+    local done = core.createMQ(1)
+
+    spawn(function(queue, out)
+        queue:send(1)
+        queue:send(2)
+        queue:send(3)
+        out:send("sent")
+    end, mq, done)
+
+    core.sleep(10)
+    assert(mq:recv() == 1)
+    assert(mq:recv() == 2)
+    assert(mq:recv() == 3)
+    assert(done:recv() == "sent")
+end
+
+-- Tests select returns a queued message immediately.
+do
+    local mq1 = core.createMQ(1)
+    local mq2 = core.createMQ(1)
+
+    mq2:send("two", 2)
+
+    local idx, a, b = core.select({mq1, mq2})
+    assert(idx == 2)
+    assert(a == "two")
+    assert(b == 2)
+end
+
+-- Tests select wakes with the index of the queue that fired.
+do
+    local mq1 = core.createMQ(1)
+    local mq2 = core.createMQ(1)
+
+    core.createTimer(function(queue)
+        queue:send("late")
+    end, mq2):start(20)
+
+    local idx, value = core.select({mq1, mq2}, floor(core.time()) + 100)
+    assert(idx == 2)
+    assert(value == "late")
+
+    -- the waiter has been removed from the other queue
+    mq1:send("queued")
+    assert(mq1:recv() == "queued")
+end
+
+-- Tests select times out.
+do
+    local mq1 = core.createMQ(1)
+    local mq2 = core.createMQ(1)
+
+    local ok, err = core.select({mq1, mq2}, floor(core.time()) + 10)
+    assert(ok == false)
+    assert(err == "timeout")
+
+    mq1:send(1)
+    mq2:send(2)
+    assert(mq1:recv() == 1)
+    assert(mq2:recv() == 2)
+end
+
+-- Tests a message wakes only one of the select waiters.
+do
+    local mq = core.createMQ(2)
+    local done = core.createMQ(2)
+
+    for i = 1, 2 do
+        spawn(function(queue, out)
+            local idx, value = core.select({queue}, floor(core.time()) + 50)
+            out:send(i, idx, value)
+        end, mq, done)
+    end
+
+    core.sleep(10)
+    mq:send("only")
+
+    local results = {}
+    for _ = 1, 2 do
+        local i, idx, value = done:recv()
+        results[i] = {idx, value}
+    end
+    assert(results[1][1] == 1 and results[1][2] == "only")
+    assert(results[2][1] == false and results[2][2] == "timeout")
+end
+
+-- Tests coroutines woken by a message are resumed by the ready queue.
+do
+    local mq = core.createMQ(1)
+    local done = core.createMQ(4)
+    local before = core.getSchedulerStats()
+
+    for i = 1, 4 do
+        spawn(function(queue, out)
+            out:send(i, queue:recv())
+        end, mq, done)
+    end
+
+    core.sleep(10)
+    mq:send("wakeup")
+
+    local seen = {}
+    for _ = 1, 4 do
+        local i, value = done:recv()
+        assert(value == "wakeup")
+        seen[i] = true
+    end
+    for i = 1, 4 do
+        assert(seen[i])
+    end
+
+    local after = core.getSchedulerStats()
+    assert(after.resumes - before.resumes >= 4)
+    assert(after.drains > before.drains)
+    assert(after.gcSteps > before.gcSteps)
+end
+
+-- Tests gather joins the results and errors of the spawned tasks in order.
+do
+    local tasks = {
+        core.spawn(function(ms, value)
+            core.sleep(ms)
+            return value, ms
+        end, 30, "slow"),
+        core.spawn(function()
+            error("failed")
+        end),
+        core.spawn(function(ms, value)
+            core.sleep(ms)
+            return value
+        end, 10, "fast"),
+    }
+    assert(tasks[1]:done() == false)
+
+    local results = core.gather(tasks, floor(core.time()) + 1000)
+    assert(#results == 3)
+    assert(results[1][1] == true and results[1][2] == "slow" and results[1][3] == 30)
+    assert(results[2][1] == false and results[2][2]:find("failed"))
+    assert(results[3][1] == true and results[3][2] == "fast")
+    for _, t in ipairs(tasks) do
+        assert(t:done())
+    end
+
+    -- done tasks are joined immediately
+    assert(#core.gather(tasks) == 3)
+end
+
+-- Tests gather times out while the tasks keep running.
+do
+    local task = core.spawn(core.sleep, 50)
+    local ok, err = core.gather({task}, floor(core.time()) + 10)
+    assert(ok == false and err == "timeout")
+    assert(task:done() == false)
+    assert(core.gather({task})[1][1] == true)
+end
+
+-- Tests cancelling a context unwinds the waits of the spawned tasks.
+do
+    local ctx = core.createContext()
+    local mq = core.createMQ(1)
+    core.setContext(ctx)
+    local tasks = {
+        core.spawn(function()
+            return mq:recvUntil(floor(core.time()) + 1000)
+        end),
+        core.spawn(function()
+            return core.select({mq}, floor(core.time()) + 1000)
+        end),
+        core.spawn(core.sleep, 1000),
+    }
+    core.setContext(nil)
+    assert(core.getContext() == nil)
+
+    core.sleep(10)
+    assert(ctx:err() == nil)
+    ctx:cancel()
+    assert(ctx:err() == "cancelled")
+
+    local results = core.gather(tasks, floor(core.time()) + 100)
+    assert(results[1][1] == true and results[1][2] == false and results[1][3] == "cancelled")
+    assert(results[2][1] == true and results[2][2] == false and results[2][3] == "cancelled")
+    assert(results[3][1] == false and results[3][2]:find("cancelled"))
+end
+
+-- Tests the deadline of a context expires the waits.
+do
+    local ctx = core.createContext(floor(core.time()) + 10)
+    local task = core.spawn(function()
+        core.setContext(ctx)
+        assert(core.getContext() == ctx)
+        core.sleep(1000)
+    end)
+    local result = core.gather({task}, floor(core.time()) + 100)[1]
+    assert(result[1] == false and result[2]:find("timeout"))
+    assert(ctx:err() == "timeout")
+
+    -- waits raise immediately in a done context
+    core.setContext(ctx)
+    assert(pcall(core.sleep, 0) == false)
+    core.setContext(nil)
+end
+
+-- Tests offloaded operations return the same results as the libraries.
+do
+    local hash = require "hash"
+    local cipher = require "cipher"
+    local base64 = require "base64"
+    local data = string.rep("homekit-bridge", 1024)
+
+    assert(core.offload("hash", "SHA256", data) == hash.create("SHA256"):update(data):digest())
+    assert(core.offload("hash", "SHA256", data, "key") == hash.create("SHA256", "key"):update(data):digest())
+
+    local key = string.rep("k", 16)
+    local iv = string.rep("i", 16)
+    local encrypted = core.offload("cipher", "AES-128-CBC", "encrypt", key, iv, data)
+    assert(encrypted == cipher.create("AES-128-CBC"):process("encrypt", key, iv, data))
+    assert(core.offload("cipher", "AES-128-CBC", "decrypt", key, iv, encrypted) == data)
+
+    local encoded = core.offload("base64encode", data)
+    assert(encoded == base64.encode(data))
+    assert(core.offload("base64decode", encoded) == data)
+    assert(core.offload("base64encode", "") == "")
+
+    assert(pcall(core.offload, "base64decode", "!!!") == false)
+    assert(pcall(core.offload, "json") == false)
+    assert(pcall(core.offload, "cipher", "AES-128-CBC", "encrypt", "short", iv, data) == false)
+end
+
+-- Tests the GC pacer follows the configuration and steps with allocation.
+do
+    local before = core.getGCStats()
+    assert(before.mode == "incremental")
+
+    core.configureGC({ mode = "generational", budget = 64 * 1024 })
+    local stats = core.getGCStats()
+    assert(stats.mode == "generational" and stats.budget == 64 * 1024)
+    assert(stats.maxPauseBudget == before.maxPauseBudget)
+
+    local t = {}
+    for i = 1, 1000 do
+        t[i] = { i }
+    end
+    t = nil
+    core.sleep(10)
+
+    local after = core.getGCStats()
+    assert(after.steps > before.steps)
+    assert(after.heapHigh >= after.heap)
+
+    assert(pcall(core.configureGC, { mode = "manual" }) == false)
+    assert(pcall(core.configureGC, { budget = 0 }) == false)
+    core.configureGC({ mode = before.mode, budget = before.budget })
+end
+
+-- Tests the allocator statistics follow the live objects.
+do
+    local before = core.memstats()
+    assert(before.live > 0 and before.peak >= before.live)
+    assert(#before.classes == 8)
+
+    local t = {}
+    for i = 1, 1000 do
+        t[i] = tostring(i) .. "-bridge"
+    end
+    local stats = core.memstats()
+    assert(stats.live > before.live)
+    assert(stats.peak >= stats.live)
+    assert(stats.allocs >= before.allocs + 1000)
+    assert(stats.allocBytes - before.allocBytes >= stats.live - before.live)
+    if stats.allocator == "slab" then
+        local blocks = 0
+        for _, cls in ipairs(stats.classes) do
+            assert(cls.bytes <= cls.blocks * cls.size)
+            blocks = blocks + cls.blocks
+        end
+        assert(blocks > 1000)
+        assert(stats.fragmentation >= 0 and stats.fragmentation < 1)
+    end
+    t = nil
+end
+
+-- Tests memory tags account the coroutines and callbacks, and enforce the soft limit.
+do
+    local prev = core.getMemTag()
+    local tag = core.createMemTag("test", 64 * 1024)
+    assert(tag > 0)
+
+    core.setMemTag(tag)
+    local timerTag
+    core.createTimer(function ()
+        timerTag = core.getMemTag()
+    end):start(0)
+    local t = {}
+    for i = 1, 100 do
+        t[i] = tostring(i) .. "-tagged"
+    end
+    local ok, err = pcall(string.rep, "x", 128 * 1024)
+    local taskTag = core.gather({ core.spawn(core.getMemTag) })[1][2]
+    core.setMemTag(prev)
+
+    assert(ok == false and err:find("memory"))
+    assert(taskTag == tag)
+    core.sleep(10)
+    assert(timerTag == tag)
+
+    local stats
+    for _, s in ipairs(core.memstats().tags) do
+        if s.tag == tag then
+            stats = s
+        end
+    end
+    assert(stats.name == "test" and stats.limit == 64 * 1024)
+    assert(stats.live > 0 and stats.peak >= stats.live)
+    assert(stats.limitHits > 0)
+    t = nil
+
+    assert(pcall(core.setMemTag, 255) == false)
+end
@@ -0,0 +1,779 @@
+local hap = require "hap"
+local core = require "core"
+
+-- Tests the metadata of a characteristic prototype is frozen once it is instantiated.
+do
+    local prototype = hap.newCharacteristicPrototype("UInt8", "TemperatureDisplayUnits", {
+        readable = true,
+        writable = true,
+        supportsEventNotification = true
+    }):setMfgDesc("units"):setValidVals(0, 1)
+
+    local characteristic = prototype:new(1)
+    assert(characteristic)
+    assert(pcall(prototype.setMfgDesc, prototype, "other") == false)
+    assert(pcall(prototype.setValidVals, prototype, 0) == false)
+    assert(pcall(prototype.setContraints, prototype, 0, 1, 1) == false)
+
+    -- The instance overrides the metadata.
+    assert(pcall(characteristic.setMfgDesc, characteristic, "other"))
+end
+
+-- Benchmarks building 10 to 150 accessories by hap.newCharacteristic() and hap.newService(),
+-- and the type lookups of the first and the last entries in the type tables.
+do
+    local logger = log.getLogger("testhap")
+    local clock = os.clock
+    local props = {
+        readable = true,
+        writable = true,
+        supportsEventNotification = true,
+        ip = { supportsWriteResponse = false },
+    }
+    for _, n in ipairs({ 10, 50, 100, 150 }) do
+        local chars, svcs = 0, 0
+        for i = 1, n do
+            local t1 = clock()
+            local characteristics = {
+                hap.newCharacteristic(21, "Bool", "On", props),
+                hap.newCharacteristic(22, "Int", "Brightness", props),
+                hap.newCharacteristic(23, "Float", "Hue", props),
+                hap.newCharacteristic(24, "Float", "Saturation", props),
+            }
+            local t2 = clock()
+            local service = hap.newService(20, "LightBulb", true, false, characteristics)
+            local t3 = clock()
+            assert(hap.newAccessory(i + 1, "BridgedAccessory", "Light", "test", "light", "0", "1.0", "1.0", {
+                hap.AccessoryInformationService,
+                service,
+            }))
+            chars = chars + t2 - t1
+            svcs = svcs + t3 - t2
+        end
+        logger:info(("%d accessories: newCharacteristic %.3f us, newService %.3f us per accessory"):format(
+            n, chars * 1e6 / n, svcs * 1e6 / n))
+    end
+
+    local count = 10000
+    for _, type in ipairs({ "AdministratorOnlyAccess", "ADKVersion" }) do
+        local t1 = clock()
+        for i = 1, count do
+            hap.newCharacteristic(i, "UInt32", type, props)
+        end
+        logger:info(("newCharacteristic of %s: %.3f us per call"):format(type, (clock() - t1) * 1e6 / count))
+    end
+end
+
+local function newPrimaryAccessory()
+    return hap.newAccessory(1, "Bridges", "Test Bridge", "test", "bridge", "0", "1.0", "1.0", {
+        hap.AccessoryInformationService,
+        hap.HAPProtocolInformationService,
+        hap.PairingService,
+    })
+end
+
+local function newLightBulb(aid, characteristics, readMany)
+    return hap.newAccessory(aid, "BridgedAccessory", "Light " .. aid, "test", "light", tostring(aid), "1.0", "1.0", {
+        hap.AccessoryInformationService,
+        hap.newService(20, "LightBulb", true, false, characteristics),
+    }, nil, readMany)
+end
+
+local function newOn(iid, read, write)
+    return hap.newCharacteristic(iid, "Bool", "On", {
+        readable = true,
+        writable = true,
+        supportsEventNotification = true
+    }, read, write)
+end
+
+-- Tests the accessory server allocates the IP sessions when the connections are accepted,
+-- keeps the reserve of idle sessions, and pools the buffers of the closed sessions.
+do
+    local socket = require "socket"
+    local function waitSessions(active, allocated)
+        local ip
+        for _ = 1, 500 do
+            ip = hap.getIPSessionStats()
+            if ip.active == active and ip.allocated == allocated then
+                break
+            end
+            core.sleep(1)
+        end
+        return ip
+    end
+
+    hap.setIPSessionLimits({ max = 4, reserve = 2 })
+    local accepted, invalidated = 0, 0
+    hap.start(newPrimaryAccessory(), { newLightBulb(2, { newOn(21, function () return true end) }) }, false,
+        function () accepted = accepted + 1 end, function () invalidated = invalidated + 1 end)
+    local ip = hap.getIPSessionStats()
+    assert(ip.active == 0 and ip.allocated == 2 and ip.pooled == 0 and ip.port > 0)
+    assert(ip.allocatedBytes == 2 * ip.sessionBytes)
+
+    local socks = {}
+    for i = 1, 3 do
+        socks[i] = socket.create("TCP", "IPV4")
+        socks[i]:connect("127.0.0.1", ip.port)
+        local stats = waitSessions(i, math.min(i + 2, 4))
+        assert(stats.active == i and stats.allocated == math.min(i + 2, 4))
+    end
+    assert(accepted == 3 and hap.getIPSessionStats().peak == 4)
+
+    for _, sock in ipairs(socks) do
+        sock:destroy()
+    end
+    ip = waitSessions(0, 2)
+    assert(ip.active == 0 and ip.allocated == 2 and ip.pooled == 2 and invalidated == 3)
+
+    hap.stop()
+    hap.setIPSessionLimits({ max = 5, reserve = 2 })
+end
+
+-- Tests reconfiguring the bridged accessories of the accessory server, the sessions keep their sizes,
+-- and the accessories over the sizes are rejected.
+do
+    local function read(request)
+        return true
+    end
+    local kept = newLightBulb(2, { newOn(21, read), newOn(22, read) })
+    hap.start(newPrimaryAccessory(), { kept, newLightBulb(3, { newOn(21, read) }) }, false)
+    local ip = hap.getIPSessionStats()
+    assert(ip.port > 0)
+
+    assert(hap.reconfigure({ kept, newLightBulb(4, { newOn(21, read) }) }) == true)
+    assert(hap.reconfigure({ kept }) == true)
+    assert(hap.reconfigure({ kept, newLightBulb(5, { newOn(21, read) }) }) == true)
+    local stats = hap.getIPSessionStats()
+    assert(stats.eventNotifications == ip.eventNotifications and stats.contexts == ip.contexts)
+    assert(stats.port == ip.port)
+
+    local success, err = pcall(hap.reconfigure, {
+        kept, newLightBulb(5, { newOn(21, read) }), newLightBulb(6, { newOn(21, read) })
+    })
+    assert(success == false and err:find("restart the server"))
+    hap.stop()
+end
+
+-- Benchmarks the memory of the IP sessions of the accessory server serving 10 to 150 accessories,
+-- the sessions allocated for the reserve against the default maximum sessions, and the process memory.
+do
+    local logger = log.getLogger("testhap")
+    local function read(request)
+        return true
+    end
+    for _, n in ipairs({ 10, 50, 100, 149 }) do
+        collectgarbage()
+        local m1 = core.memstats()
+        local accs = {}
+        for i = 1, n do
+            accs[i] = newLightBulb(i + 1, { newOn(21, read) })
+        end
+        hap.start(newPrimaryAccessory(), accs, false)
+        core.sleep(100)
+        local ip = hap.getIPSessionStats()
+        local m2 = core.memstats()
+        logger:info(("%d accessories: session %d bytes, %d of %d sessions %d bytes, default %d bytes, process +%d KB"):format(
+            n + 1, ip.sessionBytes, ip.allocated, ip.max, ip.allocatedBytes, ip.defaultBytes,
+            (m2.processBytes - m1.processBytes) // 1024))
+        hap.stop()
+    end
+end
+
+-- The following tests serve the accessories by the loopback server.
+local ok, loopback = pcall(require, "haploopback")
+if not ok then
+    log.getLogger("testhap"):info("Skip the loopback tests, the bridge is built without CONFIG_HAP_LOOPBACK.")
+    return
+end
+
+---Wait for the responses of the reads and writes.
+---@return HAPLoopbackResponse[] responses
+---@return HAPLoopbackResponse[] events
+local function takeResponses(n)
+    local resps, events = {}, {}
+    for _ = 1, 500 do
+        for _, resp in ipairs(loopback.responses()) do
+            table.insert(resp.kind == "event" and events or resps, resp)
+        end
+        if #resps >= n then
+            break
+        end
+        core.sleep(1)
+    end
+    return resps, events
+end
+
+-- Tests the value cache answers the reads in the TTL, a stale value is refreshed in the background,
+-- and a write drops the cached value.
+do
+    local reads = 0
+    local on = newOn(21, function (request)
+        reads = reads + 1
+        return reads % 2 == 1
+    end, function (request, value) end):setCacheTTL(50)
+    loopback.start(newPrimaryAccessory(), { newLightBulb(2, { on }) })
+    local before = hap.getCacheStats()
+
+    loopback.read(1, 2, 21)
+    loopback.read(2, 2, 21)
+    local resps = takeResponses(2)
+    assert(#resps == 2 and resps[1].err == 0 and resps[1].value == true and resps[2].value == true)
+    assert(reads == 1)
+
+    -- The stale value answers the read.
+    core.sleep(60)
+    loopback.read(1, 2, 21)
+    resps = takeResponses(1)
+    assert(resps[1].value == true)
+    core.sleep(10)
+    assert(reads == 2)
+
+    -- The refreshed value is changed, and an event is raised.
+    loopback.read(1, 2, 21)
+    local events
+    resps, events = takeResponses(1)
+    assert(resps[1].value == false)
+    core.sleep(10)
+    for _, resp in ipairs(loopback.responses()) do
+        table.insert(events, resp)
+    end
+    assert(#events == 1 and events[1].aid == 2 and events[1].iid == 21 and events[1].session == nil)
+
+    loopback.write(1, 2, 21, true)
+    resps = takeResponses(1)
+    assert(resps[1].kind == "write" and resps[1].err == 0)
+    loopback.read(1, 2, 21)
+    resps = takeResponses(1)
+    assert(resps[1].value == true and reads == 3)
+
+    local stats = hap.getCacheStats()
+    assert(stats.misses - before.misses == 2)
+    assert(stats.hits - before.hits == 2)
+    assert(stats.staleHits - before.staleHits == 1)
+    assert(stats.refreshes - before.refreshes == 1)
+    hap.stop()
+end
+
+-- Tests a write callback pushing the written value like the plugins do, the value answers
+-- the reads without calling the read callback, and an event is raised only if it is changed.
+do
+    local reads = 0
+    local on = newOn(21, function (request)
+        reads = reads + 1
+        return false
+    end, function (request, value)
+        hap.updateValue(request.aid, request.sid, request.cid, value)
+    end)
+    loopback.start(newPrimaryAccessory(), { newLightBulb(2, { on }) })
+
+    loopback.write(1, 2, 21, true)
+    local resps, events = takeResponses(1)
+    assert(resps[1].kind == "write" and resps[1].err == 0)
+    loopback.read(2, 2, 21)
+    resps = takeResponses(1)
+    assert(resps[1].value == true and reads == 0)
+
+    -- The same value raises no event.
+    loopback.write(1, 2, 21, true)
+    takeResponses(1)
+    core.sleep(10)
+    for _, resp in ipairs(loopback.responses()) do
+        table.insert(events, resp)
+    end
+    assert(#events == 1 and events[1].aid == 2 and events[1].iid == 21)
+
+    -- The pushed value expires, the cache is disabled.
+    core.sleep(1100)
+    loopback.read(2, 2, 21)
+    resps = takeResponses(1)
+    assert(resps[1].value == false and reads == 1)
+    assert(hap.updateValue(2, 20, 21, false) == true)
+    assert(hap.updateValue(2, 20, 21, false) == false)
+    hap.stop()
+end
+
+-- Tests the reads of one characteristic from several sessions share one read callback,
+-- and the shared read keeps running when the session of the first read is invalidated.
+do
+    local calls, release = 0, false
+    local on = newOn(21, function (request)
+        calls = calls + 1
+        while not release do
+            core.sleep(1)
+        end
+        return true
+    end, function (request, value) end)
+    loopback.start(newPrimaryAccessory(), { newLightBulb(2, { on }) })
+    local before = hap.getReadStats()
+
+    loopback.read(1, 2, 21)
+    loopback.read(2, 2, 21)
+    loopback.read(3, 2, 21)
+    core.sleep(10)
+    assert(calls == 1 and hap.getReadStats().collapsed - before.collapsed == 2)
+
+    loopback.invalidate(1)
+    core.sleep(10)
+    release = true
+    local resps = takeResponses(2)
+    core.sleep(10)
+    for _, resp in ipairs(loopback.responses()) do
+        table.insert(resps, resp)
+    end
+    assert(#resps == 2)
+    for _, resp in ipairs(resps) do
+        assert(resp.session ~= 1 and resp.err == 0 and resp.value == true)
+    end
+    assert(hap.getReadStats().inFlight == 0)
+
+    -- A read not shared by other sessions is cancelled, and it is not answered.
+    release = false
+    loopback.read(2, 2, 21)
+    core.sleep(10)
+    assert(calls == 2)
+    loopback.invalidate(2)
+    core.sleep(10)
+    assert(hap.getReadStats().inFlight == 0)
+    release = true
+    core.sleep(10)
+    assert(#loopback.responses() == 0)
+    hap.stop()
+end
+
+-- Tests the readMany calls follow the read limits, and the batched reads of an invalidated
+-- session are dropped.
+do
+    local calls, release = 0, true
+    local function read(request)
+        return false
+    end
+    local acc = newLightBulb(2, { newOn(21, read), newOn(22, read), newOn(23, read) }, function (requests)
+        calls = calls + 1
+        while not release do
+            core.sleep(1)
+        end
+        local values = {}
+        for i = 1, #requests do
+            values[i] = true
+        end
+        return values
+    end)
+    loopback.start(newPrimaryAccessory(), { acc })
+    hap.setReadLimits({ maxPerAccessory = 1, deadline = 100 })
+
+    -- The read is dropped before the readMany call.
+    loopback.read(1, 2, 21)
+    loopback.invalidate(1)
+    core.sleep(10)
+    assert(calls == 0 and #loopback.responses() == 0)
+
+    -- The read of the invalidated session in the readMany call is not answered.
+    release = false
+    loopback.read(2, 2, 21)
+    loopback.read(3, 2, 22)
+    core.sleep(10)
+    assert(calls == 1)
+    loopback.invalidate(2)
+
+    -- The readMany call in flight blocks the next call of the accessory, until the deadline.
+    local before = hap.getReadSchedStats()
+    loopback.read(4, 2, 23)
+    core.sleep(10)
+    assert(calls == 1)
+    local resps = takeResponses(1)
+    assert(#resps == 1 and resps[1].session == 4 and resps[1].err ~= 0)
+    assert(hap.getReadSchedStats().expired - before.expired == 1)
+
+    release = true
+    resps = takeResponses(1)
+    assert(#resps == 1 and resps[1].session == 3 and resps[1].err == 0 and resps[1].value == true)
+
+    -- The next call is dispatched once the call in flight finishes.
+    release = false
+    loopback.read(3, 2, 21)
+    core.sleep(10)
+    loopback.read(4, 2, 22)
+    core.sleep(10)
+    assert(calls == 2)
+    release = true
+    resps = takeResponses(2)
+    assert(#resps == 2 and calls == 3 and hap.getReadStats().inFlight == 0)
+    hap.setReadLimits({ maxPerAccessory = 4, deadline = 5000 })
+    hap.stop()
+end
+
+-- Tests the queued reads reuse the pooled requests, and benchmarks the allocations
+-- of a read against the request table passed to the read callbacks before.
+do
+    local logger = log.getLogger("testhap")
+    local function read(request)
+        core.sleep(1)
+        return true
+    end
+    loopback.start(newPrimaryAccessory(), {
+        newLightBulb(2, { newOn(21, read), newOn(22, read), newOn(23, read) })
+    })
+    hap.setReadLimits({ maxInFlight = 1 })
+
+    local function burst()
+        loopback.read(1, 2, 21)
+        loopback.read(1, 2, 22)
+        loopback.read(1, 2, 23)
+        assert(#takeResponses(3) == 3)
+    end
+    burst()
+    local before = hap.getReadStats()
+    assert(before.pooled >= 2)
+    for _ = 1, 10 do
+        burst()
+    end
+    local after = hap.getReadStats()
+    assert(after.requestAllocs == before.requestAllocs)
+    local reads = after.handled - before.handled
+    assert(reads == 30)
+
+    local m1 = core.memstats()
+    local t
+    for _ = 1, 100 do
+        t = { transportType = 1, session = t, aid = 2, sid = 20, cid = 21, remote = false }
+    end
+    local m2 = core.memstats()
+    local tableAllocs = (m2.allocs - m1.allocs) / 100
+    assert(tableAllocs >= 2)
+
+    logger:info(("read: %.1f allocs, %.0f bytes; request table: %.1f allocs, %.0f bytes"):format(
+        (after.allocs - before.allocs) / reads, (after.allocBytes - before.allocBytes) / reads,
+        tableAllocs, (m2.allocBytes - m1.allocBytes) / 100))
+    hap.setReadLimits({ maxInFlight = 32 })
+    hap.stop()
+end
+
+-- Tests the read scheduler keeps the limits per accessory, rejects the reads over the queue
+-- and fails the queued reads at the deadline.
+do
+    local release = false
+    local function read(request)
+        while not release do
+            core.sleep(1)
+        end
+        return true
+    end
+    local function newChars()
+        return { newOn(21, read), newOn(22, read), newOn(23, read), newOn(24, read) }
+    end
+    loopback.start(newPrimaryAccessory(), { newLightBulb(2, newChars()), newLightBulb(3, newChars()) })
+    hap.setReadLimits({ maxPerAccessory = 1, maxQueued = 2, deadline = 50 })
+    local before = hap.getReadSchedStats()
+
+    loopback.read(1, 2, 21)
+    loopback.read(1, 2, 22)
+    loopback.read(1, 2, 23)
+    -- The other accessory is not blocked by the queue.
+    loopback.read(1, 3, 21)
+    core.sleep(10)
+    local stats = hap.getReadSchedStats()
+    assert(stats.queued == 2 and hap.getReadStats().inFlight == 2)
+
+    loopback.read(1, 2, 24)
+    local resps = takeResponses(1)
+    assert(resps[1].iid == 24 and resps[1].err ~= 0)
+    assert(hap.getReadSchedStats().rejected - before.rejected == 1)
+
+    resps = takeResponses(2)
+    assert(#resps == 2 and resps[1].err ~= 0 and resps[2].err ~= 0)
+    stats = hap.getReadSchedStats()
+    assert(stats.expired - before.expired == 2 and stats.queued == 0)
+
+    release = true
+    resps = takeResponses(2)
+    assert(#resps == 2 and resps[1].value == true and resps[2].value == true)
+
+    -- The queued read is dispatched once the read of the accessory finishes.
+    release = false
+    loopback.read(1, 2, 21)
+    loopback.read(1, 2, 22)
+    core.sleep(10)
+    assert(hap.getReadSchedStats().queued == 1)
+    release = true
+    resps = takeResponses(2)
+    assert(#resps == 2 and resps[1].err == 0 and resps[2].err == 0)
+    stats = hap.getReadSchedStats()
+    assert(stats.dispatched - before.dispatched == 1)
+    -- The expired and the dispatched reads are observed in the wait histogram.
+    local function count(hist)
+        local n = 0
+        for _, bucket in ipairs(hist) do
+            n = n + bucket.count
+        end
+        return n
+    end
+    assert(count(stats.wait) - count(before.wait) == 3)
+    hap.setReadLimits({ maxPerAccessory = 4, maxQueued = 128, deadline = 5000 })
+    hap.stop()
+end
+
+-- Tests the debounced writes are answered at once, the reads in the window get the written value,
+-- and only the latest value reaches the write callback.
+do
+    local reads, seen = 0, {}
+    local on = newOn(21, function (request)
+        reads = reads + 1
+        return false
+    end, function (request, value)
+        assert(request.session == nil)
+        table.insert(seen, value)
+        core.sleep(20)
+    end):setWriteDebounce(30)
+    loopback.start(newPrimaryAccessory(), { newLightBulb(2, { on }) })
+    local before = hap.getWriteStats()
+
+    loopback.write(1, 2, 21, false)
+    loopback.write(1, 2, 21, false)
+    loopback.write(1, 2, 21, true)
+    local resps = takeResponses(3)
+    assert(#resps == 3 and #seen == 0)
+    for _, resp in ipairs(resps) do
+        assert(resp.kind == "write" and resp.err == 0)
+    end
+    loopback.read(2, 2, 21)
+    resps = takeResponses(1)
+    assert(resps[1].value == true and reads == 0)
+
+    core.sleep(60)
+    assert(#seen == 1 and seen[1] == true)
+    local stats = hap.getWriteStats()
+    assert(stats.debounced - before.debounced == 2 and stats.dispatched - before.dispatched == 1)
+
+    -- The writes while the callback is running are collapsed into one more call.
+    loopback.write(1, 2, 21, true)
+    core.sleep(40)
+    assert(#seen == 2)
+    loopback.write(1, 2, 21, false)
+    loopback.write(1, 2, 21, true)
+    takeResponses(3)
+    core.sleep(60)
+    assert(#seen == 3 and seen[2] == true and seen[3] == true)
+    stats = hap.getWriteStats()
+    assert(stats.dispatched - before.dispatched == 3)
+    hap.stop()
+end
+
+-- Tests the events raised in the event window are merged, one event is delivered
+-- for a characteristic in a window.
+do
+    local function read(request)
+        return false
+    end
+    loopback.start(newPrimaryAccessory(), { newLightBulb(2, { newOn(21, read), newOn(22, read) }) })
+    hap.setEventWindow(20)
+    local before = hap.getEventStats()
+
+    hap.raiseEvent(2, 20, 21)
+    hap.raiseEvents({ { 2, 20, 21 }, { 2, 20, 22 }, { 2, 20, 21 } })
+    hap.raiseEvent(2, 20, 22)
+    assert(#loopback.responses() == 0)
+    core.sleep(40)
+    local events = loopback.responses()
+    assert(#events == 2)
+    local iids = {}
+    for _, event in ipairs(events) do
+        assert(event.kind == "event" and event.aid == 2 and event.session == nil)
+        iids[event.iid] = true
+    end
+    assert(iids[21] and iids[22])
+    local stats = hap.getEventStats()
+    assert(stats.window == 20)
+    assert(stats.raised - before.raised == 5 and stats.delivered - before.delivered == 2)
+
+    -- The events are raised at once without the window.
+    hap.setEventWindow(0)
+    hap.raiseEvent(2, 20, 21)
+    hap.raiseEvent(2, 20, 21)
+    assert(#loopback.responses() == 2)
+    hap.setEventWindow(5)
+    hap.stop()
+end
+
+-- Tests an event for all sessions takes the place of the events queued for the sessions,
+-- the controllers get the event once.
+do
+    local sessions = {}
+    local function read(request)
+        sessions[#sessions + 1] = request.session
+        return false
+    end
+    loopback.start(newPrimaryAccessory(), { newLightBulb(2, { newOn(21, read), newOn(22, read) }) })
+    loopback.read(1, 2, 21)
+    loopback.read(2, 2, 22)
+    assert(#takeResponses(2) == 2 and #sessions == 2 and sessions[1] ~= sessions[2])
+    hap.setEventWindow(20)
+
+    hap.raiseEvent(2, 20, 21, sessions[1])
+    hap.raiseEvent(2, 20, 22, sessions[1])
+    hap.raiseEvent(2, 20, 21, sessions[2])
+    hap.raiseEvent(2, 20, 21)
+    -- The event for a session is covered by the event for all sessions.
+    hap.raiseEvent(2, 20, 21, sessions[2])
+    core.sleep(40)
+    local events = loopback.responses()
+    assert(#events == 2)
+    table.sort(events, function (a, b) return a.iid < b.iid end)
+    assert(events[1].iid == 21 and events[1].session == nil)
+    assert(events[2].iid == 22 and events[2].session == 1)
+    hap.setEventWindow(5)
+    hap.stop()
+end
+
+-- Tests reconfiguring the bridged accessories with a read in flight, a queued read and a refresh
+-- in flight, the removed accessories are kept until their callbacks return and raise no events.
+do
+    local release = false
+    local function slowRead(request)
+        while not release do
+            core.sleep(1)
+        end
+        return true
+    end
+    local reads = 0
+    local removed = newLightBulb(2, { newOn(21, slowRead), newOn(22, slowRead) })
+    local refreshed = newLightBulb(4, { newOn(21, function (request)
+        reads = reads + 1
+        if reads > 1 then
+            slowRead(request)
+        end
+        return reads == 1
+    end):setCacheTTL(20) })
+    local kept = newLightBulb(3, { newOn(21, function (request)
+        return false
+    end) })
+    hap.setReadLimits({ maxPerAccessory = 1 })
+    loopback.start(newPrimaryAccessory(), { removed, kept, refreshed })
+
+    loopback.read(1, 4, 21)
+    local resps = takeResponses(1)
+    assert(resps[1].err == 0 and resps[1].value == true)
+
+    -- The read of iid 21 is in flight, the read of iid 22 waits for it.
+    loopback.read(1, 2, 21)
+    loopback.read(1, 2, 22)
+    core.sleep(30)
+    -- The stale value answers the read, and the refresh blocks in the read callback.
+    loopback.read(2, 4, 21)
+    resps = takeResponses(1)
+    assert(#resps == 1 and resps[1].aid == 4 and resps[1].value == true)
+    core.sleep(10)
+    assert(reads == 2 and hap.getReadStats().inFlight == 1)
+
+    assert(hap.reconfigure({ kept }) == true)
+    assert(hap.reconfigure({ kept }) == false)
+    resps = takeResponses(1)
+    assert(#resps == 1 and resps[1].aid == 2 and resps[1].iid == 22 and resps[1].err ~= 0)
+
+    -- Only the pending work keeps the removed accessories.
+    removed = nil
+    refreshed = nil
+    collectgarbage()
+    collectgarbage()
+
+    loopback.read(2, 2, 21)
+    loopback.read(2, 3, 21)
+    resps = takeResponses(2)
+    table.sort(resps, function (a, b) return a.aid < b.aid end)
+    assert(resps[1].aid == 2 and resps[1].err ~= 0)
+    assert(resps[2].aid == 3 and resps[2].err == 0 and resps[2].value == false)
+
+    release = true
+    local events
+    resps, events = takeResponses(1)
+    assert(#resps == 1 and resps[1].session == 1 and resps[1].aid == 2 and resps[1].iid == 21)
+    assert(resps[1].err == 0 and resps[1].value == true)
+    core.sleep(10)
+    for _, resp in ipairs(loopback.responses()) do
+        table.insert(events, resp)
+    end
+    assert(#events == 0)
+    assert(hap.getReadStats().inFlight == 0)
+
+    hap.stop()
+    hap.setReadLimits({ maxPerAccessory = 4 })
+end
+
+-- Tests reconfiguring adds the bridged accessories fitting in the sizes of the sessions,
+-- the added accessories are read and raise events, and a set over the sizes is rejected.
+do
+    local function read(request)
+        return true
+    end
+    local kept = newLightBulb(2, { newOn(21, read), newOn(22, read), newOn(23, read) })
+    loopback.start(newPrimaryAccessory(), { kept, newLightBulb(3, { newOn(21, read) }) })
+    local ip = hap.getIPSessionStats()
+
+    assert(hap.reconfigure({ kept, newLightBulb(4, { newOn(21, read) }) }) == true)
+    assert(hap.getIPSessionStats().eventNotifications == ip.eventNotifications)
+    loopback.read(1, 4, 21)
+    local resps = takeResponses(1)
+    assert(#resps == 1 and resps[1].aid == 4 and resps[1].err == 0 and resps[1].value == true)
+    assert(hap.updateValue(4, 20, 21, false) == true)
+    core.sleep(10)
+    local events = {}
+    for _, resp in ipairs(loopback.responses()) do
+        if resp.kind == "event" then
+            table.insert(events, resp)
+        end
+    end
+    assert(#events == 1 and events[1].aid == 4 and events[1].iid == 21)
+
+    -- One more characteristic supporting event notification has no slot in the sessions.
+    local success, err = pcall(hap.reconfigure, {
+        kept, newLightBulb(4, { newOn(21, read) }), newLightBulb(5, { newOn(21, read) })
+    })
+    assert(success == false and err:find("restart the server"))
+    loopback.read(1, 5, 21)
+    resps = takeResponses(1)
+    assert(#resps == 1 and resps[1].aid == 5 and resps[1].err ~= 0)
+    hap.stop()
+end
+
+-- Benchmarks serving 10 to 150 accessories: starting the server, reading a characteristic
+-- of every accessory through the attribute index, and the memory of the sessions, the heap
+-- and the process. Every characteristic supporting event notification keeps a slot.
+do
+    local logger = log.getLogger("testhap")
+    local clock = os.clock
+    local function read(request)
+        return true
+    end
+    for _, n in ipairs({ 10, 50, 100, 149 }) do
+        collectgarbage()
+        local m1 = core.memstats()
+        local accs = {}
+        for i = 1, n do
+            accs[i] = newLightBulb(i + 1, { newOn(21, read) })
+        end
+        local t1 = clock()
+        loopback.start(newPrimaryAccessory(), accs)
+        local t2 = clock()
+        local reads = 0
+        for i = 1, n, 50 do
+            local last = math.min(i + 49, n)
+            for aid = i + 1, last + 1 do
+                loopback.read(1, aid, 21)
+            end
+            local resps = takeResponses(last - i + 1)
+            for _, resp in ipairs(resps) do
+                assert(resp.err == 0 and resp.value == true)
+            end
+            reads = reads + #resps
+        end
+        local t3 = clock()
+        assert(reads == n)
+        local ip = hap.getIPSessionStats()
+        assert(ip.eventNotifications >= n)
+        local m2 = core.memstats()
+        logger:info(("%d accessories: start %.3f ms, %d reads %.3f ms, session %d bytes x %d, heap +%d bytes, process +%d KB"):format(
+            n + 1, (t2 - t1) * 1000, reads, (t3 - t2) * 1000, ip.sessionBytes, ip.max, m2.live - m1.live,
+            (m2.processBytes - m1.processBytes) // 1024))
+        hap.stop()
+    end
+end
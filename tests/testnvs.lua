@@ -123,6 +123,32 @@ do
     end
 end
 
+-- Tests the values survive rewrites which compact the log of the log engine.
+do
+    local core = require "core"
+    local handle <close> = nvs.open("test")
+    handle:set("keep", "kept")
+    handle:commit()
+    for i = 1, 200 do
+        handle:set("big", string.rep(string.char(i), 1024))
+        handle:commit()
+    end
+    -- The compaction runs in steps in the run loop, a commit between the steps goes to both logs.
+    core.sleep(0)
+    handle:set("between", "steps")
+    handle:commit()
+    core.sleep(10)
+    assert(handle:get("between") == "steps")
+    assert(handle:get("big") == string.rep(string.char(200), 1024))
+    assert(handle:get("keep") == "kept")
+end
+do
+    local handle <close> = nvs.open("test")
+    assert(handle:get("big") == string.rep(string.char(200), 1024))
+    assert(handle:get("keep") == "kept")
+    assert(handle:get("between") == "steps")
+end
+
 do
     local handle <close> = nvs.open("test")
     handle:erase()